@@ -0,0 +1,43 @@
+// Where backup::Backup puts the entries it reads: a tar file (see
+// backup/tar_writer.h) or a copy of the tree in a host directory (see
+// backup/directory_writer.h).
+
+#ifndef __BACKUP_ARCHIVE_H__
+#define __BACKUP_ARCHIVE_H__
+
+#include <stddef.h>
+#include <string>
+
+namespace backup {
+
+class Archive {
+ public:
+  virtual ~Archive() { }
+
+  // Paths are relative to the root of the archive, e.g. "DCIM/100APPLE".
+  // The methods return false once the archive can no longer be written.
+  virtual bool AddDirectory(const std::string& path, int mode,
+                            long long mtime) = 0;
+  virtual bool AddSymLink(const std::string& path, const std::string& target,
+                          long long mtime) = 0;
+
+  // Starts a file of exactly size bytes, which are then passed to WriteData.
+  // If EndFile is called early, the rest of the file is filled with zeros.
+  // AbortFile instead leaves the file out, keeping any earlier copy of it.
+  virtual bool BeginFile(const std::string& path, int mode, long long size,
+                         long long mtime) = 0;
+  virtual bool WriteData(const char* data, size_t size) = 0;
+  virtual bool EndFile() = 0;
+  virtual bool AbortFile() = 0;
+
+  // Removes an entry that no longer exists, if the archive is able to.
+  // Directories are removed after the entries beneath them.
+  virtual bool Remove(const std::string& path) { return true; }
+
+  // Completes the archive
+  virtual bool Finish() = 0;
+};
+
+}  // namespace backup
+
+#endif  // __BACKUP_ARCHIVE_H__
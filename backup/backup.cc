@@ -0,0 +1,744 @@
+#include "backup/backup.h"
+
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <vector>
+#include "backup/archive.h"
+#include "backup/directory_writer.h"
+#include "backup/tar_writer.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+
+using ::google::protobuf::Closure;
+
+namespace backup {
+
+// Entries requested from ReadDir at a time
+static const int kListingPage = 256;
+// Progress is logged this often
+static const long long kProgressIntervalUsec = 10 * 1000000LL;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// A directory, symlink or file, in the order it is written to the archive
+struct Entry {
+  enum Type {
+    DIRECTORY,
+    SYMLINK,
+    FILE
+  };
+
+  Entry() : mode(0), size(0), mtime(0), reader(-1), hash(kHashBasis),
+            opened(false), done(false), failed(false), started(false) { }
+
+  Type type;
+  std::string path;  // In the service
+  std::string name;  // In the archive
+  int mode;
+  long long size;
+  long long mtime;
+  std::string target;  // Of a symlink
+
+  // Set by the reader of a file
+  int reader;
+  unsigned long long hash;
+  std::deque<std::string*> chunks;
+  bool opened;
+  bool done;
+  bool failed;
+
+  // Set by the writer once the header is written
+  bool started;
+};
+
+// A directory to list, or a name to GetAttr
+struct Task {
+  std::string path;
+  bool list;
+};
+
+class Pipeline {
+ public:
+  Pipeline(proto::FsService* service, const std::string& root,
+           Archive* archive, const BackupOptions& options,
+           BackupStats* stats)
+      : service_(service), root_(root), archive_(archive), options_(options),
+        stats_(stats), pending_(0), walked_(false), walk_failed_(false),
+        aborted_(false), first_(0), next_file_(0),
+        outstanding_(options.readers, 0) {
+    while (root_.size() > 1 && root_[root_.size() - 1] == '/') {
+      root_.erase(root_.size() - 1);
+    }
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&work_cond_, NULL);
+    pthread_cond_init(&entry_cond_, NULL);
+    pthread_cond_init(&chunk_cond_, NULL);
+    pthread_cond_init(&space_cond_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  ~Pipeline() {
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      for (size_t j = 0; j < entries_[i]->chunks.size(); ++j) {
+        delete entries_[i]->chunks[j];
+      }
+      delete entries_[i];
+    }
+    delete null_callback_;
+    pthread_cond_destroy(&space_cond_);
+    pthread_cond_destroy(&chunk_cond_);
+    pthread_cond_destroy(&entry_cond_);
+    pthread_cond_destroy(&work_cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // The entries now in the archive, once Run has returned
+  Manifest* manifest() { return &manifest_; }
+
+  bool Run() {
+    Task task;
+    task.path = root_;
+    task.list = false;
+    tasks_.push_back(task);
+    pending_ = 1;
+
+    std::vector<pthread_t> threads;
+    std::vector<Worker> workers(options_.walkers + options_.readers);
+    for (size_t i = 0; i < workers.size(); ++i) {
+      workers[i].pipeline = this;
+      workers[i].reader = static_cast<int>(i) - options_.walkers;
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, &RunWorker, &workers[i]) != 0) {
+        syslog(LOG_ERR, "pthread_create() failed: %m");
+        Abort();
+        break;
+      }
+      threads.push_back(thread);
+    }
+    bool success = !aborted_ && Write();
+    if (!success) {
+      Abort();
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+      pthread_join(threads[i], NULL);
+    }
+    if (success && options_.previous != NULL) {
+      success = RemoveMissing();
+    }
+    return success && archive_->Finish();
+  }
+
+ private:
+  struct Worker {
+    Pipeline* pipeline;
+    int reader;  // Negative for a walker
+  };
+
+  static void* RunWorker(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    if (worker->reader < 0) {
+      worker->pipeline->Walk();
+    } else {
+      worker->pipeline->Read(worker->reader);
+    }
+    return NULL;
+  }
+
+  // Wakes every thread to stop
+  void Abort() {
+    pthread_mutex_lock(&mutex_);
+    aborted_ = true;
+    WakeAll();
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Must be called with mutex_ held.
+  void WakeAll() {
+    pthread_cond_broadcast(&work_cond_);
+    pthread_cond_broadcast(&entry_cond_);
+    pthread_cond_broadcast(&chunk_cond_);
+    pthread_cond_broadcast(&space_cond_);
+  }
+
+  // Must be called with mutex_ held.
+  void Error(const rpc::Rpc& rpc, const char* call, const std::string& path) {
+    syslog(LOG_ERR, "%s %s failed: %s", call, path.c_str(),
+           rpc.ErrorText().c_str());
+    stats_->errors++;
+  }
+
+  // Keeps the previous manifest's record of an entry that could not be read,
+  // so that it is neither removed nor assumed unchanged.  Must be called with
+  // mutex_ held.
+  void KeepPrevious(const std::string& name) {
+    if (options_.previous != NULL) {
+      Manifest::const_iterator it = options_.previous->find(name);
+      if (it != options_.previous->end()) {
+        manifest_[name] = it->second;
+      }
+    }
+  }
+
+  // Removes the entries of the previous manifest that were not found, deepest
+  // first, or keeps them all if the walk was incomplete.
+  bool RemoveMissing() {
+    const Manifest& previous = *options_.previous;
+    for (Manifest::const_reverse_iterator it = previous.rbegin();
+         it != previous.rend(); ++it) {
+      if (manifest_.count(it->first) != 0) {
+        continue;
+      } else if (walk_failed_) {
+        manifest_[it->first] = it->second;
+      } else if (!archive_->Remove(it->first)) {
+        return false;
+      } else {
+        stats_->removed++;
+      }
+    }
+    return true;
+  }
+
+  std::string ArchiveName(const std::string& path) {
+    if (root_ == "/") {
+      return path.substr(1);
+    }
+    return root_.substr(root_.rfind('/') + 1) + path.substr(root_.size());
+  }
+
+  void Walk() {
+    pthread_mutex_lock(&mutex_);
+    while (true) {
+      while (tasks_.empty() && !walked_ && !aborted_) {
+        pthread_cond_wait(&work_cond_, &mutex_);
+      }
+      if (tasks_.empty() || aborted_) {
+        break;
+      }
+      Task task = tasks_.front();
+      tasks_.pop_front();
+      pthread_mutex_unlock(&mutex_);
+      if (task.list) {
+        List(task.path);
+      } else {
+        Stat(task.path);
+      }
+      pthread_mutex_lock(&mutex_);
+      if (--pending_ == 0) {
+        walked_ = true;
+        WakeAll();
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  void List(const std::string& path) {
+    long long offset = 0;
+    while (true) {
+      rpc::Rpc rpc;
+      proto::ReadDirRequest request;
+      proto::ReadDirResponse response;
+      request.mutable_header()->set_fs_id("backup");
+      request.set_path(path);
+      request.set_offset(offset);
+      request.set_max_entries(kListingPage);
+      service_->ReadDir(&rpc, &request, &response, null_callback_);
+      pthread_mutex_lock(&mutex_);
+      if (rpc.Failed()) {
+        Error(rpc, "ReadDir", path);
+        walk_failed_ = true;
+        pthread_mutex_unlock(&mutex_);
+        return;
+      }
+      for (int i = 0; i < response.entry_size(); ++i) {
+        const std::string& filename = response.entry(i).filename();
+        if (filename == "." || filename == "..") {
+          continue;
+        }
+        Task task;
+        task.path = (path == "/" ? "" : path) + "/" + filename;
+        task.list = false;
+        tasks_.push_back(task);
+        pending_++;
+      }
+      pthread_cond_broadcast(&work_cond_);
+      bool aborted = aborted_;
+      pthread_mutex_unlock(&mutex_);
+      if (!response.has_next_offset() || aborted) {
+        return;
+      }
+      offset = response.next_offset();
+    }
+  }
+
+  void Stat(const std::string& path) {
+    rpc::Rpc rpc;
+    proto::GetAttrRequest request;
+    proto::GetAttrResponse response;
+    request.mutable_header()->set_fs_id("backup");
+    request.set_path(path);
+    service_->GetAttr(&rpc, &request, &response, null_callback_);
+    if (rpc.Failed()) {
+      pthread_mutex_lock(&mutex_);
+      Error(rpc, "GetAttr", path);
+      walk_failed_ = true;
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    const proto::Stat& stat = response.stat();
+    Entry* entry = new Entry;
+    entry->path = path;
+    entry->name = ArchiveName(path);
+    entry->mode = stat.mode();
+    entry->size = stat.size();
+    entry->mtime = stat.has_mtime() ? stat.mtime().tv_sec() : 0;
+    if (S_ISDIR(stat.mode())) {
+      entry->type = Entry::DIRECTORY;
+      entry->done = true;
+    } else if (S_ISLNK(stat.mode())) {
+      entry->type = Entry::SYMLINK;
+      entry->done = true;
+      rpc::Rpc link_rpc;
+      proto::ReadLinkRequest link_request;
+      proto::ReadLinkResponse link_response;
+      link_request.mutable_header()->set_fs_id("backup");
+      link_request.set_path(path);
+      service_->ReadLink(&link_rpc, &link_request, &link_response,
+                         null_callback_);
+      if (link_rpc.Failed()) {
+        pthread_mutex_lock(&mutex_);
+        Error(link_rpc, "ReadLink", path);
+        KeepPrevious(entry->name);
+        pthread_mutex_unlock(&mutex_);
+        delete entry;
+        return;
+      }
+      entry->target = link_response.destination();
+    } else if (S_ISREG(stat.mode())) {
+      entry->type = Entry::FILE;
+      if (Unchanged(*entry)) {
+        pthread_mutex_lock(&mutex_);
+        manifest_[entry->name] = options_.previous->find(entry->name)->second;
+        stats_->unchanged++;
+        pthread_mutex_unlock(&mutex_);
+        delete entry;
+        return;
+      }
+    } else {
+      // Devices, sockets and the like are not archived
+      delete entry;
+      return;
+    }
+    pthread_mutex_lock(&mutex_);
+    if (entry->type == Entry::DIRECTORY) {
+      Task task;
+      task.path = path;
+      task.list = true;
+      tasks_.push_back(task);
+      pending_++;
+      pthread_cond_broadcast(&work_cond_);
+    }
+    if (entry->name.empty()) {
+      // The root of the filesystem has no entry of its own
+      delete entry;
+    } else {
+      entries_.push_back(entry);
+      pthread_cond_broadcast(entry->type == Entry::FILE ? &entry_cond_ :
+                                                          &chunk_cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Returns true if the previous manifest has the file with the same size and
+  // modification time
+  bool Unchanged(const Entry& entry) {
+    if (options_.previous == NULL) {
+      return false;
+    }
+    Manifest::const_iterator it = options_.previous->find(entry.name);
+    return (it != options_.previous->end() && it->second.type == 'f' &&
+            it->second.size == entry.size && it->second.mtime == entry.mtime);
+  }
+
+  // Returns the next file for a reader, or NULL once there are none.  Must be
+  // called with mutex_ held.
+  Entry* NextFile() {
+    while (!aborted_) {
+      if (next_file_ < first_) {
+        next_file_ = first_;
+      }
+      for (; next_file_ < first_ + static_cast<long long>(entries_.size());
+           ++next_file_) {
+        Entry* entry = entries_[next_file_ - first_];
+        if (entry->type == Entry::FILE && entry->reader == -1) {
+          next_file_++;
+          return entry;
+        }
+      }
+      if (walked_) {
+        break;
+      }
+      pthread_cond_wait(&entry_cond_, &mutex_);
+    }
+    return NULL;
+  }
+
+  void Read(int reader) {
+    pthread_mutex_lock(&mutex_);
+    Entry* entry;
+    while ((entry = NextFile()) != NULL) {
+      entry->reader = reader;
+      pthread_mutex_unlock(&mutex_);
+      ReadFile(reader, entry);
+      pthread_mutex_lock(&mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  void ReadFile(int reader, Entry* entry) {
+    rpc::Rpc open_rpc;
+    proto::OpenRequest open_request;
+    proto::OpenResponse open_response;
+    open_request.mutable_header()->set_fs_id("backup");
+    open_request.set_path(entry->path);
+    open_request.set_flags(O_RDONLY);
+    service_->Open(&open_rpc, &open_request, &open_response, null_callback_);
+    pthread_mutex_lock(&mutex_);
+    if (open_rpc.Failed()) {
+      Error(open_rpc, "Open", entry->path);
+      entry->failed = true;
+      entry->done = true;
+      pthread_cond_broadcast(&chunk_cond_);
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    entry->opened = true;
+    stats_->files++;
+    pthread_cond_broadcast(&chunk_cond_);
+    long long offset = 0;
+    while (offset < entry->size) {
+      while (outstanding_[reader] >= options_.buffers_per_reader &&
+             !aborted_) {
+        pthread_cond_wait(&space_cond_, &mutex_);
+      }
+      if (aborted_) {
+        break;
+      }
+      outstanding_[reader]++;
+      pthread_mutex_unlock(&mutex_);
+      rpc::Rpc rpc;
+      proto::ReadRequest request;
+      proto::ReadResponse response;
+      request.mutable_header()->set_fs_id("backup");
+      request.set_filehandle(open_response.filehandle());
+      request.set_offset(offset);
+      long long size = entry->size - offset;
+      request.set_size(size < options_.buffer_size ? size :
+                                                     options_.buffer_size);
+      service_->Read(&rpc, &request, &response, null_callback_);
+      pthread_mutex_lock(&mutex_);
+      if (rpc.Failed() || response.buffer().empty()) {
+        if (rpc.Failed()) {
+          Error(rpc, "Read", entry->path);
+        } else {
+          syslog(LOG_ERR, "%s shrank while it was read",
+                 entry->path.c_str());
+          stats_->errors++;
+        }
+        entry->failed = true;
+        outstanding_[reader]--;
+        break;
+      }
+      std::string* chunk = new std::string;
+      chunk->swap(*response.mutable_buffer());
+      if (options_.hash) {
+        entry->hash = UpdateHash(entry->hash, chunk->data(), chunk->size());
+      }
+      offset += chunk->size();
+      stats_->bytes += chunk->size();
+      entry->chunks.push_back(chunk);
+      pthread_cond_broadcast(&chunk_cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+
+    rpc::Rpc release_rpc;
+    proto::ReleaseRequest release_request;
+    proto::ReleaseResponse release_response;
+    release_request.mutable_header()->set_fs_id("backup");
+    release_request.set_filehandle(open_response.filehandle());
+    service_->Release(&release_rpc, &release_request, &release_response,
+                      null_callback_);
+    pthread_mutex_lock(&mutex_);
+    entry->done = true;
+    pthread_cond_broadcast(&chunk_cond_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Records an entry written to the archive in the manifest.  Must be called
+  // with mutex_ held.
+  void Record(const Entry& entry) {
+    if (entry.failed) {
+      // A file that could not be read stays in the manifest, so that it is
+      // not removed, but with a size no file has, so that the next backup
+      // reads it again
+      KeepPrevious(entry.name);
+      Manifest::iterator it = manifest_.find(entry.name);
+      if (it != manifest_.end() && it->second.type == 'f') {
+        it->second.size = -1;
+        it->second.hash.clear();
+      }
+      return;
+    }
+    ManifestEntry* record = &manifest_[entry.name];
+    record->mtime = entry.mtime;
+    if (entry.type == Entry::DIRECTORY) {
+      record->type = 'd';
+      stats_->directories++;
+    } else if (entry.type == Entry::SYMLINK) {
+      record->type = 'l';
+      stats_->symlinks++;
+    } else {
+      record->type = 'f';
+      record->size = entry.size;
+      if (options_.hash) {
+        record->hash = FormatHash(entry.hash);
+      }
+    }
+  }
+
+  // Writes the entries to the archive in order, returning false if the
+  // archive could not be written.
+  bool Write() {
+    long long start = NowMicros();
+    long long progress = start;
+    bool success = true;
+    pthread_mutex_lock(&mutex_);
+    while (success && !aborted_) {
+      if (entries_.empty()) {
+        if (walked_) {
+          break;
+        }
+        pthread_cond_wait(&chunk_cond_, &mutex_);
+        continue;
+      }
+      Entry* entry = entries_.front();
+      if (!entry->done && (!entry->opened || entry->chunks.empty())) {
+        pthread_cond_wait(&chunk_cond_, &mutex_);
+        continue;
+      }
+      std::deque<std::string*> chunks;
+      chunks.swap(entry->chunks);
+      bool done = entry->done;
+      bool opened = entry->opened;
+      bool failed = done && entry->failed;
+      pthread_mutex_unlock(&mutex_);
+
+      if (entry->type == Entry::DIRECTORY) {
+        success = archive_->AddDirectory(entry->name, entry->mode,
+                                         entry->mtime);
+      } else if (entry->type == Entry::SYMLINK) {
+        success = archive_->AddSymLink(entry->name, entry->target,
+                                       entry->mtime);
+      } else if (opened) {
+        // A file that failed before any of it was written is left out
+        if (!entry->started && !failed) {
+          success = archive_->BeginFile(entry->name, entry->mode,
+                                        entry->size, entry->mtime);
+          entry->started = true;
+        }
+        for (size_t i = 0; i < chunks.size(); ++i) {
+          if (entry->started) {
+            success = success && archive_->WriteData(chunks[i]->data(),
+                                                     chunks[i]->size());
+          }
+          delete chunks[i];
+        }
+        if (success && done && entry->started) {
+          success = failed ? archive_->AbortFile() : archive_->EndFile();
+        }
+      }
+
+      pthread_mutex_lock(&mutex_);
+      if (!chunks.empty()) {
+        outstanding_[entry->reader] -= chunks.size();
+        pthread_cond_broadcast(&space_cond_);
+      }
+      if (done && success) {
+        Record(*entry);
+      }
+      if (done) {
+        entries_.pop_front();
+        first_++;
+        delete entry;
+      }
+      long long now = NowMicros();
+      if (now - progress >= kProgressIntervalUsec) {
+        progress = now;
+        syslog(LOG_INFO, "%lld files, %.1f MiB read (%.1f MiB/s)",
+               stats_->files, stats_->bytes / (1024.0 * 1024),
+               stats_->bytes / (1024.0 * 1024) / ((now - start) / 1000000.0));
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+    return success;
+  }
+
+  proto::FsService* service_;
+  std::string root_;
+  Archive* archive_;
+  BackupOptions options_;
+  Closure* null_callback_;
+
+  pthread_mutex_t mutex_;  // protects the members below
+  pthread_cond_t work_cond_;  // tasks_ or walked_ changed
+  pthread_cond_t entry_cond_;  // A file was added to entries_
+  pthread_cond_t chunk_cond_;  // The first entry may be ready to write
+  pthread_cond_t space_cond_;  // outstanding_ went down
+  BackupStats* stats_;
+  std::deque<Task> tasks_;
+  // Tasks queued or being worked on; the walk is over when none are left
+  int pending_;
+  bool walked_;
+  // Set when part of the tree could not be listed
+  bool walk_failed_;
+  bool aborted_;
+  std::deque<Entry*> entries_;
+  // The position of entries_[0] among all entries
+  long long first_;
+  // The position from which readers look for the next file
+  long long next_file_;
+  // Chunks read by each reader and not yet written
+  std::vector<int> outstanding_;
+  Manifest manifest_;
+};
+
+bool Backup(proto::FsService* service, const std::string& root,
+            Archive* archive, const BackupOptions& options,
+            Manifest* manifest, BackupStats* stats) {
+  Pipeline pipeline(service, root, archive, options, stats);
+  bool success = pipeline.Run();
+  if (manifest != NULL) {
+    manifest->swap(*pipeline.manifest());
+  }
+  return success;
+}
+
+// Opens the first of destination.1, destination.2, ... that does not exist
+static int CreateNextArchive(const std::string& destination,
+                             std::string* name) {
+  for (int i = 1; ; ++i) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%d", i);
+    *name = destination + suffix;
+    int fd = open(name->c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd != -1 || errno != EEXIST) {
+      return fd;
+    }
+  }
+}
+
+std::string ManifestName(const std::string& device_id,
+                         const std::string& root,
+                         const std::string& destination) {
+  std::string key = root;
+  while (key.size() > 1 && key[key.size() - 1] == '/') {
+    key.erase(key.size() - 1);
+  }
+  key += '\0';
+  if (destination.empty() || destination[0] != '/') {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+      key += std::string(cwd) + "/";
+    }
+  }
+  key += destination;
+  struct stat stbuf;
+  bool sync = (stat(destination.c_str(), &stbuf) == 0 &&
+               S_ISDIR(stbuf.st_mode));
+  key += '\0';
+  key += sync ? "directory" : "tar";
+  return device_id + "-" +
+         FormatHash(UpdateHash(kHashBasis, key.data(), key.size())) +
+         ".manifest";
+}
+
+bool BackupTo(proto::FsService* service, const std::string& root,
+              const std::string& destination,
+              const std::string& manifest_file, const BackupOptions& options) {
+  BackupOptions incremental = options;
+  Manifest previous;
+  incremental.previous = NULL;
+  if (!manifest_file.empty()) {
+    if (!ReadManifest(manifest_file, &previous)) {
+      return false;
+    }
+    incremental.previous = &previous;
+  }
+  struct stat stbuf;
+  bool exists = (stat(destination.c_str(), &stbuf) == 0);
+  bool sync = (exists && S_ISDIR(stbuf.st_mode));
+  int fd = -1;
+  std::string archive_name = destination;
+  Archive* archive = NULL;
+  if (sync) {
+    archive = new DirectoryWriter(destination);
+  } else {
+    if (!previous.empty() && exists) {
+      // The unchanged files are only in the earlier archives, so the files
+      // that changed go in a new one next to them
+      fd = CreateNextArchive(destination, &archive_name);
+    } else {
+      if (!previous.empty()) {
+        syslog(LOG_INFO, "%s is missing, reading every file",
+               destination.c_str());
+        incremental.previous = NULL;
+      }
+      fd = open(destination.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    }
+    if (fd == -1) {
+      syslog(LOG_ERR, "Unable to create %s: %m", archive_name.c_str());
+      return false;
+    }
+    archive = new TarWriter(fd);
+  }
+  Manifest manifest;
+  BackupStats stats;
+  long long start = NowMicros();
+  bool success = Backup(service, root, archive, incremental, &manifest,
+                        &stats);
+  delete archive;
+  if (fd != -1 && close(fd) != 0) {
+    syslog(LOG_ERR, "Unable to write %s: %m", archive_name.c_str());
+    success = false;
+  }
+  double seconds = (NowMicros() - start) / 1000000.0;
+  if (archive_name != destination) {
+    syslog(LOG_INFO, "Wrote the changes to %s", archive_name.c_str());
+  }
+  syslog(LOG_INFO, "%lld directories, %lld files read, %lld unchanged, "
+         "%lld removed, %lld symlinks, %lld errors", stats.directories,
+         stats.files, stats.unchanged, stats.removed, stats.symlinks,
+         stats.errors);
+  syslog(LOG_INFO, "%.1f MiB read in %.1fs, %.1f MiB/s",
+         stats.bytes / (1024.0 * 1024), seconds,
+         stats.bytes / (1024.0 * 1024) / seconds);
+  if (success && !manifest_file.empty()) {
+    success = WriteManifest(manifest_file, manifest);
+  }
+  return success;
+}
+
+}  // namespace backup
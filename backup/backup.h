@@ -0,0 +1,103 @@
+// Copies a directory tree from an FsService into an archive, such as a tar
+// file or a host directory, keeping the device, the archive and the disk busy
+// at the same time.  Three stages run concurrently:
+//
+//  - Walker threads list directories and GetAttr their entries in parallel,
+//    adding each directory, symlink and file to the archive's order.
+//  - Reader threads take the files in that order and read them in chunks.
+//    Each reader holds at most buffers_per_reader unwritten chunks, so
+//    memory is bounded and a slow disk pushes back on the device.
+//  - The calling thread writes the entries to the archive in order, as soon
+//    as the chunks of the oldest file arrive.
+//
+// Entries that cannot be read are left out and counted as errors, as is a
+// file that fails part way through or shrinks while it is read: a host
+// directory keeps its earlier copy, and the next backup reads it again.  A
+// file that grows is cut off at the size it had when it was listed.
+//
+// Given the manifest of a previous backup, only files that are new or whose
+// size or modification time changed are read, so that an incremental backup
+// costs little more than the listing.  Entries of the manifest that no longer
+// exist are removed from the archive, unless part of the tree could not be
+// listed, in which case they are kept in the new manifest instead.
+
+#ifndef __BACKUP_BACKUP_H__
+#define __BACKUP_BACKUP_H__
+
+#include <string>
+#include "backup/manifest.h"
+
+namespace proto {
+class FsService;
+}
+
+namespace backup {
+
+class Archive;
+
+struct BackupOptions {
+  BackupOptions()
+      : walkers(8), readers(4), buffers_per_reader(4),
+        buffer_size(1024 * 1024), previous(NULL), hash(false) { }
+
+  int walkers;
+  int readers;
+  int buffers_per_reader;
+  int buffer_size;
+  // The manifest of the previous backup, or NULL to read every file
+  const Manifest* previous;
+  // Whether to record a hash of the contents of the files read
+  bool hash;
+};
+
+struct BackupStats {
+  BackupStats()
+      : directories(0), files(0), symlinks(0), unchanged(0), removed(0),
+        bytes(0), errors(0) { }
+
+  long long directories;
+  // Files read
+  long long files;
+  long long symlinks;
+  // Files skipped because the previous manifest has them
+  long long unchanged;
+  long long removed;
+  // Bytes of file data read from the service
+  long long bytes;
+  // Entries left out or padded because a call failed
+  long long errors;
+};
+
+// Archives the tree at root, which is named by its last component in the
+// archive, e.g. "/DCIM" becomes "DCIM/...".  The whole filesystem is archived
+// without a leading directory when root is "/".  The entries now in the
+// archive are recorded in manifest, if not NULL.  Does not take ownership of
+// service, which is called from several threads at once, or of archive.
+// Returns false if the archive could not be written; stats is filled in
+// either way.
+bool Backup(proto::FsService* service, const std::string& root,
+            Archive* archive, const BackupOptions& options,
+            Manifest* manifest, BackupStats* stats);
+
+// Backs up root into destination: an existing directory is synced with the
+// tree and anything else is replaced with a tar file.  When manifest_file is
+// not empty, files unchanged since the manifest it holds are not read, and it
+// is replaced with the new manifest if the backup succeeds.  An existing tar
+// file is then never replaced: the files that changed are written to the
+// first of destination.1, destination.2, ... that does not exist.  The
+// statistics and sustained rate are logged.  options.previous is ignored.
+bool BackupTo(proto::FsService* service, const std::string& root,
+              const std::string& destination,
+              const std::string& manifest_file, const BackupOptions& options);
+
+// Returns the name of a file in which to keep the manifest for backups of
+// root into destination from the device with the identifier.  Each tree,
+// destination and kind of archive has its own, since a manifest only
+// describes what is in the archive it was written with.
+std::string ManifestName(const std::string& device_id,
+                         const std::string& root,
+                         const std::string& destination);
+
+}  // namespace backup
+
+#endif  // __BACKUP_BACKUP_H__
@@ -0,0 +1,207 @@
+#include "backup/directory_writer.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <vector>
+
+namespace backup {
+
+// Suffix of files being written
+static const char kTempSuffix[] = ".iphonedisk-tmp";
+
+// Removes path, and everything beneath it if it is a directory.  Returns true
+// if nothing is left at path.
+static bool RemoveAll(const std::string& path) {
+  struct stat stbuf;
+  if (lstat(path.c_str(), &stbuf) != 0) {
+    return errno == ENOENT;
+  }
+  if (!S_ISDIR(stbuf.st_mode)) {
+    return unlink(path.c_str()) == 0;
+  }
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL) {
+    return false;
+  }
+  std::vector<std::string> names;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    std::string name(entry->d_name);
+    if (name != "." && name != "..") {
+      names.push_back(name);
+    }
+  }
+  closedir(dir);
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!RemoveAll(path + "/" + names[i])) {
+      return false;
+    }
+  }
+  return rmdir(path.c_str()) == 0;
+}
+
+// Makes way at path for an entry of type S_IFDIR, S_IFREG or S_IFLNK, whose
+// type may have changed since the last sync.  A directory is kept for a
+// directory, and a file or symlink for a file, which is renamed over it.
+// Anything else is removed, without following symlinks.
+static bool MakeRoom(const std::string& path, int type) {
+  struct stat stbuf;
+  if (lstat(path.c_str(), &stbuf) != 0) {
+    return errno == ENOENT;
+  }
+  if ((type == S_IFDIR && S_ISDIR(stbuf.st_mode)) ||
+      (type == S_IFREG && !S_ISDIR(stbuf.st_mode))) {
+    return true;
+  }
+  if (!RemoveAll(path)) {
+    syslog(LOG_ERR, "Unable to remove %s: %m", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+DirectoryWriter::DirectoryWriter(const std::string& directory)
+    : directory_(directory), fd_(-1), mode_(0), size_(0), mtime_(0),
+      remaining_(0) { }
+
+DirectoryWriter::~DirectoryWriter() {
+  if (fd_ != -1) {
+    close(fd_);
+    unlink((path_ + kTempSuffix).c_str());
+  }
+}
+
+bool DirectoryWriter::AddDirectory(const std::string& path, int mode,
+                                   long long mtime) {
+  std::string full_path = directory_ + "/" + path;
+  if (!MakeRoom(full_path, S_IFDIR)) {
+    return false;
+  }
+  if (mkdir(full_path.c_str(), (mode & 07777) | 0700) != 0 &&
+      errno != EEXIST) {
+    syslog(LOG_ERR, "Unable to create %s: %m", full_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DirectoryWriter::AddSymLink(const std::string& path,
+                                 const std::string& target, long long mtime) {
+  std::string full_path = directory_ + "/" + path;
+  if (!MakeRoom(full_path, S_IFLNK)) {
+    return false;
+  }
+  if (symlink(target.c_str(), full_path.c_str()) != 0) {
+    syslog(LOG_ERR, "Unable to create %s: %m", full_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DirectoryWriter::BeginFile(const std::string& path, int mode,
+                                long long size, long long mtime) {
+  path_ = directory_ + "/" + path;
+  std::string temp = path_ + kTempSuffix;
+  // The temporary name may itself be a symlink from the device
+  if (!RemoveAll(temp)) {
+    syslog(LOG_ERR, "Unable to remove %s: %m", temp.c_str());
+    return false;
+  }
+  fd_ = open(temp.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600);
+  if (fd_ == -1) {
+    syslog(LOG_ERR, "Unable to create %s: %m", temp.c_str());
+    return false;
+  }
+  mode_ = mode;
+  size_ = size;
+  mtime_ = mtime;
+  remaining_ = size;
+  return true;
+}
+
+bool DirectoryWriter::WriteData(const char* data, size_t size) {
+  if (static_cast<long long>(size) > remaining_) {
+    size = remaining_;
+  }
+  remaining_ -= size;
+  while (size > 0) {
+    ssize_t n = write(fd_, data, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_ERR, "Unable to write %s: %m", path_.c_str());
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool DirectoryWriter::EndFile() {
+  std::string temp = path_ + kTempSuffix;
+  // A file cut short is filled with zeros, as in a tar archive
+  bool success = (ftruncate(fd_, size_) == 0 &&
+                  fchmod(fd_, mode_ & 07777) == 0);
+  if (close(fd_) != 0) {
+    success = false;
+  }
+  fd_ = -1;
+  struct timeval times[2];
+  times[0].tv_sec = mtime_;
+  times[0].tv_usec = 0;
+  times[1] = times[0];
+  if (!success || utimes(temp.c_str(), times) != 0 ||
+      !MakeRoom(path_, S_IFREG) || rename(temp.c_str(), path_.c_str()) != 0) {
+    syslog(LOG_ERR, "Unable to write %s: %m", path_.c_str());
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool DirectoryWriter::AbortFile() {
+  std::string temp = path_ + kTempSuffix;
+  close(fd_);
+  fd_ = -1;
+  if (unlink(temp.c_str()) != 0) {
+    syslog(LOG_ERR, "Unable to remove %s: %m", temp.c_str());
+  }
+  return true;
+}
+
+bool DirectoryWriter::Remove(const std::string& path) {
+  std::string full_path = directory_ + "/" + path;
+  struct stat stbuf;
+  // The entry is already gone if a directory above it was replaced, and must
+  // not be looked for through a symlink that took a directory's place
+  for (size_t slash = path.find('/'); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    std::string parent = directory_ + "/" + path.substr(0, slash);
+    if (lstat(parent.c_str(), &stbuf) != 0 || !S_ISDIR(stbuf.st_mode)) {
+      return true;
+    }
+  }
+  if (lstat(full_path.c_str(), &stbuf) != 0) {
+    return errno == ENOENT;
+  }
+  int ret = S_ISDIR(stbuf.st_mode) ? rmdir(full_path.c_str()) :
+                                     unlink(full_path.c_str());
+  if (ret != 0) {
+    // Not fatal: the directory may hold files that were never synced
+    syslog(LOG_ERR, "Unable to remove %s: %m", full_path.c_str());
+  }
+  return true;
+}
+
+bool DirectoryWriter::Finish() {
+  return true;
+}
+
+}  // namespace backup
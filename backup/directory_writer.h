@@ -0,0 +1,48 @@
+// An Archive that keeps a copy of the tree in a host directory, for syncing.
+// Files are written to a temporary name and renamed into place once complete,
+// so an interrupted sync, or a file that cannot be read in full, leaves the
+// previous copy of a file intact.  Files keep their mode and modification
+// time; directories are created as needed and their times are not kept.  An
+// entry whose type changed since the last sync replaces the old one, and
+// symlinks in the copy are never followed.
+
+#ifndef __BACKUP_DIRECTORY_WRITER_H__
+#define __BACKUP_DIRECTORY_WRITER_H__
+
+#include <string>
+#include "backup/archive.h"
+
+namespace backup {
+
+class DirectoryWriter : public Archive {
+ public:
+  // The directory must exist
+  explicit DirectoryWriter(const std::string& directory);
+  virtual ~DirectoryWriter();
+
+  virtual bool AddDirectory(const std::string& path, int mode,
+                            long long mtime);
+  virtual bool AddSymLink(const std::string& path, const std::string& target,
+                          long long mtime);
+  virtual bool BeginFile(const std::string& path, int mode, long long size,
+                         long long mtime);
+  virtual bool WriteData(const char* data, size_t size);
+  virtual bool EndFile();
+  virtual bool AbortFile();
+  virtual bool Remove(const std::string& path);
+  virtual bool Finish();
+
+ private:
+  std::string directory_;
+  // The file being written
+  int fd_;
+  std::string path_;
+  int mode_;
+  long long size_;
+  long long mtime_;
+  long long remaining_;
+};
+
+}  // namespace backup
+
+#endif  // __BACKUP_DIRECTORY_WRITER_H__
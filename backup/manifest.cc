@@ -0,0 +1,132 @@
+#include "backup/manifest.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+namespace backup {
+
+static const char kHeader[] = "# iphonedisk manifest 1\n";
+
+static std::string Escape(const std::string& path) {
+  std::string escaped;
+  for (size_t i = 0; i < path.size(); ++i) {
+    if (path[i] == '\\') {
+      escaped += "\\\\";
+    } else if (path[i] == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += path[i];
+    }
+  }
+  return escaped;
+}
+
+static std::string Unescape(const std::string& escaped) {
+  std::string path;
+  for (size_t i = 0; i < escaped.size(); ++i) {
+    if (escaped[i] == '\\' && i + 1 < escaped.size()) {
+      path += (escaped[++i] == 'n') ? '\n' : escaped[i];
+    } else {
+      path += escaped[i];
+    }
+  }
+  return path;
+}
+
+// Parses one line, without its newline
+static bool ParseLine(const std::string& line, Manifest* manifest) {
+  char type;
+  long long size;
+  long long mtime;
+  char hash[32];
+  int consumed = 0;
+  // The path follows a single space and may itself begin with spaces
+  if (sscanf(line.c_str(), "%c %lld %lld %31s%n", &type, &size, &mtime,
+             hash, &consumed) != 4 ||
+      static_cast<size_t>(consumed) + 1 >= line.size() ||
+      line[consumed] != ' ') {
+    return false;
+  }
+  ManifestEntry* entry = &(*manifest)[Unescape(line.substr(consumed + 1))];
+  entry->type = type;
+  entry->size = size;
+  entry->mtime = mtime;
+  entry->hash = (std::string(hash) == "-") ? "" : hash;
+  return true;
+}
+
+bool ReadManifest(const std::string& filename, Manifest* manifest) {
+  manifest->clear();
+  FILE* file = fopen(filename.c_str(), "r");
+  if (file == NULL) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    syslog(LOG_ERR, "Unable to open %s: %m", filename.c_str());
+    return false;
+  }
+  bool success = true;
+  std::string line;
+  int number = 0;
+  int c;
+  while ((c = getc(file)) != EOF) {
+    if (c != '\n') {
+      line += static_cast<char>(c);
+      continue;
+    }
+    number++;
+    if (!line.empty() && line[0] != '#' && !ParseLine(line, manifest)) {
+      syslog(LOG_ERR, "%s:%d: invalid entry", filename.c_str(), number);
+      success = false;
+      break;
+    }
+    line.clear();
+  }
+  fclose(file);
+  return success;
+}
+
+bool WriteManifest(const std::string& filename, const Manifest& manifest) {
+  std::string temp = filename + ".tmp";
+  FILE* file = fopen(temp.c_str(), "w");
+  if (file == NULL) {
+    syslog(LOG_ERR, "Unable to create %s: %m", temp.c_str());
+    return false;
+  }
+  fputs(kHeader, file);
+  for (Manifest::const_iterator it = manifest.begin(); it != manifest.end();
+       ++it) {
+    const ManifestEntry& entry = it->second;
+    fprintf(file, "%c %lld %lld %s %s\n", entry.type, entry.size, entry.mtime,
+            entry.hash.empty() ? "-" : entry.hash.c_str(),
+            Escape(it->first).c_str());
+  }
+  bool failed = ferror(file);
+  if (fclose(file) != 0 || failed ||
+      rename(temp.c_str(), filename.c_str()) != 0) {
+    syslog(LOG_ERR, "Unable to write %s: %m", filename.c_str());
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+unsigned long long UpdateHash(unsigned long long hash, const char* data,
+                              size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string FormatHash(unsigned long long hash) {
+  char buffer[17];
+  snprintf(buffer, sizeof(buffer), "%016llx", hash);
+  return buffer;
+}
+
+}  // namespace backup
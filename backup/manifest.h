@@ -0,0 +1,48 @@
+// A record of the entries of a backed up tree, from which the next backup
+// tells which files changed using only their metadata.  It is stored as text,
+// one entry per line:
+//
+//   <type> <size> <mtime> <hash> <path>
+//
+// where the type is f, d or l (file, directory or symlink), the hash is the
+// 64-bit FNV-1a hash of a file's contents in hex, or "-" if it was not
+// computed, and backslashes and newlines in the path are escaped.  A file
+// that could not be read has a size of -1, so that the next backup reads it.
+
+#ifndef __BACKUP_MANIFEST_H__
+#define __BACKUP_MANIFEST_H__
+
+#include <map>
+#include <string>
+
+namespace backup {
+
+struct ManifestEntry {
+  ManifestEntry() : type('f'), size(0), mtime(0) { }
+
+  char type;
+  long long size;
+  long long mtime;
+  std::string hash;  // Empty if not computed
+};
+
+// Entries by their path in the archive
+typedef std::map<std::string, ManifestEntry> Manifest;
+
+// Reads a manifest written by WriteManifest.  A missing file is an empty
+// manifest.  Returns false if the file could not be read or parsed.
+bool ReadManifest(const std::string& filename, Manifest* manifest);
+
+// Replaces the file with the manifest, atomically.  Returns false if it could
+// not be written.
+bool WriteManifest(const std::string& filename, const Manifest& manifest);
+
+// Updates a running FNV-1a hash, which starts at kHashBasis, with data
+static const unsigned long long kHashBasis = 14695981039346656037ULL;
+unsigned long long UpdateHash(unsigned long long hash, const char* data,
+                              size_t size);
+std::string FormatHash(unsigned long long hash);
+
+}  // namespace backup
+
+#endif  // __BACKUP_MANIFEST_H__
@@ -0,0 +1,273 @@
+#include "backup/tar_writer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+namespace backup {
+
+static const int kBlockSize = 512;
+// Output is written to the file descriptor in pieces of this size
+static const size_t kFlushSize = 1024 * 1024;
+// The largest size that fits the 11 octal digits of a ustar header
+static const long long kMaxUstarSize = 077777777777LL;
+
+// The fields of a ustar header block
+struct Header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+// Fills all but the last byte of a field with the value in octal
+static void SetOctal(char* field, size_t size, long long value) {
+  for (size_t i = size - 1; i > 0; --i) {
+    field[i - 1] = '0' + (value & 7);
+    value >>= 3;
+  }
+}
+
+// Sets the name and prefix fields of a header, returning false if path does
+// not fit them.
+static bool SetPath(const std::string& path, Header* header) {
+  if (path.size() <= sizeof(header->name)) {
+    memcpy(header->name, path.data(), path.size());
+    return true;
+  }
+  // The prefix holds the leading directories, split at a slash
+  size_t slash = path.rfind('/', sizeof(header->prefix));
+  while (slash != std::string::npos && slash > 0) {
+    if (path.size() - slash - 1 <= sizeof(header->name)) {
+      memcpy(header->prefix, path.data(), slash);
+      memcpy(header->name, path.data() + slash + 1, path.size() - slash - 1);
+      return true;
+    }
+    slash = path.rfind('/', slash - 1);
+  }
+  return false;
+}
+
+static size_t Digits(size_t n) {
+  size_t digits = 1;
+  for (; n >= 10; n /= 10) {
+    digits++;
+  }
+  return digits;
+}
+
+// Appends a pax record, "<length> <key>=<value>\n", where the length counts
+// the whole record including its own digits.
+static void AppendRecord(const char* key, const std::string& value,
+                         std::string* records) {
+  size_t size = strlen(key) + value.size() + 3;
+  // Adding the digits may carry into another digit
+  size_t length = size + Digits(size);
+  length = size + Digits(length);
+  char prefix[24];
+  snprintf(prefix, sizeof(prefix), "%zu ", length);
+  records->append(prefix);
+  records->append(key);
+  records->append("=");
+  records->append(value);
+  records->append("\n");
+}
+
+TarWriter::TarWriter(int fd)
+    : fd_(fd), bytes_written_(0), failed_(false), file_start_(0),
+      remaining_(0), padding_(0) {
+  buffer_.reserve(kFlushSize + kBlockSize);
+}
+
+TarWriter::~TarWriter() { }
+
+bool TarWriter::AddDirectory(const std::string& path, int mode,
+                             long long mtime) {
+  std::string name = path;
+  if (name.empty() || name[name.size() - 1] != '/') {
+    name += "/";
+  }
+  return AddHeader(name, '5', mode, 0, mtime, "");
+}
+
+bool TarWriter::AddSymLink(const std::string& path, const std::string& target,
+                           long long mtime) {
+  return AddHeader(path, '2', 0777, 0, mtime, target);
+}
+
+bool TarWriter::BeginFile(const std::string& path, int mode, long long size,
+                          long long mtime) {
+  file_start_ = bytes_written_ + buffer_.size();
+  if (!AddHeader(path, '0', mode, size, mtime, "")) {
+    return false;
+  }
+  remaining_ = size;
+  padding_ = (kBlockSize - size % kBlockSize) % kBlockSize;
+  return true;
+}
+
+bool TarWriter::WriteData(const char* data, size_t size) {
+  if (static_cast<long long>(size) > remaining_) {
+    size = remaining_;
+  }
+  remaining_ -= size;
+  return Append(data, size);
+}
+
+bool TarWriter::EndFile() {
+  bool success = AppendZeros(remaining_ + padding_);
+  remaining_ = 0;
+  padding_ = 0;
+  return success;
+}
+
+bool TarWriter::AbortFile() {
+  if (failed_) {
+    return false;
+  }
+  if (file_start_ >= bytes_written_) {
+    buffer_.resize(file_start_ - bytes_written_);
+  } else {
+    off_t offset = lseek(fd_, file_start_ - bytes_written_, SEEK_CUR);
+    if (offset == -1) {
+      syslog(LOG_WARNING, "Unable to cut a file out of the archive (%m), "
+             "filling it with zeros");
+      return EndFile();
+    }
+    if (ftruncate(fd_, offset) != 0) {
+      syslog(LOG_ERR, "Unable to truncate archive: %m");
+      failed_ = true;
+      return false;
+    }
+    buffer_.clear();
+    bytes_written_ = file_start_;
+  }
+  remaining_ = 0;
+  padding_ = 0;
+  return true;
+}
+
+bool TarWriter::Finish() {
+  return AppendZeros(2 * kBlockSize) && Flush();
+}
+
+bool TarWriter::AddHeader(const std::string& path, char type, int mode,
+                          long long size, long long mtime,
+                          const std::string& target) {
+  Header header;
+  memset(&header, 0, sizeof(header));
+  std::string records;
+  if (!SetPath(path, &header)) {
+    AppendRecord("path", path, &records);
+    // A truncated name for readers that do not understand pax headers
+    memcpy(header.name, path.data() + path.size() - sizeof(header.name),
+           sizeof(header.name));
+  }
+  if (target.size() > sizeof(header.linkname)) {
+    AppendRecord("linkpath", target, &records);
+  } else {
+    memcpy(header.linkname, target.data(), target.size());
+  }
+  if (size > kMaxUstarSize) {
+    char value[24];
+    snprintf(value, sizeof(value), "%lld", size);
+    AppendRecord("size", value, &records);
+    size = 0;
+  }
+  if (!records.empty()) {
+    std::string base = path.substr(0, path.find_last_not_of('/') + 1);
+    base = "PaxHeaders/" + base.substr(base.rfind('/') + 1);
+    if (!AddHeader(base.substr(0, sizeof(header.name)), 'x', 0644,
+                   records.size(), mtime, "") ||
+        !Append(records.data(), records.size()) ||
+        !AppendZeros((kBlockSize - records.size() % kBlockSize) %
+                     kBlockSize)) {
+      return false;
+    }
+  }
+  SetOctal(header.mode, sizeof(header.mode), mode & 07777);
+  SetOctal(header.uid, sizeof(header.uid), 0);
+  SetOctal(header.gid, sizeof(header.gid), 0);
+  SetOctal(header.size, sizeof(header.size), size);
+  SetOctal(header.mtime, sizeof(header.mtime), mtime < 0 ? 0 : mtime);
+  header.type = type;
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+  // The checksum is computed with the checksum field set to spaces
+  memset(header.checksum, ' ', sizeof(header.checksum));
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&header);
+  unsigned int checksum = 0;
+  for (size_t i = 0; i < sizeof(header); ++i) {
+    checksum += bytes[i];
+  }
+  snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+  return Append(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+bool TarWriter::Append(const char* data, size_t size) {
+  if (failed_) {
+    return false;
+  }
+  while (size > 0) {
+    size_t n = size;
+    if (buffer_.size() + n > kFlushSize) {
+      n = kFlushSize - buffer_.size();
+    }
+    buffer_.append(data, n);
+    data += n;
+    size -= n;
+    if (buffer_.size() >= kFlushSize && !Flush()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TarWriter::AppendZeros(size_t size) {
+  static const char zeros[kBlockSize] = { 0 };
+  while (size > 0) {
+    size_t n = size < sizeof(zeros) ? size : sizeof(zeros);
+    if (!Append(zeros, n)) {
+      return false;
+    }
+    size -= n;
+  }
+  return true;
+}
+
+bool TarWriter::Flush() {
+  size_t written = 0;
+  while (written < buffer_.size()) {
+    ssize_t n = write(fd_, buffer_.data() + written,
+                      buffer_.size() - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      syslog(LOG_ERR, "Unable to write archive: %m");
+      failed_ = true;
+      return false;
+    }
+    written += n;
+  }
+  bytes_written_ += buffer_.size();
+  buffer_.clear();
+  return true;
+}
+
+}  // namespace backup
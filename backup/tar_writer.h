@@ -0,0 +1,59 @@
+// Writes a POSIX (pax) tar archive to a file descriptor.  Entries are written
+// as ustar headers, preceded by a pax extended header when a path or link is
+// too long for ustar or a file is larger than 8GB.  Output is gathered into
+// large writes.
+
+#ifndef __BACKUP_TAR_WRITER_H__
+#define __BACKUP_TAR_WRITER_H__
+
+#include <string>
+#include "backup/archive.h"
+
+namespace backup {
+
+class TarWriter : public Archive {
+ public:
+  // Does not take ownership of fd
+  explicit TarWriter(int fd);
+  virtual ~TarWriter();
+
+  virtual bool AddDirectory(const std::string& path, int mode,
+                            long long mtime);
+  virtual bool AddSymLink(const std::string& path, const std::string& target,
+                          long long mtime);
+  virtual bool BeginFile(const std::string& path, int mode, long long size,
+                         long long mtime);
+  virtual bool WriteData(const char* data, size_t size);
+  virtual bool EndFile();
+  // Cuts the file out of the archive, or fills it with zeros if the file
+  // descriptor cannot seek, as a pipe cannot
+  virtual bool AbortFile();
+
+  // Writes the end of archive marker and any buffered output
+  virtual bool Finish();
+
+  // Bytes written to the file descriptor so far
+  long long bytes_written() const { return bytes_written_; }
+
+ private:
+  bool AddHeader(const std::string& path, char type, int mode,
+                 long long size, long long mtime, const std::string& target);
+  bool Append(const char* data, size_t size);
+  bool AppendZeros(size_t size);
+  bool Flush();
+
+  int fd_;
+  std::string buffer_;
+  long long bytes_written_;
+  bool failed_;
+  // Where the headers of the current file begin
+  long long file_start_;
+  // Bytes of the current file still to be written
+  long long remaining_;
+  // Padding after the current file, to the next block
+  int padding_;
+};
+
+}  // namespace backup
+
+#endif  // __BACKUP_TAR_WRITER_H__
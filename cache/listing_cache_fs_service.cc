@@ -0,0 +1,658 @@
+#include "cache/listing_cache_fs_service.h"
+
+#include <algorithm>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <vector>
+#include "memory/memory_budget.h"
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace cache {
+
+static metrics::Counter g_lookups(
+    "listing_cache_lookups_total", "GetAttr calls seen by the listing cache");
+static metrics::Counter g_negative_lookups(
+    "listing_cache_negative_lookups_total",
+    "GetAttr calls for missing names answered from a cached listing");
+static metrics::Gauge g_listings(
+    "listing_cache_listings", "Complete directory listings held");
+static metrics::Counter g_polls(
+    "listing_cache_polls_total",
+    "Directories checked for changes by the poller");
+static metrics::Counter g_invalidations(
+    "listing_cache_invalidations_total",
+    "Listings dropped because the poller found their directory changed");
+
+// Listings being read in pages are tracked for at most this many directories
+static const size_t kMaxPartialListings = 16;
+// Memory charged for a listing in addition to its path and hashes
+static const long long kListingCost = 64;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// 64-bit FNV-1a
+static unsigned long long HashName(const std::string& name) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < name.size(); ++i) {
+    hash ^= static_cast<unsigned char>(name[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Splits path into its parent directory and its last component.  Returns
+// false for the root.
+static bool SplitPath(const std::string& path, std::string* parent,
+                      std::string* name) {
+  size_t slash = path.rfind('/');
+  if (slash == std::string::npos || slash + 1 == path.size()) {
+    return false;
+  }
+  *parent = (slash == 0) ? "/" : path.substr(0, slash);
+  *name = path.substr(slash + 1);
+  return true;
+}
+
+// The attributes of a directory that change along with its entries
+struct DirectoryStat {
+  long long mtime;
+  int mtime_nsec;
+  long long size;
+  long long nlink;
+};
+
+static bool SameStat(const DirectoryStat& a, const DirectoryStat& b) {
+  return (a.mtime == b.mtime && a.mtime_nsec == b.mtime_nsec &&
+          a.size == b.size && a.nlink == b.nlink);
+}
+
+// Returns true if path is beneath directory
+static bool IsBeneath(const std::string& path, const std::string& directory) {
+  return (path.size() > directory.size() &&
+          path.compare(0, directory.size(), directory) == 0 &&
+          (path[directory.size()] == '/' || directory == "/"));
+}
+
+class ListingCacheService : public proto::FsService {
+ public:
+  ListingCacheService(proto::FsService* service,
+                      const ListingCacheOptions& options)
+      : service_(service),
+        options_(options),
+        generation_(0),
+        next_serial_(0),
+        polling_(false),
+        stopping_(false),
+        memory_("listing_cache", &EvictListings, this) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&poll_cond_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+    if (options_.poll_interval_usec > 0) {
+      polling_ = (pthread_create(&poll_thread_, NULL, &RunPoller, this) == 0);
+      if (!polling_) {
+        syslog(LOG_ERR, "pthread_create() failed: %m");
+      }
+    }
+  }
+
+  virtual ~ListingCacheService() {
+    if (polling_) {
+      pthread_mutex_lock(&mutex_);
+      stopping_ = true;
+      pthread_cond_signal(&poll_cond_);
+      pthread_mutex_unlock(&mutex_);
+      pthread_join(poll_thread_, NULL);
+    }
+    g_listings.Add(-static_cast<long long>(listings_.size()));
+    delete null_callback_;
+    pthread_cond_destroy(&poll_cond_);
+    pthread_mutex_destroy(&mutex_);
+    delete service_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    g_lookups.Increment();
+    if (IsMissing(request->path())) {
+      g_negative_lookups.Increment();
+      memory_.RecordHit();
+      rpc->SetFailed("No such file or directory");
+      done->Run();
+      return;
+    }
+    service_->GetAttr(rpc, request, response, done);
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    service_->ReadLink(rpc, request, response, done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    Added(request->target());
+    service_->SymLink(rpc, request, response, null_callback_);
+    Added(request->target());
+    done->Run();
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    long long start_usec = NowMicros();
+    pthread_mutex_lock(&mutex_);
+    long long generation = generation_;
+    pthread_mutex_unlock(&mutex_);
+    // The poller compares the directory with its attributes from before the
+    // listing, so that a change made while it is read is not missed
+    DirectoryStat stat;
+    bool has_stat = (polling_ && request->offset() == 0 &&
+                     ReadStat(request->header(), request->path(), &stat));
+    service_->ReadDir(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      AddPage(request->path(), request->offset(), *response, generation,
+              start_usec, has_stat ? &stat : NULL);
+    }
+    done->Run();
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    Removed(request->path());
+    service_->Unlink(rpc, request, response, null_callback_);
+    Removed(request->path());
+    done->Run();
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    Removed(request->path());
+    service_->RemoveTree(rpc, request, response, null_callback_);
+    Removed(request->path());
+    done->Run();
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    Added(request->path());
+    service_->MkDir(rpc, request, response, null_callback_);
+    Added(request->path());
+    done->Run();
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    Removed(request->source_path());
+    Removed(request->destination_path());
+    Added(request->destination_path());
+    service_->Rename(rpc, request, response, null_callback_);
+    Removed(request->source_path());
+    Removed(request->destination_path());
+    Added(request->destination_path());
+    done->Run();
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    service_->Open(rpc, request, response, done);
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    Added(request->path());
+    service_->Create(rpc, request, response, null_callback_);
+    Added(request->path());
+    done->Run();
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    service_->Release(rpc, request, response, done);
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    service_->Read(rpc, request, response, done);
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    service_->ReadV(rpc, request, response, done);
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    service_->Write(rpc, request, response, done);
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    service_->CopyRange(rpc, request, response, done);
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    service_->Truncate(rpc, request, response, done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    service_->FTruncate(rpc, request, response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    service_->FGetAttr(rpc, request, response, done);
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    service_->StatFs(rpc, request, response, done);
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    service_->GetXAttr(rpc, request, response, done);
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    service_->SetXAttr(rpc, request, response, done);
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    service_->ListXAttr(rpc, request, response, done);
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    service_->RemoveXAttr(rpc, request, response, done);
+  }
+
+ private:
+  // The sorted hashes of the names in a directory
+  struct Listing {
+    std::vector<unsigned long long> hashes;
+    // When the first page of the listing was requested, or when the poller
+    // last found the directory unchanged
+    long long start_usec;
+    long long charged;
+    // Tells a listing from the one it replaced
+    long long serial;
+    // Whether the poller can check the listing against stat
+    bool has_stat;
+    DirectoryStat stat;
+  };
+  typedef std::map<std::string, Listing> ListingMap;
+
+  // A listing read in pages, up to the entry at next_offset
+  struct PartialListing {
+    std::vector<unsigned long long> hashes;
+    long long start_usec;
+    long long next_offset;
+    bool has_stat;
+    DirectoryStat stat;
+  };
+  typedef std::map<std::string, PartialListing> PartialListingMap;
+
+  // Returns true if the fresh listing of the parent of path does not have it
+  bool IsMissing(const std::string& path) {
+    std::string parent, name;
+    if (!SplitPath(path, &parent, &name)) {
+      return false;
+    }
+    unsigned long long hash = HashName(name);
+    bool missing = false;
+    pthread_mutex_lock(&mutex_);
+    ListingMap::iterator it = listings_.find(parent);
+    if (it != listings_.end()) {
+      if (NowMicros() - it->second.start_usec >= options_.ttl_usec) {
+        DropListing(it);
+      } else {
+        missing = !std::binary_search(it->second.hashes.begin(),
+                                      it->second.hashes.end(), hash);
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+    return missing;
+  }
+
+  // Adds a page of entries to the listing of path.  The listing is complete,
+  // and used, once a page without a next_offset is added.  Pages read while
+  // the tree changed are discarded since they may predate the change.  stat
+  // is given with the first page when polling, unless it could not be read.
+  void AddPage(const std::string& path, long long offset,
+               const proto::ReadDirResponse& response,
+               long long generation, long long start_usec,
+               const DirectoryStat* stat) {
+    pthread_mutex_lock(&mutex_);
+    if (generation != generation_) {
+      partial_listings_.erase(path);
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    PartialListingMap::iterator it = partial_listings_.find(path);
+    if (offset == 0) {
+      if (it == partial_listings_.end()) {
+        if (partial_listings_.size() >= kMaxPartialListings) {
+          partial_listings_.erase(partial_listings_.begin());
+        }
+        it = partial_listings_.insert(
+            std::make_pair(path, PartialListing())).first;
+      }
+      it->second.hashes.clear();
+      it->second.start_usec = start_usec;
+      it->second.has_stat = (stat != NULL);
+      if (stat != NULL) {
+        it->second.stat = *stat;
+      }
+    } else if (it == partial_listings_.end() ||
+               it->second.next_offset != offset) {
+      // The earlier pages were not seen
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    PartialListing& partial = it->second;
+    for (int i = 0; i < response.entry_size(); ++i) {
+      partial.hashes.push_back(HashName(response.entry(i).filename()));
+    }
+    if (response.has_next_offset()) {
+      partial.next_offset = response.next_offset();
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    ListingMap::iterator old = listings_.find(path);
+    if (old != listings_.end()) {
+      DropListing(old);
+    }
+    while (!listings_.empty() &&
+           listings_.size() >= static_cast<size_t>(options_.max_listings)) {
+      DropListing(listings_.begin());
+    }
+    Listing& listing = listings_[path];
+    listing.hashes.swap(partial.hashes);
+    listing.start_usec = partial.start_usec;
+    listing.serial = next_serial_++;
+    listing.has_stat = partial.has_stat;
+    listing.stat = partial.stat;
+    partial_listings_.erase(it);
+    std::sort(listing.hashes.begin(), listing.hashes.end());
+    listing.charged = kListingCost + path.size() +
+        listing.hashes.size() * sizeof(unsigned long long);
+    long long charged = listing.charged;
+    g_listings.Add(1);
+    pthread_mutex_unlock(&mutex_);
+    // Charging may evict, which takes the lock
+    memory_.Charge(charged);
+  }
+
+  // Records that path is about to be created.  Calls that create a path call
+  // this again once the device has answered, since a listing read while the
+  // call was in progress may have been cached without the name.
+  void Added(const std::string& path) {
+    std::string parent, name;
+    bool charge = false;
+    pthread_mutex_lock(&mutex_);
+    generation_++;
+    if (SplitPath(path, &parent, &name)) {
+      ListingMap::iterator it = listings_.find(parent);
+      if (it != listings_.end()) {
+        std::vector<unsigned long long>& hashes = it->second.hashes;
+        unsigned long long hash = HashName(name);
+        std::vector<unsigned long long>::iterator position =
+            std::lower_bound(hashes.begin(), hashes.end(), hash);
+        if (position == hashes.end() || *position != hash) {
+          hashes.insert(position, hash);
+          it->second.charged += sizeof(hash);
+          charge = true;
+        }
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (charge) {
+      memory_.Charge(sizeof(unsigned long long));
+    }
+  }
+
+  // Records that path is about to be removed or replaced.  Its name stays in
+  // the index of its parent, which only sends a later lookup to the device,
+  // but the listings of path and of any directories beneath it are dropped.
+  // Like Added, this is called again once the device has answered.
+  void Removed(const std::string& path) {
+    pthread_mutex_lock(&mutex_);
+    generation_++;
+    DropSubtree(path, NULL);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Drops the listings of path and of the directories beneath it, adding
+  // their paths to dropped if not NULL.  Names such as "a b" sort between "a"
+  // and "a/b", so the listings beneath are found from path + "/".
+  void DropSubtree(const std::string& path,
+                   std::vector<std::string>* dropped) {
+    ListingMap::iterator it = listings_.find(path);
+    if (it != listings_.end()) {
+      if (dropped != NULL) {
+        dropped->push_back(it->first);
+      }
+      DropListing(it);
+    }
+    it = listings_.lower_bound(path == "/" ? path : path + "/");
+    while (it != listings_.end() && IsBeneath(it->first, path)) {
+      if (dropped != NULL) {
+        dropped->push_back(it->first);
+      }
+      DropListing(it++);
+    }
+  }
+
+  // Reads the attributes of the directory at path.  Returns false if they
+  // could not be read or path is not a directory.
+  bool ReadStat(const proto::Header& header, const std::string& path,
+                DirectoryStat* stat) {
+    rpc::Rpc rpc;
+    proto::GetAttrRequest request;
+    proto::GetAttrResponse response;
+    *request.mutable_header() = header;
+    request.set_path(path);
+    service_->GetAttr(&rpc, &request, &response, null_callback_);
+    if (rpc.Failed() || !S_ISDIR(response.stat().mode())) {
+      return false;
+    }
+    stat->mtime = response.stat().mtime().tv_sec();
+    stat->mtime_nsec = response.stat().mtime().tv_nsec();
+    stat->size = response.stat().size();
+    stat->nlink = response.stat().nlink();
+    return true;
+  }
+
+  static void* RunPoller(void* data) {
+    static_cast<ListingCacheService*>(data)->Poll();
+    return NULL;
+  }
+
+  // A listing picked by the poller
+  struct PollEntry {
+    long long start_usec;
+    std::string path;
+    long long serial;
+
+    bool operator<(const PollEntry& other) const {
+      return start_usec < other.start_usec;
+    }
+  };
+
+  // Runs on the poller thread until the service is destroyed.  Each interval
+  // the listings checked longest ago are checked again, without the lock.
+  void Poll() {
+    pthread_mutex_lock(&mutex_);
+    while (!stopping_) {
+      long long wake = NowMicros() + options_.poll_interval_usec;
+      while (!stopping_ && NowMicros() < wake) {
+        struct timespec ts;
+        ts.tv_sec = wake / 1000000;
+        ts.tv_nsec = (wake % 1000000) * 1000;
+        pthread_cond_timedwait(&poll_cond_, &mutex_, &ts);
+      }
+      std::vector<PollEntry> entries;
+      for (ListingMap::iterator it = listings_.begin();
+           !stopping_ && it != listings_.end(); ++it) {
+        if (it->second.has_stat) {
+          PollEntry entry;
+          entry.start_usec = it->second.start_usec;
+          entry.path = it->first;
+          entry.serial = it->second.serial;
+          entries.push_back(entry);
+        }
+      }
+      size_t count = std::min(entries.size(),
+                              static_cast<size_t>(options_.poll_budget));
+      std::partial_sort(entries.begin(), entries.begin() + count,
+                        entries.end());
+      pthread_mutex_unlock(&mutex_);
+      for (size_t i = 0; i < count; ++i) {
+        CheckListing(entries[i]);
+      }
+      pthread_mutex_lock(&mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Reads the attributes of the directory of a listing again, and drops the
+  // listing if they changed or the directory is gone.  Only the listing
+  // checked is affected: the listings beneath a directory that still exists
+  // are checked on their own.
+  void CheckListing(const PollEntry& entry) {
+    g_polls.Increment();
+    long long start_usec = NowMicros();
+    proto::Header header;
+    header.set_fs_id("cache");
+    DirectoryStat stat;
+    bool exists = ReadStat(header, entry.path, &stat);
+    std::vector<std::string> invalidated;
+    pthread_mutex_lock(&mutex_);
+    ListingMap::iterator it = listings_.find(entry.path);
+    if (it != listings_.end() && it->second.serial == entry.serial) {
+      if (!exists) {
+        generation_++;
+        DropSubtree(entry.path, &invalidated);
+      } else if (!SameStat(stat, it->second.stat)) {
+        generation_++;
+        invalidated.push_back(it->first);
+        DropListing(it);
+      } else if (it->second.start_usec < start_usec) {
+        it->second.start_usec = start_usec;
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+    g_invalidations.IncrementBy(invalidated.size());
+    if (options_.invalidate != NULL) {
+      for (size_t i = 0; i < invalidated.size(); ++i) {
+        options_.invalidate(invalidated[i]);
+      }
+    }
+  }
+
+  void DropListing(ListingMap::iterator it) {
+    memory_.Release(it->second.charged);
+    listings_.erase(it);
+    g_listings.Add(-1);
+  }
+
+  // Invoked when over the memory budget.  Listings are dropped in path order,
+  // and read again from the device when next needed.
+  static void EvictListings(long long bytes, void* data) {
+    ListingCacheService* service = static_cast<ListingCacheService*>(data);
+    if (pthread_mutex_trylock(&service->mutex_) != 0) {
+      return;
+    }
+    while (bytes > 0 && !service->listings_.empty()) {
+      bytes -= service->listings_.begin()->second.charged;
+      service->DropListing(service->listings_.begin());
+    }
+    pthread_mutex_unlock(&service->mutex_);
+  }
+
+  proto::FsService* service_;
+  ListingCacheOptions options_;
+  Closure* null_callback_;
+  pthread_mutex_t mutex_;
+  // Incremented whenever the tree may have changed
+  long long generation_;
+  long long next_serial_;
+  ListingMap listings_;
+  PartialListingMap partial_listings_;
+  // Set when the poller thread is running
+  bool polling_;
+  bool stopping_;
+  pthread_t poll_thread_;
+  pthread_cond_t poll_cond_;
+  memory::Consumer memory_;
+};
+
+proto::FsService* NewListingCacheFsService(
+    proto::FsService* service, const ListingCacheOptions& options) {
+  return new ListingCacheService(service, options);
+}
+
+}  // namespace cache
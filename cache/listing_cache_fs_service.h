@@ -0,0 +1,60 @@
+// An FsService that answers GetAttr for names that do not exist without
+// asking the device.  Applications probe for many files that are not there,
+// such as lock files, sidecar files and alternate extensions, and each miss
+// otherwise costs a round trip.
+//
+// Every complete directory listing that passes through the service, whether
+// read in one ReadDir call or in pages, is kept as a sorted index of the
+// hashes of its names.  While a listing is fresh, a GetAttr for a name whose
+// hash is not in the index of its parent fails locally.  Only misses are
+// answered: a name that is in the index, or that shares a hash with one, is
+// passed through.
+//
+// Creating a file, directory or symlink adds its name to the index of its
+// parent, and removing or renaming a directory drops the listings beneath it.
+// Changes made on the device by other means are only noticed once a listing
+// is older than ttl_usec.
+//
+// The device does not report changes, but a directory's modification time,
+// size and link count change with its entries.  When poll_interval_usec is
+// set, the attributes of each directory are read before it is listed, and a
+// background thread reads them again for up to poll_budget of the listings
+// that were checked longest ago, every poll_interval_usec.  A listing whose
+// directory is unchanged is fresh for another ttl_usec; one whose directory
+// changed is dropped, along with the listings beneath it if the directory is
+// gone, and passed to invalidate so that the kernel can drop what it cached.
+// Listings the poller cannot get to within ttl_usec expire as before.
+
+#ifndef __CACHE_LISTING_CACHE_FS_SERVICE_H__
+#define __CACHE_LISTING_CACHE_FS_SERVICE_H__
+
+#include <string>
+
+namespace proto {
+class FsService;
+}
+
+namespace cache {
+
+struct ListingCacheOptions {
+  ListingCacheOptions()
+      : ttl_usec(5 * 1000000LL), max_listings(1024), poll_interval_usec(0),
+        poll_budget(8), invalidate(NULL) { }
+
+  long long ttl_usec;
+  int max_listings;
+  // Zero disables polling
+  long long poll_interval_usec;
+  // GetAttr calls made by the poller each interval
+  int poll_budget;
+  // Called with the path of each directory the poller found changed, or NULL
+  void (*invalidate)(const std::string& path);
+};
+
+// Takes ownership of service
+proto::FsService* NewListingCacheFsService(proto::FsService* service,
+                                           const ListingCacheOptions& options);
+
+}  // namespace cache
+
+#endif  // __CACHE_LISTING_CACHE_FS_SERVICE_H__
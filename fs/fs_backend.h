@@ -0,0 +1,108 @@
+// The filesystem calls made by the fuse layer, as a plain C++ interface.
+// Every call on an FsService builds a request and a response message, copies
+// paths into them and file data into bytes fields; a backend in the same
+// process takes paths as C strings and fills in buffers and structs owned by
+// the caller instead.  NewServiceBackend and NewBackendService (see
+// fs/service_backend.h) adapt between the two interfaces, so that the
+// FsService decorators, and an RPC transport, can still be used.
+//
+// Calls return zero, or a number of bytes where noted, on success and a
+// negated errno value on failure, as fuse operations do.  The controller is
+// only used to notice that the call was canceled (see rpc/rpc.h); a backend
+// that does little work per call may ignore it.  Calls are made from several
+// threads at once.
+
+#ifndef __FS_FS_BACKEND_H__
+#define __FS_FS_BACKEND_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+namespace google {
+namespace protobuf {
+class RpcController;
+}
+}
+
+namespace fs {
+
+using ::google::protobuf::RpcController;
+
+// Called by ReadDir with the name of each entry
+typedef void (*DirFiller)(const char* name, void* data);
+
+class FsBackend {
+ public:
+  virtual ~FsBackend() { }
+
+  virtual int GetAttr(RpcController* rpc, const char* path,
+                      struct stat* stbuf) = 0;
+  // Copies the destination of the symlink at path into buf, NUL terminated
+  // and cut off at size.
+  virtual int ReadLink(RpcController* rpc, const char* path, char* buf,
+                       size_t size) = 0;
+  // Creates a symlink at target that points to source
+  virtual int SymLink(RpcController* rpc, const char* source,
+                      const char* target) = 0;
+  // Passes the names in the directory at path to filler, starting with the
+  // entry at offset and stopping after max_entries of them unless it is zero.
+  // next_offset is set to the offset of the entry that follows, or to -1 when
+  // the end of the directory was reached.  dirhandle identifies the open
+  // directory the listing is read through (see ReadDirRequest).
+  virtual int ReadDir(RpcController* rpc, const char* path,
+                      long long dirhandle, long long offset, int max_entries,
+                      DirFiller filler, void* data,
+                      long long* next_offset) = 0;
+  virtual int Unlink(RpcController* rpc, const char* path) = 0;
+  virtual int MkDir(RpcController* rpc, const char* path, mode_t mode) = 0;
+  virtual int Rename(RpcController* rpc, const char* from,
+                     const char* to) = 0;
+
+  // Open and Create set filehandle to a handle for the later calls
+  virtual int Open(RpcController* rpc, const char* path, int flags,
+                   long long* filehandle) = 0;
+  virtual int Create(RpcController* rpc, const char* path, int flags,
+                     mode_t mode, long long* filehandle) = 0;
+  virtual int Release(RpcController* rpc, long long filehandle) = 0;
+  // Returns the number of bytes read, fewer than size at the end of the file
+  virtual int Read(RpcController* rpc, long long filehandle, char* buf,
+                   size_t size, off_t offset) = 0;
+  // Returns the number of bytes written
+  virtual int Write(RpcController* rpc, long long filehandle, const char* buf,
+                    size_t size, off_t offset) = 0;
+  // Copies size bytes between two open files, returning the number copied
+  virtual ssize_t CopyRange(RpcController* rpc, long long source_filehandle,
+                            off_t source_offset,
+                            long long destination_filehandle,
+                            off_t destination_offset, size_t size) = 0;
+  virtual int Truncate(RpcController* rpc, const char* path,
+                       off_t offset) = 0;
+  virtual int FTruncate(RpcController* rpc, long long filehandle,
+                        off_t offset) = 0;
+  virtual int FGetAttr(RpcController* rpc, long long filehandle,
+                       struct stat* stbuf) = 0;
+  virtual int StatFs(RpcController* rpc, struct statvfs* vfs) = 0;
+
+  // Extended attributes, with the semantics of getxattr(2) and friends.
+  // GetXAttr and ListXAttr return the size of the value or list and only
+  // copy it when size is not zero.  A backend without extended attributes
+  // returns -ENOTSUP, and the kernel falls back to AppleDouble files.
+  virtual int GetXAttr(RpcController* rpc, const char* path,
+                       const char* name, char* value, size_t size,
+                       uint32_t position) = 0;
+  // flags may have XATTR_CREATE or XATTR_REPLACE set
+  virtual int SetXAttr(RpcController* rpc, const char* path,
+                       const char* name, const char* value, size_t size,
+                       int flags, uint32_t position) = 0;
+  virtual int ListXAttr(RpcController* rpc, const char* path, char* list,
+                        size_t size) = 0;
+  virtual int RemoveXAttr(RpcController* rpc, const char* path,
+                          const char* name) = 0;
+};
+
+}  // namespace fs
+
+#endif  // __FS_FS_BACKEND_H__
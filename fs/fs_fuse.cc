@@ -1,280 +1,482 @@
 // Author: Allen Porter <allen@thebends.org>
 //
-// A fuse filesystem that proxies the filesystem requests through a protocol
-// buffer RPC service (FsService).
+// A fuse filesystem that passes the filesystem requests to an FsBackend.
 
 #include "fs/fs_fuse.h"
 
 #include <fuse.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <strings.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+#include <string>
 #include <syslog.h>
-#include "proto/fs.pb.h"
-#include "proto/fs_service.pb.h"
+#include <vector>
+#include "fs/fs_backend.h"
+#include "memory/memory_budget.h"
 #include "rpc/rpc.h"
+#include "trace/trace.h"
+
+// Linux calls a missing extended attribute ENODATA
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
 
 namespace fs {
 
-static const int kNameMax = 255;
-static const int kFiles = 110000;
-static const int kFilesFree = kFiles - 10000;
-// Default iPhone block size
-static const int kBlockSize = 4096;
+// Number of directory entries requested from the backend at a time
+static const int kReadDirPageSize = 512;
+#if FUSE_USE_VERSION >= 30
+// Largest read or write asked of the kernel in one request
+static const int kMaxTransfer = 1024 * 1024;
+#endif
+
+// Requests still running after this long fail, rather than leaving the
+// kernel waiting on a device that has stopped responding.
+static const long long kRequestTimeoutUsec = 30 * 1000000LL;
+
+static memory::Consumer g_readdir_memory("fuse_readdir_pages", NULL, NULL);
+// The data of each read and write while it is in the backend.  Services below
+// fuse do not charge it again.
+static memory::Consumer g_buffer_memory("fuse_transfer_buffers", NULL, NULL);
+
+// An Rpc for the fuse request handled by the calling thread.  The call is
+// canceled when the kernel interrupts the request, for example because the
+// process that made it was killed, or when it runs past kRequestTimeoutUsec.
+// Interrupts are noticed when the backend checks IsCanceled from the thread
+// that created the Rpc, which is how backends are called here.  Cleanup calls
+// such as Release are made with cancelable false: they have no deadline and
+// are not interrupted, since dropping one would leak the handles it frees.
+class FuseRpc : public rpc::Rpc {
+ public:
+  explicit FuseRpc(bool cancelable = true)
+      : thread_(pthread_self()), cancelable_(cancelable),
+        interrupted_(false) {
+    if (cancelable_) {
+      SetTimeout(kRequestTimeoutUsec);
+    }
+  }
+
+  virtual bool IsCanceled() const {
+    if (cancelable_ && !interrupted_ &&
+        pthread_equal(thread_, pthread_self()) && fuse_interrupted()) {
+      FuseRpc* self = const_cast<FuseRpc*>(this);
+      self->interrupted_ = true;
+      self->StartCancel();
+    }
+    return rpc::Rpc::IsCanceled();
+  }
+
+  // The error to return to the kernel for a failed call.  Calls that were
+  // not canceled return the negated failure.
+  int error(int failure = ENOENT) const {
+    if (interrupted_) {
+      return -EINTR;
+    }
+    return IsCanceled() ? -ETIMEDOUT : -failure;
+  }
+
+ private:
+  pthread_t thread_;
+  bool cancelable_;
+  bool interrupted_;
+};
 
-static google::protobuf::Closure* g_null_callback = NULL;
+#if FUSE_USE_VERSION >= 30
+// Fuse 3 passes the open file, when there is one, to getattr and truncate
+// rather than calling fgetattr and ftruncate.
+int fs_fgetattr(const char *path, struct stat* stbuf,
+                struct fuse_file_info *fi);
+int fs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
 
+// Requests carry up to kMaxTransfer bytes, and are moved to and from the
+// kernel with splice when it is able to.  With the writeback cache, the kernel
+// gathers small writes into large ones before they reach the backend.
+void* fs_init(struct fuse_conn_info* conn, struct fuse_config* config) {
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  syslog(LOG_DEBUG, "fs_init: %s", context->fs_id.c_str());
+  conn->max_write = kMaxTransfer;
+  // Matches the max_read mount option, see InitFuseArgs
+  conn->max_read = kMaxTransfer;
+  conn->max_readahead = kMaxTransfer;
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                                 FUSE_CAP_SPLICE_MOVE |
+                                 FUSE_CAP_ATOMIC_O_TRUNC);
+  if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    context->writeback_cache = true;
+  }
+  // Return value is passed in private_data of context for all other calls
+  return context;
+}
+#else
 void* fs_init(struct fuse_conn_info* conn) {
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
   syslog(LOG_DEBUG, "fs_init: %s", context->fs_id.c_str());
+  conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
   // Return value is passed in private_data of context for all other calls
   return context;
 }
+#endif
+
+// The kernel reads pages of files opened for writing into the writeback cache
+// and keeps track of the end of the file itself, so writes are never appends.
+static int OpenFlags(struct Context* context, int flags) {
+  if (context->writeback_cache) {
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+      flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    flags &= ~O_APPEND;
+  }
+  return flags;
+}
 
 void fs_destroy(void* data) {
   struct Context* context = static_cast<struct Context*>(data);
   syslog(LOG_DEBUG, "fs_destroy: %s", context->fs_id.c_str());
 }
 
-void fill_stat(const proto::Stat& stat, struct stat* stbuf) {
-  stbuf->st_size = stat.size();
-  stbuf->st_blocks = stat.blocks();
-  stbuf->st_mode = stat.mode();
-  if (stat.has_nlink()) {
-    stbuf->st_nlink = stat.nlink();
-  }
-  if (stat.has_mtime()) {
-    stbuf->st_mtimespec.tv_sec = stat.mtime().tv_sec();
-    stbuf->st_mtimespec.tv_nsec = stat.mtime().tv_nsec();
-  }
-  stbuf->st_uid = getuid();
-  stbuf->st_gid = getgid();
-  stbuf->st_blksize = kBlockSize; 
+// The value to return to the kernel for a backend call that returned ret
+static int Result(const FuseRpc& rpc, int ret) {
+  return ret < 0 ? rpc.error(-ret) : ret;
 }
 
+#if FUSE_USE_VERSION >= 30
+int fs_getattr(const char* path, struct stat* stbuf,
+               struct fuse_file_info* fi) {
+  if (fi != NULL) {
+    return fs_fgetattr(path, stbuf, fi);
+  }
+#else
 int fs_getattr(const char* path, struct stat* stbuf) {
+#endif
+  trace::Span span("fuse", "getattr");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
   memset(stbuf, 0, sizeof(struct stat));
-  rpc::Rpc rpc;
-  proto::GetAttrRequest request;
-  proto::GetAttrResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  context->service->GetAttr(&rpc, &request, &response, g_null_callback);
-  if (rpc.Failed()) {
-    return -ENOENT;
-  }
-  fill_stat(response.stat(), stbuf);
-  return 0; 
+  FuseRpc rpc;
+  return Result(rpc, context->backend->GetAttr(&rpc, path, stbuf));
 }
 
 int fs_readlink(const char* path, char *buf, size_t bufsize) {
+  trace::Span span("fuse", "readlink");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::ReadLinkRequest request;
-  proto::ReadLinkResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  context->service->ReadLink(&rpc, &request, &response, g_null_callback);
-  if (rpc.Failed()) {
-    return -ENOENT;
-  }
-  strncpy(buf, response.destination().c_str(), bufsize);
-  return 0; 
+  FuseRpc rpc;
+  return Result(rpc, context->backend->ReadLink(&rpc, path, buf, bufsize));
 }
 
 int fs_symlink(const char* source, const char* target) {
+  trace::Span span("fuse", "symlink");
+  span.set_path(source);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::SymLinkRequest request;
-  proto::SymLinkResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_source(source);
-  request.set_target(target);
-  context->service->SymLink(&rpc, &request, &response, g_null_callback);
-  return rpc.Failed() ? -ENOENT : 0;
+  FuseRpc rpc;
+  return Result(rpc, context->backend->SymLink(&rpc, source, target));
+}
+
+// State for an open directory, stored in the fuse file handle.  It holds the
+// most recently fetched page of entries so that the small buffers handed to
+// readdir by the kernel can be filled without going back to the backend.
+struct OpenDir {
+  OpenDir() : loaded(false), base(0), next_offset(-1), charged(0) { }
+
+  bool loaded;
+  off_t base;  // Offset of the first entry in page
+  std::vector<std::string> page;
+  long long next_offset;  // -1 once page reaches the end of the directory
+  long long charged;  // Memory charged for page
+};
+
+static void AddPageEntry(const char* name, void* data) {
+  OpenDir* dir = static_cast<OpenDir*>(data);
+  dir->page.push_back(name);
+  dir->charged += sizeof(std::string) + dir->page.back().capacity();
 }
 
+int fs_opendir(const char* path, struct fuse_file_info* fi) {
+  fi->fh = reinterpret_cast<uint64_t>(new OpenDir);
+  return 0;
+}
+
+int fs_releasedir(const char* path, struct fuse_file_info* fi) {
+  OpenDir* dir = reinterpret_cast<OpenDir*>(fi->fh);
+  g_readdir_memory.Release(dir->charged);
+  delete dir;
+  return 0;
+}
+
+// Adds an entry to the kernel buffer, returning false once it is full
+static bool FillDir(fuse_fill_dir_t filler, void* buf, const char* name,
+                    off_t next) {
+#if FUSE_USE_VERSION >= 30
+  return filler(buf, name, NULL, next, (enum fuse_fill_dir_flags)0) == 0;
+#else
+  return filler(buf, name, NULL, next) == 0;
+#endif
+}
+
+// Entries are passed to the filler with the offset of the following entry, so
+// fuse calls back with that offset once the kernel buffer has been consumed.
+// Pages are only requested from the backend as the listing is read.
+#if FUSE_USE_VERSION >= 30
+int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+               off_t offset, struct fuse_file_info *fi,
+               enum fuse_readdir_flags flags) {
+#else
 int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi) {
+#endif
+  trace::Span span("fuse", "readdir");
+  span.set_path(path);
+  span.set_offset(offset);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::ReadDirRequest request;
-  proto::ReadDirResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  context->service->ReadDir(&rpc, &request, &response, g_null_callback);
-  if (rpc.Failed()) {
-    return -ENOENT;
-  }
-  for (int i = 0; i < response.entry_size(); ++i) {
-    const proto::ReadDirResponse::Entry& entry = response.entry(i);
-    if (filler(buf, entry.filename().c_str(), NULL, 0) != 0) {
-      return -ENOENT;
+  OpenDir* dir = reinterpret_cast<OpenDir*>(fi->fh);
+  while (true) {
+    off_t end = dir->base + dir->page.size();
+    if (!dir->loaded || offset == 0 || offset < dir->base || offset >= end) {
+      if (dir->loaded && offset == end && dir->next_offset == -1) {
+        return 0;
+      }
+      dir->page.clear();
+      dir->base = offset;
+      dir->loaded = false;
+      dir->next_offset = -1;
+      g_readdir_memory.Release(dir->charged);
+      dir->charged = 0;
+      FuseRpc rpc;
+      int ret = context->backend->ReadDir(&rpc, path, fi->fh, offset,
+                                          kReadDirPageSize, &AddPageEntry,
+                                          dir, &dir->next_offset);
+      if (ret < 0) {
+        dir->page.clear();
+        dir->charged = 0;
+        return rpc.error(-ret);
+      }
+      dir->loaded = true;
+      g_readdir_memory.Charge(dir->charged);
     }
+    for (size_t i = offset - dir->base; i < dir->page.size(); ++i) {
+      if (!FillDir(filler, buf, dir->page[i].c_str(), dir->base + i + 1)) {
+        // The kernel buffer is full
+        return 0;
+      }
+    }
+    if (dir->next_offset == -1 || dir->page.empty()) {
+      return 0;
+    }
+    offset = dir->next_offset;
   }
-  return 0; 
 }
 
 int fs_unlink(const char* path) {
+  trace::Span span("fuse", "unlink");
+  span.set_path(path);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  FuseRpc rpc;
+  return Result(rpc, context->backend->Unlink(&rpc, path));
+}
+
+// The kernel empties a directory with unlink and rmdir calls of its own
+// before removing it, so a tree cannot be removed with one RemoveTree call
+// here.  Unlink removes an empty directory, as AFCRemovePath does.
+int fs_rmdir(const char* path) {
+  trace::Span span("fuse", "rmdir");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::UnlinkRequest request;
-  proto::UnlinkResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  context->service->Unlink(&rpc, &request, &response, g_null_callback);
-  return rpc.Failed() ? -ENOENT : 0;
+  FuseRpc rpc;
+  return Result(rpc, context->backend->Unlink(&rpc, path));
 }
 
 int fs_mkdir(const char* path, mode_t mode) {
+  trace::Span span("fuse", "mkdir");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::MkDirRequest request;
-  proto::MkDirResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  request.set_mode(mode);
-  context->service->MkDir(&rpc, &request, &response, g_null_callback);
-  return rpc.Failed() ? -ENOENT : 0;
+  FuseRpc rpc;
+  return Result(rpc, context->backend->MkDir(&rpc, path, mode));
 }
 
+#if FUSE_USE_VERSION >= 30
+int fs_rename(const char* from, const char* to, unsigned int flags) {
+  // Neither RENAME_EXCHANGE nor RENAME_NOREPLACE can be done atomically
+  if (flags != 0) {
+    return -EINVAL;
+  }
+#else
 int fs_rename(const char* from, const char* to) {
+#endif
+  trace::Span span("fuse", "rename");
+  span.set_path(from);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::RenameRequest request;
-  proto::RenameResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_source_path(from);
-  request.set_destination_path(to);
-  context->service->Rename(&rpc, &request, &response, g_null_callback);
-  return rpc.Failed() ? -ENOENT : 0;
+  FuseRpc rpc;
+  return Result(rpc, context->backend->Rename(&rpc, from, to));
 }
 
 int fs_open(const char *path, struct fuse_file_info *fi) {
+  trace::Span span("fuse", "open");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::OpenRequest request;
-  proto::OpenResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  request.set_flags(fi->flags);
-  context->service->Open(&rpc, &request, &response, g_null_callback);
-  if (rpc.Failed()) {
-    return -ENOENT;
+  FuseRpc rpc;
+  long long filehandle;
+  int ret = context->backend->Open(&rpc, path, OpenFlags(context, fi->flags),
+                                   &filehandle);
+  if (ret < 0) {
+    return rpc.error(-ret);
   }
-  fi->fh = response.filehandle();
+  fi->fh = filehandle;
   return 0;
 }
 
 int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  trace::Span span("fuse", "create");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::CreateRequest request;
-  proto::CreateResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  request.set_flags(fi->flags);
-  request.set_mode(mode);
-  context->service->Create(&rpc, &request, &response, g_null_callback);
-  if (rpc.Failed()) {
-    return -ENOENT;
+  FuseRpc rpc;
+  long long filehandle;
+  int ret = context->backend->Create(&rpc, path,
+                                     OpenFlags(context, fi->flags), mode,
+                                     &filehandle);
+  if (ret < 0) {
+    return rpc.error(-ret);
   }
-  fi->fh = response.filehandle();
+  fi->fh = filehandle;
   return 0;
 }
 
 int fs_release(const char *path, struct fuse_file_info *fi) {
+  trace::Span span("fuse", "release");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::ReleaseRequest request;
-  proto::ReleaseResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_filehandle(fi->fh);
-  context->service->Release(&rpc, &request, &response, g_null_callback);
-  return rpc.Failed() ? -ENOENT : 0;
+  FuseRpc rpc(false);
+  return Result(rpc, context->backend->Release(&rpc, fi->fh));
 }
 
 int fs_read(const char *path, char *buf, size_t size, off_t offset,
                    struct fuse_file_info *fi) {
+  trace::Span span("fuse", "read");
+  span.set_path(path);
+  span.set_size(size);
+  span.set_offset(offset);
+  memory::ScopedCharge charge(&g_buffer_memory, size);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::ReadRequest request;
-  proto::ReadResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_filehandle(fi->fh);
-  request.set_size(size);
-  request.set_offset(offset);
-  context->service->Read(&rpc, &request, &response, g_null_callback);
-  if (rpc.Failed()) {
-    return -ENOENT;
-  }
-  memcpy(buf, response.buffer().data(), response.buffer().size());
-  return response.buffer().size();
+  FuseRpc rpc;
+  return Result(rpc, context->backend->Read(&rpc, fi->fh, buf, size, offset));
 }
 
 int fs_write(const char *path, const char *buf, size_t size,
              off_t offset, struct fuse_file_info *fi) {
+  trace::Span span("fuse", "write");
+  span.set_path(path);
+  span.set_size(size);
+  span.set_offset(offset);
+  memory::ScopedCharge charge(&g_buffer_memory, size);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  FuseRpc rpc;
+  return Result(rpc, context->backend->Write(&rpc, fi->fh, buf, size,
+                                             offset));
+}
+
+#if FUSE_USE_VERSION >= 30
+// Copies within the volume are left to the backend, so the data does not
+// pass through the kernel.  When the backend fails the copy the kernel falls
+// back to reading and writing the range itself.  fuse 2, which macFUSE
+// provides, has no copy_file_range, so there copies are always made with
+// reads and writes.
+ssize_t fs_copy_file_range(const char* path_in, struct fuse_file_info* fi_in,
+                           off_t offset_in, const char* path_out,
+                           struct fuse_file_info* fi_out, off_t offset_out,
+                           size_t size, int flags) {
+  trace::Span span("fuse", "copy_file_range");
+  span.set_path(path_in);
+  span.set_size(size);
+  span.set_offset(offset_in);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::WriteRequest request;
-  proto::WriteResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_filehandle(fi->fh);
-  request.mutable_buffer()->assign(buf, size);
-  request.set_offset(offset);
-  context->service->Write(&rpc, &request, &response, g_null_callback);
-  return (rpc.Failed() ? -ENOENT : response.size());
+  FuseRpc rpc;
+  ssize_t ret = context->backend->CopyRange(&rpc, fi_in->fh, offset_in,
+                                            fi_out->fh, offset_out, size);
+  return ret < 0 ? rpc.error(-ret) : ret;
 }
+#endif
 
+#if FUSE_USE_VERSION >= 30
+int fs_truncate(const char *path, off_t offset, struct fuse_file_info *fi) {
+  if (fi != NULL) {
+    return fs_ftruncate(path, offset, fi);
+  }
+#else
 int fs_truncate(const char *path, off_t offset) {
+#endif
+  trace::Span span("fuse", "truncate");
+  span.set_path(path);
+  span.set_size(offset);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  FuseRpc rpc;
+  return Result(rpc, context->backend->Truncate(&rpc, path, offset));
+}
+
+int fs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
+  trace::Span span("fuse", "ftruncate");
+  span.set_path(path);
+  span.set_size(offset);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::TruncateRequest request;
-  proto::TruncateResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  request.set_path(path);
-  request.set_offset(offset);
-  context->service->Truncate(&rpc, &request, &response, g_null_callback);
-  return rpc.Failed() ? -ENOENT : 0;
+  FuseRpc rpc;
+  return Result(rpc, context->backend->FTruncate(&rpc, fi->fh, offset));
+}
+
+int fs_fgetattr(const char *path, struct stat* stbuf,
+                struct fuse_file_info *fi) {
+  trace::Span span("fuse", "fgetattr");
+  span.set_path(path);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  memset(stbuf, 0, sizeof(struct stat));
+  FuseRpc rpc;
+  return Result(rpc, context->backend->FGetAttr(&rpc, fi->fh, stbuf));
 }
 
 int fs_statfs(const char* path, struct statvfs* vfs) {
+  trace::Span span("fuse", "statfs");
+  span.set_path(path);
   struct Context* context =
     static_cast<struct Context*>(fuse_get_context()->private_data);
-  rpc::Rpc rpc;
-  proto::StatFsRequest request;
-  proto::StatFsResponse response;
-  request.mutable_header()->set_fs_id(context->fs_id);
-  context->service->StatFs(&rpc, &request, &response, g_null_callback);
-  if (rpc.Failed()) {
-    return -ENOENT;
-  }
-  vfs->f_namemax = kNameMax;
-  vfs->f_bsize = response.stat().bsize();
-  vfs->f_frsize = response.stat().frsize();
-  vfs->f_blocks = response.stat().blocks();
-  vfs->f_bfree = response.stat().bfree();
-  vfs->f_bavail = vfs->f_bfree;
-  vfs->f_files = kFiles;
-  vfs->f_ffree = kFilesFree;
+  FuseRpc rpc;
+  return Result(rpc, context->backend->StatFs(&rpc, vfs));
+}
+
+#if FUSE_USE_VERSION >= 30
+int fs_chown(const char* path, uid_t uid, gid_t, struct fuse_file_info*) {
+  return 0;
+}
+
+int fs_chmod(const char* path, mode_t, struct fuse_file_info*) {
   return 0;
 }
 
+int fs_utimens(const char* path, const struct timespec tv[2],
+               struct fuse_file_info*) {
+  return 0;
+}
+#else
 int fs_chown(const char* path, uid_t uid, gid_t) {
   return 0;
 }
@@ -286,43 +488,128 @@ int fs_chmod(const char* path, mode_t) {
 int fs_utimens(const char* path, const struct timespec tv[2]) {
   return 0;
 }
+#endif
+
+// Extended attributes are not stored on the device, see
+// xattr/xattr_fs_service.h.  A backend without them fails the calls, which
+// tells the kernel to fall back to AppleDouble files.  Only MacFUSE passes a
+// position, for resource forks.
+#ifdef __APPLE__
+int fs_getxattr(const char* path, const char* name, char* value, size_t size,
+                uint32_t position) {
+#else
+int fs_getxattr(const char* path, const char* name, char* value,
+                size_t size) {
+  const uint32_t position = 0;
+#endif
+  trace::Span span("fuse", "getxattr");
+  span.set_path(path);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  FuseRpc rpc;
+  int ret = context->backend->GetXAttr(&rpc, path, name, value, size,
+                                       position);
+  // The kernel handles these, they are not failures of the call
+  if (ret == -ENOATTR || ret == -ERANGE) {
+    return ret;
+  }
+  return Result(rpc, ret);
+}
+
+#ifdef __APPLE__
+int fs_setxattr(const char* path, const char* name, const char* value,
+                size_t size, int flags, uint32_t position) {
+#else
+int fs_setxattr(const char* path, const char* name, const char* value,
+                size_t size, int flags) {
+  const uint32_t position = 0;
+#endif
+  trace::Span span("fuse", "setxattr");
+  span.set_path(path);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  FuseRpc rpc;
+  int ret = context->backend->SetXAttr(&rpc, path, name, value, size, flags,
+                                       position);
+  if (ret == -EEXIST || ret == -ENOATTR) {
+    return ret;
+  }
+  return Result(rpc, ret);
+}
+
+int fs_listxattr(const char* path, char* list, size_t size) {
+  trace::Span span("fuse", "listxattr");
+  span.set_path(path);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  FuseRpc rpc;
+  int ret = context->backend->ListXAttr(&rpc, path, list, size);
+  if (ret == -ERANGE) {
+    return ret;
+  }
+  return Result(rpc, ret);
+}
+
+int fs_removexattr(const char* path, const char* name) {
+  trace::Span span("fuse", "removexattr");
+  span.set_path(path);
+  struct Context* context =
+    static_cast<struct Context*>(fuse_get_context()->private_data);
+  FuseRpc rpc;
+  int ret = context->backend->RemoveXAttr(&rpc, path, name);
+  if (ret == -ENOATTR) {
+    return ret;
+  }
+  return Result(rpc, ret);
+}
 
 // TODO(allen): fuse_op could be a static that is initialized once.
 void InitFuseOps(struct fuse_operations* fuse_op) {
-  if (g_null_callback == NULL) {
-    g_null_callback = google::protobuf::NewPermanentCallback(
-        &google::protobuf::DoNothing);
-  }
   bzero(fuse_op, sizeof(struct fuse_operations));
   fuse_op->init     = fs_init;
   fuse_op->destroy  = fs_destroy;
   fuse_op->getattr  = fs_getattr;
   fuse_op->readlink = fs_readlink;
   fuse_op->symlink  = fs_symlink;
+  fuse_op->opendir  = fs_opendir;
   fuse_op->readdir  = fs_readdir;
+  fuse_op->releasedir = fs_releasedir;
   fuse_op->open     = fs_open;
   fuse_op->create   = fs_create;
   fuse_op->release  = fs_release;
   fuse_op->read     = fs_read;
   fuse_op->write    = fs_write;
   fuse_op->truncate = fs_truncate;
+#if FUSE_USE_VERSION >= 30
+  fuse_op->copy_file_range = fs_copy_file_range;
+#else
+  fuse_op->ftruncate = fs_ftruncate;
+  fuse_op->fgetattr = fs_fgetattr;
+#endif
   fuse_op->unlink   = fs_unlink;
   fuse_op->rename   = fs_rename;
   fuse_op->mkdir    = fs_mkdir;
-  fuse_op->rmdir    = fs_unlink;
+  fuse_op->rmdir    = fs_rmdir;
   fuse_op->statfs   = fs_statfs;
   fuse_op->chown    = fs_chown;
   fuse_op->chmod    = fs_chmod;
   fuse_op->utimens  = fs_utimens;
+  fuse_op->getxattr = fs_getxattr;
+  fuse_op->setxattr = fs_setxattr;
+  fuse_op->listxattr = fs_listxattr;
+  fuse_op->removexattr = fs_removexattr;
 }
 
 void InitFuseArgs(struct fuse_args* args, const std::string& volname,
                   const std::string& volicon) {
   *args = (struct fuse_args)FUSE_ARGS_INIT(0, NULL);
+#ifdef __APPLE__
   fuse_opt_add_arg(args, "-d");
+#endif
 #ifdef DEBUG
   fuse_opt_add_arg(args, "-odebug");
 #endif
+#ifdef __APPLE__
   fuse_opt_add_arg(args, "-odefer_permissions");
   std::string volname_arg("-ovolname=");
   volname_arg.append(volname);
@@ -334,6 +621,18 @@ void InitFuseArgs(struct fuse_args* args, const std::string& volname,
   }
   // Mount the device on the desktop
   fuse_opt_add_arg(args, "-olocal");
+#else
+  // Linux has no volume names or icons; the name shows up in the mount table
+  std::string fsname_arg("-ofsname=");
+  fsname_arg.append(volname);
+  fuse_opt_add_arg(args, fsname_arg.c_str());
+#if FUSE_USE_VERSION >= 30
+  // The kernel otherwise reads at most 128k at a time
+  char max_read_arg[32];
+  snprintf(max_read_arg, sizeof(max_read_arg), "-omax_read=%d", kMaxTransfer);
+  fuse_opt_add_arg(args, max_read_arg);
+#endif
+#endif
 }
 
 }  // namespace fs
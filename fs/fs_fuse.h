@@ -1,39 +1,42 @@
 // Author: Allen Porter <allen@thebends.org>
 //
 // The fuse filesystem implementation.  This filesystem forwards all calls to
-// an FsService.
+// an FsBackend.
 
 #ifndef __FS_FS_FUSE_H__
 #define __FS_FS_FUSE_H__
 
 #include <string>
-#include <fuse/fuse.h>
+#include <fuse.h>
 
 struct fuse_operations;
-namespace proto {
-class FsService;
-}
 
 namespace fs {
 
+class FsBackend;
+
 // Context information about filesystem available to every filesystem call.
 //
 // The caller is responsible for initializing a Context pointer that is
 // specified in the private userdata call to fuse_new.  Every filesystem call
-// will use the Context to obtain the FsService object that actually processes
-// the filesystem command.
+// will use the Context to obtain the FsBackend object that actually processes
+// the filesystem command.  An FsService is called through a backend made by
+// NewServiceBackend (see fs/service_backend.h).
 //
-// Note that the fuse filesystem can only be initialized in multithreaded mode
-// if the FsService is also multi-threaded -- however most implementations in
-// this project are not currently multi-threaded.
+// The fuse loop is multithreaded, so the FsBackend is called from several
+// threads at once.  Services that can only handle one call at a time, such as
+// the mobile service, are wrapped in a scheduler (see
+// scheduler/scheduling_fs_service.h).
 struct Context {
-  Context() : service(NULL) { }
+  Context() : backend(NULL), writeback_cache(false) { }
 
-  proto::FsService* service;
+  FsBackend* backend;
   std::string fs_id;
+  // Set when fuse 3 has enabled the kernel writeback cache
+  bool writeback_cache;
 };
 
-// Initialize the fuse_op datastructure for use with an FsService.
+// Initialize the fuse_op datastructure for use with an FsBackend.
 void InitFuseOps(struct fuse_operations* fuse_op);
 
 // Initialize the FuseArgs datastructure for mounting the specified volume
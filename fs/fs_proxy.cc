@@ -5,33 +5,74 @@
 
 #include "fs/fs_proxy.h"
 
+#include <set>
 #include <string>
-#include <fuse/fuse.h>
+#include <fuse.h>
+#if FUSE_USE_VERSION < 30
 #include <fuse/fuse_lowlevel.h>
+#endif
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <syslog.h>
+#include <unistd.h>
 #include "proto/fs_service.pb.h"
 #include "fs/fs.h"
+#include "fs/fs_backend.h"
 #include "fs/fs_fuse.h"
+#include "fs/service_backend.h"
 
 namespace fs {
 
+#if FUSE_USE_VERSION >= 30
+// The fuse objects of the sessions that are running, for InvalidatePath
+static pthread_mutex_t g_sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::set<struct fuse*> g_sessions;
+
+static void AddSession(struct fuse* fuse) {
+  pthread_mutex_lock(&g_sessions_mutex);
+  g_sessions.insert(fuse);
+  pthread_mutex_unlock(&g_sessions_mutex);
+}
+
+static void RemoveSession(struct fuse* fuse) {
+  pthread_mutex_lock(&g_sessions_mutex);
+  g_sessions.erase(fuse);
+  pthread_mutex_unlock(&g_sessions_mutex);
+}
+#endif
+
 // A wrapper around a fuse_chan object.  This object mainly exists to enforce
-// propper shutdown of the fuse channel.
+// propper shutdown of the fuse channel.  Fuse 3 has no channels, and mounts
+// the fuse object itself (see Session).
+//
+// Volumes are mounted in /Volumes.  Linux has no such place, so there the
+// volume name is the mount point, or a directory in /tmp when it is relative.
 class MountPoint {
  public:
   MountPoint(const std::string& volname,
-             const std::string& volicon) : channel_(NULL) {
+             const std::string& volicon) {
+#if FUSE_USE_VERSION < 30
+    channel_ = NULL;
+#endif
+#ifdef __APPLE__
     mount_path_ = "/Volumes/";
     mount_path_.append(volname);
+#else
+    if (volname.empty() || volname[0] != '/') {
+      mount_path_ = "/tmp/";
+    }
+    mount_path_.append(volname);
+#endif
     InitFuseArgs(&args_, volname, volicon);
   }
 
   ~MountPoint() {
+#if FUSE_USE_VERSION < 30
     if (channel_ != NULL) {
       fuse_unmount(mount_path_.c_str(), channel_);
     }
+#endif
     // Ignore errors
     rmdir(mount_path_.c_str());
   }
@@ -41,20 +82,26 @@ class MountPoint {
     rmdir(mount_path_.c_str());
     mkdir(mount_path_.c_str(), S_IFDIR|0755);
 
+#if FUSE_USE_VERSION < 30
     channel_ = fuse_mount(mount_path_.c_str(), &args_);
     if (channel_ == NULL) {
       syslog(LOG_ERR, "fuse_mount() failed");
       return false;
     }
+#endif
     return true;
   }
 
+#if FUSE_USE_VERSION < 30
   struct fuse_chan* channel() { return channel_; }
+#endif
   struct fuse_args* args() { return &args_; }
   const std::string& mount_path() { return mount_path_; }
 
  private:
+#if FUSE_USE_VERSION < 30
   struct fuse_chan* channel_;
+#endif
   struct fuse_args args_;
   std::string mount_path_;
 };
@@ -74,19 +121,43 @@ class Session {
   // The caller is responsible for making sure that this object is not deleted
   // while the Loop is running.
   ~Session() {
+#if FUSE_USE_VERSION >= 30
+    if (fuse_ != NULL) {
+      RemoveSession(fuse_);
+      // A no-op if the filesystem was already unmounted by MakeLoopExit
+      fuse_unmount(fuse_);
+      fuse_destroy(fuse_);
+    }
+    delete mount_point_;
+#else
     delete mount_point_;
     if (fuse_ != NULL) {
       fuse_destroy(fuse_);
     }
+#endif
   }
 
   bool Create(Context* context) {
+#if FUSE_USE_VERSION >= 30
+    fuse_ = fuse_new(mount_point_->args(), &fuse_ops_, sizeof(fuse_ops_),
+                     context);
+#else
     fuse_ = fuse_new(mount_point_->channel(), mount_point_->args(), &fuse_ops_,
                      sizeof(fuse_ops_), context);
+#endif
     if (fuse_ == NULL) {
       syslog(LOG_INFO, "fuse_new() failed");
       return false;
     }
+#if FUSE_USE_VERSION >= 30
+    if (fuse_mount(fuse_, mount_point_->mount_path().c_str()) != 0) {
+      syslog(LOG_ERR, "fuse_mount() failed");
+      fuse_destroy(fuse_);
+      fuse_ = NULL;
+      return false;
+    }
+    AddSession(fuse_);
+#endif
     return true;
   }
 
@@ -96,8 +167,14 @@ class Session {
     // TODO(allen): The signal handling code for fuse does not support more than
     // one session at a time, which is a bit worrysome in this context. Fix!
     fuse_set_signal_handlers(fuse_get_session(fuse_));
-    // Blocks until the session has exited
-    fuse_loop(fuse_);
+    // Blocks until the session has exited.  Requests are handled on several
+    // threads, so that a slow request does not hold up the others; services
+    // that cannot handle concurrent calls are wrapped in a scheduler.
+#if FUSE_USE_VERSION >= 30
+    fuse_loop_mt(fuse_, 0);
+#else
+    fuse_loop_mt(fuse_);
+#endif
     // The session has exited, either because the filesystem was unmounted by
     // a third party or because this filesystem object is in the destructor.
     fuse_remove_signal_handlers(fuse_get_session(fuse_));
@@ -107,7 +184,19 @@ class Session {
   // thread to make a thread blocked in Loop exit.  This is a no-op if the
   // loop has already exited.
   void MakeLoopExit() {
+#ifdef __APPLE__
     unmount(mount_point_->mount_path().c_str(), MNT_FORCE);
+#else
+    // The loop threads are blocked reading requests from the kernel until the
+    // filesystem is unmounted.  Unmounting needs fusermount when not root.
+    fuse_exit(fuse_);
+#if FUSE_USE_VERSION >= 30
+    RemoveSession(fuse_);
+    fuse_unmount(fuse_);
+#else
+    fuse_unmount(mount_point_->mount_path().c_str(), NULL);
+#endif
+#endif
   }
 
  private:
@@ -120,16 +209,19 @@ static void* StartMountThread(void* data);
 
 class ProxyFilesystem : public Filesystem {
  public:
-  ProxyFilesystem(proto::FsService* service,
+  // Takes ownership of owned_backend, which may be NULL
+  ProxyFilesystem(FsBackend* backend,
+                  FsBackend* owned_backend,
                   const std::string& fs_id,
                   const std::string& volname,
                   const std::string& volicon)
-      : volname_(volname),
+      : owned_backend_(owned_backend),
+        volname_(volname),
         volicon_(volicon),
         session_(NULL) {
     pthread_mutex_init(&mutex_, NULL);
     pthread_cond_init(&cond_, NULL);
-    context_.service = service;
+    context_.backend = backend;
     context_.fs_id = fs_id;
   }
 
@@ -140,6 +232,7 @@ class ProxyFilesystem : public Filesystem {
 
     pthread_mutex_destroy(&mutex_);
     pthread_cond_destroy(&cond_);
+    delete owned_backend_;
   }
 
   virtual bool Mount() {
@@ -209,6 +302,7 @@ class ProxyFilesystem : public Filesystem {
 
  private:
   struct Context context_;
+  FsBackend* owned_backend_;
   std::string volname_;
   std::string volicon_;
 
@@ -231,7 +325,27 @@ Filesystem* NewProxyFilesystem(proto::FsService* service,
                                const std::string& fs_id,
                                const std::string& volname,
                                const std::string& volicon) {
-  return new ProxyFilesystem(service, fs_id, volname, volicon);
+  FsBackend* backend = NewServiceBackend(service, fs_id);
+  return new ProxyFilesystem(backend, backend, fs_id, volname, volicon);
+}
+
+Filesystem* NewBackendFilesystem(FsBackend* backend,
+                                 const std::string& fs_id,
+                                 const std::string& volname,
+                                 const std::string& volicon) {
+  return new ProxyFilesystem(backend, NULL, fs_id, volname, volicon);
+}
+
+void InvalidatePath(const std::string& path) {
+#if FUSE_USE_VERSION >= 30
+  pthread_mutex_lock(&g_sessions_mutex);
+  for (std::set<struct fuse*>::iterator it = g_sessions.begin();
+       it != g_sessions.end(); ++it) {
+    // Fails when the kernel has nothing cached for path, which is fine
+    fuse_invalidate_path(*it, path.c_str());
+  }
+  pthread_mutex_unlock(&g_sessions_mutex);
+#endif
 }
 
 }  // namespace fs
@@ -1,7 +1,7 @@
 // Author: Allen Porter <allen@thebends.org>
 //
 // A Filesystem implementation that proxies all calls to the specified
-// FsService and mounts the filesystem using FUSE.
+// FsService, or FsBackend, and mounts the filesystem using FUSE.
 
 #ifndef __FS_FS_PROXY_H__
 #define __FS_FS_PROXY_H__
@@ -15,12 +15,26 @@ namespace proto {
 namespace fs {
 
 class Filesystem;
+class FsBackend;
 
 Filesystem* NewProxyFilesystem(proto::FsService* service,
                                const std::string& fs_id,
                                const std::string& volname,
                                const std::string& volicon);
 
+// Calls backend directly, without building a protocol buffer message for
+// each call.  Does not take ownership of backend.
+Filesystem* NewBackendFilesystem(FsBackend* backend,
+                                 const std::string& fs_id,
+                                 const std::string& volname,
+                                 const std::string& volicon);
+
+// Drops what the kernel cached for path, such as its attributes and the
+// entries of a directory, in every filesystem this process mounted.  Only
+// fuse 3 can do so; with older versions this does nothing and the kernel
+// caches expire on their own.
+void InvalidatePath(const std::string& path);
+
 }  // namespace fs
 
 #endif  // __FS_FS_PROXY_H__
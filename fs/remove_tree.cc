@@ -0,0 +1,288 @@
+#include "fs/remove_tree.h"
+
+#include <deque>
+#include <pthread.h>
+#include <string>
+#include <sys/time.h>
+#include <syslog.h>
+#include <vector>
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace fs {
+
+static metrics::Counter g_removed(
+    "remove_tree_entries_total", "Entries removed by RemoveTree calls");
+
+// Entries requested from ReadDir at a time
+static const int kListingPage = 256;
+// Progress is logged this often
+static const long long kProgressIntervalUsec = 10 * 1000000LL;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// An entry to remove
+struct Node {
+  Node(const std::string& path, Node* parent)
+      : path(path), parent(parent), listed(false), pending(0),
+        failed(false) { }
+
+  std::string path;
+  Node* parent;
+  // Set once the entries of a directory have been pushed
+  bool listed;
+  // Entries of a listed directory not yet removed or given up on
+  int pending;
+  // Set when an entry beneath the directory could not be removed
+  bool failed;
+};
+
+class TreeRemover {
+ public:
+  TreeRemover(const std::vector<proto::FsService*>& services,
+              RpcController* rpc,
+              const proto::RemoveTreeRequest* request,
+              proto::RemoveTreeResponse* response)
+      : services_(services), rpc_(rpc), request_(request),
+        response_(response), finished_(false), canceled_(false),
+        root_removed_(false), removed_(0) {
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&work_cond_, NULL);
+  }
+
+  ~TreeRemover() {
+    pthread_cond_destroy(&work_cond_);
+    pthread_mutex_destroy(&mutex_);
+    delete null_callback_;
+  }
+
+  // Returns true if the path of the request is gone
+  bool Run() {
+    start_ = NowMicros();
+    progress_ = start_;
+    nodes_.push_back(Node(request_->path(), NULL));
+    stack_.push_back(&nodes_.back());
+    // The calling thread works with the first service
+    std::vector<Worker> workers(services_.size());
+    std::vector<pthread_t> threads(services_.size());
+    std::vector<bool> started(services_.size(), false);
+    for (size_t i = 0; i < services_.size(); ++i) {
+      workers[i].remover = this;
+      workers[i].service = services_[i];
+    }
+    for (size_t i = 1; i < services_.size(); ++i) {
+      started[i] = (pthread_create(&threads[i], NULL, &RunWorker,
+                                   &workers[i]) == 0);
+    }
+    Work(services_[0]);
+    for (size_t i = 1; i < services_.size(); ++i) {
+      if (started[i]) {
+        pthread_join(threads[i], NULL);
+      }
+    }
+    if (canceled_) {
+      syslog(LOG_INFO, "Canceled removing %s after %lld entries",
+             request_->path().c_str(), removed_);
+    }
+    return root_removed_;
+  }
+
+  bool canceled() const { return canceled_; }
+
+ private:
+  struct Worker {
+    TreeRemover* remover;
+    proto::FsService* service;
+  };
+
+  static void* RunWorker(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    worker->remover->Work(worker->service);
+    return NULL;
+  }
+
+  void Work(proto::FsService* service) {
+    pthread_mutex_lock(&mutex_);
+    while (!finished_) {
+      if (rpc_->IsCanceled()) {
+        canceled_ = true;
+        finished_ = true;
+        pthread_cond_broadcast(&work_cond_);
+        break;
+      }
+      if (stack_.empty()) {
+        pthread_cond_wait(&work_cond_, &mutex_);
+        continue;
+      }
+      Node* node = stack_.back();
+      stack_.pop_back();
+      pthread_mutex_unlock(&mutex_);
+
+      std::string error;
+      std::vector<std::string> names;
+      bool removed = Unlink(service, node->path, &error);
+      bool listed = !removed && !node->listed &&
+                    List(service, node->path, &names);
+
+      pthread_mutex_lock(&mutex_);
+      if (listed) {
+        // The directory is removed again once its entries are gone, or
+        // right away if it was empty
+        node->listed = true;
+        node->pending = names.size();
+        if (names.empty()) {
+          stack_.push_back(node);
+        }
+        for (size_t i = 0; i < names.size(); ++i) {
+          nodes_.push_back(Node(node->path + "/" + names[i], node));
+          stack_.push_back(&nodes_.back());
+        }
+        pthread_cond_broadcast(&work_cond_);
+      } else {
+        Done(node, removed, error);
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Records that node was removed or given up on, and pushes its directory
+  // when it was the last entry left.  A directory that cannot be emptied is
+  // given up on without being listed as a failure.
+  void Done(Node* node, bool removed, const std::string& error) {
+    if (removed) {
+      response_->set_removed(++removed_);
+      g_removed.Increment();
+    } else {
+      proto::RemoveTreeResponse::Failure* failure =
+          response_->add_failure();
+      failure->set_path(node->path);
+      failure->set_error(error);
+    }
+    while (true) {
+      Node* parent = node->parent;
+      if (parent == NULL) {
+        root_removed_ = removed;
+        finished_ = true;
+        pthread_cond_broadcast(&work_cond_);
+        break;
+      }
+      if (!removed) {
+        parent->failed = true;
+      }
+      if (--parent->pending > 0) {
+        break;
+      }
+      if (!parent->failed) {
+        stack_.push_back(parent);
+        pthread_cond_broadcast(&work_cond_);
+        break;
+      }
+      node = parent;
+      removed = false;
+    }
+    long long now = NowMicros();
+    if (now - progress_ >= kProgressIntervalUsec) {
+      progress_ = now;
+      syslog(LOG_INFO, "Removing %s: %lld entries (%.1f/s)",
+             request_->path().c_str(), removed_,
+             removed_ / ((now - start_) / 1000000.0));
+    }
+  }
+
+  bool Unlink(proto::FsService* service, const std::string& path,
+              std::string* error) {
+    rpc::Rpc rpc;
+    proto::UnlinkRequest request;
+    proto::UnlinkResponse response;
+    request.mutable_header()->CopyFrom(request_->header());
+    request.set_path(path);
+    service->Unlink(&rpc, &request, &response, null_callback_);
+    if (rpc.Failed()) {
+      *error = rpc.ErrorText();
+      return false;
+    }
+    return true;
+  }
+
+  // Returns false if path is not a directory that could be listed
+  bool List(proto::FsService* service, const std::string& path,
+            std::vector<std::string>* names) {
+    long long offset = 0;
+    while (true) {
+      rpc::Rpc rpc;
+      proto::ReadDirRequest request;
+      proto::ReadDirResponse response;
+      request.mutable_header()->CopyFrom(request_->header());
+      request.set_path(path);
+      request.set_offset(offset);
+      request.set_max_entries(kListingPage);
+      service->ReadDir(&rpc, &request, &response, null_callback_);
+      if (rpc.Failed()) {
+        return false;
+      }
+      for (int i = 0; i < response.entry_size(); ++i) {
+        const std::string& filename = response.entry(i).filename();
+        if (filename != "." && filename != "..") {
+          names->push_back(filename);
+        }
+      }
+      if (!response.has_next_offset()) {
+        return true;
+      }
+      offset = response.next_offset();
+    }
+  }
+
+  std::vector<proto::FsService*> services_;
+  RpcController* rpc_;
+  const proto::RemoveTreeRequest* request_;
+  proto::RemoveTreeResponse* response_;
+  Closure* null_callback_;
+  long long start_;
+
+  pthread_mutex_t mutex_;  // protects the members below
+  pthread_cond_t work_cond_;
+  // Every entry seen, so that none is freed while the call runs
+  std::deque<Node> nodes_;
+  // Entries to remove, the most recently listed first
+  std::vector<Node*> stack_;
+  bool finished_;
+  bool canceled_;
+  bool root_removed_;
+  long long removed_;
+  long long progress_;
+};
+
+void RemoveTree(const std::vector<proto::FsService*>& services,
+                RpcController* rpc,
+                const proto::RemoveTreeRequest* request,
+                proto::RemoveTreeResponse* response) {
+  if (request->path().empty() || request->path() == "/") {
+    rpc->SetFailed("Refusing to remove the root directory");
+    return;
+  }
+  response->set_removed(0);
+  TreeRemover remover(services, rpc, request, response);
+  if (remover.Run()) {
+    return;
+  }
+  if (remover.canceled()) {
+    rpc->SetFailed("Canceled");
+  } else if (response->failure_size() > 0) {
+    rpc->SetFailed(response->failure(0).error());
+  } else {
+    rpc->SetFailed("Directory not empty");
+  }
+}
+
+}  // namespace fs
@@ -0,0 +1,42 @@
+// Carries out a RemoveTree call (see proto/fs.proto) as Unlink and ReadDir
+// calls, for services that have no faster way to remove a directory.  An
+// entry is first removed with Unlink, which removes files and empty
+// directories alike, and is only listed when that fails.  Its entries are
+// then removed the same way, deepest first, and the directory is removed
+// again once they are gone, so a tree of files costs one call per file and
+// about three per directory.
+//
+// Each service is a connection to the same filesystem and is used by one
+// thread, so with several connections the calls overlap: while one removes a
+// file another lists the next directory.  Progress is logged every few
+// seconds and counted in the remove_tree_entries_total metric.
+
+#ifndef __FS_REMOVE_TREE_H__
+#define __FS_REMOVE_TREE_H__
+
+#include <vector>
+
+namespace google {
+namespace protobuf {
+class RpcController;
+}
+}
+
+namespace proto {
+class FsService;
+class RemoveTreeRequest;
+class RemoveTreeResponse;
+}
+
+namespace fs {
+
+// Fails the rpc unless the path of the request is gone.  Stops early, with
+// the rpc failed, when it is canceled.  Refuses to remove "/".
+void RemoveTree(const std::vector<proto::FsService*>& services,
+                google::protobuf::RpcController* rpc,
+                const proto::RemoveTreeRequest* request,
+                proto::RemoveTreeResponse* response);
+
+}  // namespace fs
+
+#endif  // __FS_REMOVE_TREE_H__
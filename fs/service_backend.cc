@@ -0,0 +1,764 @@
+#include "fs/service_backend.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <vector>
+#include "fs/fs_backend.h"
+#include "fs/remove_tree.h"
+#include "proto/fs_service.pb.h"
+
+// Linux calls a missing extended attribute ENODATA
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+using ::google::protobuf::Closure;
+
+namespace fs {
+
+static const int kNameMax = 255;
+static const int kFiles = 110000;
+static const int kFilesFree = kFiles - 10000;
+// Default iPhone block size
+static const int kBlockSize = 4096;
+
+class ServiceBackend : public FsBackend {
+ public:
+  ServiceBackend(proto::FsService* service, const std::string& fs_id)
+      : service_(service), fs_id_(fs_id) {
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~ServiceBackend() {
+    delete null_callback_;
+  }
+
+  virtual int GetAttr(RpcController* rpc, const char* path,
+                      struct stat* stbuf) {
+    proto::GetAttrRequest request;
+    proto::GetAttrResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    service_->GetAttr(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    FillStat(response.stat(), stbuf);
+    return 0;
+  }
+
+  virtual int ReadLink(RpcController* rpc, const char* path, char* buf,
+                       size_t size) {
+    proto::ReadLinkRequest request;
+    proto::ReadLinkResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    service_->ReadLink(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    strncpy(buf, response.destination().c_str(), size);
+    if (size > 0) {
+      buf[size - 1] = '\0';
+    }
+    return 0;
+  }
+
+  virtual int SymLink(RpcController* rpc, const char* source,
+                      const char* target) {
+    proto::SymLinkRequest request;
+    proto::SymLinkResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_source(source);
+    request.set_target(target);
+    service_->SymLink(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : 0;
+  }
+
+  virtual int ReadDir(RpcController* rpc, const char* path,
+                      long long dirhandle, long long offset, int max_entries,
+                      DirFiller filler, void* data, long long* next_offset) {
+    proto::ReadDirRequest request;
+    proto::ReadDirResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_dirhandle(dirhandle);
+    request.set_offset(offset);
+    if (max_entries > 0) {
+      request.set_max_entries(max_entries);
+    }
+    service_->ReadDir(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    for (int i = 0; i < response.entry_size(); ++i) {
+      filler(response.entry(i).filename().c_str(), data);
+    }
+    *next_offset = response.has_next_offset() ? response.next_offset() : -1;
+    return 0;
+  }
+
+  virtual int Unlink(RpcController* rpc, const char* path) {
+    proto::UnlinkRequest request;
+    proto::UnlinkResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    service_->Unlink(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : 0;
+  }
+
+  virtual int MkDir(RpcController* rpc, const char* path, mode_t mode) {
+    proto::MkDirRequest request;
+    proto::MkDirResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_mode(mode);
+    service_->MkDir(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : 0;
+  }
+
+  virtual int Rename(RpcController* rpc, const char* from, const char* to) {
+    proto::RenameRequest request;
+    proto::RenameResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_source_path(from);
+    request.set_destination_path(to);
+    service_->Rename(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : 0;
+  }
+
+  virtual int Open(RpcController* rpc, const char* path, int flags,
+                   long long* filehandle) {
+    proto::OpenRequest request;
+    proto::OpenResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_flags(flags);
+    service_->Open(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    *filehandle = response.filehandle();
+    return 0;
+  }
+
+  virtual int Create(RpcController* rpc, const char* path, int flags,
+                     mode_t mode, long long* filehandle) {
+    proto::CreateRequest request;
+    proto::CreateResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_flags(flags);
+    request.set_mode(mode);
+    service_->Create(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    *filehandle = response.filehandle();
+    return 0;
+  }
+
+  virtual int Release(RpcController* rpc, long long filehandle) {
+    proto::ReleaseRequest request;
+    proto::ReleaseResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_filehandle(filehandle);
+    service_->Release(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : 0;
+  }
+
+  virtual int Read(RpcController* rpc, long long filehandle, char* buf,
+                   size_t size, off_t offset) {
+    proto::ReadRequest request;
+    proto::ReadResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_filehandle(filehandle);
+    request.set_size(size);
+    request.set_offset(offset);
+    service_->Read(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    memcpy(buf, response.buffer().data(), response.buffer().size());
+    return response.buffer().size();
+  }
+
+  virtual int Write(RpcController* rpc, long long filehandle, const char* buf,
+                    size_t size, off_t offset) {
+    proto::WriteRequest request;
+    proto::WriteResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_filehandle(filehandle);
+    request.mutable_buffer()->assign(buf, size);
+    request.set_offset(offset);
+    service_->Write(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : response.size();
+  }
+
+  // The kernel copies the range itself when this fails
+  virtual ssize_t CopyRange(RpcController* rpc, long long source_filehandle,
+                            off_t source_offset,
+                            long long destination_filehandle,
+                            off_t destination_offset, size_t size) {
+    proto::CopyRangeRequest request;
+    proto::CopyRangeResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_source_filehandle(source_filehandle);
+    request.set_source_offset(source_offset);
+    request.set_destination_filehandle(destination_filehandle);
+    request.set_destination_offset(destination_offset);
+    request.set_size(size);
+    service_->CopyRange(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -EOPNOTSUPP : response.size();
+  }
+
+  virtual int Truncate(RpcController* rpc, const char* path, off_t offset) {
+    proto::TruncateRequest request;
+    proto::TruncateResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_offset(offset);
+    service_->Truncate(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : 0;
+  }
+
+  virtual int FTruncate(RpcController* rpc, long long filehandle,
+                        off_t offset) {
+    proto::FTruncateRequest request;
+    proto::FTruncateResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_filehandle(filehandle);
+    request.set_offset(offset);
+    service_->FTruncate(rpc, &request, &response, null_callback_);
+    return rpc->Failed() ? -ENOENT : 0;
+  }
+
+  virtual int FGetAttr(RpcController* rpc, long long filehandle,
+                       struct stat* stbuf) {
+    proto::FGetAttrRequest request;
+    proto::FGetAttrResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_filehandle(filehandle);
+    service_->FGetAttr(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    FillStat(response.stat(), stbuf);
+    return 0;
+  }
+
+  virtual int StatFs(RpcController* rpc, struct statvfs* vfs) {
+    proto::StatFsRequest request;
+    proto::StatFsResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    service_->StatFs(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOENT;
+    }
+    vfs->f_namemax = kNameMax;
+    vfs->f_bsize = response.stat().bsize();
+    vfs->f_frsize = response.stat().frsize();
+    vfs->f_blocks = response.stat().blocks();
+    vfs->f_bfree = response.stat().bfree();
+    vfs->f_bavail = vfs->f_bfree;
+    vfs->f_files = kFiles;
+    vfs->f_ffree = kFilesFree;
+    return 0;
+  }
+
+  virtual int GetXAttr(RpcController* rpc, const char* path,
+                       const char* name, char* value, size_t size,
+                       uint32_t position) {
+    proto::GetXAttrRequest request;
+    proto::GetXAttrResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_name(name);
+    if (position != 0) {
+      request.set_position(position);
+    }
+    service_->GetXAttr(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOTSUP;
+    }
+    if (!response.has_value()) {
+      return -ENOATTR;
+    }
+    return CopyOut(response.value(), value, size);
+  }
+
+  virtual int SetXAttr(RpcController* rpc, const char* path,
+                       const char* name, const char* value, size_t size,
+                       int flags, uint32_t position) {
+    proto::SetXAttrRequest request;
+    proto::SetXAttrResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_name(name);
+    request.set_value(value, size);
+    if (position != 0) {
+      request.set_position(position);
+    }
+    if (flags & XATTR_CREATE) {
+      request.set_create(true);
+    }
+    if (flags & XATTR_REPLACE) {
+      request.set_replace(true);
+    }
+    service_->SetXAttr(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOTSUP;
+    }
+    if (request.create() && response.existed()) {
+      return -EEXIST;
+    } else if (request.replace() && !response.existed()) {
+      return -ENOATTR;
+    }
+    return 0;
+  }
+
+  // The names are returned one after another, each terminated by a NUL
+  virtual int ListXAttr(RpcController* rpc, const char* path, char* list,
+                        size_t size) {
+    proto::ListXAttrRequest request;
+    proto::ListXAttrResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    service_->ListXAttr(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOTSUP;
+    }
+    std::string buffer;
+    for (int i = 0; i < response.name_size(); ++i) {
+      buffer.append(response.name(i));
+      buffer.push_back('\0');
+    }
+    return CopyOut(buffer, list, size);
+  }
+
+  virtual int RemoveXAttr(RpcController* rpc, const char* path,
+                          const char* name) {
+    proto::RemoveXAttrRequest request;
+    proto::RemoveXAttrResponse response;
+    request.mutable_header()->set_fs_id(fs_id_);
+    request.set_path(path);
+    request.set_name(name);
+    service_->RemoveXAttr(rpc, &request, &response, null_callback_);
+    if (rpc->Failed()) {
+      return -ENOTSUP;
+    }
+    return response.existed() ? 0 : -ENOATTR;
+  }
+
+ private:
+  static void FillStat(const proto::Stat& stat, struct stat* stbuf) {
+    stbuf->st_size = stat.size();
+    stbuf->st_blocks = stat.blocks();
+    stbuf->st_mode = stat.mode();
+    if (stat.has_nlink()) {
+      stbuf->st_nlink = stat.nlink();
+    }
+    if (stat.has_mtime()) {
+#ifdef __APPLE__
+      stbuf->st_mtimespec.tv_sec = stat.mtime().tv_sec();
+      stbuf->st_mtimespec.tv_nsec = stat.mtime().tv_nsec();
+#else
+      stbuf->st_mtim.tv_sec = stat.mtime().tv_sec();
+      stbuf->st_mtim.tv_nsec = stat.mtime().tv_nsec();
+#endif
+    }
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_blksize = kBlockSize;
+  }
+
+  // A size of zero asks for the size of the buffer
+  static int CopyOut(const std::string& buffer, char* out, size_t size) {
+    if (size == 0) {
+      return buffer.size();
+    } else if (buffer.size() > size) {
+      return -ERANGE;
+    }
+    memcpy(out, buffer.data(), buffer.size());
+    return buffer.size();
+  }
+
+  proto::FsService* service_;
+  std::string fs_id_;
+  Closure* null_callback_;
+};
+
+class BackendService : public proto::FsService {
+ public:
+  BackendService(FsBackend* backend) : backend_(backend) { }
+
+  virtual ~BackendService() {
+    delete backend_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    if (Check(rpc, backend_->GetAttr(rpc, request->path().c_str(),
+                                     &stbuf))) {
+      FillStat(stbuf, response->mutable_stat());
+    }
+    done->Run();
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    char destination[PATH_MAX + 1];
+    if (Check(rpc, backend_->ReadLink(rpc, request->path().c_str(),
+                                      destination, sizeof(destination)))) {
+      response->set_destination(destination);
+    }
+    done->Run();
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    Check(rpc, backend_->SymLink(rpc, request->source().c_str(),
+                                 request->target().c_str()));
+    done->Run();
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    long long next_offset = -1;
+    if (Check(rpc, backend_->ReadDir(rpc, request->path().c_str(),
+                                     request->dirhandle(), request->offset(),
+                                     request->max_entries(), &AddEntry,
+                                     response, &next_offset))) {
+      if (next_offset != -1) {
+        response->set_next_offset(next_offset);
+      }
+    } else {
+      response->Clear();
+    }
+    done->Run();
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    Check(rpc, backend_->Unlink(rpc, request->path().c_str()));
+    done->Run();
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    fs::RemoveTree(std::vector<proto::FsService*>(1, this), rpc, request,
+                   response);
+    done->Run();
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    Check(rpc, backend_->MkDir(rpc, request->path().c_str(),
+                               request->mode()));
+    done->Run();
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    Check(rpc, backend_->Rename(rpc, request->source_path().c_str(),
+                                request->destination_path().c_str()));
+    done->Run();
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    long long filehandle;
+    if (Check(rpc, backend_->Open(rpc, request->path().c_str(),
+                                  request->flags(), &filehandle))) {
+      response->set_filehandle(filehandle);
+    }
+    done->Run();
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    long long filehandle;
+    if (Check(rpc, backend_->Create(rpc, request->path().c_str(),
+                                    request->flags(), request->mode(),
+                                    &filehandle))) {
+      response->set_filehandle(filehandle);
+    }
+    done->Run();
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    Check(rpc, backend_->Release(rpc, request->filehandle()));
+    done->Run();
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    std::string* buffer = response->mutable_buffer();
+    buffer->resize(request->size());
+    int n = backend_->Read(rpc, request->filehandle(),
+                           buffer->empty() ? NULL : &(*buffer)[0],
+                           request->size(), request->offset());
+    buffer->resize(n < 0 ? 0 : n);
+    Check(rpc, n);
+    done->Run();
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    for (int i = 0; i < request->range_size(); ++i) {
+      std::string* buffer = response->add_buffer();
+      buffer->resize(request->range(i).size());
+      int n = backend_->Read(rpc, request->filehandle(),
+                             buffer->empty() ? NULL : &(*buffer)[0],
+                             buffer->size(), request->range(i).offset());
+      if (!Check(rpc, n)) {
+        response->Clear();
+        break;
+      }
+      buffer->resize(n);
+    }
+    done->Run();
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    const std::string& buffer = request->buffer();
+    int n = backend_->Write(rpc, request->filehandle(), buffer.data(),
+                            buffer.size(), request->offset());
+    if (Check(rpc, n)) {
+      response->set_size(n);
+    }
+    done->Run();
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    ssize_t n = backend_->CopyRange(rpc, request->source_filehandle(),
+                                    request->source_offset(),
+                                    request->destination_filehandle(),
+                                    request->destination_offset(),
+                                    request->size());
+    if (Check(rpc, n)) {
+      response->set_size(n);
+    }
+    done->Run();
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    Check(rpc, backend_->Truncate(rpc, request->path().c_str(),
+                                  request->offset()));
+    done->Run();
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    Check(rpc, backend_->FTruncate(rpc, request->filehandle(),
+                                   request->offset()));
+    done->Run();
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    if (Check(rpc, backend_->FGetAttr(rpc, request->filehandle(), &stbuf))) {
+      FillStat(stbuf, response->mutable_stat());
+    }
+    done->Run();
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    struct statvfs vfs;
+    memset(&vfs, 0, sizeof(vfs));
+    if (Check(rpc, backend_->StatFs(rpc, &vfs))) {
+      response->mutable_stat()->set_bsize(vfs.f_bsize);
+      response->mutable_stat()->set_frsize(vfs.f_frsize);
+      response->mutable_stat()->set_blocks(vfs.f_blocks);
+      response->mutable_stat()->set_bfree(vfs.f_bfree);
+    }
+    done->Run();
+  }
+
+  // A missing attribute is not a failure: the value is left out instead
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    const char* path = request->path().c_str();
+    const char* name = request->name().c_str();
+    int size = backend_->GetXAttr(rpc, path, name, NULL, 0,
+                                  request->position());
+    if (size >= 0) {
+      std::string* value = response->mutable_value();
+      value->resize(size);
+      size = backend_->GetXAttr(rpc, path, name,
+                                value->empty() ? NULL : &(*value)[0],
+                                value->size(), request->position());
+      if (size >= 0) {
+        value->resize(size);
+      } else {
+        response->clear_value();
+      }
+    }
+    if (size != -ENOATTR) {
+      Check(rpc, size);
+    }
+    done->Run();
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    int flags = 0;
+    if (request->create()) {
+      flags |= XATTR_CREATE;
+    }
+    if (request->replace()) {
+      flags |= XATTR_REPLACE;
+    }
+    const std::string& value = request->value();
+    int ret = backend_->SetXAttr(rpc, request->path().c_str(),
+                                 request->name().c_str(), value.data(),
+                                 value.size(), flags, request->position());
+    if (ret == -EEXIST || ret == -ENOATTR) {
+      // Refused because of create or replace
+      response->set_existed(ret == -EEXIST);
+    } else if (Check(rpc, ret)) {
+      response->set_existed(request->replace());
+    }
+    done->Run();
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    const char* path = request->path().c_str();
+    int size = backend_->ListXAttr(rpc, path, NULL, 0);
+    std::string list;
+    if (size > 0) {
+      list.resize(size);
+      size = backend_->ListXAttr(rpc, path, &list[0], list.size());
+    }
+    if (Check(rpc, size)) {
+      list.resize(size);
+      size_t start = 0;
+      while (start < list.size()) {
+        size_t end = list.find('\0', start);
+        if (end == std::string::npos) {
+          end = list.size();
+        }
+        response->add_name(list.substr(start, end - start));
+        start = end + 1;
+      }
+    }
+    done->Run();
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    int ret = backend_->RemoveXAttr(rpc, request->path().c_str(),
+                                    request->name().c_str());
+    if (ret == -ENOATTR) {
+      response->set_existed(false);
+    } else if (Check(rpc, ret)) {
+      response->set_existed(true);
+    }
+    done->Run();
+  }
+
+ private:
+  // Fails the rpc if ret is a negated errno value.  Returns true on success.
+  static bool Check(RpcController* rpc, long long ret) {
+    if (ret < 0) {
+      rpc->SetFailed(strerror(-ret));
+      return false;
+    }
+    return true;
+  }
+
+  static void AddEntry(const char* name, void* data) {
+    static_cast<proto::ReadDirResponse*>(data)->add_entry()->set_filename(
+        name);
+  }
+
+  static void FillStat(const struct stat& stbuf, proto::Stat* stat) {
+    stat->set_size(stbuf.st_size);
+    stat->set_blocks(stbuf.st_blocks);
+    stat->set_mode(stbuf.st_mode);
+    stat->set_nlink(stbuf.st_nlink);
+#ifdef __APPLE__
+    stat->mutable_mtime()->set_tv_sec(stbuf.st_mtimespec.tv_sec);
+    stat->mutable_mtime()->set_tv_nsec(stbuf.st_mtimespec.tv_nsec);
+#else
+    stat->mutable_mtime()->set_tv_sec(stbuf.st_mtim.tv_sec);
+    stat->mutable_mtime()->set_tv_nsec(stbuf.st_mtim.tv_nsec);
+#endif
+  }
+
+  FsBackend* backend_;
+};
+
+FsBackend* NewServiceBackend(proto::FsService* service,
+                             const std::string& fs_id) {
+  return new ServiceBackend(service, fs_id);
+}
+
+proto::FsService* NewBackendService(FsBackend* backend) {
+  return new BackendService(backend);
+}
+
+}  // namespace fs
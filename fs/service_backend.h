@@ -0,0 +1,31 @@
+// Adapters between the two filesystem interfaces: FsService, whose calls are
+// protocol buffer messages that may cross a process boundary, and FsBackend
+// (see fs/fs_backend.h), whose calls are plain C++.
+
+#ifndef __FS_SERVICE_BACKEND_H__
+#define __FS_SERVICE_BACKEND_H__
+
+#include <string>
+
+namespace proto {
+class FsService;
+}
+
+namespace fs {
+
+class FsBackend;
+
+// An FsBackend that makes each call on service, with requests for fs_id.  A
+// failed call returns the error fuse has always returned for it, ENOENT for
+// most calls.  Does not take ownership of service.
+FsBackend* NewServiceBackend(proto::FsService* service,
+                             const std::string& fs_id);
+
+// An FsService that makes each call on backend, so that a backend can be
+// wrapped by the FsService decorators.  A failed call fails the rpc with the
+// text of its errno value.  Takes ownership of backend.
+proto::FsService* NewBackendService(FsBackend* backend);
+
+}  // namespace fs
+
+#endif  // __FS_SERVICE_BACKEND_H__
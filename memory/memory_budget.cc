@@ -0,0 +1,156 @@
+#include "memory/memory_budget.h"
+
+#include <algorithm>
+#include <map>
+#include <pthread.h>
+#include <syslog.h>
+#include "metrics/metrics.h"
+
+namespace memory {
+
+static const long long kDefaultBudget = 64 * 1024 * 1024;
+
+static metrics::Gauge g_budget_gauge(
+    "memory_budget_bytes", "Memory that caches and buffers may hold");
+static metrics::Gauge g_usage_gauge(
+    "memory_usage_bytes", "Memory held by caches and buffers");
+static metrics::Counter g_evicted_counter(
+    "memory_evicted_bytes_total", "Memory reclaimed from caches");
+
+class Governor {
+ public:
+  static void Register(Consumer* consumer) {
+    pthread_mutex_lock(&mutex_);
+    Consumers()->push_back(consumer);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  static void Unregister(Consumer* consumer) {
+    pthread_mutex_lock(&mutex_);
+    std::vector<Consumer*>* consumers = Consumers();
+    consumers->erase(std::remove(consumers->begin(), consumers->end(),
+                                 consumer),
+                     consumers->end());
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  static void Add(long long bytes) {
+    g_usage_gauge.Set(__sync_add_and_fetch(&usage_, bytes));
+    g_budget_gauge.Set(budget_);
+  }
+
+  // Evicts from the consumers in order of increasing hits per byte until
+  // usage is back under the budget.  Only one thread evicts at a time; others
+  // that are over budget carry on rather than waiting.
+  static void EvictIfOverBudget() {
+    if (usage_ <= budget_ || pthread_mutex_trylock(&mutex_) != 0) {
+      return;
+    }
+    std::vector<Consumer*>* consumers = Consumers();
+    std::vector<std::pair<double, Consumer*> > order;
+    for (size_t i = 0; i < consumers->size(); ++i) {
+      Consumer* consumer = (*consumers)[i];
+      if (consumer->evict_ != NULL && consumer->usage_ > 0) {
+        double value = static_cast<double>(consumer->hits_) /
+                       consumer->usage_;
+        order.push_back(std::make_pair(value, consumer));
+      }
+    }
+    std::sort(order.begin(), order.end());
+    long long before = usage_;
+    for (size_t i = 0; i < order.size() && usage_ > budget_; ++i) {
+      Consumer* consumer = order[i].second;
+      (*consumer->evict_)(usage_ - budget_, consumer->user_data_);
+    }
+    // Older hits count for less at each pass
+    for (size_t i = 0; i < consumers->size(); ++i) {
+      (*consumers)[i]->hits_ /= 2;
+    }
+    if (usage_ < before) {
+      g_evicted_counter.IncrementBy(before - usage_);
+    }
+    if (usage_ > budget_) {
+      syslog(LOG_DEBUG, "Memory usage %lld exceeds budget %lld", usage_,
+             budget_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  static void GetUsage(std::vector<Usage>* usage) {
+    std::map<std::string, long long> by_name;
+    pthread_mutex_lock(&mutex_);
+    std::vector<Consumer*>* consumers = Consumers();
+    for (size_t i = 0; i < consumers->size(); ++i) {
+      by_name[(*consumers)[i]->name_] += (*consumers)[i]->usage_;
+    }
+    pthread_mutex_unlock(&mutex_);
+    usage->clear();
+    for (std::map<std::string, long long>::const_iterator it =
+             by_name.begin(); it != by_name.end(); ++it) {
+      Usage entry;
+      entry.name = it->first;
+      entry.bytes = it->second;
+      usage->push_back(entry);
+    }
+  }
+
+  // Consumers may be statics in other files, so the list is created on first
+  // use rather than relying on the order of static initialization.
+  static std::vector<Consumer*>* Consumers() {
+    static std::vector<Consumer*>* consumers = new std::vector<Consumer*>;
+    return consumers;
+  }
+
+  static pthread_mutex_t mutex_;  // protects the list of consumers
+  static volatile long long usage_;
+  static volatile long long budget_;
+};
+
+pthread_mutex_t Governor::mutex_ = PTHREAD_MUTEX_INITIALIZER;
+volatile long long Governor::usage_ = 0;
+volatile long long Governor::budget_ = kDefaultBudget;
+
+Consumer::Consumer(const char* name, EvictCallback evict, void* user_data)
+    : name_(name),
+      evict_(evict),
+      user_data_(user_data),
+      usage_(0),
+      hits_(0) {
+  Governor::Register(this);
+}
+
+Consumer::~Consumer() {
+  Governor::Unregister(this);
+  Governor::Add(-usage_);
+}
+
+void Consumer::Charge(long long bytes) {
+  __sync_add_and_fetch(&usage_, bytes);
+  Governor::Add(bytes);
+  Governor::EvictIfOverBudget();
+}
+
+void Consumer::Release(long long bytes) {
+  __sync_sub_and_fetch(&usage_, bytes);
+  Governor::Add(-bytes);
+}
+
+void SetBudget(long long bytes) {
+  Governor::budget_ = bytes;
+  g_budget_gauge.Set(bytes);
+  Governor::EvictIfOverBudget();
+}
+
+long long Budget() {
+  return Governor::budget_;
+}
+
+long long TotalUsage() {
+  return Governor::usage_;
+}
+
+void GetUsage(std::vector<Usage>* usage) {
+  Governor::GetUsage(usage);
+}
+
+}  // namespace memory
@@ -0,0 +1,97 @@
+// Process-wide accounting of the memory held by caches and transfer buffers.
+// Every consumer of a significant amount of memory owns a Consumer object and
+// charges its allocations against it.  When the total exceeds the budget,
+// memory is reclaimed from the consumers that get the least out of it first:
+// each consumer counts the device round trips its memory has saved, and those
+// with the fewest hits per byte held are asked to evict before the others.
+//
+// Memory that cannot be reclaimed, such as the buffer of a read in progress,
+// is still charged so that it pushes caches out, but is never refused.
+
+#ifndef __MEMORY_MEMORY_BUDGET_H__
+#define __MEMORY_MEMORY_BUDGET_H__
+
+#include <string>
+#include <vector>
+
+namespace memory {
+
+// Asks the owner of a consumer to free approximately bytes of memory, calling
+// Release for whatever it frees.  The callback may be invoked from any thread
+// that charges memory, with no locks held other than the governor's own.
+typedef void (*EvictCallback)(long long bytes, void* user_data);
+
+class Consumer {
+ public:
+  // evict may be NULL if the memory cannot be reclaimed on demand.  A consumer
+  // that is a member of its owner should be declared after the memory it
+  // accounts for, so that it is unregistered before that memory is destroyed.
+  Consumer(const char* name, EvictCallback evict, void* user_data);
+
+  // Unregisters the consumer and releases anything still charged to it.
+  ~Consumer();
+
+  // Accounts for bytes of newly allocated memory, first evicting from the
+  // consumers with the lowest value if the budget would be exceeded.  This
+  // must not be called while holding a lock that the evict callback of this
+  // consumer acquires.
+  void Charge(long long bytes);
+
+  // Accounts for bytes of memory that have been freed.
+  void Release(long long bytes);
+
+  // Records that memory held by this consumer saved a device round trip.
+  void RecordHit() { __sync_add_and_fetch(&hits_, 1); }
+
+  const char* name() const { return name_; }
+  long long usage() const { return usage_; }
+
+ private:
+  friend class Governor;
+
+  const char* name_;
+  EvictCallback evict_;
+  void* user_data_;
+  volatile long long usage_;
+  volatile long long hits_;
+
+  Consumer(const Consumer&);
+  void operator=(const Consumer&);
+};
+
+// Charges memory to a consumer for the lifetime of the object, typically a
+// transfer buffer that lives for the duration of a request.
+class ScopedCharge {
+ public:
+  ScopedCharge(Consumer* consumer, long long bytes)
+      : consumer_(consumer), bytes_(bytes) {
+    consumer_->Charge(bytes_);
+  }
+
+  ~ScopedCharge() {
+    consumer_->Release(bytes_);
+  }
+
+ private:
+  Consumer* consumer_;
+  long long bytes_;
+};
+
+// Sets the total number of bytes that consumers may hold before eviction.
+void SetBudget(long long bytes);
+
+long long Budget();
+long long TotalUsage();
+
+struct Usage {
+  std::string name;
+  long long bytes;
+};
+
+// Returns the current usage of every registered consumer.  Consumers with the
+// same name are combined.
+void GetUsage(std::vector<Usage>* usage);
+
+}  // namespace memory
+
+#endif  // __MEMORY_MEMORY_BUDGET_H__
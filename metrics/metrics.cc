@@ -0,0 +1,60 @@
+#include "metrics/metrics.h"
+
+#include <stddef.h>
+
+namespace metrics {
+
+static Metric* volatile g_metrics = NULL;
+
+static const long long kHistogramBounds[Histogram::kBuckets] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+  500000, 1000000, 2500000, 10000000
+};
+
+Metric::Metric(Type type, const char* name, const char* labels,
+               const char* help)
+    : value_(0),
+      type_(type),
+      name_(name),
+      labels_(labels),
+      help_(help) {
+  do {
+    next_ = g_metrics;
+  } while (!__sync_bool_compare_and_swap(&g_metrics, next_, this));
+}
+
+Histogram::Histogram(const char* name, const char* help)
+    : Metric(HISTOGRAM, name, "", help),
+      sum_(0) {
+  for (int i = 0; i <= kBuckets; ++i) {
+    buckets_[i] = 0;
+  }
+}
+
+Histogram::Histogram(const char* name, const char* labels, const char* help)
+    : Metric(HISTOGRAM, name, labels, help),
+      sum_(0) {
+  for (int i = 0; i <= kBuckets; ++i) {
+    buckets_[i] = 0;
+  }
+}
+
+void Histogram::Observe(long long usec) {
+  int i = 0;
+  while (i < kBuckets && usec > kHistogramBounds[i]) {
+    i++;
+  }
+  __sync_add_and_fetch(&buckets_[i], 1);
+  __sync_add_and_fetch(&sum_, usec);
+  __sync_add_and_fetch(&value_, 1);
+}
+
+long long Histogram::bound(int i) {
+  return kHistogramBounds[i];
+}
+
+const Metric* FirstMetric() {
+  return g_metrics;
+}
+
+}  // namespace metrics
@@ -0,0 +1,100 @@
+// Named values exported for monitoring.  Metrics are normally declared as
+// file level statics next to the code that updates them, register themselves
+// in a process-wide list when constructed and are never unregistered.
+// Updating a metric is a single atomic instruction and never takes a lock.
+
+#ifndef __METRICS_METRICS_H__
+#define __METRICS_METRICS_H__
+
+namespace metrics {
+
+class Metric {
+ public:
+  enum Type {
+    COUNTER,
+    GAUGE,
+    HISTOGRAM
+  };
+
+  // The name should follow the Prometheus conventions, e.g.
+  // "mobilefs_read_bytes_total".  labels is either empty or a comma separated
+  // list of label pairs, e.g. "op=\"read\"".
+  Metric(Type type, const char* name, const char* labels, const char* help);
+
+  Type type() const { return type_; }
+  const char* name() const { return name_; }
+  const char* labels() const { return labels_; }
+  const char* help() const { return help_; }
+  // The count of observations for a histogram
+  long long value() const { return value_; }
+
+  // The next registered metric, or NULL
+  const Metric* next() const { return next_; }
+
+ protected:
+  volatile long long value_;
+
+ private:
+  Type type_;
+  const char* name_;
+  const char* labels_;
+  const char* help_;
+  Metric* next_;
+};
+
+// A value that only increases, such as a number of requests or bytes.
+class Counter : public Metric {
+ public:
+  Counter(const char* name, const char* help)
+      : Metric(COUNTER, name, "", help) { }
+  Counter(const char* name, const char* labels, const char* help)
+      : Metric(COUNTER, name, labels, help) { }
+
+  void Increment() { __sync_add_and_fetch(&value_, 1); }
+  void IncrementBy(long long n) { __sync_add_and_fetch(&value_, n); }
+};
+
+// A value that may go up and down, such as a queue depth or a size.
+class Gauge : public Metric {
+ public:
+  Gauge(const char* name, const char* help)
+      : Metric(GAUGE, name, "", help) { }
+  Gauge(const char* name, const char* labels, const char* help)
+      : Metric(GAUGE, name, labels, help) { }
+
+  void Set(long long value) { value_ = value; }
+  void Add(long long n) { __sync_add_and_fetch(&value_, n); }
+};
+
+// A distribution of durations, such as the latency of a call, counted in
+// fixed buckets between 100us and 10s.  Exported in seconds, as Prometheus
+// expects, so the name should end in "_seconds".
+class Histogram : public Metric {
+ public:
+  static const int kBuckets = 15;
+
+  Histogram(const char* name, const char* help);
+  Histogram(const char* name, const char* labels, const char* help);
+
+  void Observe(long long usec);
+
+  // The upper bound of bucket i in microseconds
+  static long long bound(int i);
+  // Observations in bucket i alone, with bucket kBuckets holding those above
+  // the last bound
+  long long bucket(int i) const { return buckets_[i]; }
+  // Sum of the observations in microseconds
+  long long sum() const { return sum_; }
+
+ private:
+  volatile long long buckets_[kBuckets + 1];
+  volatile long long sum_;
+};
+
+// Returns the first registered metric.  The list may be walked with
+// Metric::next() from any thread.
+const Metric* FirstMetric();
+
+}  // namespace metrics
+
+#endif  // __METRICS_METRICS_H__
@@ -0,0 +1,335 @@
+#include "metrics/metrics_fs_service.h"
+
+#include <sys/time.h>
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace metrics {
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// The metrics of one method, labelled with its name
+struct OpMetrics {
+  explicit OpMetrics(const char* labels)
+      : calls("fs_calls_total", labels, "Calls by method"),
+        errors("fs_errors_total", labels, "Failed calls by method"),
+        duration("fs_call_duration_seconds", labels,
+                 "Duration of calls by method") { }
+
+  void Record(RpcController* rpc, long long start) {
+    calls.Increment();
+    if (rpc->Failed()) {
+      errors.Increment();
+    }
+    duration.Observe(NowMicros() - start);
+  }
+
+  Counter calls;
+  Counter errors;
+  Histogram duration;
+};
+
+static OpMetrics g_getattr("op=\"GetAttr\"");
+static OpMetrics g_readlink("op=\"ReadLink\"");
+static OpMetrics g_symlink("op=\"SymLink\"");
+static OpMetrics g_readdir("op=\"ReadDir\"");
+static OpMetrics g_open("op=\"Open\"");
+static OpMetrics g_create("op=\"Create\"");
+static OpMetrics g_release("op=\"Release\"");
+static OpMetrics g_read("op=\"Read\"");
+static OpMetrics g_readv("op=\"ReadV\"");
+static OpMetrics g_write("op=\"Write\"");
+static OpMetrics g_copyrange("op=\"CopyRange\"");
+static OpMetrics g_truncate("op=\"Truncate\"");
+static OpMetrics g_ftruncate("op=\"FTruncate\"");
+static OpMetrics g_fgetattr("op=\"FGetAttr\"");
+static OpMetrics g_unlink("op=\"Unlink\"");
+static OpMetrics g_removetree("op=\"RemoveTree\"");
+static OpMetrics g_rename("op=\"Rename\"");
+static OpMetrics g_mkdir("op=\"MkDir\"");
+static OpMetrics g_statfs("op=\"StatFs\"");
+static OpMetrics g_getxattr("op=\"GetXAttr\"");
+static OpMetrics g_setxattr("op=\"SetXAttr\"");
+static OpMetrics g_listxattr("op=\"ListXAttr\"");
+static OpMetrics g_removexattr("op=\"RemoveXAttr\"");
+
+static Counter g_read_bytes(
+    "fs_read_bytes_total", "Bytes returned by Read and ReadV");
+static Counter g_write_bytes(
+    "fs_write_bytes_total", "Bytes accepted by Write");
+static Counter g_copy_bytes(
+    "fs_copy_bytes_total", "Bytes copied by CopyRange");
+
+class MetricsService : public proto::FsService {
+ public:
+  explicit MetricsService(proto::FsService* service) : service_(service) {
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~MetricsService() {
+    delete null_callback_;
+    delete service_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    long long start = NowMicros();
+    service_->GetAttr(rpc, request, response, null_callback_);
+    g_getattr.Record(rpc, start);
+    done->Run();
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    long long start = NowMicros();
+    service_->ReadLink(rpc, request, response, null_callback_);
+    g_readlink.Record(rpc, start);
+    done->Run();
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    long long start = NowMicros();
+    service_->SymLink(rpc, request, response, null_callback_);
+    g_symlink.Record(rpc, start);
+    done->Run();
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    long long start = NowMicros();
+    service_->ReadDir(rpc, request, response, null_callback_);
+    g_readdir.Record(rpc, start);
+    done->Run();
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    long long start = NowMicros();
+    service_->Open(rpc, request, response, null_callback_);
+    g_open.Record(rpc, start);
+    done->Run();
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    long long start = NowMicros();
+    service_->Create(rpc, request, response, null_callback_);
+    g_create.Record(rpc, start);
+    done->Run();
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    long long start = NowMicros();
+    service_->Release(rpc, request, response, null_callback_);
+    g_release.Record(rpc, start);
+    done->Run();
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    long long start = NowMicros();
+    service_->Read(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      g_read_bytes.IncrementBy(response->buffer().size());
+    }
+    g_read.Record(rpc, start);
+    done->Run();
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    long long start = NowMicros();
+    service_->ReadV(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      for (int i = 0; i < response->buffer_size(); ++i) {
+        g_read_bytes.IncrementBy(response->buffer(i).size());
+      }
+    }
+    g_readv.Record(rpc, start);
+    done->Run();
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    long long start = NowMicros();
+    service_->Write(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      g_write_bytes.IncrementBy(response->size());
+    }
+    g_write.Record(rpc, start);
+    done->Run();
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    long long start = NowMicros();
+    service_->CopyRange(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      g_copy_bytes.IncrementBy(response->size());
+    }
+    g_copyrange.Record(rpc, start);
+    done->Run();
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    long long start = NowMicros();
+    service_->Truncate(rpc, request, response, null_callback_);
+    g_truncate.Record(rpc, start);
+    done->Run();
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    long long start = NowMicros();
+    service_->FTruncate(rpc, request, response, null_callback_);
+    g_ftruncate.Record(rpc, start);
+    done->Run();
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    long long start = NowMicros();
+    service_->FGetAttr(rpc, request, response, null_callback_);
+    g_fgetattr.Record(rpc, start);
+    done->Run();
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    long long start = NowMicros();
+    service_->Unlink(rpc, request, response, null_callback_);
+    g_unlink.Record(rpc, start);
+    done->Run();
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    long long start = NowMicros();
+    service_->RemoveTree(rpc, request, response, null_callback_);
+    g_removetree.Record(rpc, start);
+    done->Run();
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    long long start = NowMicros();
+    service_->Rename(rpc, request, response, null_callback_);
+    g_rename.Record(rpc, start);
+    done->Run();
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    long long start = NowMicros();
+    service_->MkDir(rpc, request, response, null_callback_);
+    g_mkdir.Record(rpc, start);
+    done->Run();
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    long long start = NowMicros();
+    service_->StatFs(rpc, request, response, null_callback_);
+    g_statfs.Record(rpc, start);
+    done->Run();
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    long long start = NowMicros();
+    service_->GetXAttr(rpc, request, response, null_callback_);
+    g_getxattr.Record(rpc, start);
+    done->Run();
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    long long start = NowMicros();
+    service_->SetXAttr(rpc, request, response, null_callback_);
+    g_setxattr.Record(rpc, start);
+    done->Run();
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    long long start = NowMicros();
+    service_->ListXAttr(rpc, request, response, null_callback_);
+    g_listxattr.Record(rpc, start);
+    done->Run();
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    long long start = NowMicros();
+    service_->RemoveXAttr(rpc, request, response, null_callback_);
+    g_removexattr.Record(rpc, start);
+    done->Run();
+  }
+
+ private:
+  proto::FsService* service_;
+  Closure* null_callback_;
+};
+
+proto::FsService* NewMetricsFsService(proto::FsService* service) {
+  return new MetricsService(service);
+}
+
+}  // namespace metrics
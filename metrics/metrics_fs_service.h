@@ -0,0 +1,20 @@
+// An FsService that counts the calls made to another, the calls that failed,
+// the bytes moved by Read, Write and CopyRange, and how long the calls took,
+// for each method.  Placed in front of the other services, it measures the
+// calls as the kernel sees them.
+
+#ifndef __METRICS_METRICS_FS_SERVICE_H__
+#define __METRICS_METRICS_FS_SERVICE_H__
+
+namespace proto {
+class FsService;
+}
+
+namespace metrics {
+
+// Takes ownership of service
+proto::FsService* NewMetricsFsService(proto::FsService* service);
+
+}  // namespace metrics
+
+#endif  // __METRICS_METRICS_FS_SERVICE_H__
@@ -0,0 +1,228 @@
+#include "metrics/metrics_server.h"
+
+#include <errno.h>
+#include <map>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <vector>
+#include "metrics/metrics.h"
+
+namespace metrics {
+
+// How long a client has to send its request before it is sent plain text
+static const int kRequestTimeoutMsec = 100;
+
+#ifdef MSG_NOSIGNAL
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+static const char* TypeName(Metric::Type type) {
+  switch (type) {
+    case Metric::COUNTER:
+      return "counter";
+    case Metric::GAUGE:
+      return "gauge";
+    case Metric::HISTOGRAM:
+      return "histogram";
+  }
+  return "untyped";
+}
+
+// Appends name{labels,extra} with the braces left out when both are empty
+static void AppendSeries(const char* name, const char* suffix,
+                         const char* labels, const std::string& extra,
+                         std::string* output) {
+  output->append(name);
+  output->append(suffix);
+  if (*labels != '\0' || !extra.empty()) {
+    output->append("{");
+    output->append(labels);
+    if (*labels != '\0' && !extra.empty()) {
+      output->append(",");
+    }
+    output->append(extra);
+    output->append("}");
+  }
+}
+
+static void AppendValue(long long value, std::string* output) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), " %lld\n", value);
+  output->append(buffer);
+}
+
+static void AppendHistogram(const Histogram* histogram, std::string* output) {
+  char le[32];
+  long long count = 0;
+  for (int i = 0; i <= Histogram::kBuckets; ++i) {
+    count += histogram->bucket(i);
+    if (i < Histogram::kBuckets) {
+      snprintf(le, sizeof(le), "le=\"%g\"", Histogram::bound(i) / 1000000.0);
+    } else {
+      snprintf(le, sizeof(le), "le=\"+Inf\"");
+    }
+    AppendSeries(histogram->name(), "_bucket", histogram->labels(), le,
+                 output);
+    AppendValue(count, output);
+  }
+  AppendSeries(histogram->name(), "_sum", histogram->labels(), "", output);
+  char sum[32];
+  snprintf(sum, sizeof(sum), " %.6f\n", histogram->sum() / 1000000.0);
+  output->append(sum);
+  // Buckets may be updated while they are read, so the count is the total of
+  // the buckets rather than the count of observations.
+  AppendSeries(histogram->name(), "_count", histogram->labels(), "", output);
+  AppendValue(count, output);
+}
+
+void WriteText(std::string* output) {
+  // Metrics are listed newest first, and the series of one name may be
+  // registered from several files, but must be written together.
+  std::vector<const Metric*> all;
+  for (const Metric* metric = FirstMetric(); metric != NULL;
+       metric = metric->next()) {
+    all.push_back(metric);
+  }
+  std::vector<std::string> names;
+  std::map<std::string, std::vector<const Metric*> > families;
+  for (std::vector<const Metric*>::reverse_iterator it = all.rbegin();
+       it != all.rend(); ++it) {
+    std::vector<const Metric*>* family = &families[(*it)->name()];
+    if (family->empty()) {
+      names.push_back((*it)->name());
+    }
+    family->push_back(*it);
+  }
+  for (size_t i = 0; i < names.size(); ++i) {
+    const std::vector<const Metric*>& family = families[names[i]];
+    const Metric* first = family[0];
+    output->append("# HELP ");
+    output->append(first->name());
+    output->append(" ");
+    output->append(first->help());
+    output->append("\n# TYPE ");
+    output->append(first->name());
+    output->append(" ");
+    output->append(TypeName(first->type()));
+    output->append("\n");
+    for (size_t j = 0; j < family.size(); ++j) {
+      if (family[j]->type() == Metric::HISTOGRAM) {
+        AppendHistogram(static_cast<const Histogram*>(family[j]), output);
+      } else {
+        AppendSeries(family[j]->name(), "", family[j]->labels(), "", output);
+        AppendValue(family[j]->value(), output);
+      }
+    }
+  }
+}
+
+static bool SendAll(int fd, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, kSendFlags);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+static void Answer(int fd) {
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  // Clients that say nothing get the text alone
+  char request[1024];
+  ssize_t n = 0;
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, kRequestTimeoutMsec) == 1) {
+    n = recv(fd, request, sizeof(request), 0);
+  }
+  std::string body;
+  WriteText(&body);
+  std::string response;
+  if (n >= 4 && memcmp(request, "GET ", 4) == 0) {
+    char header[160];
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n"
+             "\r\n", body.size());
+    response = header;
+  }
+  response.append(body);
+  if (!SendAll(fd, response)) {
+    syslog(LOG_DEBUG, "Unable to send metrics: %m");
+  }
+}
+
+static void* ServerThread(void* arg) {
+  int server = *static_cast<int*>(arg);
+  delete static_cast<int*>(arg);
+  while (true) {
+    int fd = accept(server, NULL, NULL);
+    if (fd == -1) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        syslog(LOG_ERR, "accept() failed: %m");
+        break;
+      }
+      continue;
+    }
+    Answer(fd);
+    close(fd);
+  }
+  close(server);
+  return NULL;
+}
+
+bool Serve(const std::string& path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  if (path.size() >= sizeof(address.sun_path)) {
+    syslog(LOG_ERR, "Metrics socket path too long: %s", path.c_str());
+    return false;
+  }
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server == -1) {
+    syslog(LOG_ERR, "socket() failed: %m");
+    return false;
+  }
+  unlink(path.c_str());
+  if (bind(server, reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(server, 8) != 0) {
+    syslog(LOG_ERR, "Unable to listen on %s: %m", path.c_str());
+    close(server);
+    return false;
+  }
+  pthread_t thread;
+  int* arg = new int(server);
+  if (pthread_create(&thread, NULL, &ServerThread, arg) != 0) {
+    syslog(LOG_ERR, "pthread_create() failed: %m");
+    delete arg;
+    close(server);
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+}  // namespace metrics
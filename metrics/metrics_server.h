@@ -0,0 +1,27 @@
+// Serves the registered metrics in the Prometheus text format on a Unix
+// domain socket, from a thread of its own.  A client that sends an HTTP
+// request gets an HTTP response, so the socket can be scraped directly, e.g.
+//
+//   curl --unix-socket /tmp/iphonedisk.sock http://localhost/metrics
+//
+// while any other client is simply sent the text and disconnected.  Reading
+// the metrics never takes a lock, so scrapes do not slow down requests.
+
+#ifndef __METRICS_METRICS_SERVER_H__
+#define __METRICS_METRICS_SERVER_H__
+
+#include <string>
+
+namespace metrics {
+
+// Appends every registered metric to output in the Prometheus text format.
+void WriteText(std::string* output);
+
+// Listens on a Unix domain socket at path, replacing any file already there,
+// and starts the thread that answers connections to it.  Returns false if the
+// socket or the thread could not be created.
+bool Serve(const std::string& path);
+
+}  // namespace metrics
+
+#endif  // __METRICS_METRICS_SERVER_H__
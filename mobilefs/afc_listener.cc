@@ -7,17 +7,43 @@
 
 #include <string>
 #include <syslog.h>
+#include "metrics/metrics.h"
 
 namespace mobilefs {
 
+static metrics::Counter g_connects(
+    "mobilefs_device_connects_total", "Devices connected");
+static metrics::Counter g_disconnects(
+    "mobilefs_device_disconnects_total", "Devices disconnected");
+static metrics::Gauge g_connections(
+    "mobilefs_connections", "AFC connections open to the device");
+
 static void notify_callback(am_device_notification_callback_info *info,
                             void* arg) {
   AfcListener* listener = static_cast<AfcListener*>(arg);
   listener->DeviceCallback(info);
 }
 
-AfcListener::AfcListener(const std::string& afc_service_name)
+// Returns the unique identifier (UDID) of the device, or an empty string if it
+// is not available.
+static std::string GetDeviceId(am_device* device) {
+  std::string device_id;
+  CFStringRef identifier = AMDeviceCopyDeviceIdentifier(device);
+  if (identifier != NULL) {
+    char buffer[128];
+    if (CFStringGetCString(identifier, buffer, sizeof(buffer),
+                           kCFStringEncodingUTF8)) {
+      device_id = buffer;
+    }
+    CFRelease(identifier);
+  }
+  return device_id;
+}
+
+AfcListener::AfcListener(const std::string& afc_service_name,
+                         int connections)
     : notification_(NULL),
+      connections_(connections),
       connection_(NULL),
       user_callback_(NULL),
       user_data_(NULL) {
@@ -28,9 +54,7 @@ AfcListener::AfcListener(const std::string& afc_service_name)
 AfcListener::~AfcListener() {
   if (notification_ != NULL) {
     AMDeviceNotificationUnsubscribe(notification_);
-    if (connection_ != NULL) {
-      AFCConnectionClose(connection_);
-    }
+    CloseConnections();
   }
   CFRelease(afc_service_name_);
 }
@@ -54,21 +78,32 @@ void AfcListener::DeviceCallback(am_device_notification_callback_info* info) {
     return;
   }
   if (info->msg == ADNCI_MSG_CONNECTED) {
+    g_connects.Increment();
     struct am_device* device = info->dev;
-    if (!InitializeDevice(device) || !OpenConnection(device)) {
+    if (!InitializeDevice(device) || !OpenConnection(device, &connection_)) {
       connection_ = NULL;
-    }
-  } else {
-    if (connection_ != NULL) {
-      int ret = AFCConnectionClose(connection_);
-      if (ret != MDERR_OK) {
-        syslog(LOG_ERR, "AFCConnectionClose failed");
+    } else {
+      device_id_ = GetDeviceId(device);
+      // Additional connections only speed up transfers, so the device is
+      // usable with however many of them could be opened.
+      for (int i = 1; i < connections_; ++i) {
+        afc_connection* helper;
+        if (!OpenConnection(device, &helper)) {
+          break;
+        }
+        helpers_.push_back(helper);
       }
-      connection_ = NULL;
     }
+  } else {
+    g_disconnects.Increment();
+    CloseConnections();
+    device_id_.clear();
   }
+  g_connections.Set((connection_ != NULL ? 1 : 0) + helpers_.size());
   struct NotifyStatus status;
   status.connection = connection_;
+  status.helpers = helpers_;
+  status.device_id = device_id_;
   (*user_callback_)(&status, user_data_);
 }
 
@@ -95,14 +130,15 @@ bool AfcListener::InitializeDevice(am_device* device) {
   return true;
 }
 
-bool AfcListener::OpenConnection(am_device* device) {
+bool AfcListener::OpenConnection(am_device* device,
+                                 afc_connection** connection) {
   int socket;
   int ret = AMDeviceStartService(device, afc_service_name_, &socket);
   if (ret != MDERR_OK) {
     syslog(LOG_ERR, "AMDeviceStartService failed");
     return false;
   }
-  ret = AFCConnectionOpen(socket, 0, &connection_);
+  ret = AFCConnectionOpen(socket, 0, connection);
   if (ret != MDERR_OK) {
     syslog(LOG_ERR, "AFCConnectionOpen failed");
     return false;
@@ -111,5 +147,19 @@ bool AfcListener::OpenConnection(am_device* device) {
   return true;
 }
 
+void AfcListener::CloseConnections() {
+  for (size_t i = 0; i < helpers_.size(); ++i) {
+    AFCConnectionClose(helpers_[i]);
+  }
+  helpers_.clear();
+  if (connection_ != NULL) {
+    int ret = AFCConnectionClose(connection_);
+    if (ret != MDERR_OK) {
+      syslog(LOG_ERR, "AFCConnectionClose failed");
+    }
+    connection_ = NULL;
+  }
+}
+
 
 }  // namespace mobilefs
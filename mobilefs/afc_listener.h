@@ -8,14 +8,19 @@
 #define __MOBILEFS_AFC_LISTENER_H__
 
 #include <string>
+#include <vector>
 #include "mobilefs/mobiledevice.h"
 
 namespace mobilefs {
 
 // Information about the AFC connection, passed to the NotifyCallback.  The
 // connection is non-NULL when the device is connected and NULL otherwise.
+// The device_id is the UDID of the connected device, if known.  The helpers
+// are any additional connections to the same service that could be opened.
 struct NotifyStatus {
   afc_connection* connection;
+  std::vector<afc_connection*> helpers;
+  std::string device_id;
 };
 
 typedef void (*NotifyCallback)(NotifyStatus* status, void* user_data);
@@ -24,8 +29,9 @@ class AfcListener {
  public:
   // The name of the AFC service on the device.  Typically this is
   // "com.apple.afc", but might be different if the device is jailbroken running
-  // a custom or additional AFC service.
-  AfcListener(const std::string& afc_service_name);
+  // a custom or additional AFC service.  Up to connections connections are
+  // opened to the service on each device, the first of them being required.
+  AfcListener(const std::string& afc_service_name, int connections = 1);
   ~AfcListener();
 
   // Registers a device listener
@@ -36,11 +42,15 @@ class AfcListener {
 
  private:
   static bool InitializeDevice(am_device* device);
-  bool OpenConnection(am_device* device);
+  bool OpenConnection(am_device* device, afc_connection** connection);
+  void CloseConnections();
 
   CFStringRef afc_service_name_;
   am_device_notification* notification_;
+  int connections_;
   afc_connection* connection_;
+  std::vector<afc_connection*> helpers_;
+  std::string device_id_;
   NotifyCallback user_callback_;
   void* user_data_;
 };
@@ -0,0 +1,115 @@
+// Archives a directory of the first device to connect into a tar file, or
+// syncs it into a host directory, without going through a mount, e.g.
+//
+//   mobile_backup com.apple.afc /DCIM /backups/dcim.tar
+//   mobile_backup com.apple.afc /DCIM /backups/dcim /backups/manifests
+//
+// Listing, reading and writing the archive overlap (see backup/backup.h), and
+// large files are striped across IPHONEDISK_CONNECTIONS connections as they
+// are by mobile_fs_util.  Given a manifest directory, a manifest for each
+// device, directory and destination is kept there (see backup::ManifestName)
+// and only the files that changed since the last run are read.  Later runs
+// into a tar file write the changes to dcim.tar.1, dcim.tar.2 and so on.
+// IPHONEDISK_MANIFEST_HASH=1 records a hash of the contents of each file read
+// in the manifest.
+
+#include <stdlib.h>
+#include <string>
+#include <syslog.h>
+#include <vector>
+#include "backup/backup.h"
+#include "mobilefs/afc_listener.h"
+#include "mobilefs/mobile_fs_service.h"
+#include "proto/fs_service.pb.h"
+#include "scheduler/scheduling_fs_service.h"
+#include "stripe/striping_fs_service.h"
+
+struct BackupArgs {
+  std::string root;
+  std::string destination;
+  std::string manifest_directory;
+  bool hash;
+  bool success;
+};
+
+static void notify_callback(mobilefs::NotifyStatus* status, void* arg) {
+  struct BackupArgs* args = static_cast<struct BackupArgs*>(arg);
+  if (status->connection == NULL) {
+    return;
+  }
+  syslog(LOG_INFO, "Device connected");
+  // Walkers and readers share the connection, as fuse threads do
+  proto::FsService* service = scheduler::NewSchedulingFsService(
+      mobilefs::NewMobileFsService(status->connection,
+                                   mobilefs::MobileFsOptions()),
+      scheduler::SchedulerOptions());
+  if (!status->helpers.empty()) {
+    std::vector<proto::FsService*> helpers;
+    // Helpers never see the calls that make a reused handle stale
+    mobilefs::MobileFsOptions helper_options;
+    helper_options.reuse_handles = false;
+    for (size_t i = 0; i < status->helpers.size(); ++i) {
+      helpers.push_back(mobilefs::NewMobileFsService(status->helpers[i],
+                                                     helper_options));
+    }
+    service = stripe::NewStripingFsService(service, helpers,
+                                           stripe::StripingOptions());
+  }
+  std::string manifest_file;
+  if (!args->manifest_directory.empty()) {
+    if (status->device_id.empty()) {
+      syslog(LOG_ERR, "Device has no identifier for its manifest");
+      delete service;
+      CFRunLoopStop(CFRunLoopGetCurrent());
+      return;
+    }
+    manifest_file = args->manifest_directory + "/" +
+                    backup::ManifestName(status->device_id, args->root,
+                                         args->destination);
+  }
+  backup::BackupOptions options;
+  options.hash = args->hash;
+  args->success = backup::BackupTo(service, args->root, args->destination,
+                                   manifest_file, options);
+  delete service;
+  CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+int main(int argc, char* argv[]) {
+  openlog("mobile_backup", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_INFO));
+  if (argc != 4 && argc != 5) {
+    syslog(LOG_ERR, "Usage: %s <afc service> <device directory> "
+           "<archive or directory> [manifest directory]", argv[0]);
+    return 1;
+  }
+  struct BackupArgs args;
+  args.root = argv[2];
+  args.destination = argv[3];
+  if (argc == 5) {
+    args.manifest_directory = argv[4];
+  }
+  const char* hash = getenv("IPHONEDISK_MANIFEST_HASH");
+  args.hash = (hash != NULL && std::string(hash) == "1");
+  args.success = false;
+  int connections = 4;
+  const char* connections_env = getenv("IPHONEDISK_CONNECTIONS");
+  if (connections_env != NULL) {
+    connections = atoi(connections_env);
+    if (connections < 1) {
+      syslog(LOG_ERR, "Invalid IPHONEDISK_CONNECTIONS: %s", connections_env);
+      closelog();
+      return 1;
+    }
+  }
+  mobilefs::AfcListener listener(argv[1], connections);
+  if (!listener.SetNotifyCallback(&notify_callback, &args)) {
+    syslog(LOG_ERR, "Failed to initialize device listener");
+    closelog();
+    return 1;
+  }
+  syslog(LOG_INFO, "Waiting for device connection");
+  CFRunLoopRun();
+  closelog();
+  return args.success ? 0 : 1;
+}
@@ -2,13 +2,25 @@
 
 #include "mobilefs/mobile_fs_service.h"
 
+#include <algorithm>
+#include <list>
 #include <string>
+#include <map>
+#include <pthread.h>
 #include <set>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <vector>
+#include "fs/remove_tree.h"
 #include "proto/fs_service.pb.h"
+#include "memory/memory_budget.h"
+#include "metrics/metrics.h"
 #include "mobilefs/mobiledevice.h"
+#include "mobilefs/transfer_tuner.h"
+#include "trace/trace.h"
 
 namespace mobilefs {
 
@@ -16,66 +28,131 @@ using ::google::protobuf::Closure;
 using ::google::protobuf::RpcController;
 
 static const int kMaxBufferSize = 1024 * 1024;
+// Transfers start out split into chunks of this size, until the tuners have
+// measured the link.
+static const int kInitialChunkSize = 128 * 1024;
+// Smallest chunk size considered, if the device reports a smaller block size
+static const int kMinChunkSize = 4096;
+// Maximum number of partially read directory listings kept open
+static const size_t kMaxDirCursors = 16;
+// Rough amount of memory held by the AFC library for an open listing
+static const long long kDirCursorCost = 16 * 1024;
+// Maximum number of released read-only handles kept open for reuse
+static const size_t kMaxIdleHandles = 8;
+// How long a released handle is kept open in case its file is opened again.
+// A file replaced on the device by other means may be read through an old
+// handle for this long.
+static const long long kIdleHandleUsec = 2 * 1000000LL;
+// Rough amount of memory held by the AFC library for an open file
+static const long long kIdleHandleCost = 4 * 1024;
+// A file found by GetAttr within this long is opened for reading without
+// asking the device.  The kernel looks a file up just before opening it.
+static const long long kRecentStatUsec = 1000000LL;
+// Maximum number of files remembered as recently found
+static const size_t kMaxRecentStats = 64;
+
+static metrics::Gauge g_read_chunk_size(
+    "mobilefs_read_chunk_bytes", "Size of individual AFC reads");
+static metrics::Gauge g_read_rate(
+    "mobilefs_read_chunk_bytes_per_second",
+    "Measured throughput of AFC reads of the current chunk size");
+static metrics::Gauge g_read_latency(
+    "mobilefs_read_chunk_latency_usec",
+    "Measured latency of AFC reads of the current chunk size");
+static metrics::Gauge g_write_chunk_size(
+    "mobilefs_write_chunk_bytes", "Size of individual AFC writes");
+static metrics::Gauge g_write_rate(
+    "mobilefs_write_chunk_bytes_per_second",
+    "Measured throughput of AFC writes of the current chunk size");
+static metrics::Gauge g_write_latency(
+    "mobilefs_write_chunk_latency_usec",
+    "Measured latency of AFC writes of the current chunk size");
+static metrics::Counter g_handle_reuses(
+    "mobilefs_handle_reuses_total",
+    "Opens that reused a handle kept open after an earlier release");
+static metrics::Counter g_deferred_opens(
+    "mobilefs_deferred_opens_total",
+    "Opens answered without opening the file on the device");
+static metrics::Counter g_skipped_opens(
+    "mobilefs_skipped_opens_total",
+    "Deferred opens released without any reads");
+
+// Holds a mutex for the lifetime of the object
+class MutexLock {
+ public:
+  explicit MutexLock(pthread_mutex_t* mutex) : mutex_(mutex) {
+    pthread_mutex_lock(mutex_);
+  }
+
+  ~MutexLock() {
+    pthread_mutex_unlock(mutex_);
+  }
+
+ private:
+  pthread_mutex_t* mutex_;
+};
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Returns true if path is directory or beneath it
+static bool IsAtOrBeneath(const std::string& path,
+                          const std::string& directory) {
+  return (path.compare(0, directory.size(), directory) == 0 &&
+          (path.size() == directory.size() || path[directory.size()] == '/' ||
+           directory == "/"));
+}
+
+// Returns the smallest chunk size worth using on the connection
+static int MinChunkSize(afc_connection* conn) {
+  int fs_block_size = AFCConnectionGetFSBlockSize(conn);
+  syslog(LOG_DEBUG, "AFC block size: fs=%d socket=%d", fs_block_size,
+         AFCConnectionGetSocketBlockSize(conn));
+  return std::max(fs_block_size, kMinChunkSize);
+}
 
 class MobileFsService : public proto::FsService {
  public:
-  MobileFsService(afc_connection* conn) : conn_(conn) { }
+  MobileFsService(afc_connection* conn, const MobileFsOptions& options)
+      : conn_(conn), options_(options),
+        min_chunk_size_(MinChunkSize(conn)),
+        read_tuner_(min_chunk_size_, kMaxBufferSize, kInitialChunkSize,
+                    &g_read_chunk_size, &g_read_rate, &g_read_latency),
+        write_tuner_(min_chunk_size_, kMaxBufferSize, kInitialChunkSize,
+                     &g_write_chunk_size, &g_write_rate, &g_write_latency),
+        next_filehandle_(1),
+        copy_buffer_(NULL),
+        cursor_memory_("mobilefs_dir_cursors", &EvictDirCursors, this),
+        handle_memory_("mobilefs_idle_handles", &EvictIdleHandles, this),
+        buffer_memory_("mobilefs_read_buffers", NULL, NULL),
+        copy_memory_("mobilefs_copy_buffer", NULL, NULL) {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+
+  virtual ~MobileFsService() {
+    while (!idle_handles_.empty()) {
+      CloseIdleHandle(idle_handles_.begin());
+    }
+    if (copy_buffer_ != NULL) {
+      free(copy_buffer_);
+      copy_memory_.Release(kMaxBufferSize);
+    }
+    pthread_mutex_destroy(&mutex_);
+  }
 
   void GetAttr(RpcController* rpc,
                const proto::GetAttrRequest* request,
                proto::GetAttrResponse* response,
                Closure* done) {
-    struct afc_dictionary *info;
-    if (AFCFileInfoOpen(conn_, (char*)request->path().c_str(),
-                        &info) != MDERR_OK) {
-      rpc->SetFailed("AFCFileInfoOpen failed");
-    } else {
-      std::map<std::string, std::string> info_map;
-      CreateMap(info, &info_map);
-      AFCKeyValueClose(info);
-      if (!info_map.count("st_size") ||
-          !info_map.count("st_ifmt") ||
-          !info_map.count("st_blocks")) {
-        rpc->SetFailed("AFCFileInfoOpen: Mising keys");
-      } else {
-        proto::Stat* stat = response->mutable_stat();
-        stat->set_size(atol(info_map["st_size"].c_str()));
-        stat->set_blocks(atol(info_map["st_blocks"].c_str()));
-        if (info_map.count("st_nlink")) {
-          stat->set_nlink(atol(info_map["st_nlink"].c_str()));
-        }
-        if (info_map.count("st_mtime")) {
-          long long mtime = atoll(info_map["st_mtime"].c_str());
-          stat->mutable_mtime()->set_tv_sec(mtime / 1000000000L);
-          stat->mutable_mtime()->set_tv_nsec(0);
-        }
-        if (info_map["st_ifmt"] == "S_IFDIR") {
-          stat->set_mode(S_IFDIR);
-        } else if (info_map["st_ifmt"] == "S_IFLNK") {
-          stat->set_mode(S_IFLNK);
-        } else if (info_map["st_ifmt"] == "S_IFREG") {
-          stat->set_mode(S_IFREG);
-        } else if (info_map["st_ifmt"] == "S_IFSOCK") {
-          stat->set_mode(S_IFSOCK);
-        } else if (info_map["st_ifmt"] == "S_IFCHR") {
-          stat->set_mode(S_IFCHR);
-        } else if (info_map["st_ifmt"] == "S_IFBLK") {
-          stat->set_mode(S_IFBLK);
-        } else if (info_map["st_ifmt"] == "S_IFIFO") {
-          stat->set_mode(S_IFIFO);
-        } else if (info_map["st_ifmt"] == "S_IFSOCK") {
-          stat->set_mode(S_IFSOCK);
-        } else {
-          rpc->SetFailed("AFCFileInfoOpen: Unknown s_ifmt value");
-        }
-        if (S_ISDIR(stat->mode())) {
-          stat->set_mode(stat->mode() | 0755);
-        } else if (S_ISLNK(stat->mode())) {
-          stat->set_mode(stat->mode() | 0777);
-        } else {
-          stat->set_mode(stat->mode() | 0644);
-        }
-      }
+    trace::Span span("mobilefs", "GetAttr");
+    MutexLock lock(&mutex_);
+    span.set_path(request->path());
+    if (StatPath(rpc, request->path(), response->mutable_stat()) &&
+        S_ISREG(response->stat().mode())) {
+      RecordStat(request->path());
     }
     done->Run();
   }
@@ -84,9 +161,14 @@ class MobileFsService : public proto::FsService {
                 const proto::ReadLinkRequest* request,
                 proto::ReadLinkResponse* response,
                 Closure* done) {
+    trace::Span span("mobilefs", "ReadLink");
+    MutexLock lock(&mutex_);
+    span.set_path(request->path());
     struct afc_dictionary *info;
-    if (AFCFileInfoOpen(conn_, (char*)request->path().c_str(),
-                        &info) != MDERR_OK) {
+    trace::Span afc_span("afc", "AFCFileInfoOpen");
+    int ret = AFCFileInfoOpen(conn_, (char*)request->path().c_str(), &info);
+    afc_span.End();
+    if (ret != MDERR_OK) {
       rpc->SetFailed("AFCFileInfoOpen failed");
     } else {
       std::map<std::string, std::string> info_map;
@@ -105,37 +187,87 @@ class MobileFsService : public proto::FsService {
                const proto::SymLinkRequest* request,
                proto::SymLinkResponse* response,
                Closure* done) {
+    trace::Span span("mobilefs", "SymLink");
+    MutexLock lock(&mutex_);
+    span.set_path(request->source());
+    trace::Span afc_span("afc", "AFCLinkPath");
     int ret = AFCLinkPath(conn_, /* soft */ 2,
                           request->source().c_str(),
 request->target().c_str());
+    afc_span.End();
     if (ret != MDERR_OK) {
       rpc->SetFailed("AFCLinkPath failed");
     }
     done->Run();
   }
 
+  // The afc_directory of a listing that has not been read to the end is kept
+  // open, so that the request for the following page continues where the
+  // previous one stopped instead of reopening the directory and skipping over
+  // the entries that were already returned.  Each open directory has its own
+  // cursor; a listing whose cursor was closed is reopened at its offset, which
+  // skips entries if some were removed in the meantime.
   void ReadDir(RpcController* rpc,
                const proto::ReadDirRequest* request,
                proto::ReadDirResponse* response,
                Closure* done) {
-    struct afc_directory* dir;
-    int ret = AFCDirectoryOpen(conn_, request->path().c_str(), &dir);
-    if (ret != MDERR_OK) {
-      rpc->SetFailed("AFCDirectoryOpen failed");
+    trace::Span span("mobilefs", "ReadDir");
+    MutexLock lock(&mutex_);
+    span.set_path(request->path());
+    span.set_offset(request->offset());
+    DirCursorKey key(request->path(), request->dirhandle());
+    DirCursor cursor;
+    DirCursorMap::iterator it = dirs_.find(key);
+    if (it != dirs_.end() && it->second.position == request->offset()) {
+      cursor = it->second;
+      dirs_.erase(it);
+      cursor_memory_.Release(kDirCursorCost);
+      cursor_memory_.RecordHit();
     } else {
+      if (it != dirs_.end()) {
+        CloseDirCursor(it);
+      }
+      trace::Span afc_span("afc", "AFCDirectoryOpen");
+      int ret = AFCDirectoryOpen(conn_, request->path().c_str(), &cursor.dir);
+      afc_span.End();
+      if (ret != MDERR_OK) {
+        rpc->SetFailed("AFCDirectoryOpen failed");
+        done->Run();
+        return;
+      }
+      cursor.position = 0;
+    }
+    bool eof = false;
+    while (!request->max_entries() ||
+           response->entry_size() < request->max_entries()) {
       char *buffer = NULL;
-      do {
-        ret = AFCDirectoryRead(conn_, dir, &buffer);
-        if (ret != MDERR_OK) {
-          response->Clear();
-          rpc->SetFailed("AFCDirectoryRead failed");
-          break;
-        }
-        if (buffer != NULL) {
-          response->add_entry()->set_filename(buffer);
-        }
-      } while (buffer != NULL);
-      AFCDirectoryClose(conn_, dir);
+      trace::Span afc_span("afc", "AFCDirectoryRead");
+      int ret = AFCDirectoryRead(conn_, cursor.dir, &buffer);
+      afc_span.End();
+      if (ret != MDERR_OK) {
+        response->Clear();
+        rpc->SetFailed("AFCDirectoryRead failed");
+        eof = true;
+        break;
+      }
+      if (buffer == NULL) {
+        eof = true;
+        break;
+      }
+      if (cursor.position >= request->offset()) {
+        response->add_entry()->set_filename(buffer);
+      }
+      cursor.position++;
+    }
+    if (eof) {
+      AFCDirectoryClose(conn_, cursor.dir);
+    } else {
+      response->set_next_offset(cursor.position);
+      if (dirs_.size() >= kMaxDirCursors) {
+        CloseDirCursor(dirs_.begin());
+      }
+      cursor_memory_.Charge(kDirCursorCost);
+      dirs_[key] = cursor;
     }
     done->Run();
   }
@@ -144,18 +276,42 @@ request->target().c_str());
               const proto::UnlinkRequest* request,
               proto::UnlinkResponse* response,
               Closure* done) {
+    trace::Span span("mobilefs", "Unlink");
+    MutexLock lock(&mutex_);
+    span.set_path(request->path());
+    ForgetHandles(request->path());
+    trace::Span afc_span("afc", "AFCRemovePath");
     int res = AFCRemovePath(conn_, request->path().c_str());
+    afc_span.End();
     if (res != MDERR_OK) {
       rpc->SetFailed("AFCRemovePath failed");
     }
     done->Run();
   }
 
+  // AFC removes one path per call, so each entry is removed with Unlink.
+  // Several connections remove a tree together through the striping service.
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    trace::Span span("mobilefs", "RemoveTree");
+    span.set_path(request->path());
+    fs::RemoveTree(std::vector<proto::FsService*>(1, this), rpc, request,
+                   response);
+    done->Run();
+  }
+
   void MkDir(RpcController* rpc,
              const proto::MkDirRequest* request,
              proto::MkDirResponse* response,
              Closure* done) {
+    trace::Span span("mobilefs", "MkDir");
+    MutexLock lock(&mutex_);
+    span.set_path(request->path());
+    trace::Span afc_span("afc", "AFCDirectoryCreate");
     int res = AFCDirectoryCreate(conn_, request->path().c_str());
+    afc_span.End();
     if (res != MDERR_OK) {
       rpc->SetFailed("AFCDirectoryCreate failed");
     }
@@ -166,27 +322,90 @@ request->target().c_str());
               const proto::RenameRequest* request,
               proto::RenameResponse* response,
               Closure* done) {
+    trace::Span span("mobilefs", "Rename");
+    MutexLock lock(&mutex_);
+    span.set_path(request->source_path());
+    ForgetHandles(request->source_path());
+    ForgetHandles(request->destination_path());
+    trace::Span afc_span("afc", "AFCRenamePath");
     int res = AFCRenamePath(conn_, request->source_path().c_str(),
                             request->destination_path().c_str());
+    afc_span.End();
     if (res != MDERR_OK) {
       rpc->SetFailed("AFCRenamePath failed");
+    } else {
+      for (OpenFileMap::iterator it = files_.begin(); it != files_.end();
+           ++it) {
+        if (it->second.path == request->source_path()) {
+          it->second.path = request->destination_path();
+        }
+      }
     }
     done->Run();
   }
 
+  // Files opened for reading reuse a handle released recently, if any, since
+  // the same file is often opened, read briefly and released again.  Every
+  // read seeks first, so the position the handle was left at does not matter.
+  //
+  // Many opens are never read from, so when GetAttr has just found the file,
+  // opening it on the device is put off until it is first read (see
+  // FileRef).  Opens for writing are never put off, since they may create or
+  // truncate the file.
   void Open(RpcController* rpc,
             const proto::OpenRequest* request,
             proto::OpenResponse* response,
             Closure* done) {
+    trace::Span span("mobilefs", "Open");
+    MutexLock lock(&mutex_);
     // O_RDONLY/O_WRONLY/O_RDWR (0/1/2) => (1/2/3)
     int mode = (request->flags() & O_ACCMODE) + 1;
-    afc_file_ref fd;
-    int ret = AFCFileRefOpen(conn_, request->path().c_str(), mode, &fd);
-    if (ret != MDERR_OK) {
-      rpc->SetFailed("AFCFileRefOpen failed");
+    span.set_path(request->path());
+    CloseExpiredHandles();
+    bool reusable = (options_.reuse_handles && mode == 1 &&
+                     !(request->flags() & O_TRUNC));
+    afc_file_ref fd = 0;
+    bool opened = true;
+    if (reusable && TakeIdleHandle(request->path(), &fd)) {
+      g_handle_reuses.Increment();
+      handle_memory_.RecordHit();
+    } else if (reusable && IsRecentlyStatted(request->path())) {
+      g_deferred_opens.Increment();
+      opened = false;
     } else {
-      response->set_filehandle(fd);
+      trace::Span afc_span("afc", "AFCFileRefOpen");
+      int ret = AFCFileRefOpen(conn_, request->path().c_str(), mode, &fd);
+      afc_span.End();
+      if (ret != MDERR_OK) {
+        rpc->SetFailed("AFCFileRefOpen failed");
+        done->Run();
+        return;
+      }
+    }
+    // The kernel passes O_TRUNC along instead of truncating by path first
+    // (see fs_init), so the file is truncated through the new handle
+    if (request->flags() & O_TRUNC) {
+      trace::Span truncate_span("afc", "AFCFileRefSetFileSize");
+      int ret = AFCFileRefSetFileSize(conn_, fd, 0);
+      truncate_span.End();
+      if (ret != MDERR_OK) {
+        trace::Span close_span("afc", "AFCFileRefClose");
+        AFCFileRefClose(conn_, fd);
+        close_span.End();
+        rpc->SetFailed("AFCFileRefSetFileSize failed");
+        done->Run();
+        return;
+      }
+      SetLocalSize(request->path(), 0);
     }
+    long long filehandle = next_filehandle_++;
+    OpenFile* file = &files_[filehandle];
+    file->path = request->path();
+    file->mode = mode;
+    file->fd = fd;
+    file->opened = opened;
+    file->reusable = reusable;
+    response->set_filehandle(filehandle);
     done->Run();
   }
 
@@ -194,12 +413,27 @@ request->target().c_str());
               const proto::CreateRequest* request,
               proto::CreateResponse* response,
               Closure* done) {
+    trace::Span span("mobilefs", "Create");
+    MutexLock lock(&mutex_);
+    span.set_path(request->path());
+    ForgetHandles(request->path());
     afc_file_ref fd;
+    trace::Span afc_span("afc", "AFCFileRefOpen");
     int ret = AFCFileRefOpen(conn_, request->path().c_str(), 3, &fd);
+    afc_span.End();
     if (ret != MDERR_OK) {
       rpc->SetFailed("AFCFileRefOpen failed");
     } else {
-      response->set_filehandle(fd);
+      long long filehandle = next_filehandle_++;
+      OpenFile* file = &files_[filehandle];
+      file->path = request->path();
+      file->mode = 3;
+      file->fd = fd;
+      file->opened = true;
+      // The file is created or truncated, so other handles on it are now of
+      // an empty file
+      SetLocalSize(request->path(), 0);
+      response->set_filehandle(filehandle);
     }
     done->Run();
   }
@@ -208,7 +442,25 @@ request->target().c_str());
                const proto::ReleaseRequest* request,
                proto::ReleaseResponse* response,
                Closure* done) {
-    AFCFileRefClose(conn_, request->filehandle());
+    trace::Span span("mobilefs", "Release");
+    MutexLock lock(&mutex_);
+    CloseExpiredHandles();
+    OpenFileMap::iterator it = files_.find(request->filehandle());
+    if (it == files_.end()) {
+      rpc->SetFailed("Unknown filehandle");
+    } else {
+      OpenFile* file = &it->second;
+      if (!file->opened) {
+        g_skipped_opens.Increment();
+      } else if (file->reusable) {
+        KeepIdleHandle(file->path, file->fd);
+      } else {
+        trace::Span afc_span("afc", "AFCFileRefClose");
+        AFCFileRefClose(conn_, file->fd);
+        afc_span.End();
+      }
+      files_.erase(it);
+    }
     done->Run();
   }
 
@@ -216,25 +468,78 @@ request->target().c_str());
             const proto::ReadRequest* request,
             proto::ReadResponse* response,
             Closure* done) {
+    trace::Span span("mobilefs", "Read");
+    MutexLock lock(&mutex_);
+    span.set_size(request->size());
+    span.set_offset(request->offset());
     if (request->size() > kMaxBufferSize) {
       rpc->SetFailed("Read request too large");
       done->Run();
       return;
     }
-    int ret = AFCFileRefSeek(conn_, request->filehandle(), request->offset(),
-                             0);
-    if (ret != MDERR_OK) {
-      rpc->SetFailed("AFCFileRefSeek failed");
-    } else {
-      void* buf = malloc(request->size());
-      unsigned int n = request->size();
-      ret = AFCFileRefRead(conn_, request->filehandle(), buf, &n);
-      if (ret != MDERR_OK) {
-        rpc->SetFailed("AFCFileRefRead failed");
-      } else {
-        response->mutable_buffer()->assign((char*)buf, n);
+    afc_file_ref fd;
+    const char* error = FileRef(request->filehandle(), &fd);
+    if (error == NULL) {
+      error = Seek(fd, request->offset());
+    }
+    // The data is read straight into the response.  Its memory is charged
+    // by the caller that asked for the read, such as fuse (see fs_read).
+    if (error == NULL && request->size() > 0) {
+      std::string* buffer = response->mutable_buffer();
+      buffer->resize(request->size());
+      long long total = 0;
+      error = ReadChunks(rpc, fd, &(*buffer)[0], request->size(), &total);
+      buffer->resize(error == NULL ? total : 0);
+    }
+    if (error != NULL) {
+      rpc->SetFailed(error);
+    }
+    done->Run();
+  }
+
+  // AFC reads from the position of the file, so each range is a seek and a
+  // read, but the ranges are read under one lock with the file opened once,
+  // and a range that starts where the one before it ended is not sought.
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    trace::Span span("mobilefs", "ReadV");
+    MutexLock lock(&mutex_);
+    long long total = 0;
+    for (int i = 0; i < request->range_size(); ++i) {
+      total += request->range(i).size();
+    }
+    span.set_size(total);
+    if (total > kMaxBufferSize) {
+      rpc->SetFailed("Read request too large");
+      done->Run();
+      return;
+    }
+    afc_file_ref fd;
+    const char* error = FileRef(request->filehandle(), &fd);
+    // Only ReadV is charged here, since it reads ahead of any caller that
+    // accounts for the buffer
+    memory::ScopedCharge charge(&buffer_memory_, total);
+    long long position = -1;
+    for (int i = 0; error == NULL && i < request->range_size(); ++i) {
+      const proto::ReadVRequest::Range& range = request->range(i);
+      if (range.offset() != position) {
+        error = Seek(fd, range.offset());
+      }
+      std::string* buffer = response->add_buffer();
+      long long n = 0;
+      if (error == NULL && range.size() > 0) {
+        buffer->resize(range.size());
+        error = ReadChunks(rpc, fd, &(*buffer)[0], range.size(), &n);
       }
-      free(buf);
+      buffer->resize(n);
+      // The position is unknown after a short read
+      position = (n == range.size()) ? range.offset() + n : -1;
+    }
+    if (error != NULL) {
+      response->Clear();
+      rpc->SetFailed(error);
     }
     done->Run();
   }
@@ -243,19 +548,85 @@ request->target().c_str());
              const proto::WriteRequest* request,
              proto::WriteResponse* response,
              Closure* done) {
-    int ret = AFCFileRefSeek(conn_, request->filehandle(), request->offset(),
-                             0);
-    if (ret != MDERR_OK) {
-      rpc->SetFailed("AFCFileRefSeek failed");
+    trace::Span span("mobilefs", "Write");
+    MutexLock lock(&mutex_);
+    span.set_size(request->buffer().size());
+    span.set_offset(request->offset());
+    const std::string& buffer = request->buffer();
+    afc_file_ref fd;
+    const char* error = FileRef(request->filehandle(), &fd);
+    if (error == NULL) {
+      error = Seek(fd, request->offset());
+    }
+    if (error == NULL) {
+      error = WriteChunks(rpc, fd, buffer.data(), buffer.size());
+    }
+    if (error != NULL) {
+      rpc->SetFailed(error);
     } else {
-      ret = AFCFileRefWrite(conn_, request->filehandle(),
-                            request->buffer().data(), request->buffer().size());
-      if (ret != MDERR_OK) {
-        rpc->SetFailed("AFCFileWrite failed");
-      } else {
-        // Always writes the entire buffer
-        response->set_size(request->buffer().size());
+      // Always writes the entire buffer
+      response->set_size(buffer.size());
+      Extend(request->filehandle(), request->offset() + buffer.size());
+    }
+    done->Run();
+  }
+
+  // AFC has no copy of its own, so the range is read into a buffer kept for
+  // copies and written back from there, without the data leaving this
+  // process.  Calls on the connection are synchronous, so the reads and
+  // writes take turns.  Only the libfuse 3 frontend makes this call; macFUSE
+  // has no copy_file_range, so copies in a mount on a Mac still go through
+  // the kernel as reads and writes.
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    trace::Span span("mobilefs", "CopyRange");
+    MutexLock lock(&mutex_);
+    span.set_size(request->size());
+    span.set_offset(request->source_offset());
+    if (copy_buffer_ == NULL) {
+      copy_buffer_ = static_cast<char*>(malloc(kMaxBufferSize));
+      if (copy_buffer_ == NULL) {
+        rpc->SetFailed("Out of memory");
+        done->Run();
+        return;
       }
+      copy_memory_.Charge(kMaxBufferSize);
+    }
+    afc_file_ref source_fd, destination_fd;
+    const char* error = FileRef(request->source_filehandle(), &source_fd);
+    if (error == NULL) {
+      error = FileRef(request->destination_filehandle(), &destination_fd);
+    }
+    long long total = 0;
+    while (error == NULL && total < request->size()) {
+      long long size = std::min<long long>(kMaxBufferSize,
+                                           request->size() - total);
+      long long n = 0;
+      error = Seek(source_fd, request->source_offset() + total);
+      if (error == NULL) {
+        error = ReadChunks(rpc, source_fd, copy_buffer_, size, &n);
+      }
+      if (error == NULL && n > 0) {
+        error = Seek(destination_fd, request->destination_offset() + total);
+        if (error == NULL) {
+          error = WriteChunks(rpc, destination_fd, copy_buffer_, n);
+        }
+        if (error == NULL) {
+          total += n;
+          Extend(request->destination_filehandle(),
+                 request->destination_offset() + total);
+        }
+      }
+      if (n < size) {
+        break;
+      }
+    }
+    if (error != NULL) {
+      rpc->SetFailed(error);
+    } else {
+      response->set_size(total);
     }
     done->Run();
   }
@@ -264,15 +635,79 @@ request->target().c_str());
                 const proto::TruncateRequest* request,
                 proto::TruncateResponse* response,
                 Closure* done) {
+    trace::Span span("mobilefs", "Truncate");
+    MutexLock lock(&mutex_);
+    span.set_path(request->path());
+    span.set_size(request->offset());
     afc_file_ref fd;
+    trace::Span afc_span("afc", "AFCFileRefOpen");
     int ret = AFCFileRefOpen(conn_, request->path().c_str(), 3, &fd);
+    afc_span.End();
     if (ret != MDERR_OK) {
       rpc->SetFailed("AFCFileRefOpen failed");
     } else {
+      trace::Span truncate_span("afc", "AFCFileRefSetFileSize");
+      truncate_span.set_size(request->offset());
       ret = AFCFileRefSetFileSize(conn_, fd, request->offset());
+      truncate_span.End();
+      trace::Span close_span("afc", "AFCFileRefClose");
       AFCFileRefClose(conn_, fd);
+      close_span.End();
+      if (ret != MDERR_OK) {
+        rpc->SetFailed("AFCFileRefSetFileSize failed");
+      } else {
+        SetLocalSize(request->path(), request->offset());
+      }
+    }
+    done->Run();
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    trace::Span span("mobilefs", "FTruncate");
+    MutexLock lock(&mutex_);
+    span.set_size(request->offset());
+    afc_file_ref fd;
+    const char* error = FileRef(request->filehandle(), &fd);
+    if (error != NULL) {
+      rpc->SetFailed(error);
+    } else {
+      OpenFile* file = &files_[request->filehandle()];
+      span.set_path(file->path);
+      trace::Span afc_span("afc", "AFCFileRefSetFileSize");
+      afc_span.set_size(request->offset());
+      int ret = AFCFileRefSetFileSize(conn_, fd, request->offset());
+      afc_span.End();
       if (ret != MDERR_OK) {
         rpc->SetFailed("AFCFileRefSetFileSize failed");
+      } else {
+        SetLocalSize(file->path, request->offset());
+      }
+    }
+    done->Run();
+  }
+
+  // Answers from the locally tracked stat when possible, only going to the
+  // device the first time a handle that was not created by us is examined.
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    trace::Span span("mobilefs", "FGetAttr");
+    MutexLock lock(&mutex_);
+    OpenFileMap::iterator it = files_.find(request->filehandle());
+    if (it == files_.end()) {
+      rpc->SetFailed("Unknown filehandle");
+    } else {
+      OpenFile* file = &it->second;
+      if (!file->has_stat &&
+          StatPath(rpc, file->path, &file->stat)) {
+        file->has_stat = true;
+      }
+      if (file->has_stat) {
+        response->mutable_stat()->CopyFrom(file->stat);
       }
     }
     done->Run();
@@ -282,8 +717,13 @@ request->target().c_str());
               const proto::StatFsRequest* request,
               proto::StatFsResponse* response,
               Closure* done) {
+    trace::Span span("mobilefs", "StatFs");
+    MutexLock lock(&mutex_);
     struct afc_dictionary* info;
-    if (AFCDeviceInfoOpen(conn_, &info) != MDERR_OK) {
+    trace::Span afc_span("afc", "AFCDeviceInfoOpen");
+    int ret = AFCDeviceInfoOpen(conn_, &info);
+    afc_span.End();
+    if (ret != MDERR_OK) {
       rpc->SetFailed("AFCDeviceInfoOpen failed");
     } else {
       std::map<std::string, std::string> info_map;
@@ -309,6 +749,360 @@ request->target().c_str());
   }
 
  private:
+  // Information about a file handle returned by Open or Create.  The stat is
+  // loaded lazily and is then kept current as the file is written and
+  // truncated through any handle, so that fstat() after a write does not
+  // need a round trip.
+  struct OpenFile {
+    OpenFile() : mode(1), fd(0), opened(false), has_stat(false),
+                 reusable(false) { }
+
+    std::string path;
+    // The AFC open mode
+    int mode;
+    // The AFC handle, once opened is set
+    afc_file_ref fd;
+    bool opened;
+    bool has_stat;
+    proto::Stat stat;
+    // Whether the handle may be kept open for reuse once it is released
+    bool reusable;
+  };
+  // Open files by the handle given to the caller, which is not the AFC handle
+  // since the file may not be open on the device yet
+  typedef std::map<long long, OpenFile> OpenFileMap;
+
+  // A read-only handle that was released but left open, oldest first
+  struct IdleHandle {
+    std::string path;
+    afc_file_ref fd;
+    long long released_usec;
+  };
+  typedef std::list<IdleHandle> IdleHandleList;
+
+  // An open directory listing, positioned at the entry with index position.
+  struct DirCursor {
+    struct afc_directory* dir;
+    long long position;
+  };
+  // Cursors are found by path and the dirhandle of the request
+  typedef std::pair<std::string, long long> DirCursorKey;
+  typedef std::map<DirCursorKey, DirCursor> DirCursorMap;
+
+  void CloseDirCursor(DirCursorMap::iterator it) {
+    AFCDirectoryClose(conn_, it->second.dir);
+    dirs_.erase(it);
+    cursor_memory_.Release(kDirCursorCost);
+  }
+
+  // Invoked when over the memory budget.  A listing that is closed early is
+  // reopened if it is read further.
+  // Nothing is evicted while a call is using the connection, which includes
+  // calls on this thread that charge memory.
+  static void EvictDirCursors(long long bytes, void* data) {
+    MobileFsService* service = static_cast<MobileFsService*>(data);
+    if (pthread_mutex_trylock(&service->mutex_) != 0) {
+      return;
+    }
+    while (bytes > 0 && !service->dirs_.empty()) {
+      service->CloseDirCursor(service->dirs_.begin());
+      bytes -= kDirCursorCost;
+    }
+    pthread_mutex_unlock(&service->mutex_);
+  }
+
+  // Returns the AFC handle of an open file in fd, first opening the file on
+  // the device if Open put that off.  Returns the reason for a failure, or
+  // NULL.
+  const char* FileRef(long long filehandle, afc_file_ref* fd) {
+    OpenFileMap::iterator it = files_.find(filehandle);
+    if (it == files_.end()) {
+      return "Unknown filehandle";
+    }
+    OpenFile* file = &it->second;
+    if (!file->opened) {
+      trace::Span afc_span("afc", "AFCFileRefOpen");
+      afc_span.set_path(file->path);
+      int ret = AFCFileRefOpen(conn_, file->path.c_str(), file->mode,
+                               &file->fd);
+      afc_span.End();
+      if (ret != MDERR_OK) {
+        return "AFCFileRefOpen failed";
+      }
+      file->opened = true;
+    }
+    *fd = file->fd;
+    return NULL;
+  }
+
+  // Records that GetAttr found a regular file at path
+  void RecordStat(const std::string& path) {
+    if (recent_stats_.size() >= kMaxRecentStats &&
+        recent_stats_.find(path) == recent_stats_.end()) {
+      recent_stats_.erase(recent_stats_.begin());
+    }
+    recent_stats_[path] = NowMicros();
+  }
+
+  bool IsRecentlyStatted(const std::string& path) {
+    std::map<std::string, long long>::iterator it = recent_stats_.find(path);
+    return (it != recent_stats_.end() &&
+            NowMicros() - it->second < kRecentStatUsec);
+  }
+
+  // Keeps a released handle open for the next Open of path, making room by
+  // closing the oldest idle handle if needed
+  void KeepIdleHandle(const std::string& path, afc_file_ref fd) {
+    if (idle_handles_.size() >= kMaxIdleHandles) {
+      CloseIdleHandle(idle_handles_.begin());
+    }
+    IdleHandle handle;
+    handle.path = path;
+    handle.fd = fd;
+    handle.released_usec = NowMicros();
+    idle_handles_.push_back(handle);
+    handle_memory_.Charge(kIdleHandleCost);
+  }
+
+  // Returns the most recently released handle for path in fd, if any
+  bool TakeIdleHandle(const std::string& path, afc_file_ref* fd) {
+    for (IdleHandleList::reverse_iterator it = idle_handles_.rbegin();
+         it != idle_handles_.rend(); ++it) {
+      if (it->path == path) {
+        *fd = it->fd;
+        idle_handles_.erase(--it.base());
+        handle_memory_.Release(kIdleHandleCost);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void CloseIdleHandle(IdleHandleList::iterator it) {
+    trace::Span afc_span("afc", "AFCFileRefClose");
+    AFCFileRefClose(conn_, it->fd);
+    afc_span.End();
+    idle_handles_.erase(it);
+    handle_memory_.Release(kIdleHandleCost);
+  }
+
+  void CloseExpiredHandles() {
+    long long now = NowMicros();
+    while (!idle_handles_.empty() &&
+           now - idle_handles_.front().released_usec >= kIdleHandleUsec) {
+      CloseIdleHandle(idle_handles_.begin());
+    }
+  }
+
+  // Invoked before path, or the directory at path, is removed or replaced.
+  // The idle handles of the files there are closed and those of open files
+  // are closed when they are released, so that a later Open gets the new
+  // file instead.  Files whose open was put off are opened now, so that they
+  // are still read from the file that was opened.
+  void ForgetHandles(const std::string& path) {
+    IdleHandleList::iterator it = idle_handles_.begin();
+    while (it != idle_handles_.end()) {
+      if (IsAtOrBeneath(it->path, path)) {
+        CloseIdleHandle(it++);
+      } else {
+        ++it;
+      }
+    }
+    for (OpenFileMap::iterator file = files_.begin(); file != files_.end();
+         ++file) {
+      if (IsAtOrBeneath(file->second.path, path)) {
+        file->second.reusable = false;
+        afc_file_ref fd;
+        // A failure is reported by the next call on the file
+        FileRef(file->first, &fd);
+      }
+    }
+    std::map<std::string, long long>::iterator stat = recent_stats_.begin();
+    while (stat != recent_stats_.end()) {
+      if (IsAtOrBeneath(stat->first, path)) {
+        recent_stats_.erase(stat++);
+      } else {
+        ++stat;
+      }
+    }
+  }
+
+  // Invoked when over the memory budget, like EvictDirCursors
+  static void EvictIdleHandles(long long bytes, void* data) {
+    MobileFsService* service = static_cast<MobileFsService*>(data);
+    if (pthread_mutex_trylock(&service->mutex_) != 0) {
+      return;
+    }
+    while (bytes > 0 && !service->idle_handles_.empty()) {
+      service->CloseIdleHandle(service->idle_handles_.begin());
+      bytes -= kIdleHandleCost;
+    }
+    pthread_mutex_unlock(&service->mutex_);
+  }
+
+  // Records a new size for the file at path, as a result of a local write or
+  // truncate, in every open handle on it that has loaded its stat.  The
+  // others load it from the device when they are first examined.
+  void SetLocalSize(const std::string& path, long long size) {
+    for (OpenFileMap::iterator it = files_.begin(); it != files_.end();
+         ++it) {
+      OpenFile* file = &it->second;
+      if (file->path == path && file->has_stat) {
+        SetStatSize(&file->stat, size);
+      }
+    }
+  }
+
+  // Updates a stat for a file that was just written or truncated
+  static void SetStatSize(proto::Stat* stat, long long size) {
+    stat->set_size(size);
+    stat->set_blocks((size + 511) / 512);
+    stat->mutable_mtime()->set_tv_sec(time(NULL));
+    stat->mutable_mtime()->set_tv_nsec(0);
+  }
+
+  // Populates stat with the attributes of the file at the specified path,
+  // returning false and failing the rpc if the device lookup failed.
+  bool StatPath(RpcController* rpc, const std::string& path,
+                proto::Stat* stat) {
+    struct afc_dictionary *info;
+    trace::Span afc_span("afc", "AFCFileInfoOpen");
+    afc_span.set_path(path);
+    int ret = AFCFileInfoOpen(conn_, (char*)path.c_str(), &info);
+    afc_span.End();
+    if (ret != MDERR_OK) {
+      rpc->SetFailed("AFCFileInfoOpen failed");
+      return false;
+    }
+    std::map<std::string, std::string> info_map;
+    CreateMap(info, &info_map);
+    AFCKeyValueClose(info);
+    if (!info_map.count("st_size") ||
+        !info_map.count("st_ifmt") ||
+        !info_map.count("st_blocks")) {
+      rpc->SetFailed("AFCFileInfoOpen: Mising keys");
+      return false;
+    }
+    stat->set_size(atol(info_map["st_size"].c_str()));
+    stat->set_blocks(atol(info_map["st_blocks"].c_str()));
+    if (info_map.count("st_nlink")) {
+      stat->set_nlink(atol(info_map["st_nlink"].c_str()));
+    }
+    if (info_map.count("st_mtime")) {
+      long long mtime = atoll(info_map["st_mtime"].c_str());
+      stat->mutable_mtime()->set_tv_sec(mtime / 1000000000L);
+      stat->mutable_mtime()->set_tv_nsec(0);
+    }
+    if (info_map["st_ifmt"] == "S_IFDIR") {
+      stat->set_mode(S_IFDIR);
+    } else if (info_map["st_ifmt"] == "S_IFLNK") {
+      stat->set_mode(S_IFLNK);
+    } else if (info_map["st_ifmt"] == "S_IFREG") {
+      stat->set_mode(S_IFREG);
+    } else if (info_map["st_ifmt"] == "S_IFSOCK") {
+      stat->set_mode(S_IFSOCK);
+    } else if (info_map["st_ifmt"] == "S_IFCHR") {
+      stat->set_mode(S_IFCHR);
+    } else if (info_map["st_ifmt"] == "S_IFBLK") {
+      stat->set_mode(S_IFBLK);
+    } else if (info_map["st_ifmt"] == "S_IFIFO") {
+      stat->set_mode(S_IFIFO);
+    } else {
+      rpc->SetFailed("AFCFileInfoOpen: Unknown s_ifmt value");
+      return false;
+    }
+    if (S_ISDIR(stat->mode())) {
+      stat->set_mode(stat->mode() | 0755);
+    } else if (S_ISLNK(stat->mode())) {
+      stat->set_mode(stat->mode() | 0777);
+    } else {
+      stat->set_mode(stat->mode() | 0644);
+    }
+    return true;
+  }
+
+  // Moves the position of an open file.  Returns the reason for a failure,
+  // or NULL.
+  const char* Seek(long long filehandle, long long offset) {
+    trace::Span seek_span("afc", "AFCFileRefSeek");
+    seek_span.set_offset(offset);
+    int ret = AFCFileRefSeek(conn_, filehandle, offset, 0);
+    return (ret == MDERR_OK) ? NULL : "AFCFileRefSeek failed";
+  }
+
+  // Reads up to size bytes from the position of an open file in chunks sized
+  // by the read tuner, stopping early at the end of the file.  Returns the
+  // reason for a failure, or NULL.
+  const char* ReadChunks(RpcController* rpc, long long filehandle, char* buf,
+                         long long size, long long* total) {
+    *total = 0;
+    while (*total < size) {
+      // The caller may have gone away, in which case the rest of the
+      // transfer would only hold up other calls.
+      if (rpc->IsCanceled()) {
+        return "Canceled";
+      }
+      unsigned int chunk = std::min<long long>(read_tuner_.NextChunkSize(),
+                                               size - *total);
+      unsigned int n = chunk;
+      trace::Span afc_span("afc", "AFCFileRefRead");
+      afc_span.set_size(n);
+      long long start = NowMicros();
+      int ret = AFCFileRefRead(conn_, filehandle, buf + *total, &n);
+      afc_span.End();
+      if (ret != MDERR_OK) {
+        return "AFCFileRefRead failed";
+      }
+      read_tuner_.Record(n, NowMicros() - start);
+      *total += n;
+      if (n < chunk) {
+        break;
+      }
+    }
+    return NULL;
+  }
+
+  // Writes size bytes at the position of an open file in chunks sized by the
+  // write tuner.  Returns the reason for a failure, or NULL.
+  const char* WriteChunks(RpcController* rpc, long long filehandle,
+                          const char* buf, long long size) {
+    long long total = 0;
+    while (total < size) {
+      if (rpc->IsCanceled()) {
+        return "Canceled";
+      }
+      int chunk = std::min<long long>(write_tuner_.NextChunkSize(),
+                                      size - total);
+      trace::Span afc_span("afc", "AFCFileRefWrite");
+      afc_span.set_size(chunk);
+      long long start = NowMicros();
+      int ret = AFCFileRefWrite(conn_, filehandle, buf + total, chunk);
+      afc_span.End();
+      if (ret != MDERR_OK) {
+        return "AFCFileWrite failed";
+      }
+      write_tuner_.Record(chunk, NowMicros() - start);
+      total += chunk;
+    }
+    return NULL;
+  }
+
+  // Keeps the cached sizes of the file up to date after writing up to end
+  // through an open handle
+  void Extend(long long filehandle, long long end) {
+    OpenFileMap::iterator it = files_.find(filehandle);
+    if (it == files_.end()) {
+      return;
+    }
+    const std::string path = it->second.path;
+    for (it = files_.begin(); it != files_.end(); ++it) {
+      OpenFile* file = &it->second;
+      if (file->path == path && file->has_stat) {
+        SetStatSize(&file->stat, std::max<long long>(end, file->stat.size()));
+      }
+    }
+  }
+
   // Converts an AFC Dictionary into a map
   static void CreateMap(struct afc_dictionary* in,
                         std::map<std::string, std::string>* out) {
@@ -319,11 +1113,33 @@ printf("%s => %s\n", key, val);
     }
   }
 
+  // The connection is used by one call at a time.  Callers should also go
+  // through a scheduler (see scheduler/scheduling_fs_service.h) so that the
+  // order in which waiting calls get the connection is not left to chance.
+  pthread_mutex_t mutex_;
   afc_connection* conn_;
+  MobileFsOptions options_;
+  // Asked of the connection once, and shared by the two tuners
+  const int min_chunk_size_;
+  TransferTuner read_tuner_;
+  TransferTuner write_tuner_;
+  OpenFileMap files_;
+  long long next_filehandle_;
+  DirCursorMap dirs_;
+  IdleHandleList idle_handles_;
+  // When GetAttr last found a regular file at each path
+  std::map<std::string, long long> recent_stats_;
+  // Allocated by the first CopyRange and kept for the next ones
+  char* copy_buffer_;
+  memory::Consumer cursor_memory_;
+  memory::Consumer handle_memory_;
+  memory::Consumer buffer_memory_;
+  memory::Consumer copy_memory_;
 };
 
-proto::FsService* NewMobileFsService(afc_connection* conn) {
-  return new MobileFsService(conn);
+proto::FsService* NewMobileFsService(afc_connection* conn,
+                                     const MobileFsOptions& options) {
+  return new MobileFsService(conn, options);
 }
 
 }  // namespace mobilefs
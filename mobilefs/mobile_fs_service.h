@@ -11,7 +11,18 @@ class FsService;
 
 namespace mobilefs {
 
-proto::FsService* NewMobileFsService(afc_connection* conn);
+struct MobileFsOptions {
+  MobileFsOptions() : reuse_handles(true) { }
+
+  // Whether files opened for reading may reuse a handle released moments
+  // before, or skip opening the file until it is read.  Both rely on seeing
+  // every Unlink, Rename and Create on the path, so this must be false for a
+  // connection that only carries stripes (see stripe/striping_fs_service.h).
+  bool reuse_handles;
+};
+
+proto::FsService* NewMobileFsService(afc_connection* conn,
+                                     const MobileFsOptions& options);
 
 }  // namespace mobilefs
 
@@ -2,20 +2,50 @@
 //
 // Mounts the mobilefs service.
 
+#include <errno.h>
+#include <stdlib.h>
 #include <string>
+#include <sys/stat.h>
+#include <vector>
 #include <syslog.h>
+#include "cache/listing_cache_fs_service.h"
+#include "fs/fs_proxy.h"
+#include "memory/memory_budget.h"
+#include "metrics/metrics_fs_service.h"
+#include "metrics/metrics_server.h"
 #include "mobilefs/afc_listener.h"
 #include "mobilefs/mobile_fs_service.h"
 #include "mount/mount_service.h"
+#include "policy/path_policy_fs_service.h"
+#include "prefetch/prefetch_fs_service.h"
 #include "proto/mount_service.pb.h"
+#include "replay/recording_fs_service.h"
+#include "scheduler/scheduling_fs_service.h"
+#include "stripe/striping_fs_service.h"
 #include "rpc/rpc.h"
 #include "test/loopback_fs_service.h"
+#include "trace/trace.h"
+#include "xattr/xattr_fs_service.h"
 
 using namespace google::protobuf;
 
 struct MountArgs {
   std::string volume;
   std::string volicon;
+  // Records the calls to the device when not empty
+  std::string recording;
+  policy::PathPolicy policy;
+  // Holds the files kept off the device by the policy, if not empty
+  std::string local_directory;
+  // Holds the extended attributes of each device, if not empty
+  std::string xattr_directory;
+  // The AFC service mounted, which decides the files that are seen
+  std::string afc_service;
+  // Counts the calls of each method for the metrics server
+  bool metrics;
+  // How often cached listings are checked for changes on the device
+  cache::ListingCacheOptions cache_options;
+  prefetch::PrefetchOptions prefetch_options;
 };
 
 static proto::MountService* mounter = NULL;
@@ -26,6 +56,20 @@ static void sig_handler(int signal) {
   CFRunLoopStop(CFRunLoopGetCurrent());
 }
 
+// Creates directory and any missing parents
+static bool MakeDirectories(const std::string& directory) {
+  size_t end = 0;
+  while (end != std::string::npos) {
+    end = directory.find('/', end + 1);
+    std::string path = directory.substr(0, end);
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+      syslog(LOG_ERR, "Unable to create %s: %m", path.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
 static void notify_callback(mobilefs::NotifyStatus* status,
                             void* arg) {
   struct MountArgs* mount_args = static_cast<struct MountArgs*>(arg);
@@ -39,9 +83,57 @@ static void notify_callback(mobilefs::NotifyStatus* status,
       return;
     }
     syslog(LOG_INFO, "Device connected");
-    mounter = mount::NewMountService(
-        mobilefs::NewMobileFsService(status->connection),
-        mount_args->volicon);
+    // Fuse requests arrive on several threads and share one AFC connection
+    proto::FsService* service = scheduler::NewSchedulingFsService(
+        mobilefs::NewMobileFsService(status->connection,
+                                     mobilefs::MobileFsOptions()),
+        scheduler::SchedulerOptions());
+    // Large reads and writes are spread over the additional connections
+    if (!status->helpers.empty()) {
+      std::vector<proto::FsService*> helpers;
+      // Helpers never see the calls that make a reused handle stale
+      mobilefs::MobileFsOptions helper_options;
+      helper_options.reuse_handles = false;
+      for (size_t i = 0; i < status->helpers.size(); ++i) {
+        helpers.push_back(mobilefs::NewMobileFsService(status->helpers[i],
+                                                       helper_options));
+      }
+      service = stripe::NewStripingFsService(service, helpers,
+                                             stripe::StripingOptions());
+    }
+    // The ranges a reader seeks to are fetched along with its first read
+    service = prefetch::NewPrefetchFsService(service,
+                                             mount_args->prefetch_options);
+    // Lookups of missing names are answered from listings already read
+    service = cache::NewListingCacheFsService(service,
+                                              mount_args->cache_options);
+    // Finder probes are answered without a trip to the scheduler
+    service = policy::NewPathPolicyFsService(
+        service,
+        mount_args->local_directory.empty() ? NULL : test::NewLoopbackService(),
+        mount_args->local_directory, mount_args->policy);
+    // Extended attributes never reach the device.  Each AFC service of a
+    // device sees different files, so each has a store of its own.
+    if (!mount_args->xattr_directory.empty() && !status->device_id.empty()) {
+      proto::FsService* xattrs = xattr::NewXAttrFsService(
+          service, mount_args->xattr_directory + "/" + status->device_id +
+                   "-" + mount_args->afc_service);
+      if (xattrs != NULL) {
+        service = xattrs;
+      }
+    }
+    if (!mount_args->recording.empty()) {
+      proto::FsService* recorder =
+          replay::NewRecordingFsService(service, mount_args->recording);
+      if (recorder != NULL) {
+        syslog(LOG_INFO, "Recording to %s", mount_args->recording.c_str());
+        service = recorder;
+      }
+    }
+    if (mount_args->metrics) {
+      service = metrics::NewMetricsFsService(service);
+    }
+    mounter = mount::NewMountService(service, mount_args->volicon);
     rpc::Rpc rpc;
     proto::MountRequest request;
     request.set_fs_id("mobile-fs");
@@ -64,16 +156,122 @@ int main(int argc, char* argv[]) {
 #else
   setlogmask(LOG_UPTO(LOG_INFO));
 #endif
-  if (argc != 4) {
-    syslog(LOG_ERR, "Usage: %s <volume> <volicon> <afc service>", argv[0]);
+  if (argc != 4 && argc != 5) {
+    syslog(LOG_ERR, "Usage: %s <volume> <volicon> <afc service> [trace file]",
+           argv[0]);
     return 1;
   }
   signal(SIGINT, sig_handler);
+  // The memory budget for caches and buffers may be set from the environment
+  const char* budget_mb = getenv("IPHONEDISK_MEMORY_BUDGET_MB");
+  if (budget_mb != NULL) {
+    memory::SetBudget(atoll(budget_mb) * 1024 * 1024);
+  }
+  // When a trace file is specified, requests are traced and the trace is
+  // written each time the process receives SIGUSR1, and again on exit.
+  std::string trace_file;
+  if (argc == 5) {
+    trace_file = argv[4];
+    if (!trace::FlushOnSignal(SIGUSR1, trace_file)) {
+      syslog(LOG_ERR, "Failed to enable tracing");
+      closelog();
+      return 1;
+    }
+  }
 
   struct MountArgs args;
   args.volume = argv[1];
   args.volicon = argv[2];
-  mobilefs::AfcListener listener(argv[3]);
+  args.afc_service = argv[3];
+  // Metrics are served in the Prometheus text format on a Unix socket
+  args.metrics = false;
+  const char* metrics_socket = getenv("IPHONEDISK_METRICS_SOCKET");
+  if (metrics_socket != NULL) {
+    if (!metrics::Serve(metrics_socket)) {
+      closelog();
+      return 1;
+    }
+    args.metrics = true;
+  }
+  // Calls to the device may be recorded for later replay by fs_replay
+  const char* recording = getenv("IPHONEDISK_RECORD");
+  if (recording != NULL) {
+    args.recording = recording;
+  }
+  // .DS_Store and AppleDouble files are kept on the host, in
+  // ~/Library/Caches/iphonedisk/<volume> unless set otherwise.
+  policy::DefaultPathPolicy(&args.policy);
+  const char* path_policy = getenv("IPHONEDISK_PATH_POLICY");
+  if (path_policy != NULL &&
+      !policy::ParsePathPolicy(path_policy, &args.policy)) {
+    syslog(LOG_ERR, "Invalid IPHONEDISK_PATH_POLICY: %s", path_policy);
+    closelog();
+    return 1;
+  }
+  const char* local_directory = getenv("IPHONEDISK_LOCAL_DIRECTORY");
+  const char* home = getenv("HOME");
+  if (local_directory != NULL) {
+    args.local_directory = local_directory;
+  } else if (home != NULL) {
+    args.local_directory = std::string(home) + "/Library/Caches/iphonedisk/" +
+                           args.volume;
+  }
+  if (!args.local_directory.empty() &&
+      !MakeDirectories(args.local_directory)) {
+    // Local files are denied instead
+    args.local_directory.clear();
+  }
+  // Extended attributes are stored in
+  // ~/Library/Application Support/iphonedisk/xattr unless set otherwise
+  const char* xattr_directory = getenv("IPHONEDISK_XATTR_DIRECTORY");
+  if (xattr_directory != NULL) {
+    args.xattr_directory = xattr_directory;
+  } else if (home != NULL) {
+    args.xattr_directory = std::string(home) +
+        "/Library/Application Support/iphonedisk/xattr";
+  }
+  if (!args.xattr_directory.empty() &&
+      !MakeDirectories(args.xattr_directory)) {
+    // The kernel falls back to AppleDouble files instead
+    args.xattr_directory.clear();
+  }
+  // Large transfers use up to IPHONEDISK_CONNECTIONS connections to the
+  // device, or just one when set to 1.
+  int connections = 4;
+  const char* connections_env = getenv("IPHONEDISK_CONNECTIONS");
+  if (connections_env != NULL) {
+    connections = atoi(connections_env);
+    if (connections < 1) {
+      syslog(LOG_ERR, "Invalid IPHONEDISK_CONNECTIONS: %s", connections_env);
+      closelog();
+      return 1;
+    }
+  }
+  // Cached listings are checked for changes made on the device every
+  // IPHONEDISK_POLL_INTERVAL_MS, with at most IPHONEDISK_POLL_BUDGET calls to
+  // the device each time.  Off by default: the calls compete with the mount's
+  // own, and only fuse 3 can drop what the kernel cached.
+  const char* poll_interval = getenv("IPHONEDISK_POLL_INTERVAL_MS");
+  if (poll_interval != NULL) {
+    args.cache_options.poll_interval_usec = atoll(poll_interval) * 1000;
+  }
+  const char* poll_budget = getenv("IPHONEDISK_POLL_BUDGET");
+  if (poll_budget != NULL) {
+    args.cache_options.poll_budget = atoi(poll_budget);
+    if (args.cache_options.poll_budget < 1) {
+      syslog(LOG_ERR, "Invalid IPHONEDISK_POLL_BUDGET: %s", poll_budget);
+      closelog();
+      return 1;
+    }
+  }
+  args.cache_options.invalidate = &fs::InvalidatePath;
+  // The last IPHONEDISK_PREFETCH_TAIL_KB of large files are read along with
+  // their first read, unless set to 0, until the reads of the file are known.
+  const char* prefetch_tail = getenv("IPHONEDISK_PREFETCH_TAIL_KB");
+  if (prefetch_tail != NULL) {
+    args.prefetch_options.tail_size = atoll(prefetch_tail) * 1024;
+  }
+  mobilefs::AfcListener listener(argv[3], connections);
   if (!listener.SetNotifyCallback(&notify_callback, &args)) {
     syslog(LOG_ERR, "Failed to initialize device listener");
     closelog();
@@ -82,6 +280,9 @@ int main(int argc, char* argv[]) {
   syslog(LOG_INFO, "Waiting for device connection");
   CFRunLoopRun();
   syslog(LOG_INFO, "Exiting");
+  if (!trace_file.empty()) {
+    trace::Flush(trace_file);
+  }
   closelog();
   return 0;
 }
@@ -0,0 +1,115 @@
+// Removes directories of the first device to connect, and everything in
+// them, without going through a mount, e.g.
+//
+//   mobile_rm com.apple.afc /DCIM/100APPLE /Downloads/old
+//
+// Deleting a folder through a mount costs a listing of each directory and a
+// separate call for each entry, one at a time.  Here each tree is removed
+// with one RemoveTree call (see fs/remove_tree.h), which lists and removes
+// entries over IPHONEDISK_CONNECTIONS connections at once.  The entries that
+// could not be removed are logged.  A mount of the device notices the change
+// once the listings it cached expire, or sooner when it polls them (see
+// IPHONEDISK_POLL_INTERVAL_MS in the README).
+//
+// Only the device is touched.  The files a mount keeps on the host for the
+// removed folders, such as their .DS_Store, and the extended attributes it
+// stored for their entries are left behind; the attributes reappear on any
+// entry later created at the same path through a mount.
+
+#include <stdlib.h>
+#include <string>
+#include <syslog.h>
+#include <vector>
+#include "mobilefs/afc_listener.h"
+#include "mobilefs/mobile_fs_service.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+#include "scheduler/scheduling_fs_service.h"
+#include "stripe/striping_fs_service.h"
+
+struct RemoveArgs {
+  std::vector<std::string> paths;
+  bool success;
+};
+
+static void notify_callback(mobilefs::NotifyStatus* status, void* arg) {
+  struct RemoveArgs* args = static_cast<struct RemoveArgs*>(arg);
+  if (status->connection == NULL) {
+    return;
+  }
+  syslog(LOG_INFO, "Device connected");
+  proto::FsService* service = scheduler::NewSchedulingFsService(
+      mobilefs::NewMobileFsService(status->connection,
+                                   mobilefs::MobileFsOptions()),
+      scheduler::SchedulerOptions());
+  if (!status->helpers.empty()) {
+    std::vector<proto::FsService*> helpers;
+    // Helpers never see the calls that make a reused handle stale
+    mobilefs::MobileFsOptions helper_options;
+    helper_options.reuse_handles = false;
+    for (size_t i = 0; i < status->helpers.size(); ++i) {
+      helpers.push_back(mobilefs::NewMobileFsService(status->helpers[i],
+                                                     helper_options));
+    }
+    service = stripe::NewStripingFsService(service, helpers,
+                                           stripe::StripingOptions());
+  }
+  google::protobuf::Closure* done = google::protobuf::NewPermanentCallback(
+      &google::protobuf::DoNothing);
+  args->success = true;
+  for (size_t i = 0; i < args->paths.size(); ++i) {
+    rpc::Rpc rpc;
+    proto::RemoveTreeRequest request;
+    proto::RemoveTreeResponse response;
+    request.mutable_header()->set_fs_id("mobile_rm");
+    request.set_path(args->paths[i]);
+    service->RemoveTree(&rpc, &request, &response, done);
+    for (int j = 0; j < response.failure_size(); ++j) {
+      syslog(LOG_ERR, "%s: %s", response.failure(j).path().c_str(),
+             response.failure(j).error().c_str());
+    }
+    if (rpc.Failed()) {
+      syslog(LOG_ERR, "Failed to remove %s: %s", args->paths[i].c_str(),
+             rpc.ErrorText().c_str());
+      args->success = false;
+    }
+    syslog(LOG_INFO, "Removed %lld entries from %s",
+           static_cast<long long>(response.removed()),
+           args->paths[i].c_str());
+  }
+  delete done;
+  delete service;
+  CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+int main(int argc, char* argv[]) {
+  openlog("mobile_rm", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_INFO));
+  if (argc < 3) {
+    syslog(LOG_ERR, "Usage: %s <afc service> <device path>...", argv[0]);
+    return 1;
+  }
+  struct RemoveArgs args;
+  args.paths.assign(argv + 2, argv + argc);
+  args.success = false;
+  int connections = 4;
+  const char* connections_env = getenv("IPHONEDISK_CONNECTIONS");
+  if (connections_env != NULL) {
+    connections = atoi(connections_env);
+    if (connections < 1) {
+      syslog(LOG_ERR, "Invalid IPHONEDISK_CONNECTIONS: %s", connections_env);
+      closelog();
+      return 1;
+    }
+  }
+  mobilefs::AfcListener listener(argv[1], connections);
+  if (!listener.SetNotifyCallback(&notify_callback, &args)) {
+    syslog(LOG_ERR, "Failed to initialize device listener");
+    closelog();
+    return 1;
+  }
+  syslog(LOG_INFO, "Waiting for device connection");
+  CFRunLoopRun();
+  closelog();
+  return args.success ? 0 : 1;
+}
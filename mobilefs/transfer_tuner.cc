@@ -0,0 +1,110 @@
+#include "mobilefs/transfer_tuner.h"
+
+#include <stddef.h>
+#include <syslog.h>
+#include "metrics/metrics.h"
+
+namespace mobilefs {
+
+// Every kProbeInterval transfers one uses a neighbouring chunk size
+static const int kProbeInterval = 8;
+// Weight given to the newest sample in the moving averages
+static const double kSampleWeight = 0.25;
+
+static int RoundUpToPowerOfTwo(int n) {
+  int size = 1;
+  while (size < n) {
+    size <<= 1;
+  }
+  return size;
+}
+
+TransferTuner::TransferTuner(int min_size, int max_size, int initial_size,
+                             metrics::Gauge* chunk_size_gauge,
+                             metrics::Gauge* rate_gauge,
+                             metrics::Gauge* latency_gauge)
+    : min_size_(RoundUpToPowerOfTwo(min_size)),
+      current_(0),
+      transfers_(0),
+      probe_up_(true),
+      chunk_size_gauge_(chunk_size_gauge),
+      rate_gauge_(rate_gauge),
+      latency_gauge_(latency_gauge) {
+  max_size = RoundUpToPowerOfTwo(max_size);
+  for (int size = min_size_; size <= max_size; size <<= 1) {
+    buckets_.push_back(Bucket());
+    if (size <= initial_size) {
+      current_ = buckets_.size() - 1;
+    }
+  }
+  UpdateGauges();
+}
+
+int TransferTuner::NextChunkSize() {
+  if (++transfers_ % kProbeInterval != 0) {
+    return SizeOf(current_);
+  }
+  // Alternate between probing the next larger and next smaller size
+  probe_up_ = !probe_up_;
+  int probe = current_ + (probe_up_ ? 1 : -1);
+  if (probe < 0 || probe >= static_cast<int>(buckets_.size())) {
+    probe = current_ + (probe_up_ ? -1 : 1);
+  }
+  if (probe < 0 || probe >= static_cast<int>(buckets_.size())) {
+    return SizeOf(current_);
+  }
+  return SizeOf(probe);
+}
+
+void TransferTuner::Record(int bytes, long long micros) {
+  if (bytes < min_size_ || micros <= 0) {
+    // Too small to say anything about throughput
+    return;
+  }
+  // Attribute the sample to the largest chunk size that it filled
+  int index = 0;
+  while (index + 1 < static_cast<int>(buckets_.size()) &&
+         SizeOf(index + 1) <= bytes) {
+    index++;
+  }
+  Bucket* bucket = &buckets_[index];
+  double rate = bytes * 1000000.0 / micros;
+  if (bucket->samples == 0) {
+    bucket->rate = rate;
+    bucket->latency = micros;
+  } else {
+    bucket->rate += kSampleWeight * (rate - bucket->rate);
+    bucket->latency += kSampleWeight * (micros - bucket->latency);
+  }
+  bucket->samples++;
+
+  int best = current_;
+  for (int i = 0; i < static_cast<int>(buckets_.size()); ++i) {
+    if (buckets_[i].samples > 0 &&
+        (buckets_[best].samples == 0 ||
+         buckets_[i].rate > buckets_[best].rate)) {
+      best = i;
+    }
+  }
+  if (best != current_) {
+    syslog(LOG_DEBUG, "Transfer size %d -> %d (%.0f bytes/s)",
+           SizeOf(current_), SizeOf(best), buckets_[best].rate);
+    current_ = best;
+  }
+  UpdateGauges();
+}
+
+void TransferTuner::UpdateGauges() {
+  const Bucket& bucket = buckets_[current_];
+  if (chunk_size_gauge_ != NULL) {
+    chunk_size_gauge_->Set(SizeOf(current_));
+  }
+  if (rate_gauge_ != NULL) {
+    rate_gauge_->Set(static_cast<long long>(bucket.rate));
+  }
+  if (latency_gauge_ != NULL) {
+    latency_gauge_->Set(static_cast<long long>(bucket.latency));
+  }
+}
+
+}  // namespace mobilefs
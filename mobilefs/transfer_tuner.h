@@ -0,0 +1,66 @@
+// Chooses the size of the individual AFC reads and writes used to service a
+// larger request.  The best size depends on the device, the USB link and the
+// version of the AFC service, so rather than hard coding it the tuner
+// measures the throughput achieved by each power of two transfer size and
+// settles on the fastest, while occasionally probing the neighbouring sizes so
+// that it follows changes in conditions.
+//
+// A TransferTuner is not thread safe; use one per connection and direction.
+
+#ifndef __MOBILEFS_TRANSFER_TUNER_H__
+#define __MOBILEFS_TRANSFER_TUNER_H__
+
+#include <vector>
+
+namespace metrics {
+class Gauge;
+}
+
+namespace mobilefs {
+
+class TransferTuner {
+ public:
+  // Chunk sizes are powers of two between min_size and max_size, which are
+  // rounded up to a power of two.  The gauges are updated with the chosen
+  // chunk size, its measured throughput in bytes per second and its average
+  // latency in microseconds; any of them may be NULL.
+  TransferTuner(int min_size, int max_size, int initial_size,
+                metrics::Gauge* chunk_size_gauge,
+                metrics::Gauge* rate_gauge,
+                metrics::Gauge* latency_gauge);
+
+  // Returns the chunk size to use for the next transfer
+  int NextChunkSize();
+
+  // Records a transfer of the specified number of bytes that took micros
+  // microseconds to complete.
+  void Record(int bytes, long long micros);
+
+  // The currently preferred chunk size
+  int chunk_size() const { return SizeOf(current_); }
+
+ private:
+  struct Bucket {
+    Bucket() : samples(0), rate(0), latency(0) { }
+
+    int samples;
+    double rate;     // bytes per second
+    double latency;  // microseconds
+  };
+
+  int SizeOf(int index) const { return min_size_ << index; }
+  void UpdateGauges();
+
+  int min_size_;
+  std::vector<Bucket> buckets_;
+  int current_;
+  int transfers_;
+  bool probe_up_;
+  metrics::Gauge* chunk_size_gauge_;
+  metrics::Gauge* rate_gauge_;
+  metrics::Gauge* latency_gauge_;
+};
+
+}  // namespace mobilefs
+
+#endif  // __MOBILEFS_TRANSFER_TUNER_H__
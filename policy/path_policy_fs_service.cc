@@ -0,0 +1,510 @@
+#include "policy/path_policy_fs_service.h"
+
+#include <fnmatch.h>
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace policy {
+
+static metrics::Counter g_denied_calls(
+    "path_policy_calls_total", "action=\"deny\"",
+    "Calls answered without the device because of the path policy");
+static metrics::Counter g_local_calls(
+    "path_policy_calls_total", "action=\"local\"",
+    "Calls answered without the device because of the path policy");
+
+// Handles returned by the local service are tagged so they can be told apart
+// from handles returned by the device.
+static const long long kLocalHandle = 1LL << 48;
+
+static const char* kDefaultDeny[] = {
+  ".Spotlight-V100",
+  ".Trashes",
+  ".fseventsd",
+  ".hidden",
+  ".TemporaryItems",
+  ".metadata_never_index",
+};
+
+static const char* kDefaultLocal[] = {
+  "._*",
+  ".DS_Store",
+};
+
+void DefaultPathPolicy(PathPolicy* policy) {
+  policy->deny.assign(kDefaultDeny,
+                      kDefaultDeny + sizeof(kDefaultDeny) / sizeof(char*));
+  policy->local.assign(kDefaultLocal,
+                       kDefaultLocal + sizeof(kDefaultLocal) / sizeof(char*));
+}
+
+// Splits value on sep, appending the parts to out
+static void Split(const std::string& value, char sep,
+                  std::vector<std::string>* out) {
+  size_t start = 0;
+  while (start <= value.size()) {
+    size_t end = value.find(sep, start);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    if (end > start) {
+      out->push_back(value.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+}
+
+bool ParsePathPolicy(const std::string& spec, PathPolicy* policy) {
+  policy->deny.clear();
+  policy->local.clear();
+  std::vector<std::string> options;
+  Split(spec, ',', &options);
+  for (size_t i = 0; i < options.size(); ++i) {
+    size_t equals = options[i].find('=');
+    if (equals == std::string::npos) {
+      return false;
+    }
+    std::string key = options[i].substr(0, equals);
+    std::string value = options[i].substr(equals + 1);
+    if (key == "deny") {
+      Split(value, ':', &policy->deny);
+    } else if (key == "local") {
+      Split(value, ':', &policy->local);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Prefixes the paths of a request that is sent to the local service
+template <class Request>
+static void SetLocalPath(const std::string& directory, Request* request) {
+  request->set_path(directory + request->path());
+}
+
+static void SetLocalPath(const std::string& directory,
+                         proto::SymLinkRequest* request) {
+  request->set_target(directory + request->target());
+}
+
+static void SetLocalPath(const std::string& directory,
+                         proto::RenameRequest* request) {
+  request->set_source_path(directory + request->source_path());
+  request->set_destination_path(directory + request->destination_path());
+}
+
+// Tags the handle of a response from the local service
+template <class Response>
+static void TagLocalHandle(Response* response) { }
+
+static void TagLocalHandle(proto::OpenResponse* response) {
+  response->set_filehandle(response->filehandle() | kLocalHandle);
+}
+
+static void TagLocalHandle(proto::CreateResponse* response) {
+  response->set_filehandle(response->filehandle() | kLocalHandle);
+}
+
+class PathPolicyService : public proto::FsService {
+ public:
+  PathPolicyService(proto::FsService* service,
+                    proto::FsService* local,
+                    const std::string& local_directory,
+                    const PathPolicy& policy)
+      : service_(service),
+        local_(local),
+        local_directory_(local_directory),
+        policy_(policy) {
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~PathPolicyService() {
+    delete null_callback_;
+    delete local_;
+    delete service_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    ByPath(&proto::FsService::GetAttr, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    ByPath(&proto::FsService::ReadLink, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    ByPath(&proto::FsService::SymLink, request->target(), true, rpc, request,
+           response, done);
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    ByPath(&proto::FsService::ReadDir, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    ByPath(&proto::FsService::Unlink, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    ByPath(&proto::FsService::RemoveTree, request->path(), false, rpc,
+           request, response, done);
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    ByPath(&proto::FsService::MkDir, request->path(), true, rpc, request,
+           response, done);
+  }
+
+  // Files cannot be moved between the device and the host.  The local files
+  // beneath a directory on the device move along with it.
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    Action source = Classify(request->source_path());
+    Action destination = Classify(request->destination_path());
+    if (source != destination) {
+      if (source == DENY || destination == DENY) {
+        g_denied_calls.Increment();
+      } else {
+        g_local_calls.Increment();
+      }
+      rpc->SetFailed("Rename across the path policy");
+      done->Run();
+      return;
+    }
+    if (source != DEVICE || local_ == NULL) {
+      ByPath(&proto::FsService::Rename, request->destination_path(), true,
+             rpc, request, response, done);
+      return;
+    }
+    service_->Rename(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      MoveLocal(request->source_path(), request->destination_path());
+    }
+    done->Run();
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    ByPath(&proto::FsService::Open, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    ByPath(&proto::FsService::Create, request->path(), true, rpc, request,
+           response, done);
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    ByHandle(&proto::FsService::Release, rpc, request, response, done);
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    ByHandle(&proto::FsService::Read, rpc, request, response, done);
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    ByHandle(&proto::FsService::ReadV, rpc, request, response, done);
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    ByHandle(&proto::FsService::Write, rpc, request, response, done);
+  }
+
+  // Both files must be on the same side of the policy.  The kernel copies
+  // across it with reads and writes instead.
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    bool local = (request->source_filehandle() & kLocalHandle) != 0;
+    if (local != ((request->destination_filehandle() & kLocalHandle) != 0)) {
+      g_local_calls.Increment();
+      rpc->SetFailed("Copy across the path policy");
+      done->Run();
+      return;
+    }
+    if (!local) {
+      service_->CopyRange(rpc, request, response, done);
+      return;
+    }
+    g_local_calls.Increment();
+    proto::CopyRangeRequest local_request(*request);
+    local_request.set_source_filehandle(
+        request->source_filehandle() & ~kLocalHandle);
+    local_request.set_destination_filehandle(
+        request->destination_filehandle() & ~kLocalHandle);
+    local_->CopyRange(rpc, &local_request, response, null_callback_);
+    done->Run();
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    ByPath(&proto::FsService::Truncate, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    ByHandle(&proto::FsService::FTruncate, rpc, request, response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    ByHandle(&proto::FsService::FGetAttr, rpc, request, response, done);
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    service_->StatFs(rpc, request, response, done);
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    ByPath(&proto::FsService::GetXAttr, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    ByPath(&proto::FsService::SetXAttr, request->path(), true, rpc, request,
+           response, done);
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    ByPath(&proto::FsService::ListXAttr, request->path(), false, rpc, request,
+           response, done);
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    ByPath(&proto::FsService::RemoveXAttr, request->path(), false, rpc, request,
+           response, done);
+  }
+
+ private:
+  enum Action {
+    DEVICE,
+    DENY,
+    LOCAL
+  };
+
+  static bool Matches(const std::vector<std::string>& patterns,
+                      const std::string& name) {
+    for (size_t i = 0; i < patterns.size(); ++i) {
+      if (fnmatch(patterns[i].c_str(), name.c_str(), 0) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // A path is denied if any of its components matches a deny pattern, and
+  // otherwise local if any matches a local pattern.
+  Action Classify(const std::string& path) const {
+    Action action = DEVICE;
+    size_t start = 0;
+    while (start < path.size()) {
+      size_t end = path.find('/', start);
+      if (end == std::string::npos) {
+        end = path.size();
+      }
+      if (end > start) {
+        std::string name = path.substr(start, end - start);
+        if (Matches(policy_.deny, name)) {
+          return DENY;
+        }
+        if (Matches(policy_.local, name)) {
+          action = (local_ != NULL) ? LOCAL : DENY;
+        }
+      }
+      start = end + 1;
+    }
+    return action;
+  }
+
+  template <class Request, class Response>
+  void ByPath(void (proto::FsService::*method)(RpcController*,
+                                               const Request*,
+                                               Response*,
+                                               Closure*),
+              const std::string& path,
+              bool creates,
+              RpcController* rpc,
+              const Request* request,
+              Response* response,
+              Closure* done) {
+    switch (Classify(path)) {
+      case DEVICE:
+        (service_->*method)(rpc, request, response, done);
+        return;
+      case DENY:
+        g_denied_calls.Increment();
+        rpc->SetFailed(creates ? "Denied by path policy" :
+                                 "No such file or directory");
+        break;
+      case LOCAL: {
+        g_local_calls.Increment();
+        if (creates) {
+          MakeLocalParents(path);
+        }
+        Request local_request(*request);
+        SetLocalPath(local_directory_, &local_request);
+        (local_->*method)(rpc, &local_request, response, null_callback_);
+        if (!rpc->Failed()) {
+          TagLocalHandle(response);
+        }
+        break;
+      }
+    }
+    done->Run();
+  }
+
+  template <class Request, class Response>
+  void ByHandle(void (proto::FsService::*method)(RpcController*,
+                                                 const Request*,
+                                                 Response*,
+                                                 Closure*),
+                RpcController* rpc,
+                const Request* request,
+                Response* response,
+                Closure* done) {
+    if ((request->filehandle() & kLocalHandle) == 0) {
+      (service_->*method)(rpc, request, response, done);
+      return;
+    }
+    g_local_calls.Increment();
+    Request local_request(*request);
+    local_request.set_filehandle(request->filehandle() & ~kLocalHandle);
+    (local_->*method)(rpc, &local_request, response, null_callback_);
+    done->Run();
+  }
+
+  // The directories above a local file may only exist on the device, so they
+  // are created on the host as needed.  Failures show up in the call itself.
+  void MakeLocalParents(const std::string& path) {
+    size_t end = 0;
+    while ((end = path.find('/', end + 1)) != std::string::npos) {
+      rpc::Rpc rpc;
+      proto::MkDirRequest request;
+      proto::MkDirResponse response;
+      request.mutable_header()->set_fs_id("local");
+      request.set_path(local_directory_ + path.substr(0, end));
+      request.set_mode(0755);
+      local_->MkDir(&rpc, &request, &response, null_callback_);
+    }
+  }
+
+  // Invoked after a path on the device is renamed.  The local files kept for
+  // whatever the rename replaced are removed, and those beneath source are
+  // moved to destination.  Failures are not reported.
+  void MoveLocal(const std::string& source, const std::string& destination) {
+    rpc::Rpc remove_rpc;
+    proto::RemoveTreeRequest remove_request;
+    proto::RemoveTreeResponse remove_response;
+    remove_request.mutable_header()->set_fs_id("local");
+    remove_request.set_path(local_directory_ + destination);
+    local_->RemoveTree(&remove_rpc, &remove_request, &remove_response,
+                       null_callback_);
+    rpc::Rpc stat_rpc;
+    proto::GetAttrRequest stat_request;
+    proto::GetAttrResponse stat_response;
+    stat_request.mutable_header()->set_fs_id("local");
+    stat_request.set_path(local_directory_ + source);
+    local_->GetAttr(&stat_rpc, &stat_request, &stat_response, null_callback_);
+    if (stat_rpc.Failed()) {
+      return;
+    }
+    MakeLocalParents(destination);
+    rpc::Rpc rename_rpc;
+    proto::RenameRequest rename_request;
+    proto::RenameResponse rename_response;
+    rename_request.mutable_header()->set_fs_id("local");
+    rename_request.set_source_path(source);
+    rename_request.set_destination_path(destination);
+    SetLocalPath(local_directory_, &rename_request);
+    local_->Rename(&rename_rpc, &rename_request, &rename_response,
+                   null_callback_);
+  }
+
+  proto::FsService* service_;
+  proto::FsService* local_;
+  std::string local_directory_;
+  PathPolicy policy_;
+  Closure* null_callback_;
+};
+
+proto::FsService* NewPathPolicyFsService(proto::FsService* service,
+                                         proto::FsService* local,
+                                         const std::string& local_directory,
+                                         const PathPolicy& policy) {
+  return new PathPolicyService(service, local, local_directory, policy);
+}
+
+}  // namespace policy
@@ -0,0 +1,48 @@
+// An FsService that keeps the files the Finder probes for, such as .DS_Store,
+// AppleDouble (._*) files and the .Spotlight-V100 and .Trashes directories,
+// from costing a round trip to the device.  Paths with a component matching
+// one of the deny patterns do not exist: lookups fail and they cannot be
+// created.  Paths matching one of the local patterns are stored in a
+// directory on the host instead of on the device, so that the Finder can
+// still keep its metadata there.  The local files beneath a directory on the
+// device are moved and removed along with it.
+//
+// Files already on the device that match a pattern still appear in directory
+// listings, since removing them would shift the offsets of later entries.
+
+#ifndef __POLICY_PATH_POLICY_FS_SERVICE_H__
+#define __POLICY_PATH_POLICY_FS_SERVICE_H__
+
+#include <string>
+#include <vector>
+
+namespace proto {
+class FsService;
+}
+
+namespace policy {
+
+struct PathPolicy {
+  // Patterns are matched against each path component with fnmatch(3)
+  std::vector<std::string> deny;
+  std::vector<std::string> local;
+};
+
+// The probes made by the Finder, Spotlight and the Trash
+void DefaultPathPolicy(PathPolicy* policy);
+
+// Parses a policy such as "deny=.Trashes:.hidden,local=._*:.DS_Store".
+// Returns false if the spec is malformed.
+bool ParsePathPolicy(const std::string& spec, PathPolicy* policy);
+
+// Takes ownership of service and local.  Local paths are passed to the local
+// service (normally a loopback service) prefixed with local_directory.  If
+// local is NULL, local paths are denied instead.
+proto::FsService* NewPathPolicyFsService(proto::FsService* service,
+                                         proto::FsService* local,
+                                         const std::string& local_directory,
+                                         const PathPolicy& policy);
+
+}  // namespace policy
+
+#endif  // __POLICY_PATH_POLICY_FS_SERVICE_H__
@@ -0,0 +1,629 @@
+#include "prefetch/prefetch_fs_service.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <vector>
+#include "memory/memory_budget.h"
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace prefetch {
+
+static metrics::Counter g_vectored_reads(
+    "prefetch_vectored_reads_total",
+    "First reads of a file made as a ReadV with the predicted ranges");
+static metrics::Counter g_prefetched_bytes(
+    "prefetch_prefetched_bytes_total",
+    "Bytes fetched ahead of the reads that asked for them");
+static metrics::Counter g_hits(
+    "prefetch_hits_total", "Reads answered from the ranges fetched ahead");
+
+// A remembered range is cut off at this size
+static const long long kMaxRangeSize = 128 * 1024;
+// Most bytes fetched ahead of one read
+static const long long kMaxPrefetch = 256 * 1024;
+// Attributes from GetAttr are used for an open this soon after
+static const long long kRecentStatUsec = 5 * 1000000LL;
+static const size_t kMaxRecentStats = 64;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Returns true if path is directory or beneath it
+static bool IsAtOrBeneath(const std::string& path,
+                          const std::string& directory) {
+  return (path.compare(0, directory.size(), directory) == 0 &&
+          (path.size() == directory.size() || path[directory.size()] == '/' ||
+           directory == "/"));
+}
+
+// The Rpc of a combined read, which is canceled along with the caller's
+class VectorRpc : public rpc::Rpc {
+ public:
+  explicit VectorRpc(RpcController* parent) : parent_(parent) { }
+
+  virtual bool IsCanceled() const {
+    return parent_->IsCanceled() || rpc::Rpc::IsCanceled();
+  }
+
+ private:
+  RpcController* parent_;
+};
+
+// The attributes that tell whether a remembered history still applies
+struct FileStat {
+  long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+};
+
+static bool SameStat(const FileStat& a, const FileStat& b) {
+  return (a.size == b.size && a.mtime_sec == b.mtime_sec &&
+          a.mtime_nsec == b.mtime_nsec);
+}
+
+struct Range {
+  long long offset;
+  long long size;
+};
+
+// A range fetched ahead of the reads.  eof is set when it reaches the end of
+// the file, so that it also answers reads past the end.
+struct Prefetch {
+  std::string data;
+  bool eof;
+};
+
+typedef std::map<long long, Prefetch> PrefetchMap;
+
+struct OpenFile {
+  std::string path;
+  // Set for read-only files large enough to be read ahead
+  bool reading;
+  FileStat stat;
+  bool first_read;
+  long long next_offset;  // The end of the last read
+  std::vector<Range> seeks;  // Ranges read after a seek
+  PrefetchMap prefetched;  // By offset
+  long long charged;
+  // Incremented when the file changes, so that a read in progress does not
+  // keep what it fetched
+  long long generation;
+};
+
+typedef std::map<long long, OpenFile> OpenFileMap;
+
+// The ranges read after seeking the last time a file was opened
+struct History {
+  FileStat stat;
+  std::vector<Range> ranges;
+  long long used_usec;
+};
+
+typedef std::map<std::string, History> HistoryMap;
+
+struct RecentStat {
+  FileStat stat;
+  long long usec;
+};
+
+typedef std::map<std::string, RecentStat> RecentStatMap;
+
+class PrefetchService : public proto::FsService {
+ public:
+  PrefetchService(proto::FsService* service, const PrefetchOptions& options)
+      : service_(service),
+        options_(options),
+        memory_("prefetch", &EvictPrefetched, this) {
+    pthread_mutex_init(&mutex_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~PrefetchService() {
+    delete null_callback_;
+    pthread_mutex_destroy(&mutex_);
+    delete service_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    service_->GetAttr(rpc, request, response, null_callback_);
+    if (!rpc->Failed() && S_ISREG(response->stat().mode())) {
+      RecordStat(request->path(), response->stat());
+    }
+    done->Run();
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    service_->ReadLink(rpc, request, response, done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    service_->SymLink(rpc, request, response, done);
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    service_->ReadDir(rpc, request, response, done);
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    bool read_only = ((request->flags() & O_ACCMODE) == O_RDONLY &&
+                      (request->flags() & O_TRUNC) == 0);
+    if (!read_only) {
+      Forget(request->path());
+    }
+    service_->Open(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      AddFile(response->filehandle(), request->path(), read_only);
+    }
+    done->Run();
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    Forget(request->path());
+    service_->Create(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      AddFile(response->filehandle(), request->path(), false);
+    }
+    done->Run();
+  }
+
+  // The ranges the file was read in are remembered for the next open
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    pthread_mutex_lock(&mutex_);
+    OpenFileMap::iterator it = files_.find(request->filehandle());
+    if (it != files_.end()) {
+      OpenFile* file = &it->second;
+      if (file->reading && !file->first_read) {
+        Remember(*file);
+      }
+      memory_.Release(file->charged);
+      files_.erase(it);
+    }
+    pthread_mutex_unlock(&mutex_);
+    service_->Release(rpc, request, response, done);
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    pthread_mutex_lock(&mutex_);
+    OpenFileMap::iterator it = files_.find(request->filehandle());
+    if (it == files_.end() || !it->second.reading) {
+      pthread_mutex_unlock(&mutex_);
+      service_->Read(rpc, request, response, done);
+      return;
+    }
+    OpenFile* file = &it->second;
+    if (Prefetched(*file, request->offset(), request->size(),
+                   response->mutable_buffer())) {
+      Note(file, request->offset(), request->size());
+      pthread_mutex_unlock(&mutex_);
+      g_hits.Increment();
+      memory_.RecordHit();
+      done->Run();
+      return;
+    }
+    std::vector<Range> predicted;
+    if (file->first_read) {
+      Predict(*file, request->offset(), request->size(), &predicted);
+      file->first_read = false;
+    }
+    Note(file, request->offset(), request->size());
+    long long generation = file->generation;
+    pthread_mutex_unlock(&mutex_);
+    if (predicted.empty()) {
+      service_->Read(rpc, request, response, done);
+      return;
+    }
+    proto::ReadVRequest vector_request;
+    vector_request.mutable_header()->CopyFrom(request->header());
+    vector_request.set_filehandle(request->filehandle());
+    proto::ReadVRequest::Range* range = vector_request.add_range();
+    range->set_offset(request->offset());
+    range->set_size(request->size());
+    for (size_t i = 0; i < predicted.size(); ++i) {
+      range = vector_request.add_range();
+      range->set_offset(predicted[i].offset);
+      range->set_size(predicted[i].size);
+    }
+    proto::ReadVResponse vector_response;
+    VectorRpc vector_rpc(rpc);
+    service_->ReadV(&vector_rpc, &vector_request, &vector_response,
+                    null_callback_);
+    if (vector_rpc.Failed() && rpc->IsCanceled()) {
+      rpc->SetFailed(vector_rpc.ErrorText());
+      done->Run();
+      return;
+    } else if (vector_rpc.Failed() ||
+               vector_response.buffer_size() != vector_request.range_size()) {
+      // A predicted range may be what failed, or not every range came back,
+      // so the requested one is read on its own
+      service_->Read(rpc, request, response, done);
+      return;
+    }
+    g_vectored_reads.Increment();
+    response->mutable_buffer()->swap(*vector_response.mutable_buffer(0));
+    long long charged = 0;
+    pthread_mutex_lock(&mutex_);
+    it = files_.find(request->filehandle());
+    if (it != files_.end() && it->second.generation == generation) {
+      for (size_t i = 0; i < predicted.size(); ++i) {
+        std::string* data = vector_response.mutable_buffer(i + 1);
+        Prefetch* prefetch = &it->second.prefetched[predicted[i].offset];
+        prefetch->eof = (static_cast<long long>(data->size()) <
+                             predicted[i].size ||
+                         predicted[i].offset + static_cast<long long>(
+                             data->size()) >= it->second.stat.size);
+        prefetch->data.swap(*data);
+        charged += prefetch->data.size();
+      }
+      it->second.charged += charged;
+    }
+    pthread_mutex_unlock(&mutex_);
+    g_prefetched_bytes.IncrementBy(charged);
+    memory_.Charge(charged);
+    done->Run();
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    service_->ReadV(rpc, request, response, done);
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    ForgetHandle(request->filehandle());
+    service_->Write(rpc, request, response, done);
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    ForgetHandle(request->destination_filehandle());
+    service_->CopyRange(rpc, request, response, done);
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    Forget(request->path());
+    service_->Truncate(rpc, request, response, done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    ForgetHandle(request->filehandle());
+    service_->FTruncate(rpc, request, response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    service_->FGetAttr(rpc, request, response, done);
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    Forget(request->path());
+    service_->Unlink(rpc, request, response, done);
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    Forget(request->path());
+    service_->RemoveTree(rpc, request, response, done);
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    Forget(request->source_path());
+    Forget(request->destination_path());
+    service_->Rename(rpc, request, response, done);
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    service_->MkDir(rpc, request, response, done);
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    service_->StatFs(rpc, request, response, done);
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    service_->GetXAttr(rpc, request, response, done);
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    service_->SetXAttr(rpc, request, response, done);
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    service_->ListXAttr(rpc, request, response, done);
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    service_->RemoveXAttr(rpc, request, response, done);
+  }
+
+ private:
+  void RecordStat(const std::string& path, const proto::Stat& stat) {
+    long long now = NowMicros();
+    pthread_mutex_lock(&mutex_);
+    if (recent_stats_.size() >= kMaxRecentStats &&
+        recent_stats_.find(path) == recent_stats_.end()) {
+      RecentStatMap::iterator oldest = recent_stats_.begin();
+      for (RecentStatMap::iterator it = recent_stats_.begin();
+           it != recent_stats_.end(); ++it) {
+        if (it->second.usec < oldest->second.usec) {
+          oldest = it;
+        }
+      }
+      recent_stats_.erase(oldest);
+    }
+    RecentStat* recent = &recent_stats_[path];
+    recent->stat.size = stat.size();
+    recent->stat.mtime_sec = stat.mtime().tv_sec();
+    recent->stat.mtime_nsec = stat.mtime().tv_nsec();
+    recent->usec = now;
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Files opened for writing are tracked too, so that their writes drop what
+  // is kept for the other handles of the file.
+  void AddFile(long long filehandle, const std::string& path, bool read_only) {
+    pthread_mutex_lock(&mutex_);
+    OpenFile* file = &files_[filehandle];
+    file->path = path;
+    file->reading = false;
+    file->first_read = true;
+    file->next_offset = 0;
+    file->charged = 0;
+    file->generation = 0;
+    RecentStatMap::iterator it = recent_stats_.find(path);
+    if (read_only && it != recent_stats_.end() &&
+        NowMicros() - it->second.usec < kRecentStatUsec &&
+        it->second.stat.size >= options_.min_file_size) {
+      file->reading = true;
+      file->stat = it->second.stat;
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Returns true, with the data in buffer, if the read falls within a range
+  // that was fetched ahead.  Called with mutex_ held.
+  static bool Prefetched(const OpenFile& file, long long offset,
+                         long long size, std::string* buffer) {
+    PrefetchMap::const_iterator it = file.prefetched.upper_bound(offset);
+    if (it == file.prefetched.begin()) {
+      return false;
+    }
+    --it;
+    const Prefetch& prefetch = it->second;
+    long long end = it->first + prefetch.data.size();
+    if (offset + size > end && !(prefetch.eof && offset <= end)) {
+      return false;
+    }
+    long long start = offset - it->first;
+    buffer->assign(prefetch.data, start, std::min(size, end - offset));
+    return true;
+  }
+
+  // Chooses the ranges to fetch along with the first read of a file, leaving
+  // out those that overlap it.  Called with mutex_ held.
+  void Predict(const OpenFile& file, long long offset, long long size,
+               std::vector<Range>* predicted) {
+    std::vector<Range> ranges;
+    HistoryMap::iterator it = history_.find(file.path);
+    if (it != history_.end() && SameStat(it->second.stat, file.stat)) {
+      it->second.used_usec = NowMicros();
+      ranges = it->second.ranges;
+    } else if (options_.tail_size > 0) {
+      Range tail;
+      tail.offset = std::max(0LL, file.stat.size - options_.tail_size);
+      tail.size = file.stat.size - tail.offset;
+      ranges.push_back(tail);
+    }
+    long long total = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      const Range& range = ranges[i];
+      if (range.offset < offset + size && offset < range.offset + range.size) {
+        continue;
+      }
+      if (total + range.size > kMaxPrefetch) {
+        break;
+      }
+      total += range.size;
+      predicted->push_back(range);
+    }
+  }
+
+  // Records a read in the ranges read after seeking.  A read that continues
+  // the last of them extends it.  Called with mutex_ held.
+  void Note(OpenFile* file, long long offset, long long size) {
+    // The kernel reads whole pages past the end of the file
+    size = std::max(0LL, std::min(size, file->stat.size - offset));
+    if (offset == file->next_offset && !file->seeks.empty()) {
+      Range* last = &file->seeks.back();
+      if (last->offset + last->size == offset) {
+        last->size = std::min(kMaxRangeSize, last->size + size);
+      }
+    } else if (offset != file->next_offset && offset != 0 &&
+               file->seeks.size() < static_cast<size_t>(options_.max_ranges)) {
+      Range range;
+      range.offset = offset;
+      range.size = std::min(kMaxRangeSize, size);
+      file->seeks.push_back(range);
+    }
+    file->next_offset = offset + size;
+  }
+
+  // Called with mutex_ held
+  void Remember(const OpenFile& file) {
+    if (history_.size() >= static_cast<size_t>(options_.max_files) &&
+        history_.find(file.path) == history_.end()) {
+      HistoryMap::iterator oldest = history_.begin();
+      for (HistoryMap::iterator it = history_.begin(); it != history_.end();
+           ++it) {
+        if (it->second.used_usec < oldest->second.used_usec) {
+          oldest = it;
+        }
+      }
+      history_.erase(oldest);
+    }
+    History* history = &history_[file.path];
+    history->stat = file.stat;
+    history->ranges = file.seeks;
+    history->used_usec = NowMicros();
+  }
+
+  // Drops what is kept for the file with filehandle and the other handles of
+  // the same file
+  void ForgetHandle(long long filehandle) {
+    std::string path;
+    pthread_mutex_lock(&mutex_);
+    OpenFileMap::iterator it = files_.find(filehandle);
+    if (it != files_.end()) {
+      path = it->second.path;
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (!path.empty()) {
+      Forget(path);
+    }
+  }
+
+  // Drops what is kept for path and anything beneath it
+  void Forget(const std::string& path) {
+    pthread_mutex_lock(&mutex_);
+    for (OpenFileMap::iterator it = files_.begin(); it != files_.end();
+         ++it) {
+      OpenFile* file = &it->second;
+      if (IsAtOrBeneath(file->path, path)) {
+        DropPrefetched(file);
+        // The file is no longer what its history describes
+        file->reading = false;
+        file->generation++;
+      }
+    }
+    for (HistoryMap::iterator it = history_.begin(); it != history_.end();) {
+      if (IsAtOrBeneath(it->first, path)) {
+        history_.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    for (RecentStatMap::iterator it = recent_stats_.begin();
+         it != recent_stats_.end();) {
+      if (IsAtOrBeneath(it->first, path)) {
+        recent_stats_.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  void DropPrefetched(OpenFile* file) {
+    file->prefetched.clear();
+    memory_.Release(file->charged);
+    file->charged = 0;
+  }
+
+  // Invoked when over the memory budget.  The ranges are fetched again, one
+  // read at a time, if they are still needed.
+  static void EvictPrefetched(long long bytes, void* data) {
+    PrefetchService* service = static_cast<PrefetchService*>(data);
+    if (pthread_mutex_trylock(&service->mutex_) != 0) {
+      return;
+    }
+    for (OpenFileMap::iterator it = service->files_.begin();
+         bytes > 0 && it != service->files_.end(); ++it) {
+      bytes -= it->second.charged;
+      service->DropPrefetched(&it->second);
+    }
+    pthread_mutex_unlock(&service->mutex_);
+  }
+
+  proto::FsService* service_;
+  PrefetchOptions options_;
+  Closure* null_callback_;
+  pthread_mutex_t mutex_;
+  OpenFileMap files_;
+  HistoryMap history_;
+  RecentStatMap recent_stats_;
+  memory::Consumer memory_;
+};
+
+proto::FsService* NewPrefetchFsService(proto::FsService* service,
+                                       const PrefetchOptions& options) {
+  return new PrefetchService(service, options);
+}
+
+}  // namespace prefetch
@@ -0,0 +1,49 @@
+// An FsService that fetches the parts of a file a reader is about to ask for
+// along with its first read, in a single ReadV call.  Media players and
+// thumbnail and EXIF readers read the header of a file and then seek to an
+// index or tags elsewhere, often at the end, and each seek otherwise costs a
+// separate call to the device by the time the kernel asks for the data.
+//
+// When a file that is at least min_file_size bytes long is opened read-only,
+// its first read is made as a ReadV that also fetches the predicted ranges.
+// The ranges are the ones read after a seek the last time the file was
+// opened, if its size and modification time have not changed since, and
+// otherwise the last tail_size bytes of the file.  The ranges fetched are
+// kept until the file is released and answer the reads that fall within
+// them.  The reads of up to max_files files are remembered, each as at most
+// max_ranges ranges; a file read without seeking is remembered as having
+// none, so that its tail is not fetched again.
+//
+// The size and modification time of a file are taken from a GetAttr shortly
+// before it is opened, which the kernel makes when it looks the file up.
+// Writes, truncates, renames and removals drop what is kept for the file.
+
+#ifndef __PREFETCH_PREFETCH_FS_SERVICE_H__
+#define __PREFETCH_PREFETCH_FS_SERVICE_H__
+
+namespace proto {
+class FsService;
+}
+
+namespace prefetch {
+
+struct PrefetchOptions {
+  PrefetchOptions()
+      : tail_size(64 * 1024), min_file_size(256 * 1024), max_ranges(8),
+        max_files(256) { }
+
+  // Zero disables fetching the tail of files without a history
+  long long tail_size;
+  // Smaller files are left to the read-ahead of the kernel
+  long long min_file_size;
+  int max_ranges;
+  int max_files;
+};
+
+// Takes ownership of service
+proto::FsService* NewPrefetchFsService(proto::FsService* service,
+                                       const PrefetchOptions& options);
+
+}  // namespace prefetch
+
+#endif  // __PREFETCH_PREFETCH_FS_SERVICE_H__
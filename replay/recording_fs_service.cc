@@ -0,0 +1,342 @@
+#include "replay/recording_fs_service.h"
+
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include "proto/fs_service.pb.h"
+#include "proto/recording.pb.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::Message;
+using ::google::protobuf::RpcController;
+
+namespace replay {
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Adds the parts of a response that the replay needs to a recorded call.  Most
+// responses have none.
+template <class Response>
+static void RecordResponse(const Response& response,
+                           proto::RecordedCall* call) { }
+
+static void RecordResponse(const proto::OpenResponse& response,
+                           proto::RecordedCall* call) {
+  call->set_filehandle(response.filehandle());
+}
+
+static void RecordResponse(const proto::CreateResponse& response,
+                           proto::RecordedCall* call) {
+  call->set_filehandle(response.filehandle());
+}
+
+static void RecordResponse(const proto::ReadResponse& response,
+                           proto::RecordedCall* call) {
+  call->set_size(response.buffer().size());
+}
+
+static void RecordResponse(const proto::ReadVResponse& response,
+                           proto::RecordedCall* call) {
+  long long size = 0;
+  for (int i = 0; i < response.buffer_size(); ++i) {
+    size += response.buffer(i).size();
+  }
+  call->set_size(size);
+}
+
+static void RecordResponse(const proto::CopyRangeResponse& response,
+                           proto::RecordedCall* call) {
+  call->set_size(response.size());
+}
+
+class RecordingService : public proto::FsService {
+ public:
+  RecordingService(proto::FsService* service, FILE* file)
+      : service_(service), file_(file), start_usec_(NowMicros()) {
+    pthread_mutex_init(&mutex_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~RecordingService() {
+    fclose(file_);
+    delete null_callback_;
+    pthread_mutex_destroy(&mutex_);
+    delete service_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    Forward("GetAttr", &proto::FsService::GetAttr, rpc, request, response,
+            done);
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    Forward("ReadLink", &proto::FsService::ReadLink, rpc, request, response,
+            done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    Forward("SymLink", &proto::FsService::SymLink, rpc, request, response,
+            done);
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    Forward("ReadDir", &proto::FsService::ReadDir, rpc, request, response,
+            done);
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    Forward("Unlink", &proto::FsService::Unlink, rpc, request, response,
+            done);
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    Forward("RemoveTree", &proto::FsService::RemoveTree, rpc, request,
+            response, done);
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    Forward("MkDir", &proto::FsService::MkDir, rpc, request, response, done);
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    Forward("Rename", &proto::FsService::Rename, rpc, request, response,
+            done);
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    Forward("Open", &proto::FsService::Open, rpc, request, response, done);
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    Forward("Create", &proto::FsService::Create, rpc, request, response,
+            done);
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    Forward("Release", &proto::FsService::Release, rpc, request, response,
+            done);
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    Forward("Read", &proto::FsService::Read, rpc, request, response, done);
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    Forward("ReadV", &proto::FsService::ReadV, rpc, request, response, done);
+  }
+
+  // The buffer is left out of the recording; only its size is kept.
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    long long start = NowMicros();
+    service_->Write(rpc, request, response, null_callback_);
+    long long end = NowMicros();
+    proto::WriteRequest recorded;
+    recorded.mutable_header()->CopyFrom(request->header());
+    recorded.set_filehandle(request->filehandle());
+    recorded.set_offset(request->offset());
+    recorded.set_buffer("");
+    proto::RecordedCall call;
+    call.set_size(request->buffer().size());
+    Record("Write", recorded, start, end, rpc->Failed(), &call);
+    done->Run();
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    Forward("CopyRange", &proto::FsService::CopyRange, rpc, request,
+            response, done);
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    Forward("Truncate", &proto::FsService::Truncate, rpc, request, response,
+            done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    Forward("FTruncate", &proto::FsService::FTruncate, rpc, request,
+            response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    Forward("FGetAttr", &proto::FsService::FGetAttr, rpc, request, response,
+            done);
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    Forward("StatFs", &proto::FsService::StatFs, rpc, request, response,
+            done);
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    Forward("GetXAttr", &proto::FsService::GetXAttr, rpc, request, response,
+            done);
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    Forward("SetXAttr", &proto::FsService::SetXAttr, rpc, request, response,
+            done);
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    Forward("ListXAttr", &proto::FsService::ListXAttr, rpc, request, response,
+            done);
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    Forward("RemoveXAttr", &proto::FsService::RemoveXAttr, rpc, request,
+            response, done);
+  }
+
+ private:
+  template <class Request, class Response>
+  void Forward(const char* name,
+               void (proto::FsService::*method)(RpcController*,
+                                                const Request*,
+                                                Response*,
+                                                Closure*),
+               RpcController* rpc,
+               const Request* request,
+               Response* response,
+               Closure* done) {
+    long long start = NowMicros();
+    (service_->*method)(rpc, request, response, null_callback_);
+    long long end = NowMicros();
+    proto::RecordedCall call;
+    if (!rpc->Failed()) {
+      RecordResponse(*response, &call);
+    }
+    Record(name, *request, start, end, rpc->Failed(), &call);
+    done->Run();
+  }
+
+  void Record(const char* name, const Message& request, long long start,
+              long long end, bool failed, proto::RecordedCall* call) {
+    call->set_method(name);
+    request.SerializeToString(call->mutable_request());
+    call->set_start_usec(start - start_usec_);
+    call->set_duration_usec(end - start);
+    if (failed) {
+      call->set_failed(true);
+    }
+    pthread_mutex_lock(&mutex_);
+    std::map<pthread_t, int>::iterator it = threads_.find(pthread_self());
+    if (it == threads_.end()) {
+      int thread = threads_.size();
+      it = threads_.insert(std::make_pair(pthread_self(), thread)).first;
+    }
+    call->set_thread(it->second);
+    std::string buffer;
+    call->SerializeToString(&buffer);
+    // The length of the call as a varint
+    unsigned char length[5];
+    int n = 0;
+    size_t size = buffer.size();
+    do {
+      length[n] = size & 0x7f;
+      size >>= 7;
+      if (size != 0) {
+        length[n] |= 0x80;
+      }
+      n++;
+    } while (size != 0);
+    if (fwrite(length, 1, n, file_) != static_cast<size_t>(n) ||
+        fwrite(buffer.data(), 1, buffer.size(), file_) != buffer.size()) {
+      syslog(LOG_ERR, "Failed to write recording: %m");
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  proto::FsService* service_;
+  FILE* file_;
+  long long start_usec_;
+  Closure* null_callback_;
+  pthread_mutex_t mutex_;  // protects file_ and threads_
+  std::map<pthread_t, int> threads_;
+};
+
+proto::FsService* NewRecordingFsService(proto::FsService* service,
+                                        const std::string& filename) {
+  FILE* file = fopen(filename.c_str(), "wb");
+  if (file == NULL) {
+    syslog(LOG_ERR, "Unable to create recording %s: %m", filename.c_str());
+    return NULL;
+  }
+  return new RecordingService(service, file);
+}
+
+}  // namespace replay
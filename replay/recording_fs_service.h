@@ -0,0 +1,25 @@
+// An FsService that records every call made to another service, so that a
+// workload seen in the field can be replayed later (see test/fs_replay.cc).
+// The recording holds the requests, their start time and duration and the
+// calling thread, but none of the file contents.
+
+#ifndef __REPLAY_RECORDING_FS_SERVICE_H__
+#define __REPLAY_RECORDING_FS_SERVICE_H__
+
+#include <string>
+
+namespace proto {
+class FsService;
+}
+
+namespace replay {
+
+// Takes ownership of service, unless the recording file cannot be created, in
+// which case NULL is returned.  The recording is complete once the returned
+// service is deleted.
+proto::FsService* NewRecordingFsService(proto::FsService* service,
+                                        const std::string& filename);
+
+}  // namespace replay
+
+#endif  // __REPLAY_RECORDING_FS_SERVICE_H__
@@ -0,0 +1,55 @@
+#include "replay/recording_reader.h"
+
+#include <syslog.h>
+#include "proto/recording.pb.h"
+
+namespace replay {
+
+RecordingReader::RecordingReader() : file_(NULL), error_(false) { }
+
+RecordingReader::~RecordingReader() {
+  if (file_ != NULL) {
+    fclose(file_);
+  }
+}
+
+bool RecordingReader::Open(const std::string& filename) {
+  file_ = fopen(filename.c_str(), "rb");
+  if (file_ == NULL) {
+    syslog(LOG_ERR, "Unable to open recording %s: %m", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool RecordingReader::Next(proto::RecordedCall* call) {
+  unsigned int length = 0;
+  for (int shift = 0; ; shift += 7) {
+    int c = fgetc(file_);
+    if (c == EOF) {
+      // The end of the file is only expected between calls
+      error_ = (shift != 0);
+      return false;
+    }
+    if (shift > 28) {
+      error_ = true;
+      return false;
+    }
+    length |= (c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      break;
+    }
+  }
+  std::string buffer(length, '\0');
+  if (length > 0 && fread(&buffer[0], 1, length, file_) != length) {
+    error_ = true;
+    return false;
+  }
+  if (!call->ParseFromString(buffer)) {
+    error_ = true;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace replay
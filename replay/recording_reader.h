@@ -0,0 +1,35 @@
+// Reads the calls written by a recording service.
+
+#ifndef __REPLAY_RECORDING_READER_H__
+#define __REPLAY_RECORDING_READER_H__
+
+#include <stdio.h>
+#include <string>
+
+namespace proto {
+class RecordedCall;
+}
+
+namespace replay {
+
+class RecordingReader {
+ public:
+  RecordingReader();
+  ~RecordingReader();
+
+  bool Open(const std::string& filename);
+
+  // Reads the next call.  Returns false at the end of the recording, or if
+  // the recording is truncated or corrupt, in which case error() is set.
+  bool Next(proto::RecordedCall* call);
+
+  bool error() const { return error_; }
+
+ private:
+  FILE* file_;
+  bool error_;
+};
+
+}  // namespace replay
+
+#endif  // __REPLAY_RECORDING_READER_H__
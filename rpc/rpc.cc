@@ -2,17 +2,34 @@
 
 #include "rpc/rpc.h"
 
+#include <sys/time.h>
+
 namespace rpc {
 
-Rpc::Rpc() {
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+Rpc::Rpc() : cancel_callback_(NULL) {
+  pthread_mutex_init(&mutex_, NULL);
   Reset();
 }
 
-Rpc::~Rpc() { }
+Rpc::~Rpc() {
+  RunCancelCallback();
+  pthread_mutex_destroy(&mutex_);
+}
 
 void Rpc::Reset() {
+  RunCancelCallback();
   failed_ = false;
   error_text_.clear();
+  pthread_mutex_lock(&mutex_);
+  canceled_ = false;
+  deadline_usec_ = 0;
+  pthread_mutex_unlock(&mutex_);
 }
 
 bool Rpc::Failed() const {
@@ -23,7 +40,18 @@ std::string Rpc::ErrorText() const {
   return error_text_;
 }
 
-void Rpc::StartCancel() { }
+void Rpc::StartCancel() {
+  pthread_mutex_lock(&mutex_);
+  canceled_ = true;
+  pthread_mutex_unlock(&mutex_);
+  RunCancelCallback();
+}
+
+void Rpc::SetTimeout(long long timeout_usec) {
+  pthread_mutex_lock(&mutex_);
+  deadline_usec_ = (timeout_usec > 0) ? NowMicros() + timeout_usec : 0;
+  pthread_mutex_unlock(&mutex_);
+}
 
   // Server-side methods
 void Rpc::SetFailed(const std::string& reason) {
@@ -32,10 +60,33 @@ void Rpc::SetFailed(const std::string& reason) {
 }
 
 bool Rpc::IsCanceled() const {
-  return false;
+  if (canceled_) {
+    return true;
+  }
+  pthread_mutex_lock(const_cast<pthread_mutex_t*>(&mutex_));
+  long long deadline = deadline_usec_;
+  pthread_mutex_unlock(const_cast<pthread_mutex_t*>(&mutex_));
+  return deadline != 0 && NowMicros() >= deadline;
 }
 
 void Rpc::NotifyOnCancel(google::protobuf::Closure* callback) {
+  pthread_mutex_lock(&mutex_);
+  cancel_callback_ = callback;
+  bool canceled = canceled_;
+  pthread_mutex_unlock(&mutex_);
+  if (canceled) {
+    RunCancelCallback();
+  }
+}
+
+void Rpc::RunCancelCallback() {
+  pthread_mutex_lock(&mutex_);
+  google::protobuf::Closure* callback = cancel_callback_;
+  cancel_callback_ = NULL;
+  pthread_mutex_unlock(&mutex_);
+  if (callback != NULL) {
+    callback->Run();
+  }
 }
 
 }  // namespace rpc
@@ -1,5 +1,6 @@
 // Author: Allen Porter <allen@thebends.org>
 
+#include <pthread.h>
 #include <google/protobuf/service.h>
 
 namespace google {
@@ -10,7 +11,10 @@ class Closure;
 
 namespace rpc {
 
-// A simple RpcController implementation that does not support cancellation.
+// A simple RpcController implementation.  A call may be canceled from any
+// thread with StartCancel, or given a deadline with SetTimeout; services
+// that do a lot of work for one call (such as a large read split into
+// chunks) check IsCanceled as they go and give up early.
 class Rpc : public google::protobuf::RpcController {
  public:
   Rpc();
@@ -22,14 +26,29 @@ class Rpc : public google::protobuf::RpcController {
   virtual std::string ErrorText() const;
   virtual void StartCancel();
 
+  // The call is treated as canceled once timeout_usec microseconds have
+  // passed.  A timeout of zero removes the deadline.
+  void SetTimeout(long long timeout_usec);
+
   // Server-side methods
   virtual void SetFailed(const std::string& reason);
   virtual bool IsCanceled() const;
+  // The callback is run once: when the call is canceled, immediately if it
+  // was already canceled, or otherwise when the Rpc is reset or destroyed.
+  // A deadline passing does not run the callback.
   virtual void NotifyOnCancel(google::protobuf::Closure* callback);
 
  private:
+  // Runs the cancel callback, if any.  Must not be called with mutex_ held.
+  void RunCancelCallback();
+
   bool failed_;
   std::string error_text_;
+
+  pthread_mutex_t mutex_;  // protects the fields below
+  volatile bool canceled_;
+  long long deadline_usec_;
+  google::protobuf::Closure* cancel_callback_;
 };
 
 }  // namespace rpc
@@ -0,0 +1,516 @@
+#include "scheduler/scheduling_fs_service.h"
+
+#include <algorithm>
+#include <deque>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <vector>
+#include "fs/remove_tree.h"
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+#include "trace/trace.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace scheduler {
+
+static metrics::Gauge g_metadata_depth(
+    "scheduler_queue_depth", "class=\"metadata\"",
+    "Calls waiting for the service");
+static metrics::Gauge g_bulk_depth(
+    "scheduler_queue_depth", "class=\"bulk\"",
+    "Calls waiting for the service");
+static metrics::Counter g_metadata_calls(
+    "scheduler_calls_total", "class=\"metadata\"",
+    "Calls passed to the service");
+static metrics::Counter g_bulk_calls(
+    "scheduler_calls_total", "class=\"bulk\"",
+    "Calls passed to the service");
+static metrics::Counter g_metadata_wait(
+    "scheduler_wait_usec_total", "class=\"metadata\"",
+    "Time calls spent waiting for the service");
+static metrics::Counter g_bulk_wait(
+    "scheduler_wait_usec_total", "class=\"bulk\"",
+    "Time calls spent waiting for the service");
+static metrics::Counter g_metadata_canceled(
+    "scheduler_canceled_total", "class=\"metadata\"",
+    "Calls canceled while waiting for the service");
+static metrics::Counter g_bulk_canceled(
+    "scheduler_canceled_total", "class=\"bulk\"",
+    "Calls canceled while waiting for the service");
+static metrics::Counter g_metadata_service(
+    "scheduler_service_usec_total", "class=\"metadata\"",
+    "Time calls spent in the service");
+static metrics::Counter g_bulk_service(
+    "scheduler_service_usec_total", "class=\"bulk\"",
+    "Time calls spent in the service");
+
+// How often a waiting call checks whether it has been canceled
+static const long long kCancelPollUsec = 10 * 1000;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+enum CallClass {
+  METADATA,
+  BULK
+};
+
+struct ClassMetrics {
+  metrics::Gauge* depth;
+  metrics::Counter* calls;
+  metrics::Counter* wait;
+  metrics::Counter* canceled;
+  metrics::Counter* service;
+};
+
+static const ClassMetrics kClassMetrics[] = {
+  { &g_metadata_depth, &g_metadata_calls, &g_metadata_wait,
+    &g_metadata_canceled, &g_metadata_service },
+  { &g_bulk_depth, &g_bulk_calls, &g_bulk_wait, &g_bulk_canceled,
+    &g_bulk_service },
+};
+
+class SchedulingService : public proto::FsService {
+ public:
+  SchedulingService(proto::FsService* service,
+                    const SchedulerOptions& options)
+      : service_(service),
+        options_(options),
+        busy_(false),
+        metadata_run_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~SchedulingService() {
+    delete null_callback_;
+    pthread_mutex_destroy(&mutex_);
+    delete service_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    Call(METADATA, &proto::FsService::GetAttr, rpc, request, response);
+    done->Run();
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    Call(METADATA, &proto::FsService::ReadLink, rpc, request, response);
+    done->Run();
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    Call(METADATA, &proto::FsService::SymLink, rpc, request, response);
+    done->Run();
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    Call(METADATA, &proto::FsService::ReadDir, rpc, request, response);
+    done->Run();
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    Call(METADATA, &proto::FsService::Unlink, rpc, request, response);
+    done->Run();
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    fs::RemoveTree(std::vector<proto::FsService*>(1, this), rpc, request,
+                   response);
+    done->Run();
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    Call(METADATA, &proto::FsService::MkDir, rpc, request, response);
+    done->Run();
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    Call(METADATA, &proto::FsService::Rename, rpc, request, response);
+    done->Run();
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    Call(METADATA, &proto::FsService::Open, rpc, request, response);
+    done->Run();
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    Call(METADATA, &proto::FsService::Create, rpc, request, response);
+    done->Run();
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    // The handle is released even if the caller has given up on the call
+    Call(METADATA, &proto::FsService::Release, rpc, request, response, false);
+    done->Run();
+  }
+
+  // Large reads are split into chunks, stopping at the first short chunk.
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    if (request->size() <= options_.max_bulk_chunk) {
+      Call(BULK, &proto::FsService::Read, rpc, request, response);
+      done->Run();
+      return;
+    }
+    std::string* buffer = response->mutable_buffer();
+    proto::ReadRequest chunk_request(*request);
+    while (static_cast<long long>(buffer->size()) < request->size()) {
+      long long size = std::min<long long>(options_.max_bulk_chunk,
+                                           request->size() - buffer->size());
+      chunk_request.set_offset(request->offset() + buffer->size());
+      chunk_request.set_size(size);
+      proto::ReadResponse chunk_response;
+      Call(BULK, &proto::FsService::Read, rpc, &chunk_request,
+           &chunk_response);
+      if (rpc->Failed()) {
+        break;
+      }
+      buffer->append(chunk_response.buffer());
+      if (static_cast<long long>(chunk_response.buffer().size()) < size) {
+        break;
+      }
+    }
+    done->Run();
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    long long total = 0;
+    for (int i = 0; i < request->range_size(); ++i) {
+      total += request->range(i).size();
+    }
+    if (total <= options_.max_bulk_chunk) {
+      Call(BULK, &proto::FsService::ReadV, rpc, request, response);
+      done->Run();
+      return;
+    }
+    proto::ReadRequest range_request;
+    range_request.mutable_header()->CopyFrom(request->header());
+    range_request.set_filehandle(request->filehandle());
+    for (int i = 0; i < request->range_size() && !rpc->Failed(); ++i) {
+      range_request.set_offset(request->range(i).offset());
+      range_request.set_size(request->range(i).size());
+      proto::ReadResponse range_response;
+      Read(rpc, &range_request, &range_response, null_callback_);
+      response->add_buffer()->swap(*range_response.mutable_buffer());
+    }
+    if (rpc->Failed()) {
+      response->Clear();
+    }
+    done->Run();
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    const std::string& buffer = request->buffer();
+    if (buffer.size() <= static_cast<size_t>(options_.max_bulk_chunk)) {
+      Call(BULK, &proto::FsService::Write, rpc, request, response);
+      done->Run();
+      return;
+    }
+    proto::WriteRequest chunk_request;
+    chunk_request.mutable_header()->CopyFrom(request->header());
+    chunk_request.set_filehandle(request->filehandle());
+    long long total = 0;
+    while (total < static_cast<long long>(buffer.size())) {
+      size_t size = std::min<size_t>(options_.max_bulk_chunk,
+                                     buffer.size() - total);
+      chunk_request.set_offset(request->offset() + total);
+      chunk_request.mutable_buffer()->assign(buffer, total, size);
+      proto::WriteResponse chunk_response;
+      Call(BULK, &proto::FsService::Write, rpc, &chunk_request,
+           &chunk_response);
+      if (rpc->Failed()) {
+        break;
+      }
+      total += chunk_response.size();
+      if (chunk_response.size() < static_cast<long long>(size)) {
+        break;
+      }
+    }
+    response->set_size(total);
+    done->Run();
+  }
+
+  // Large copies are split into chunks like reads, stopping at the first
+  // short chunk.
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    if (request->size() <= options_.max_bulk_chunk) {
+      Call(BULK, &proto::FsService::CopyRange, rpc, request, response);
+      done->Run();
+      return;
+    }
+    proto::CopyRangeRequest chunk_request(*request);
+    long long total = 0;
+    while (total < request->size()) {
+      long long size = std::min<long long>(options_.max_bulk_chunk,
+                                           request->size() - total);
+      chunk_request.set_source_offset(request->source_offset() + total);
+      chunk_request.set_destination_offset(request->destination_offset() +
+                                           total);
+      chunk_request.set_size(size);
+      proto::CopyRangeResponse chunk_response;
+      Call(BULK, &proto::FsService::CopyRange, rpc, &chunk_request,
+           &chunk_response);
+      if (rpc->Failed()) {
+        break;
+      }
+      total += chunk_response.size();
+      if (chunk_response.size() < size) {
+        break;
+      }
+    }
+    response->set_size(total);
+    done->Run();
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    Call(METADATA, &proto::FsService::Truncate, rpc, request, response);
+    done->Run();
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    Call(METADATA, &proto::FsService::FTruncate, rpc, request, response);
+    done->Run();
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    Call(METADATA, &proto::FsService::FGetAttr, rpc, request, response);
+    done->Run();
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    Call(METADATA, &proto::FsService::StatFs, rpc, request, response);
+    done->Run();
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    Call(METADATA, &proto::FsService::GetXAttr, rpc, request, response);
+    done->Run();
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    Call(METADATA, &proto::FsService::SetXAttr, rpc, request, response);
+    done->Run();
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    Call(METADATA, &proto::FsService::ListXAttr, rpc, request, response);
+    done->Run();
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    Call(METADATA, &proto::FsService::RemoveXAttr, rpc, request, response);
+    done->Run();
+  }
+
+ private:
+  // A call waiting in one of the queues
+  struct Waiter {
+    Waiter() : granted(false) {
+      pthread_cond_init(&cond, NULL);
+    }
+
+    ~Waiter() {
+      pthread_cond_destroy(&cond);
+    }
+
+    bool granted;
+    pthread_cond_t cond;
+  };
+
+  // Waits for the turn of the call, then invokes it on the wrapped service.
+  // A cancelable call that is canceled while waiting is dropped without
+  // reaching the service; other calls always wait for their turn.
+  template <class Request, class Response>
+  void Call(CallClass call_class,
+            void (proto::FsService::*method)(RpcController*,
+                                             const Request*,
+                                             Response*,
+                                             Closure*),
+            RpcController* rpc,
+            const Request* request,
+            Response* response,
+            bool cancelable = true) {
+    const ClassMetrics& metrics = kClassMetrics[call_class];
+    long long queued = NowMicros();
+    trace::Span wait_span("scheduler", call_class == METADATA ?
+                                       "WaitMetadata" : "WaitBulk");
+    bool acquired = Acquire(call_class, cancelable ? rpc : NULL);
+    wait_span.End();
+    long long start = NowMicros();
+    metrics.wait->IncrementBy(start - queued);
+    if (!acquired) {
+      metrics.canceled->Increment();
+      rpc->SetFailed("Canceled");
+      return;
+    }
+    (service_->*method)(rpc, request, response, null_callback_);
+    long long end = NowMicros();
+    Release();
+    metrics.calls->Increment();
+    metrics.service->IncrementBy(end - start);
+  }
+
+  // Returns false, without the service, if the call is canceled first.  The
+  // call is not checked for cancellation when rpc is NULL.
+  bool Acquire(CallClass call_class, RpcController* rpc) {
+    if (rpc != NULL && rpc->IsCanceled()) {
+      return false;
+    }
+    pthread_mutex_lock(&mutex_);
+    if (!busy_) {
+      busy_ = true;
+      pthread_mutex_unlock(&mutex_);
+      return true;
+    }
+    Waiter waiter;
+    std::deque<Waiter*>* queue = &queues_[call_class];
+    queue->push_back(&waiter);
+    kClassMetrics[call_class].depth->Add(1);
+    while (!waiter.granted) {
+      long long wake = NowMicros() + kCancelPollUsec;
+      struct timespec ts;
+      ts.tv_sec = wake / 1000000;
+      ts.tv_nsec = (wake % 1000000) * 1000;
+      pthread_cond_timedwait(&waiter.cond, &mutex_, &ts);
+      if (waiter.granted) {
+        break;
+      }
+      if (rpc == NULL) {
+        continue;
+      }
+      // The controller may run callbacks, so it is not called with the lock
+      pthread_mutex_unlock(&mutex_);
+      bool canceled = rpc->IsCanceled();
+      pthread_mutex_lock(&mutex_);
+      if (canceled && !waiter.granted) {
+        queue->erase(std::find(queue->begin(), queue->end(), &waiter));
+        kClassMetrics[call_class].depth->Add(-1);
+        pthread_mutex_unlock(&mutex_);
+        return false;
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+    return true;
+  }
+
+  // Hands the service to the next waiting call, if any.  While both classes
+  // are waiting, every metadata_weight metadata calls are followed by one
+  // bulk call.
+  void Release() {
+    pthread_mutex_lock(&mutex_);
+    std::deque<Waiter*>* metadata = &queues_[METADATA];
+    std::deque<Waiter*>* bulk = &queues_[BULK];
+    CallClass next;
+    if (!metadata->empty() &&
+        (bulk->empty() || metadata_run_ < options_.metadata_weight)) {
+      next = METADATA;
+      metadata_run_++;
+    } else if (!bulk->empty()) {
+      next = BULK;
+      metadata_run_ = 0;
+    } else {
+      busy_ = false;
+      metadata_run_ = 0;
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    Waiter* waiter = queues_[next].front();
+    queues_[next].pop_front();
+    kClassMetrics[next].depth->Add(-1);
+    waiter->granted = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  proto::FsService* service_;
+  SchedulerOptions options_;
+  Closure* null_callback_;
+  pthread_mutex_t mutex_;  // protects the fields below
+  bool busy_;
+  std::deque<Waiter*> queues_[2];
+  // Metadata calls granted since the last bulk call
+  int metadata_run_;
+};
+
+proto::FsService* NewSchedulingFsService(proto::FsService* service,
+                                         const SchedulerOptions& options) {
+  return new SchedulingService(service, options);
+}
+
+}  // namespace scheduler
@@ -0,0 +1,40 @@
+// An FsService that lets one call at a time through to another service, such
+// as a device reached over a single AFC connection, picking the next call so
+// that interactive requests are not stuck behind bulk transfers.
+//
+// Calls are split into two classes.  Read, ReadV, Write and CopyRange are
+// bulk calls; every other call is a metadata call.  Each class has its own
+// queue, served in first come first served order, and when both queues are
+// waiting the metadata queue is served metadata_weight times for every bulk
+// call.  Bulk calls larger than max_bulk_chunk are split into several calls
+// that each wait their turn, so a metadata call never waits for more than one
+// chunk; a ReadV larger than that is made as one Read for each range.  A
+// RemoveTree is made as the Unlink and ReadDir calls it takes (see
+// fs/remove_tree.h), each waiting its turn.  A call canceled while it waits
+// (see rpc::Rpc) fails without reaching the wrapped service, and the
+// remaining chunks of a canceled transfer are not sent.  Release is never
+// canceled, so that the handle it frees is not leaked.
+
+#ifndef __SCHEDULER_SCHEDULING_FS_SERVICE_H__
+#define __SCHEDULER_SCHEDULING_FS_SERVICE_H__
+
+namespace proto {
+class FsService;
+}
+
+namespace scheduler {
+
+struct SchedulerOptions {
+  SchedulerOptions() : metadata_weight(4), max_bulk_chunk(256 * 1024) { }
+
+  int metadata_weight;
+  int max_bulk_chunk;
+};
+
+// Takes ownership of service
+proto::FsService* NewSchedulingFsService(proto::FsService* service,
+                                         const SchedulerOptions& options);
+
+}  // namespace scheduler
+
+#endif  // __SCHEDULER_SCHEDULING_FS_SERVICE_H__
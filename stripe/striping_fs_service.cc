@@ -0,0 +1,676 @@
+#include "stripe/striping_fs_service.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <sys/time.h>
+#include <syslog.h>
+#include "fs/remove_tree.h"
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+#include "trace/trace.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace stripe {
+
+static metrics::Counter g_striped_transfers(
+    "stripe_transfers_total", "Transfers split into stripes");
+static metrics::Counter g_retried_stripes(
+    "stripe_retries_total", "Stripes retried on the primary connection");
+static metrics::Gauge g_stripe_count(
+    "stripe_count", "Number of stripes currently preferred");
+
+// Stripes are multiples of this size
+static const long long kStripeAlignment = 4096;
+// Every kProbeInterval transfers one uses a neighbouring stripe count
+static const int kProbeInterval = 8;
+// Weight given to the newest sample in the moving averages
+static const double kSampleWeight = 0.25;
+
+// Returns true if path is directory or beneath it
+static bool IsAtOrBeneath(const std::string& path,
+                          const std::string& directory) {
+  return (path.compare(0, directory.size(), directory) == 0 &&
+          (path.size() == directory.size() || path[directory.size()] == '/' ||
+           directory == "/"));
+}
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// The Rpc of a stripe, which is canceled along with the caller's
+class StripeRpc : public rpc::Rpc {
+ public:
+  explicit StripeRpc(RpcController* parent) : parent_(parent) { }
+
+  virtual bool IsCanceled() const {
+    return parent_->IsCanceled() || rpc::Rpc::IsCanceled();
+  }
+
+ private:
+  RpcController* parent_;
+};
+
+class StripingService;
+
+// One part of a read or write, transferred by its own thread
+struct Stripe {
+  StripingService* service;
+  RpcController* parent;
+  int helper;  // -1 for the primary
+  long long filehandle;  // The caller's handle on the primary
+  long long offset;
+  long long size;
+  const char* data;  // The data to write, or NULL for a read
+  std::string buffer;  // The data read
+  long long transferred;
+  bool failed;
+  std::string error;
+};
+
+static void* RunStripe(void* arg);
+
+class StripingService : public proto::FsService {
+ public:
+  StripingService(proto::FsService* primary,
+                  const std::vector<proto::FsService*>& helpers,
+                  const StripingOptions& options)
+      : primary_(primary), helpers_(helpers), options_(options),
+        busy_(helpers.size(), false), buckets_(helpers.size() + 1),
+        current_(helpers.size()), transfers_(0), probe_up_(true) {
+    pthread_mutex_init(&mutex_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+    g_stripe_count.Set(current_ + 1);
+  }
+
+  virtual ~StripingService() {
+    delete null_callback_;
+    pthread_mutex_destroy(&mutex_);
+    for (size_t i = 0; i < helpers_.size(); ++i) {
+      delete helpers_[i];
+    }
+    delete primary_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    primary_->GetAttr(rpc, request, response, done);
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    primary_->ReadLink(rpc, request, response, done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    primary_->SymLink(rpc, request, response, done);
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    primary_->ReadDir(rpc, request, response, done);
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    primary_->Unlink(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      Moved(request->path(), "");
+    }
+    done->Run();
+  }
+
+  // Entries are removed over every connection at once
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    std::vector<proto::FsService*> services(1, primary_);
+    services.insert(services.end(), helpers_.begin(), helpers_.end());
+    fs::RemoveTree(services, rpc, request, response);
+    // Entries may have been removed even if the call failed
+    Moved(request->path(), "");
+    done->Run();
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    primary_->MkDir(rpc, request, response, done);
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    primary_->Rename(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      Moved(request->destination_path(), "");
+      Moved(request->source_path(), request->destination_path());
+    }
+    done->Run();
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    primary_->Open(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      Opened(response->filehandle(), request->path());
+    }
+    done->Run();
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    primary_->Create(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      Opened(response->filehandle(), request->path());
+    }
+    done->Run();
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    primary_->Release(rpc, request, response, null_callback_);
+    OpenFile file;
+    pthread_mutex_lock(&mutex_);
+    OpenFileMap::iterator it = files_.find(request->filehandle());
+    if (it != files_.end()) {
+      file = it->second;
+      files_.erase(it);
+    }
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i = 0; i < file.handles.size(); ++i) {
+      if (file.handles[i] != -1) {
+        ReleaseHelperHandle(i / 2, file.handles[i]);
+      }
+    }
+    done->Run();
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    std::vector<Stripe> stripes;
+    long long start = NowMicros();
+    if (!Split(rpc, request->filehandle(), request->offset(),
+               request->size(), NULL, &stripes)) {
+      primary_->Read(rpc, request, response, null_callback_);
+      if (!rpc->Failed()) {
+        Record(1, response->buffer().size(), request->size(),
+               NowMicros() - start);
+      }
+      done->Run();
+      return;
+    }
+    trace::Span span("stripe", "Read");
+    span.set_size(request->size());
+    span.set_offset(request->offset());
+    Transfer(&stripes);
+    std::string* buffer = response->mutable_buffer();
+    for (size_t i = 0; i < stripes.size(); ++i) {
+      if (stripes[i].failed) {
+        rpc->SetFailed(stripes[i].error);
+        break;
+      }
+      buffer->append(stripes[i].buffer);
+      if (stripes[i].transferred < stripes[i].size) {
+        break;
+      }
+    }
+    if (!rpc->Failed()) {
+      Record(stripes.size(), buffer->size(), request->size(),
+             NowMicros() - start);
+    } else {
+      buffer->clear();
+    }
+    done->Run();
+  }
+
+  // The ranges of a vectored read are small, so they are not striped
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    primary_->ReadV(rpc, request, response, done);
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    const std::string& buffer = request->buffer();
+    std::vector<Stripe> stripes;
+    long long start = NowMicros();
+    if (!Split(rpc, request->filehandle(), request->offset(), buffer.size(),
+               buffer.data(), &stripes)) {
+      primary_->Write(rpc, request, response, null_callback_);
+      if (!rpc->Failed()) {
+        Record(1, response->size(), buffer.size(), NowMicros() - start);
+      }
+      done->Run();
+      return;
+    }
+    trace::Span span("stripe", "Write");
+    span.set_size(buffer.size());
+    span.set_offset(request->offset());
+    Transfer(&stripes);
+    long long total = 0;
+    for (size_t i = 0; i < stripes.size(); ++i) {
+      if (stripes[i].failed) {
+        rpc->SetFailed(stripes[i].error);
+        break;
+      }
+      total += stripes[i].transferred;
+      if (stripes[i].transferred < stripes[i].size) {
+        break;
+      }
+    }
+    if (!rpc->Failed()) {
+      response->set_size(total);
+      Record(stripes.size(), total, buffer.size(), NowMicros() - start);
+    }
+    done->Run();
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    primary_->CopyRange(rpc, request, response, done);
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    primary_->Truncate(rpc, request, response, done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    primary_->FTruncate(rpc, request, response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    primary_->FGetAttr(rpc, request, response, done);
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    primary_->StatFs(rpc, request, response, done);
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    primary_->GetXAttr(rpc, request, response, done);
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    primary_->SetXAttr(rpc, request, response, done);
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    primary_->ListXAttr(rpc, request, response, done);
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    primary_->RemoveXAttr(rpc, request, response, done);
+  }
+
+  // Transfers one stripe, on the primary if its helper fails
+  void TransferStripe(Stripe* stripe) {
+    if (stripe->helper != -1) {
+      long long fh = HelperHandle(stripe->helper, stripe->filehandle,
+                                  stripe->data != NULL);
+      if (fh != -1 &&
+          Call(helpers_[stripe->helper], fh, stripe)) {
+        return;
+      }
+      g_retried_stripes.Increment();
+      stripe->buffer.clear();
+    }
+    stripe->failed = !Call(primary_, stripe->filehandle, stripe);
+  }
+
+ private:
+  // The helper handles opened for a handle on the primary, indexed by
+  // helper * 2, plus one for the handle used to write.  Unopened handles are
+  // -1.
+  struct OpenFile {
+    // Empty once the file is no longer at the path it was opened with
+    std::string path;
+    std::vector<long long> handles;
+  };
+  typedef std::map<long long, OpenFile> OpenFileMap;
+
+  // Records the path of a newly opened handle
+  void Opened(long long filehandle, const std::string& path) {
+    pthread_mutex_lock(&mutex_);
+    OpenFile* file = &files_[filehandle];
+    file->path = path;
+    file->handles.assign(helpers_.size() * 2, -1);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Invoked after the file or directory at source is renamed to destination,
+  // or removed when destination is empty.  The recorded paths of the open
+  // files there are changed to match, so that helpers do not open another
+  // file in their place.
+  void Moved(const std::string& source, const std::string& destination) {
+    pthread_mutex_lock(&mutex_);
+    for (OpenFileMap::iterator it = files_.begin(); it != files_.end();
+         ++it) {
+      std::string& path = it->second.path;
+      if (!path.empty() && IsAtOrBeneath(path, source)) {
+        if (destination.empty()) {
+          path.clear();
+        } else {
+          path = destination + path.substr(source.size());
+        }
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Returns the handle of a helper for the same file as the caller's handle,
+  // opening it if needed, or -1 if it cannot be opened.  Files are opened
+  // again without O_CREAT or O_TRUNC, since they exist and the caller's
+  // writes must not be lost.
+  long long HelperHandle(int helper, long long filehandle, bool write) {
+    int index = helper * 2 + (write ? 1 : 0);
+    pthread_mutex_lock(&mutex_);
+    OpenFileMap::iterator it = files_.find(filehandle);
+    if (it == files_.end() || it->second.path.empty()) {
+      pthread_mutex_unlock(&mutex_);
+      return -1;
+    } else if (it->second.handles[index] != -1) {
+      long long fh = it->second.handles[index];
+      pthread_mutex_unlock(&mutex_);
+      return fh;
+    }
+    std::string path = it->second.path;
+    pthread_mutex_unlock(&mutex_);
+
+    rpc::Rpc rpc;
+    proto::OpenRequest request;
+    proto::OpenResponse response;
+    request.mutable_header()->set_fs_id("stripe");
+    request.set_path(path);
+    request.set_flags(write ? O_WRONLY : O_RDONLY);
+    helpers_[helper]->Open(&rpc, &request, &response, null_callback_);
+    if (rpc.Failed()) {
+      syslog(LOG_DEBUG, "Helper %d unable to open %s: %s", helper,
+             path.c_str(), rpc.ErrorText().c_str());
+      return -1;
+    }
+    long long fh = response.filehandle();
+    pthread_mutex_lock(&mutex_);
+    it = files_.find(filehandle);
+    bool used = (it != files_.end() && it->second.handles[index] == -1 &&
+                 it->second.path == path);
+    if (used) {
+      it->second.handles[index] = fh;
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (!used) {
+      // The caller's handle was released or its file moved in the meantime
+      ReleaseHelperHandle(helper, fh);
+      return -1;
+    }
+    return fh;
+  }
+
+  void ReleaseHelperHandle(int helper, long long fh) {
+    rpc::Rpc rpc;
+    proto::ReleaseRequest request;
+    proto::ReleaseResponse response;
+    request.mutable_header()->set_fs_id("stripe");
+    request.set_filehandle(fh);
+    helpers_[helper]->Release(&rpc, &request, &response, null_callback_);
+  }
+
+  // Reads or writes a stripe on the handle of a service, returning false if
+  // the call failed.
+  bool Call(proto::FsService* service, long long fh, Stripe* stripe) {
+    StripeRpc rpc(stripe->parent);
+    if (stripe->data == NULL) {
+      proto::ReadRequest request;
+      proto::ReadResponse response;
+      request.mutable_header()->set_fs_id("stripe");
+      request.set_filehandle(fh);
+      request.set_offset(stripe->offset);
+      request.set_size(stripe->size);
+      service->Read(&rpc, &request, &response, null_callback_);
+      stripe->buffer.swap(*response.mutable_buffer());
+      stripe->transferred = stripe->buffer.size();
+    } else {
+      proto::WriteRequest request;
+      proto::WriteResponse response;
+      request.mutable_header()->set_fs_id("stripe");
+      request.set_filehandle(fh);
+      request.set_offset(stripe->offset);
+      request.set_buffer(stripe->data, stripe->size);
+      service->Write(&rpc, &request, &response, null_callback_);
+      stripe->transferred = response.size();
+    }
+    if (rpc.Failed()) {
+      stripe->error = rpc.ErrorText();
+      return false;
+    }
+    return true;
+  }
+
+  // Splits a transfer into stripes, reserving a helper for each but the
+  // last.  Returns false if the transfer should not be split.
+  bool Split(RpcController* rpc, long long filehandle, long long offset,
+             long long size, const char* data, std::vector<Stripe>* stripes) {
+    if (helpers_.empty() || size < 2LL * options_.min_stripe_size) {
+      return false;
+    }
+    pthread_mutex_lock(&mutex_);
+    OpenFileMap::const_iterator file = files_.find(filehandle);
+    if (file == files_.end() || file->second.path.empty()) {
+      pthread_mutex_unlock(&mutex_);
+      return false;
+    }
+    long long count = std::min<long long>(NextStripes(),
+                                          size / options_.min_stripe_size);
+    long long stripe_size = (size + count - 1) / count;
+    stripe_size = (stripe_size + kStripeAlignment - 1) / kStripeAlignment *
+                  kStripeAlignment;
+    count = (size + stripe_size - 1) / stripe_size;
+    std::vector<int> reserved;
+    for (size_t i = 0; i < busy_.size() &&
+         static_cast<long long>(reserved.size()) + 1 < count; ++i) {
+      if (!busy_[i]) {
+        busy_[i] = true;
+        reserved.push_back(i);
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (reserved.empty()) {
+      return false;
+    }
+    // With fewer helpers free than wanted, the last stripe is the larger
+    for (size_t i = 0; i <= reserved.size(); ++i) {
+      Stripe stripe;
+      stripe.service = this;
+      stripe.parent = rpc;
+      stripe.helper = (i < reserved.size()) ? reserved[i] : -1;
+      stripe.filehandle = filehandle;
+      stripe.offset = offset + i * stripe_size;
+      stripe.size = (i < reserved.size()) ? stripe_size :
+                    size - i * stripe_size;
+      stripe.data = (data == NULL) ? NULL : data + i * stripe_size;
+      stripe.transferred = 0;
+      stripe.failed = false;
+      stripes->push_back(stripe);
+    }
+    g_striped_transfers.Increment();
+    return true;
+  }
+
+  // Transfers the stripes in parallel, the last one on the calling thread,
+  // and then frees their helpers.
+  void Transfer(std::vector<Stripe>* stripes) {
+    std::vector<pthread_t> threads(stripes->size() - 1);
+    std::vector<bool> started(threads.size(), false);
+    for (size_t i = 0; i < threads.size(); ++i) {
+      started[i] = (pthread_create(&threads[i], NULL, &RunStripe,
+                                   &(*stripes)[i]) == 0);
+      if (!started[i]) {
+        TransferStripe(&(*stripes)[i]);
+      }
+    }
+    TransferStripe(&stripes->back());
+    for (size_t i = 0; i < threads.size(); ++i) {
+      if (started[i]) {
+        pthread_join(threads[i], NULL);
+      }
+    }
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < threads.size(); ++i) {
+      busy_[(*stripes)[i].helper] = false;
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Returns the number of stripes to use for the next transfer.  Must be
+  // called with mutex_ held.
+  int NextStripes() {
+    if (!options_.adaptive) {
+      return buckets_.size();
+    }
+    if (++transfers_ % kProbeInterval != 0) {
+      return current_ + 1;
+    }
+    // Alternate between probing one stripe more and one stripe less
+    probe_up_ = !probe_up_;
+    int probe = current_ + (probe_up_ ? 1 : -1);
+    if (probe < 0 || probe >= static_cast<int>(buckets_.size())) {
+      probe = current_ + (probe_up_ ? -1 : 1);
+    }
+    if (probe < 0 || probe >= static_cast<int>(buckets_.size())) {
+      return current_ + 1;
+    }
+    return probe + 1;
+  }
+
+  // Records the throughput of a transfer of requested bytes that moved bytes
+  // in stripes stripes.  Short transfers, at the end of a file, and those too
+  // small to split say nothing about the stripe count.
+  void Record(int stripes, long long bytes, long long requested,
+              long long micros) {
+    if (bytes < requested || requested < 2LL * options_.min_stripe_size ||
+        micros <= 0) {
+      return;
+    }
+    pthread_mutex_lock(&mutex_);
+    Bucket* bucket = &buckets_[stripes - 1];
+    double rate = bytes * 1000000.0 / micros;
+    if (bucket->samples == 0) {
+      bucket->rate = rate;
+    } else {
+      bucket->rate += kSampleWeight * (rate - bucket->rate);
+    }
+    bucket->samples++;
+    int best = current_;
+    for (int i = 0; i < static_cast<int>(buckets_.size()); ++i) {
+      if (buckets_[i].samples > 0 &&
+          (buckets_[best].samples == 0 ||
+           buckets_[i].rate > buckets_[best].rate)) {
+        best = i;
+      }
+    }
+    if (best != current_) {
+      syslog(LOG_DEBUG, "Stripes %d -> %d (%.0f bytes/s)", current_ + 1,
+             best + 1, buckets_[best].rate);
+      current_ = best;
+      g_stripe_count.Set(current_ + 1);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  // Measured throughput of transfers with a number of stripes
+  struct Bucket {
+    Bucket() : samples(0), rate(0) { }
+
+    int samples;
+    double rate;  // bytes per second
+  };
+
+  proto::FsService* primary_;
+  std::vector<proto::FsService*> helpers_;
+  StripingOptions options_;
+  Closure* null_callback_;
+
+  pthread_mutex_t mutex_;  // protects the members below
+  OpenFileMap files_;
+  std::vector<bool> busy_;  // Helpers transferring a stripe
+  std::vector<Bucket> buckets_;  // Indexed by the number of stripes - 1
+  int current_;  // Index of the preferred number of stripes
+  int transfers_;
+  bool probe_up_;
+};
+
+static void* RunStripe(void* arg) {
+  Stripe* stripe = static_cast<Stripe*>(arg);
+  stripe->service->TransferStripe(stripe);
+  return NULL;
+}
+
+proto::FsService* NewStripingFsService(
+    proto::FsService* primary,
+    const std::vector<proto::FsService*>& helpers,
+    const StripingOptions& options) {
+  return new StripingService(primary, helpers, options);
+}
+
+}  // namespace stripe
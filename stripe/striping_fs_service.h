@@ -0,0 +1,52 @@
+// An FsService that splits large reads and writes into stripes that are
+// transferred in parallel over several connections to the same device.  An
+// AFC connection handles one call at a time, so a single large file would
+// otherwise move at the speed of one connection's round trips.
+//
+// Every call goes to the primary service.  A read or write of at least twice
+// min_stripe_size bytes is split into stripes of at least min_stripe_size.
+// The last stripe goes to the primary on the caller's handle, so that the
+// primary keeps track of the size of the file, and each of the others goes
+// to a helper on a handle of its own.  Helper handles are opened on the path
+// of the caller's handle the first time they are needed, and released along
+// with it.  The path follows the file when it is renamed, and a file that is
+// removed is no longer striped.  A read is reassembled in order and stops at
+// the first short stripe.  A stripe that fails on a helper is retried on the
+// primary.
+//
+// The number of stripes adapts to what the connections achieve: the
+// throughput of each stripe count is measured and the fastest is used, while
+// every few transfers a neighbouring count is tried.
+//
+// A RemoveTree is carried out over the primary and the helpers together (see
+// fs/remove_tree.h), each removing or listing one entry at a time.
+
+#ifndef __STRIPE_STRIPING_FS_SERVICE_H__
+#define __STRIPE_STRIPING_FS_SERVICE_H__
+
+#include <vector>
+
+namespace proto {
+class FsService;
+}
+
+namespace stripe {
+
+struct StripingOptions {
+  StripingOptions() : min_stripe_size(64 * 1024), adaptive(true) { }
+
+  int min_stripe_size;
+  // When false, transfers always use every helper they are large enough for
+  bool adaptive;
+};
+
+// Takes ownership of primary and the helpers, which are connections to the
+// same filesystem.  Each helper is used by one stripe at a time.
+proto::FsService* NewStripingFsService(
+    proto::FsService* primary,
+    const std::vector<proto::FsService*>& helpers,
+    const StripingOptions& options);
+
+}  // namespace stripe
+
+#endif  // __STRIPE_STRIPING_FS_SERVICE_H__
@@ -0,0 +1,123 @@
+// Measures the cost per call of the FsService messages, by making the same
+// small calls through three stacks on a scratch directory, e.g.
+//
+//   backend_benchmark /tmp/scratch
+//
+// "native" calls the loopback backend (see test/loopback_backend.h) as the
+// fuse layer does when nothing is in between, "adapted" calls it through
+// NewServiceBackend(NewBackendService(...)), a round trip through the
+// messages, and "service" calls the loopback service through
+// NewServiceBackend, as the fuse layer calls the FsService stacks.  Each line
+// reports the time per call, which includes the system call itself.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "fs/fs_backend.h"
+#include "fs/service_backend.h"
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+#include "test/loopback_backend.h"
+#include "test/loopback_fs_service.h"
+
+static const int kDefaultCalls = 200000;
+static const int kTransferSize = 4096;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void Report(const char* stack, const char* call, int calls,
+                   long long start) {
+  double nanos = (NowMicros() - start) * 1000.0 / calls;
+  printf("%-8s %-8s %8d calls %10.1f ns/call\n", stack, call, calls, nanos);
+}
+
+static bool Check(const char* call, int ret) {
+  if (ret < 0) {
+    fprintf(stderr, "%s failed: %s\n", call, strerror(-ret));
+    return false;
+  }
+  return true;
+}
+
+static bool Measure(const char* stack, fs::FsBackend* backend,
+                    const std::string& file, int calls) {
+  rpc::Rpc rpc;
+  long long filehandle;
+  if (!Check("Create", backend->Create(&rpc, file.c_str(),
+                                       O_RDWR | O_CREAT | O_TRUNC, 0644,
+                                       &filehandle))) {
+    return false;
+  }
+  char buf[kTransferSize];
+  memset(buf, 'x', sizeof(buf));
+  bool success = Check("Write", backend->Write(&rpc, filehandle, buf,
+                                               sizeof(buf), 0));
+
+  long long start = NowMicros();
+  for (int i = 0; success && i < calls; ++i) {
+    struct stat stbuf;
+    success = Check("GetAttr", backend->GetAttr(&rpc, file.c_str(), &stbuf));
+  }
+  Report(stack, "getattr", calls, start);
+
+  start = NowMicros();
+  for (int i = 0; success && i < calls; ++i) {
+    success = Check("Read", backend->Read(&rpc, filehandle, buf, sizeof(buf),
+                                          0));
+  }
+  Report(stack, "read", calls, start);
+
+  start = NowMicros();
+  for (int i = 0; success && i < calls; ++i) {
+    success = Check("Write", backend->Write(&rpc, filehandle, buf,
+                                            sizeof(buf), 0));
+  }
+  Report(stack, "write", calls, start);
+
+  backend->Release(&rpc, filehandle);
+  backend->Unlink(&rpc, file.c_str());
+  return success;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s <scratch directory> [calls]\n", argv[0]);
+    return 1;
+  }
+  int calls = kDefaultCalls;
+  if (argc == 3) {
+    calls = atoi(argv[2]);
+    if (calls < 1) {
+      fprintf(stderr, "Invalid number of calls: %s\n", argv[2]);
+      return 1;
+    }
+  }
+  std::string file = std::string(argv[1]) + "/backend-benchmark";
+
+  fs::FsBackend* native = test::NewLoopbackBackend();
+  bool success = Measure("native", native, file, calls);
+  delete native;
+
+  proto::FsService* messages =
+      fs::NewBackendService(test::NewLoopbackBackend());
+  fs::FsBackend* adapted = fs::NewServiceBackend(messages, "benchmark");
+  success = success && Measure("adapted", adapted, file, calls);
+  delete adapted;
+  delete messages;
+
+  proto::FsService* loopback = test::NewLoopbackService();
+  fs::FsBackend* service = fs::NewServiceBackend(loopback, "benchmark");
+  success = success && Measure("service", service, file, calls);
+  delete service;
+  delete loopback;
+  return success ? 0 : 1;
+}
@@ -0,0 +1,343 @@
+// Measures an FsService directly, without going through fuse.  The loopback
+// service is used on a scratch directory, optionally behind a latency service
+// so that the results resemble those of a device on a USB connection, e.g.
+//
+//   fs_benchmark /tmp/scratch "latency=1500,jitter=300,bandwidth=20m"
+//
+// Setting IPHONEDISK_LOOPBACK=uring measures the io_uring loopback service
+// (see test/uring_loopback_fs_service.h) instead.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include <fcntl.h>
+#include <sys/time.h>
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+#include "test/latency_fs_service.h"
+#include "test/uring_loopback_fs_service.h"
+
+using google::protobuf::Closure;
+
+static const int kSmallFiles = 200;
+static const int kSmallFileSize = 4096;
+static const long long kLargeFileSize = 64 * 1024 * 1024;
+static const int kTransferSize = 128 * 1024;
+// Threads reading the large file at once, each from its own part
+static const int kReaders = 4;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+class Benchmark {
+ public:
+  Benchmark(proto::FsService* service, const std::string& directory)
+      : service_(service), directory_(directory) {
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  ~Benchmark() {
+    delete null_callback_;
+  }
+
+  bool Run() {
+    return CreateSmallFiles() && StatSmallFiles() && ListDirectory() &&
+           WriteLargeFile() && ReadLargeFile() && ReadLargeFileInParallel() &&
+           RemoveFiles();
+  }
+
+ private:
+  std::string SmallFile(int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "/small-%d", i);
+    return directory_ + name;
+  }
+
+  std::string LargeFile() {
+    return directory_ + "/large";
+  }
+
+  void Report(const char* name, int ops, long long bytes, long long start) {
+    double seconds = (NowMicros() - start) / 1000000.0;
+    printf("%-12s %8d ops %10.1f ops/s", name, ops, ops / seconds);
+    if (bytes > 0) {
+      printf(" %8.1f MiB/s", bytes / seconds / (1024 * 1024));
+    }
+    printf("\n");
+  }
+
+  bool Failed(const rpc::Rpc& rpc, const char* call) {
+    if (rpc.Failed()) {
+      fprintf(stderr, "%s failed: %s\n", call, rpc.ErrorText().c_str());
+      return true;
+    }
+    return false;
+  }
+
+  bool Create(const std::string& path, long long* fh) {
+    rpc::Rpc rpc;
+    proto::CreateRequest request;
+    proto::CreateResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_path(path);
+    request.set_flags(O_CREAT | O_TRUNC | O_RDWR);
+    request.set_mode(0644);
+    service_->Create(&rpc, &request, &response, null_callback_);
+    *fh = response.filehandle();
+    return !Failed(rpc, "Create");
+  }
+
+  bool Open(const std::string& path, long long* fh) {
+    rpc::Rpc rpc;
+    proto::OpenRequest request;
+    proto::OpenResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_path(path);
+    request.set_flags(O_RDONLY);
+    service_->Open(&rpc, &request, &response, null_callback_);
+    *fh = response.filehandle();
+    return !Failed(rpc, "Open");
+  }
+
+  bool Write(long long fh, long long offset, const std::string& buffer) {
+    rpc::Rpc rpc;
+    proto::WriteRequest request;
+    proto::WriteResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_filehandle(fh);
+    request.set_offset(offset);
+    request.set_buffer(buffer);
+    service_->Write(&rpc, &request, &response, null_callback_);
+    return !Failed(rpc, "Write");
+  }
+
+  bool Read(long long fh, long long offset, int size, long long* n) {
+    rpc::Rpc rpc;
+    proto::ReadRequest request;
+    proto::ReadResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_filehandle(fh);
+    request.set_offset(offset);
+    request.set_size(size);
+    service_->Read(&rpc, &request, &response, null_callback_);
+    *n = response.buffer().size();
+    return !Failed(rpc, "Read");
+  }
+
+  bool Release(long long fh) {
+    rpc::Rpc rpc;
+    proto::ReleaseRequest request;
+    proto::ReleaseResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_filehandle(fh);
+    service_->Release(&rpc, &request, &response, null_callback_);
+    return !Failed(rpc, "Release");
+  }
+
+  bool CreateSmallFiles() {
+    std::string buffer(kSmallFileSize, 'x');
+    long long start = NowMicros();
+    for (int i = 0; i < kSmallFiles; ++i) {
+      long long fh;
+      if (!Create(SmallFile(i), &fh) || !Write(fh, 0, buffer) ||
+          !Release(fh)) {
+        return false;
+      }
+    }
+    Report("create", kSmallFiles, kSmallFiles * kSmallFileSize, start);
+    return true;
+  }
+
+  bool StatSmallFiles() {
+    long long start = NowMicros();
+    for (int i = 0; i < kSmallFiles; ++i) {
+      rpc::Rpc rpc;
+      proto::GetAttrRequest request;
+      proto::GetAttrResponse response;
+      request.mutable_header()->set_fs_id("benchmark");
+      request.set_path(SmallFile(i));
+      service_->GetAttr(&rpc, &request, &response, null_callback_);
+      if (Failed(rpc, "GetAttr")) {
+        return false;
+      }
+    }
+    Report("getattr", kSmallFiles, 0, start);
+    return true;
+  }
+
+  bool ListDirectory() {
+    long long start = NowMicros();
+    int entries = 0;
+    long long offset = 0;
+    while (true) {
+      rpc::Rpc rpc;
+      proto::ReadDirRequest request;
+      proto::ReadDirResponse response;
+      request.mutable_header()->set_fs_id("benchmark");
+      request.set_path(directory_);
+      request.set_offset(offset);
+      request.set_max_entries(64);
+      service_->ReadDir(&rpc, &request, &response, null_callback_);
+      if (Failed(rpc, "ReadDir")) {
+        return false;
+      }
+      entries += response.entry_size();
+      if (!response.has_next_offset()) {
+        break;
+      }
+      offset = response.next_offset();
+    }
+    Report("readdir", entries, 0, start);
+    return true;
+  }
+
+  bool WriteLargeFile() {
+    std::string buffer(kTransferSize, 'y');
+    long long start = NowMicros();
+    long long fh;
+    if (!Create(LargeFile(), &fh)) {
+      return false;
+    }
+    int ops = 0;
+    for (long long offset = 0; offset < kLargeFileSize;
+         offset += kTransferSize) {
+      if (!Write(fh, offset, buffer)) {
+        return false;
+      }
+      ops++;
+    }
+    if (!Release(fh)) {
+      return false;
+    }
+    Report("write", ops, kLargeFileSize, start);
+    return true;
+  }
+
+  bool ReadLargeFile() {
+    long long start = NowMicros();
+    long long fh;
+    if (!Open(LargeFile(), &fh)) {
+      return false;
+    }
+    int ops = 0;
+    long long offset = 0;
+    while (true) {
+      long long n;
+      if (!Read(fh, offset, kTransferSize, &n)) {
+        return false;
+      }
+      if (n == 0) {
+        break;
+      }
+      offset += n;
+      ops++;
+    }
+    if (!Release(fh)) {
+      return false;
+    }
+    Report("read", ops, offset, start);
+    return true;
+  }
+
+  // A reader of one part of the large file
+  struct Reader {
+    Benchmark* benchmark;
+    long long offset;
+    long long end;
+    int ops;
+    bool success;
+  };
+
+  static void* RunReader(void* arg) {
+    Reader* reader = static_cast<Reader*>(arg);
+    Benchmark* benchmark = reader->benchmark;
+    long long fh;
+    reader->success = benchmark->Open(benchmark->LargeFile(), &fh);
+    while (reader->success && reader->offset < reader->end) {
+      long long n;
+      reader->success = benchmark->Read(fh, reader->offset, kTransferSize,
+                                        &n);
+      reader->offset += n;
+      reader->ops++;
+      if (n == 0) {
+        break;
+      }
+    }
+    if (reader->success) {
+      reader->success = benchmark->Release(fh);
+    }
+    return NULL;
+  }
+
+  bool ReadLargeFileInParallel() {
+    long long start = NowMicros();
+    Reader readers[kReaders];
+    pthread_t threads[kReaders];
+    for (int i = 0; i < kReaders; ++i) {
+      readers[i].benchmark = this;
+      readers[i].offset = kLargeFileSize / kReaders * i;
+      readers[i].end = kLargeFileSize / kReaders * (i + 1);
+      readers[i].ops = 0;
+      pthread_create(&threads[i], NULL, &RunReader, &readers[i]);
+    }
+    bool success = true;
+    int ops = 0;
+    for (int i = 0; i < kReaders; ++i) {
+      pthread_join(threads[i], NULL);
+      success = success && readers[i].success;
+      ops += readers[i].ops;
+    }
+    if (success) {
+      Report("read-par", ops, kLargeFileSize, start);
+    }
+    return success;
+  }
+
+  bool RemoveFiles() {
+    for (int i = 0; i <= kSmallFiles; ++i) {
+      rpc::Rpc rpc;
+      proto::UnlinkRequest request;
+      proto::UnlinkResponse response;
+      request.mutable_header()->set_fs_id("benchmark");
+      request.set_path(i < kSmallFiles ? SmallFile(i) : LargeFile());
+      service_->Unlink(&rpc, &request, &response, null_callback_);
+      if (Failed(rpc, "Unlink")) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  proto::FsService* service_;
+  std::string directory_;
+  Closure* null_callback_;
+};
+
+int main(int argc, char* argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s <scratch directory> [latency spec]\n",
+            argv[0]);
+    return 1;
+  }
+  proto::FsService* loopback = test::NewLoopbackServiceFromEnvironment();
+  if (loopback == NULL) {
+    return 1;
+  }
+  proto::FsService* service = loopback;
+  if (argc == 3) {
+    test::LatencyOptions options;
+    if (!test::ParseLatencyOptions(argv[2], &options)) {
+      fprintf(stderr, "Invalid latency spec: %s\n", argv[2]);
+      return 1;
+    }
+    service = test::NewLatencyFsService(loopback, options);
+  }
+  Benchmark benchmark(service, argv[1]);
+  bool success = benchmark.Run();
+  delete service;
+  return success ? 0 : 1;
+}
@@ -0,0 +1,410 @@
+// Replays a recording made by replay::NewRecordingFsService against the
+// loopback service, with paths relative to a scratch directory, and compares
+// the latency of each method with the recording.
+//
+//   fs_replay <recording> <directory> [speed] [threads] [latency spec]
+//
+// The calls start at the recorded times divided by speed (1 by default), or as
+// fast as possible when speed is 0.  The calls of each recorded thread are
+// replayed in order by one of the replay threads, of which there is one per
+// recorded thread unless a number is given.  A latency spec, as accepted by
+// test/latency_fs_service.h, puts the loopback service behind a simulated
+// device connection.  The contents of written files are not recorded, so
+// writes replay zeros.
+
+#include <algorithm>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/time.h>
+#include <time.h>
+#include <vector>
+#include "proto/fs_service.pb.h"
+#include "proto/recording.pb.h"
+#include "replay/recording_reader.h"
+#include "rpc/rpc.h"
+#include "test/latency_fs_service.h"
+#include "test/loopback_fs_service.h"
+
+using google::protobuf::Closure;
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::MethodDescriptor;
+using google::protobuf::Reflection;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// A handle used by a call, and the index of the Open or Create that
+// returned it
+struct HandleUse {
+  HandleUse(const FieldDescriptor* field, int producer)
+      : field(field), producer(producer) { }
+
+  const FieldDescriptor* field;
+  int producer;
+};
+
+struct Call {
+  Call() : done(false), failed(false), skipped(false), duration_usec(0),
+           filehandle(0) { }
+
+  proto::RecordedCall recorded;
+  // Most calls use at most one handle, but a CopyRange uses two
+  std::vector<HandleUse> handles;
+  bool done;
+  bool failed;
+  bool skipped;
+  long long duration_usec;
+  // Handle returned by the replayed Open or Create
+  long long filehandle;
+};
+
+static bool CompareStart(const Call& a, const Call& b) {
+  return a.recorded.start_usec() < b.recorded.start_usec();
+}
+
+// Handles are the "filehandle" field of a request, or fields ending in
+// "_filehandle"
+static bool IsHandle(const FieldDescriptor* field) {
+  const std::string& name = field->name();
+  return name == "filehandle" ||
+         (name.size() > 11 &&
+          name.compare(name.size() - 11, 11, "_filehandle") == 0);
+}
+
+class Replay {
+ public:
+  Replay(proto::FsService* service, const std::string& directory,
+         double speed)
+      : service_(service), directory_(directory), speed_(speed),
+        start_usec_(0), elapsed_usec_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  ~Replay() {
+    delete null_callback_;
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  bool Load(const std::string& filename) {
+    replay::RecordingReader reader;
+    if (!reader.Open(filename)) {
+      return false;
+    }
+    Call call;
+    while (reader.Next(&call.recorded)) {
+      calls_.push_back(call);
+    }
+    if (reader.error()) {
+      fprintf(stderr, "Recording is corrupt after %d calls\n",
+              static_cast<int>(calls_.size()));
+      return false;
+    }
+    // Calls are recorded as they finish
+    std::stable_sort(calls_.begin(), calls_.end(), CompareStart);
+    // A handle may be reused once released, so each call is matched with the
+    // most recent call that returned its handle.
+    std::map<long long, int> producers;
+    for (size_t i = 0; i < calls_.size(); ++i) {
+      Call* call = &calls_[i];
+      Message* request = ParseRequest(call->recorded);
+      if (request == NULL) {
+        fprintf(stderr, "Unable to parse %s request\n",
+                call->recorded.method().c_str());
+        return false;
+      }
+      const Descriptor* descriptor = request->GetDescriptor();
+      for (int f = 0; f < descriptor->field_count(); ++f) {
+        const FieldDescriptor* field = descriptor->field(f);
+        if (!IsHandle(field)) {
+          continue;
+        }
+        long long fh = request->GetReflection()->GetInt64(*request, field);
+        std::map<long long, int>::const_iterator it = producers.find(fh);
+        if (it == producers.end()) {
+          // Handles opened before the recording started cannot be replayed
+          call->skipped = true;
+        } else {
+          call->handles.push_back(HandleUse(field, it->second));
+        }
+      }
+      if (call->recorded.has_filehandle()) {
+        producers[call->recorded.filehandle()] = i;
+      }
+      delete request;
+    }
+    return true;
+  }
+
+  int recorded_threads() const {
+    int threads = 0;
+    for (size_t i = 0; i < calls_.size(); ++i) {
+      threads = std::max(threads, calls_[i].recorded.thread() + 1);
+    }
+    return threads;
+  }
+
+  void Run(int threads) {
+    queues_.resize(threads);
+    for (size_t i = 0; i < calls_.size(); ++i) {
+      queues_[calls_[i].recorded.thread() % threads].push_back(i);
+    }
+    start_usec_ = NowMicros();
+    std::vector<pthread_t> workers(threads);
+    std::vector<Worker> args(threads);
+    for (int i = 0; i < threads; ++i) {
+      args[i].replay = this;
+      args[i].queue = i;
+      pthread_create(&workers[i], NULL, &Replay::RunWorker, &args[i]);
+    }
+    for (int i = 0; i < threads; ++i) {
+      pthread_join(workers[i], NULL);
+    }
+    elapsed_usec_ = NowMicros() - start_usec_;
+  }
+
+  void Report() {
+    std::map<std::string, std::vector<long long> > recorded;
+    std::map<std::string, std::vector<long long> > replayed;
+    std::map<std::string, int> failures;
+    int skipped = 0;
+    for (size_t i = 0; i < calls_.size(); ++i) {
+      const Call& call = calls_[i];
+      if (call.skipped) {
+        skipped++;
+        continue;
+      }
+      const std::string& method = call.recorded.method();
+      recorded[method].push_back(call.recorded.duration_usec());
+      replayed[method].push_back(call.duration_usec);
+      if (call.failed != call.recorded.failed()) {
+        failures[method]++;
+      }
+    }
+    printf("%-10s %7s %21s %21s %8s %8s\n", "method", "calls",
+           "recorded mean/p99", "replayed mean/p99", "delta", "diverged");
+    for (std::map<std::string, std::vector<long long> >::iterator it =
+             recorded.begin(); it != recorded.end(); ++it) {
+      std::vector<long long>* before = &it->second;
+      std::vector<long long>* after = &replayed[it->first];
+      double before_mean = Mean(*before);
+      double after_mean = Mean(*after);
+      printf("%-10s %7d %10.0f/%-10lld %10.0f/%-10lld %+7.1f%% %8d\n",
+             it->first.c_str(), static_cast<int>(before->size()),
+             before_mean, Percentile(before, 99),
+             after_mean, Percentile(after, 99),
+             before_mean > 0 ? (after_mean / before_mean - 1) * 100 : 0.0,
+             failures[it->first]);
+    }
+    long long recorded_usec = 0;
+    if (!calls_.empty()) {
+      const proto::RecordedCall& last = calls_.back().recorded;
+      recorded_usec = last.start_usec() + last.duration_usec();
+    }
+    printf("%d calls in %.3fs (recorded %.3fs), %d skipped\n",
+           static_cast<int>(calls_.size()), elapsed_usec_ / 1000000.0,
+           recorded_usec / 1000000.0, skipped);
+  }
+
+ private:
+  struct Worker {
+    Replay* replay;
+    int queue;
+  };
+
+  static void* RunWorker(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    const std::vector<int>& queue = worker->replay->queues_[worker->queue];
+    for (size_t i = 0; i < queue.size(); ++i) {
+      worker->replay->ReplayCall(queue[i]);
+    }
+    return NULL;
+  }
+
+  Message* ParseRequest(const proto::RecordedCall& recorded) {
+    const MethodDescriptor* method =
+        service_->GetDescriptor()->FindMethodByName(recorded.method());
+    if (method == NULL) {
+      return NULL;
+    }
+    Message* request = service_->GetRequestPrototype(method).New();
+    if (!request->ParseFromString(recorded.request())) {
+      delete request;
+      return NULL;
+    }
+    return request;
+  }
+
+  // Moves a recorded path into the scratch directory
+  void RewritePaths(const std::string& method, Message* request) {
+    const Reflection* reflection = request->GetReflection();
+    static const char* kPathFields[] = {
+      "path", "source_path", "destination_path"
+    };
+    for (size_t i = 0; i < sizeof(kPathFields) / sizeof(kPathFields[0]);
+         ++i) {
+      const FieldDescriptor* field =
+          request->GetDescriptor()->FindFieldByName(kPathFields[i]);
+      if (field != NULL) {
+        reflection->SetString(request, field,
+            directory_ + reflection->GetString(*request, field));
+      }
+    }
+    // The target of a symlink is the path of the link itself
+    if (method == "SymLink") {
+      const FieldDescriptor* field =
+          request->GetDescriptor()->FindFieldByName("target");
+      reflection->SetString(request, field,
+          directory_ + reflection->GetString(*request, field));
+    }
+  }
+
+  void ReplayCall(int index) {
+    Call* call = &calls_[index];
+    if (call->skipped) {
+      return;
+    }
+    if (speed_ > 0) {
+      long long wait = start_usec_ +
+          static_cast<long long>(call->recorded.start_usec() / speed_) -
+          NowMicros();
+      if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec = wait / 1000000;
+        ts.tv_nsec = (wait % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+      }
+    }
+    // Wait for the calls that return the handles, which are always replayed
+    // before this one in recorded order.
+    std::vector<long long> fhs;
+    bool usable = true;
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < call->handles.size(); ++i) {
+      while (!calls_[call->handles[i].producer].done) {
+        pthread_cond_wait(&cond_, &mutex_);
+      }
+      const Call& producer = calls_[call->handles[i].producer];
+      fhs.push_back(producer.filehandle);
+      usable = usable && !producer.failed && !producer.skipped;
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (!usable) {
+      Finish(call, true, true, 0);
+      return;
+    }
+    const MethodDescriptor* method =
+        service_->GetDescriptor()->FindMethodByName(call->recorded.method());
+    Message* request = ParseRequest(call->recorded);
+    Message* response = service_->GetResponsePrototype(method).New();
+    RewritePaths(call->recorded.method(), request);
+    const Reflection* reflection = request->GetReflection();
+    for (size_t i = 0; i < call->handles.size(); ++i) {
+      reflection->SetInt64(request, call->handles[i].field, fhs[i]);
+    }
+    if (call->recorded.method() == "Write") {
+      reflection->SetString(request,
+          request->GetDescriptor()->FindFieldByName("buffer"),
+          std::string(call->recorded.size(), '\0'));
+    }
+    rpc::Rpc rpc;
+    long long start = NowMicros();
+    service_->CallMethod(method, &rpc, request, response, null_callback_);
+    long long duration = NowMicros() - start;
+    const FieldDescriptor* handle =
+        response->GetDescriptor()->FindFieldByName("filehandle");
+    if (handle != NULL) {
+      call->filehandle = response->GetReflection()->GetInt64(*response,
+                                                             handle);
+    }
+    Finish(call, rpc.Failed(), false, duration);
+    delete request;
+    delete response;
+  }
+
+  void Finish(Call* call, bool failed, bool skipped, long long duration) {
+    pthread_mutex_lock(&mutex_);
+    call->failed = failed;
+    call->skipped = skipped;
+    call->duration_usec = duration;
+    call->done = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  static double Mean(const std::vector<long long>& values) {
+    if (values.empty()) {
+      return 0;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+      sum += values[i];
+    }
+    return sum / values.size();
+  }
+
+  static long long Percentile(std::vector<long long>* values, int percent) {
+    if (values->empty()) {
+      return 0;
+    }
+    std::sort(values->begin(), values->end());
+    return (*values)[(values->size() - 1) * percent / 100];
+  }
+
+  proto::FsService* service_;
+  std::string directory_;
+  double speed_;
+  Closure* null_callback_;
+  std::vector<Call> calls_;
+  std::vector<std::vector<int> > queues_;
+  long long start_usec_;
+  long long elapsed_usec_;
+  pthread_mutex_t mutex_;  // protects the results of calls_
+  pthread_cond_t cond_;    // signalled when a call is done
+};
+
+int main(int argc, char* argv[]) {
+  if (argc < 3 || argc > 6) {
+    fprintf(stderr, "Usage: %s <recording> <directory> [speed] [threads] "
+            "[latency spec]\n", argv[0]);
+    return 1;
+  }
+  double speed = (argc > 3) ? atof(argv[3]) : 1;
+  int threads = (argc > 4) ? atoi(argv[4]) : 0;
+  proto::FsService* loopback = test::NewLoopbackService();
+  proto::FsService* service = loopback;
+  if (argc > 5) {
+    test::LatencyOptions options;
+    if (!test::ParseLatencyOptions(argv[5], &options)) {
+      fprintf(stderr, "Invalid latency spec: %s\n", argv[5]);
+      return 1;
+    }
+    service = test::NewLatencyFsService(loopback, options);
+  }
+  int result = 1;
+  Replay replay(service, argv[2], speed);
+  if (replay.Load(argv[1])) {
+    if (threads <= 0) {
+      threads = std::max(replay.recorded_threads(), 1);
+    }
+    replay.Run(threads);
+    replay.Report();
+    result = 0;
+  }
+  if (service != loopback) {
+    delete service;
+  }
+  delete loopback;
+  return result;
+}
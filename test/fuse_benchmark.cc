@@ -0,0 +1,140 @@
+// Measures large sequential transfers through a fuse mount of the loopback
+// service, so that the fuse frontends can be compared with each other, e.g.
+//
+//   scons fuse=2 && test/fuse_benchmark /tmp/mnt /tmp/scratch
+//   scons fuse=3 && test/fuse_benchmark /tmp/mnt /tmp/scratch
+//
+// The loopback service serves the host filesystem at the mount point, so the
+// scratch directory is reached through the mount as <mount point>/<scratch>.
+// A file is written and read back with each block size.  The page cache is
+// dropped between the two, so that the reads go through fuse.
+//
+// Setting IPHONEDISK_LOOPBACK=uring measures the io_uring loopback service
+// (see test/uring_loopback_fs_service.h) instead.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "fs/fs.h"
+#include "fs/fs_proxy.h"
+#include "proto/fs_service.pb.h"
+#include "test/uring_loopback_fs_service.h"
+
+static const long long kFileSize = 256 * 1024 * 1024;
+static const int kBlockSizes[] = { 4 * 1024, 128 * 1024, 1024 * 1024 };
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void Report(const char* name, int block_size, int ops,
+                   long long bytes, long long start) {
+  double seconds = (NowMicros() - start) / 1000000.0;
+  char label[32];
+  snprintf(label, sizeof(label), "%s-%dk", name, block_size / 1024);
+  printf("%-12s %8d ops %10.1f ops/s %8.1f MiB/s\n", label, ops,
+         ops / seconds, bytes / seconds / (1024 * 1024));
+}
+
+static bool WriteFile(const std::string& path, int block_size) {
+  int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "open(%s) failed: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  std::string buffer(block_size, 'y');
+  long long start = NowMicros();
+  int ops = 0;
+  for (long long offset = 0; offset < kFileSize; offset += block_size) {
+    if (write(fd, buffer.data(), block_size) != block_size) {
+      fprintf(stderr, "write failed: %s\n", strerror(errno));
+      close(fd);
+      return false;
+    }
+    ops++;
+  }
+  // Cached writes are only measured once they have reached the service
+  if (fsync(fd) != 0 || close(fd) != 0) {
+    fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+    return false;
+  }
+  Report("write", block_size, ops, kFileSize, start);
+  return true;
+}
+
+static bool ReadFile(const std::string& path, int block_size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "open(%s) failed: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+#ifdef __APPLE__
+  fcntl(fd, F_NOCACHE, 1);
+#else
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  std::string buffer(block_size, '\0');
+  long long start = NowMicros();
+  int ops = 0;
+  long long total = 0;
+  while (true) {
+    ssize_t n = read(fd, &buffer[0], block_size);
+    if (n < 0) {
+      fprintf(stderr, "read failed: %s\n", strerror(errno));
+      close(fd);
+      return false;
+    } else if (n == 0) {
+      break;
+    }
+    total += n;
+    ops++;
+  }
+  close(fd);
+  Report("read", block_size, ops, total, start);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  openlog("fuse_benchmark", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_ERR));
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <mount point> <scratch directory>\n",
+            argv[0]);
+    return 1;
+  }
+  const std::string mount_point(argv[1]);
+  const std::string scratch(argv[2]);
+  proto::FsService* loopback = test::NewLoopbackServiceFromEnvironment();
+  if (loopback == NULL) {
+    return 1;
+  }
+  fs::Filesystem* fs = fs::NewProxyFilesystem(loopback, "benchmark",
+                                              mount_point, "");
+  if (!fs->Mount()) {
+    fprintf(stderr, "Failed to mount %s\n", mount_point.c_str());
+    delete fs;
+    delete loopback;
+    return 1;
+  }
+  printf("fuse %d, api %d\n", fuse_version(), FUSE_USE_VERSION);
+  const std::string path = mount_point + scratch + "/fuse_benchmark";
+  bool success = true;
+  for (size_t i = 0;
+       success && i < sizeof(kBlockSizes) / sizeof(kBlockSizes[0]); ++i) {
+    success = WriteFile(path, kBlockSizes[i]) &&
+              ReadFile(path, kBlockSizes[i]);
+  }
+  unlink(path.c_str());
+  delete fs;
+  delete loopback;
+  closelog();
+  return success ? 0 : 1;
+}
@@ -0,0 +1,426 @@
+#include "test/latency_fs_service.h"
+
+#include <algorithm>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <vector>
+#include "fs/remove_tree.h"
+#include "proto/fs_service.pb.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace test {
+
+static bool ParseBandwidth(const std::string& value, long long* bytes) {
+  char* end;
+  double n = strtod(value.c_str(), &end);
+  if (*end == 'k' || *end == 'K') {
+    n *= 1024;
+    ++end;
+  } else if (*end == 'm' || *end == 'M') {
+    n *= 1024 * 1024;
+    ++end;
+  } else if (*end == 'g' || *end == 'G') {
+    n *= 1024 * 1024 * 1024;
+    ++end;
+  }
+  *bytes = static_cast<long long>(n);
+  return end != value.c_str() && *end == '\0';
+}
+
+static bool ParseInt(const std::string& value, int* n) {
+  char* end;
+  *n = strtol(value.c_str(), &end, 10);
+  return !value.empty() && *end == '\0';
+}
+
+bool ParseLatencyOptions(const std::string& spec, LatencyOptions* options) {
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    std::string option = spec.substr(start, end - start);
+    start = end + 1;
+    size_t equals = option.find('=');
+    if (equals == std::string::npos) {
+      return false;
+    }
+    std::string key = option.substr(0, equals);
+    std::string value = option.substr(equals + 1);
+    Delay* delay = &options->delay;
+    size_t dot = key.find('.');
+    if (dot != std::string::npos) {
+      delay = &options->rpc_delay[key.substr(0, dot)];
+      key = key.substr(dot + 1);
+    }
+    bool ok;
+    if (key == "latency") {
+      ok = ParseInt(value, &delay->base_usec);
+    } else if (key == "jitter") {
+      ok = ParseInt(value, &delay->jitter_usec);
+    } else if (dot != std::string::npos) {
+      ok = false;
+    } else if (key == "bandwidth") {
+      ok = ParseBandwidth(value, &options->bytes_per_second);
+    } else if (key == "failure") {
+      char* end;
+      options->failure_rate = strtod(value.c_str(), &end);
+      ok = !value.empty() && *end == '\0';
+    } else if (key == "seed") {
+      int seed;
+      ok = ParseInt(value, &seed);
+      options->seed = seed;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void Sleep(long long usec) {
+  if (usec > 0) {
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+  }
+}
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+Link::Link(long long bytes_per_second)
+    : bytes_per_second_(bytes_per_second), free_usec_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+Link::~Link() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+void Link::Transfer(long long bytes) {
+  if (bytes_per_second_ <= 0) {
+    return;
+  }
+  long long now = NowMicros();
+  pthread_mutex_lock(&mutex_);
+  // An idle link does not save up bandwidth for later
+  free_usec_ = std::max(free_usec_, now) +
+               bytes * 1000000LL / bytes_per_second_;
+  long long done_usec = free_usec_;
+  pthread_mutex_unlock(&mutex_);
+  Sleep(done_usec - now);
+}
+
+class LatencyService : public proto::FsService {
+ public:
+  LatencyService(proto::FsService* service, const LatencyOptions& options)
+      : service_(service),
+        options_(options),
+        own_link_(options.bytes_per_second),
+        link_(options.link != NULL ? options.link : &own_link_),
+        random_(options.seed) {
+    pthread_mutex_init(&mutex_, NULL);
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~LatencyService() {
+    delete service_;
+    delete null_callback_;
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    Forward("GetAttr", &proto::FsService::GetAttr, rpc, request, response,
+            done);
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    Forward("ReadLink", &proto::FsService::ReadLink, rpc, request, response,
+            done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    Forward("SymLink", &proto::FsService::SymLink, rpc, request, response,
+            done);
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    Forward("ReadDir", &proto::FsService::ReadDir, rpc, request, response,
+            done);
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    Forward("Unlink", &proto::FsService::Unlink, rpc, request, response,
+            done);
+  }
+
+  // A device removes a tree one entry at a time, so each Unlink and ReadDir
+  // is delayed
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    fs::RemoveTree(std::vector<proto::FsService*>(1, this), rpc, request,
+                   response);
+    done->Run();
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    Forward("MkDir", &proto::FsService::MkDir, rpc, request, response, done);
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    Forward("Rename", &proto::FsService::Rename, rpc, request, response,
+            done);
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    Forward("Open", &proto::FsService::Open, rpc, request, response, done);
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    Forward("Create", &proto::FsService::Create, rpc, request, response,
+            done);
+  }
+
+  // As on a device, the handle is released even if the caller has given up
+  // on the call
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    if (Delayed("Release", rpc, false)) {
+      service_->Release(rpc, request, response, null_callback_);
+    }
+    done->Run();
+  }
+
+  // The payload of a read travels back from the device after the call
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    if (Delayed("Read", rpc)) {
+      service_->Read(rpc, request, response, null_callback_);
+      Transfer(response->buffer().size());
+    }
+    done->Run();
+  }
+
+  // A device has no vectored read, so each range costs a round trip of its
+  // own on the connection; only the trips above it are saved.
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    bool delayed = true;
+    for (int i = 0; delayed && i < std::max(1, request->range_size()); ++i) {
+      delayed = Delayed("ReadV", rpc);
+    }
+    if (delayed) {
+      service_->ReadV(rpc, request, response, null_callback_);
+      for (int i = 0; i < response->buffer_size(); ++i) {
+        Transfer(response->buffer(i).size());
+      }
+    }
+    done->Run();
+  }
+
+  // The payload of a write travels to the device before the call
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    if (Delayed("Write", rpc)) {
+      Transfer(request->buffer().size());
+      service_->Write(rpc, request, response, null_callback_);
+    }
+    done->Run();
+  }
+
+  // There is no copy on the device, so the data travels both ways
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    if (Delayed("CopyRange", rpc)) {
+      service_->CopyRange(rpc, request, response, null_callback_);
+      if (!rpc->Failed()) {
+        Transfer(2 * response->size());
+      }
+    }
+    done->Run();
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    Forward("Truncate", &proto::FsService::Truncate, rpc, request, response,
+            done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    Forward("FTruncate", &proto::FsService::FTruncate, rpc, request,
+            response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    Forward("FGetAttr", &proto::FsService::FGetAttr, rpc, request, response,
+            done);
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    Forward("StatFs", &proto::FsService::StatFs, rpc, request, response,
+            done);
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    Forward("GetXAttr", &proto::FsService::GetXAttr, rpc, request, response,
+            done);
+  }
+
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    Forward("SetXAttr", &proto::FsService::SetXAttr, rpc, request, response,
+            done);
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    Forward("ListXAttr", &proto::FsService::ListXAttr, rpc, request, response,
+            done);
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    Forward("RemoveXAttr", &proto::FsService::RemoveXAttr, rpc, request,
+            response, done);
+  }
+
+ private:
+  template <class Request, class Response>
+  void Forward(const char* name,
+               void (proto::FsService::*method)(RpcController*,
+                                                const Request*,
+                                                Response*,
+                                                Closure*),
+               RpcController* rpc,
+               const Request* request,
+               Response* response,
+               Closure* done) {
+    if (Delayed(name, rpc)) {
+      (service_->*method)(rpc, request, response, null_callback_);
+    }
+    done->Run();
+  }
+
+  // Sleeps for the delay of the named call.  Returns false, after failing
+  // the rpc, if the call was chosen to fail or, when cancelable, was canceled
+  // meanwhile.
+  bool Delayed(const char* name, RpcController* rpc, bool cancelable = true) {
+    std::map<std::string, Delay>::const_iterator it =
+        options_.rpc_delay.find(name);
+    const Delay& delay =
+        (it == options_.rpc_delay.end()) ? options_.delay : it->second;
+    pthread_mutex_lock(&mutex_);
+    double jitter = -delay.jitter_usec * log(1.0 - NextRandom());
+    bool fail = NextRandom() < options_.failure_rate;
+    pthread_mutex_unlock(&mutex_);
+    Sleep(delay.base_usec + static_cast<long long>(jitter));
+    if (cancelable && rpc->IsCanceled()) {
+      rpc->SetFailed("Canceled");
+      return false;
+    }
+    if (fail) {
+      rpc->SetFailed("Injected failure");
+      return false;
+    }
+    return true;
+  }
+
+  void Transfer(long long bytes) {
+    link_->Transfer(bytes);
+  }
+
+  // Returns a number in [0, 1) from a 64-bit linear congruential generator.
+  // Must be called with mutex_ held.
+  double NextRandom() {
+    random_ = random_ * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (random_ >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  proto::FsService* service_;
+  LatencyOptions options_;
+  Link own_link_;
+  Link* link_;
+  Closure* null_callback_;
+  pthread_mutex_t mutex_;  // protects random_
+  unsigned long long random_;
+};
+
+proto::FsService* NewLatencyFsService(proto::FsService* service,
+                                      const LatencyOptions& options) {
+  return new LatencyService(service, options);
+}
+
+}  // namespace test
@@ -0,0 +1,80 @@
+// An FsService that wraps another and makes it behave like a device on the
+// other end of a USB cable: every call is delayed, Read and Write payloads are
+// limited to the bandwidth of the cable, and calls can be made to fail at
+// random.  The random numbers come from a seeded generator so that a run can
+// be repeated.
+
+#ifndef __TEST_LATENCY_FS_SERVICE_H__
+#define __TEST_LATENCY_FS_SERVICE_H__
+
+#include <map>
+#include <pthread.h>
+#include <string>
+
+namespace proto {
+class FsService;
+}
+
+namespace test {
+
+// The delay of a call is base_usec plus an exponentially distributed amount
+// with a mean of jitter_usec, which gives the long tail seen on real devices.
+struct Delay {
+  Delay() : base_usec(0), jitter_usec(0) { }
+
+  int base_usec;
+  int jitter_usec;
+};
+
+// The USB cable to a device, which every connection to the device shares.
+// Payloads are metered through one token bucket: a transfer takes its tokens
+// ahead of time and waits until the link has sent the transfers before it, so
+// more connections put more calls in flight but do not add bandwidth.
+class Link {
+ public:
+  // No limit if bytes_per_second is 0
+  explicit Link(long long bytes_per_second);
+  ~Link();
+
+  // Returns once bytes have been sent over the link
+  void Transfer(long long bytes);
+
+ private:
+  long long bytes_per_second_;
+  pthread_mutex_t mutex_;  // protects free_usec_
+  // When the transfers already admitted have been sent
+  long long free_usec_;
+};
+
+struct LatencyOptions {
+  LatencyOptions()
+      : bytes_per_second(0), link(NULL), failure_rate(0), seed(1) { }
+
+  // Delay of calls not listed in rpc_delay
+  Delay delay;
+  // Delay by method name, e.g. "GetAttr" or "Read"
+  std::map<std::string, Delay> rpc_delay;
+  // Bandwidth of Read and Write payloads, or 0 for no limit
+  long long bytes_per_second;
+  // The link shared by the connections to one device, when several services
+  // are made with these options.  Not owned.  When NULL each service has a
+  // link of its own with bytes_per_second.
+  Link* link;
+  // Fraction of calls that fail, between 0 and 1
+  double failure_rate;
+  unsigned int seed;
+};
+
+// Parses a comma separated list of options, e.g.
+//   "latency=2000,jitter=500,bandwidth=20m,failure=0.001,seed=7,Read.latency=4000"
+// Latencies are in microseconds and the bandwidth is in bytes per second with
+// an optional k, m or g suffix.  Returns false if the spec is malformed.
+bool ParseLatencyOptions(const std::string& spec, LatencyOptions* options);
+
+// Takes ownership of service
+proto::FsService* NewLatencyFsService(proto::FsService* service,
+                                      const LatencyOptions& options);
+
+}  // namespace test
+
+#endif  // __TEST_LATENCY_FS_SERVICE_H__
@@ -0,0 +1,292 @@
+#include "test/loopback_backend.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "fs/fs_backend.h"
+
+using ::google::protobuf::RpcController;
+
+namespace test {
+
+static const int kMaxBufferSize = 1024 * 1024;
+// Maximum number of partially read directory listings kept open
+static const size_t kMaxDirCursors = 16;
+
+class LoopbackBackend : public fs::FsBackend {
+ public:
+  LoopbackBackend() {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+
+  virtual ~LoopbackBackend() {
+    for (DirCursorMap::iterator it = dirs_.begin(); it != dirs_.end(); ++it) {
+      closedir(it->second.dir);
+    }
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  virtual int GetAttr(RpcController* rpc, const char* path,
+                      struct stat* stbuf) {
+    return lstat(path, stbuf) == -1 ? -errno : 0;
+  }
+
+  virtual int ReadLink(RpcController* rpc, const char* path, char* buf,
+                       size_t size) {
+    if (size == 0) {
+      return -EINVAL;
+    }
+    ssize_t n = readlink(path, buf, size - 1);
+    if (n == -1) {
+      return -errno;
+    }
+    buf[n] = '\0';
+    return 0;
+  }
+
+  virtual int SymLink(RpcController* rpc, const char* source,
+                      const char* target) {
+    return symlink(source, target) == -1 ? -errno : 0;
+  }
+
+  // Partially read listings are kept open, as by the loopback service
+  virtual int ReadDir(RpcController* rpc, const char* path,
+                      long long dirhandle, long long offset, int max_entries,
+                      fs::DirFiller filler, void* data,
+                      long long* next_offset) {
+    DirCursorKey key(path, dirhandle);
+    DirCursor cursor;
+    cursor.dir = NULL;
+    pthread_mutex_lock(&mutex_);
+    DirCursorMap::iterator it = dirs_.find(key);
+    if (it != dirs_.end() && it->second.position == offset) {
+      cursor = it->second;
+      dirs_.erase(it);
+    } else if (it != dirs_.end()) {
+      closedir(it->second.dir);
+      dirs_.erase(it);
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (cursor.dir == NULL) {
+      cursor.dir = opendir(path);
+      if (cursor.dir == NULL) {
+        return -errno;
+      }
+      cursor.position = 0;
+    }
+    bool eof = false;
+    int entries = 0;
+    while (!max_entries || entries < max_entries) {
+      struct dirent* dp = readdir(cursor.dir);
+      if (dp == NULL) {
+        eof = true;
+        break;
+      }
+      if (cursor.position >= offset) {
+        filler(dp->d_name, data);
+        entries++;
+      }
+      cursor.position++;
+    }
+    if (eof) {
+      closedir(cursor.dir);
+      *next_offset = -1;
+    } else {
+      *next_offset = cursor.position;
+      pthread_mutex_lock(&mutex_);
+      // Another request on the same handle may have been put back first
+      it = dirs_.find(key);
+      if (it != dirs_.end()) {
+        closedir(it->second.dir);
+        dirs_.erase(it);
+      } else if (dirs_.size() >= kMaxDirCursors) {
+        closedir(dirs_.begin()->second.dir);
+        dirs_.erase(dirs_.begin());
+      }
+      dirs_[key] = cursor;
+      pthread_mutex_unlock(&mutex_);
+    }
+    return 0;
+  }
+
+  // Removes empty directories too, as fuse sends rmdir here as well
+  virtual int Unlink(RpcController* rpc, const char* path) {
+    if (unlink(path) == 0) {
+      return 0;
+    } else if (errno != EISDIR && errno != EPERM) {
+      return -errno;
+    }
+    int unlink_errno = errno;
+    if (rmdir(path) == 0) {
+      return 0;
+    }
+    return errno == ENOTDIR ? -unlink_errno : -errno;
+  }
+
+  virtual int MkDir(RpcController* rpc, const char* path, mode_t mode) {
+    return mkdir(path, mode) == -1 ? -errno : 0;
+  }
+
+  virtual int Rename(RpcController* rpc, const char* from, const char* to) {
+    return rename(from, to) == -1 ? -errno : 0;
+  }
+
+  virtual int Open(RpcController* rpc, const char* path, int flags,
+                   long long* filehandle) {
+    int fd = open(path, flags);
+    if (fd == -1) {
+      return -errno;
+    }
+    *filehandle = fd;
+    return 0;
+  }
+
+  virtual int Create(RpcController* rpc, const char* path, int flags,
+                     mode_t mode, long long* filehandle) {
+    int fd = open(path, flags, mode);
+    if (fd == -1) {
+      return -errno;
+    }
+    *filehandle = fd;
+    return 0;
+  }
+
+  virtual int Release(RpcController* rpc, long long filehandle) {
+    close(filehandle);
+    return 0;
+  }
+
+  virtual int Read(RpcController* rpc, long long filehandle, char* buf,
+                   size_t size, off_t offset) {
+    ssize_t n = pread(filehandle, buf, size, offset);
+    return n == -1 ? -errno : n;
+  }
+
+  virtual int Write(RpcController* rpc, long long filehandle, const char* buf,
+                    size_t size, off_t offset) {
+    ssize_t n = pwrite(filehandle, buf, size, offset);
+    return n == -1 ? -errno : n;
+  }
+
+  // Linux copies within the kernel; elsewhere, or between filesystems, the
+  // data is copied through a buffer.
+  virtual ssize_t CopyRange(RpcController* rpc, long long source_filehandle,
+                            off_t source_offset,
+                            long long destination_filehandle,
+                            off_t destination_offset, size_t size) {
+    ssize_t total = 0;
+#ifdef __linux__
+    loff_t source = source_offset;
+    loff_t destination = destination_offset;
+    while (static_cast<size_t>(total) < size) {
+      ssize_t n = copy_file_range(source_filehandle, &source,
+                                  destination_filehandle, &destination,
+                                  size - total, 0);
+      if (n == -1) {
+        if (total == 0 && (errno == EXDEV || errno == EINVAL ||
+                           errno == ENOSYS || errno == EOPNOTSUPP)) {
+          break;
+        }
+        return -errno;
+      } else if (n == 0) {
+        return total;
+      }
+      total += n;
+    }
+    if (total > 0) {
+      return total;
+    }
+#endif
+    char* buf = static_cast<char*>(malloc(kMaxBufferSize));
+    while (static_cast<size_t>(total) < size) {
+      size_t chunk = std::min<size_t>(kMaxBufferSize, size - total);
+      ssize_t n = pread(source_filehandle, buf, chunk, source_offset + total);
+      if (n == -1) {
+        total = -errno;
+        break;
+      } else if (n == 0) {
+        break;
+      }
+      ssize_t written = pwrite(destination_filehandle, buf, n,
+                               destination_offset + total);
+      if (written == -1) {
+        total = -errno;
+        break;
+      }
+      total += written;
+      if (written < n) {
+        break;
+      }
+    }
+    free(buf);
+    return total;
+  }
+
+  virtual int Truncate(RpcController* rpc, const char* path, off_t offset) {
+    return truncate(path, offset) == -1 ? -errno : 0;
+  }
+
+  virtual int FTruncate(RpcController* rpc, long long filehandle,
+                        off_t offset) {
+    return ftruncate(filehandle, offset) == -1 ? -errno : 0;
+  }
+
+  virtual int FGetAttr(RpcController* rpc, long long filehandle,
+                       struct stat* stbuf) {
+    return fstat(filehandle, stbuf) == -1 ? -errno : 0;
+  }
+
+  virtual int StatFs(RpcController* rpc, struct statvfs* vfs) {
+    return statvfs("/", vfs) == -1 ? -errno : 0;
+  }
+
+  // Like the loopback service, extended attributes are left to the kernel
+  virtual int GetXAttr(RpcController* rpc, const char* path,
+                       const char* name, char* value, size_t size,
+                       uint32_t position) {
+    return -ENOTSUP;
+  }
+
+  virtual int SetXAttr(RpcController* rpc, const char* path,
+                       const char* name, const char* value, size_t size,
+                       int flags, uint32_t position) {
+    return -ENOTSUP;
+  }
+
+  virtual int ListXAttr(RpcController* rpc, const char* path, char* list,
+                        size_t size) {
+    return -ENOTSUP;
+  }
+
+  virtual int RemoveXAttr(RpcController* rpc, const char* path,
+                          const char* name) {
+    return -ENOTSUP;
+  }
+
+ private:
+  // An open directory listing, positioned at the entry with index position.
+  struct DirCursor {
+    DIR* dir;
+    long long position;
+  };
+  // Cursors are found by path and dirhandle
+  typedef std::pair<std::string, long long> DirCursorKey;
+  typedef std::map<DirCursorKey, DirCursor> DirCursorMap;
+
+  pthread_mutex_t mutex_;  // protects dirs_
+  DirCursorMap dirs_;
+};
+
+fs::FsBackend* NewLoopbackBackend() {
+  return new LoopbackBackend();
+}
+
+}  // namespace test
@@ -0,0 +1,17 @@
+// The loopback filesystem of test/loopback_fs_service.h as an FsBackend, for
+// measuring what the FsService messages cost per call.
+
+#ifndef __TEST_LOOPBACK_BACKEND_H__
+#define __TEST_LOOPBACK_BACKEND_H__
+
+namespace fs {
+class FsBackend;
+}
+
+namespace test {
+
+fs::FsBackend* NewLoopbackBackend();
+
+}  // namespace test
+
+#endif  // __TEST_LOOPBACK_BACKEND_H__
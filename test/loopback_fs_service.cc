@@ -2,14 +2,22 @@
 
 #include "test/loopback_fs_service.h"
 
+#include <algorithm>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <map>
+#include <pthread.h>
+#include <string>
+#ifdef __APPLE__
 #include <sys/attr.h>
+#endif
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <vector>
+#include "fs/remove_tree.h"
 #include "proto/fs_service.pb.h"
 
 using ::google::protobuf::Closure;
@@ -18,9 +26,19 @@ using ::google::protobuf::RpcController;
 namespace test {
 
 static const int kMaxBufferSize = 1024 * 1024;
+// Maximum number of partially read directory listings kept open
+static const size_t kMaxDirCursors = 16;
 
 class LoopbackService : public proto::FsService {
  public:
+  LoopbackService() {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+
+  virtual ~LoopbackService() {
+    pthread_mutex_destroy(&mutex_);
+  }
+
   void GetAttr(RpcController* rpc,
                const proto::GetAttrRequest* request,
                proto::GetAttrResponse* response,
@@ -30,13 +48,7 @@ class LoopbackService : public proto::FsService {
     if (res == -1) {
       rpc->SetFailed(strerror(errno));
     } else {
-      proto::Stat* stat = response->mutable_stat();
-      stat->set_size(stbuf.st_size);
-      stat->set_blocks(stbuf.st_blocks);
-      stat->set_mode(stbuf.st_mode);
-      stat->set_nlink(stbuf.st_nlink);
-      stat->mutable_mtime()->set_tv_sec(stbuf.st_mtimespec.tv_sec);
-      stat->mutable_mtime()->set_tv_nsec(stbuf.st_mtimespec.tv_nsec);
+      FillStat(stbuf, response->mutable_stat());
     }
     done->Run();
   }
@@ -67,34 +79,100 @@ class LoopbackService : public proto::FsService {
     done->Run();
   }
 
+  // Partially read listings are kept open so that sequential page requests
+  // do not need to skip over the entries already returned.  Each open
+  // directory has its own cursor, so concurrent listings do not reopen the
+  // directory at an offset, which skips entries when others were removed.
   void ReadDir(RpcController* rpc,
                const proto::ReadDirRequest* request,
                proto::ReadDirResponse* response,
                Closure* done) {
-    DIR* d = opendir(request->path().c_str());
-    if (d == NULL) {
-      rpc->SetFailed(strerror(errno));
-    } else {
-      struct dirent* dp;
-      while ((dp = readdir(d)) != NULL) {
+    // A cursor is removed from the map while in use, so the lock is only held
+    // while looking it up and putting it back.
+    DirCursorKey key(request->path(), request->dirhandle());
+    DirCursor cursor;
+    cursor.dir = NULL;
+    pthread_mutex_lock(&mutex_);
+    DirCursorMap::iterator it = dirs_.find(key);
+    if (it != dirs_.end() && it->second.position == request->offset()) {
+      cursor = it->second;
+      dirs_.erase(it);
+    } else if (it != dirs_.end()) {
+      closedir(it->second.dir);
+      dirs_.erase(it);
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (cursor.dir == NULL) {
+      cursor.dir = opendir(request->path().c_str());
+      if (cursor.dir == NULL) {
+        rpc->SetFailed(strerror(errno));
+        done->Run();
+        return;
+      }
+      cursor.position = 0;
+    }
+    bool eof = false;
+    while (!request->max_entries() ||
+           response->entry_size() < request->max_entries()) {
+      struct dirent* dp = readdir(cursor.dir);
+      if (dp == NULL) {
+        eof = true;
+        break;
+      }
+      if (cursor.position >= request->offset()) {
         response->add_entry()->set_filename(dp->d_name);
       }
-      closedir(d);
+      cursor.position++;
+    }
+    if (eof) {
+      closedir(cursor.dir);
+    } else {
+      response->set_next_offset(cursor.position);
+      pthread_mutex_lock(&mutex_);
+      // Another request on the same handle may have been put back first
+      it = dirs_.find(key);
+      if (it != dirs_.end()) {
+        closedir(it->second.dir);
+        dirs_.erase(it);
+      } else if (dirs_.size() >= kMaxDirCursors) {
+        closedir(dirs_.begin()->second.dir);
+        dirs_.erase(dirs_.begin());
+      }
+      dirs_[key] = cursor;
+      pthread_mutex_unlock(&mutex_);
     }
     done->Run();
   }
 
+  // Removes empty directories too, like AFCRemovePath, since fuse sends
+  // rmdir here as well
   void Unlink(RpcController* rpc,
               const proto::UnlinkRequest* request,
               proto::UnlinkResponse* response,
               Closure* done) {
     int res = unlink(request->path().c_str());
+    if (res == -1 && (errno == EISDIR || errno == EPERM)) {
+      int unlink_errno = errno;
+      res = rmdir(request->path().c_str());
+      if (res == -1 && errno == ENOTDIR) {
+        errno = unlink_errno;
+      }
+    }
     if (res == -1) {
       rpc->SetFailed(strerror(errno));
     }
     done->Run();
   }
 
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    fs::RemoveTree(std::vector<proto::FsService*>(1, this), rpc, request,
+                   response);
+    done->Run();
+  }
+
   void MkDir(RpcController* rpc,
              const proto::MkDirRequest* request,
              proto::MkDirResponse* response,
@@ -173,6 +251,35 @@ class LoopbackService : public proto::FsService {
     done->Run();
   }
 
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    long long total = 0;
+    for (int i = 0; i < request->range_size(); ++i) {
+      total += request->range(i).size();
+    }
+    if (total > kMaxBufferSize) {
+      rpc->SetFailed("Read request too large");
+      done->Run();
+      return;
+    }
+    for (int i = 0; i < request->range_size(); ++i) {
+      std::string* buffer = response->add_buffer();
+      buffer->resize(request->range(i).size());
+      ssize_t n = pread(request->filehandle(),
+                        buffer->empty() ? NULL : &(*buffer)[0],
+                        buffer->size(), request->range(i).offset());
+      if (n == -1) {
+        rpc->SetFailed(strerror(errno));
+        response->Clear();
+        break;
+      }
+      buffer->resize(n);
+    }
+    done->Run();
+  }
+
   void Write(RpcController* rpc,
              const proto::WriteRequest* request,
              proto::WriteResponse* response,
@@ -187,6 +294,31 @@ class LoopbackService : public proto::FsService {
     done->Run();
   }
 
+  // Linux copies within the kernel, sharing blocks where the filesystem
+  // supports it.  Elsewhere, or between filesystems, the data is copied
+  // through a buffer.
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    long long total = 0;
+    int error = 0;
+#ifdef __linux__
+    bool copied = KernelCopy(*request, &total, &error);
+#else
+    bool copied = false;
+#endif
+    if (!copied) {
+      BufferCopy(*request, &total, &error);
+    }
+    if (error != 0) {
+      rpc->SetFailed(strerror(error));
+    } else {
+      response->set_size(total);
+    }
+    done->Run();
+  }
+
   void Truncate(RpcController* rpc,
                 const proto::TruncateRequest* request,
                 proto::TruncateResponse* response,
@@ -198,6 +330,31 @@ class LoopbackService : public proto::FsService {
     done->Run();
   }
 
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    int res = ftruncate(request->filehandle(), request->offset());
+    if (res == -1) {
+      rpc->SetFailed(strerror(errno));
+    }
+    done->Run();
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    struct stat stbuf;
+    int res = fstat(request->filehandle(), &stbuf);
+    if (res == -1) {
+      rpc->SetFailed(strerror(errno));
+    } else {
+      FillStat(stbuf, response->mutable_stat());
+    }
+    done->Run();
+  }
+
   void StatFs(RpcController* rpc,
               const proto::StatFsRequest* request,
               proto::StatFsResponse* response,
@@ -214,6 +371,89 @@ class LoopbackService : public proto::FsService {
     }
     done->Run();
   }
+
+ private:
+  // An open directory listing, positioned at the entry with index position.
+  struct DirCursor {
+    DIR* dir;
+    long long position;
+  };
+  // Cursors are found by path and the dirhandle of the request
+  typedef std::pair<std::string, long long> DirCursorKey;
+  typedef std::map<DirCursorKey, DirCursor> DirCursorMap;
+
+#ifdef __linux__
+  // Returns false if the kernel cannot copy between the files, in which case
+  // nothing has been copied.
+  static bool KernelCopy(const proto::CopyRangeRequest& request,
+                         long long* total, int* error) {
+    loff_t source_offset = request.source_offset();
+    loff_t destination_offset = request.destination_offset();
+    while (*total < request.size()) {
+      ssize_t n = copy_file_range(request.source_filehandle(), &source_offset,
+                                  request.destination_filehandle(),
+                                  &destination_offset,
+                                  request.size() - *total, 0);
+      if (n == -1) {
+        if (*total == 0 && (errno == EXDEV || errno == EINVAL ||
+                            errno == ENOSYS || errno == EOPNOTSUPP)) {
+          return false;
+        }
+        *error = errno;
+        break;
+      } else if (n == 0) {
+        break;
+      }
+      *total += n;
+    }
+    return true;
+  }
+#endif
+
+  static void BufferCopy(const proto::CopyRangeRequest& request,
+                         long long* total, int* error) {
+    char* buf = static_cast<char*>(malloc(kMaxBufferSize));
+    while (*total < request.size()) {
+      size_t size = std::min<long long>(kMaxBufferSize,
+                                        request.size() - *total);
+      ssize_t n = pread(request.source_filehandle(), buf, size,
+                        request.source_offset() + *total);
+      if (n == -1) {
+        *error = errno;
+        break;
+      } else if (n == 0) {
+        break;
+      }
+      ssize_t written = pwrite(request.destination_filehandle(), buf, n,
+                               request.destination_offset() + *total);
+      if (written == -1) {
+        *error = errno;
+        break;
+      }
+      *total += written;
+      if (written < n) {
+        break;
+      }
+    }
+    free(buf);
+  }
+
+  static void FillStat(const struct stat& stbuf, proto::Stat* stat) {
+    stat->set_size(stbuf.st_size);
+    stat->set_blocks(stbuf.st_blocks);
+    stat->set_mode(stbuf.st_mode);
+    stat->set_nlink(stbuf.st_nlink);
+#ifdef __APPLE__
+    stat->mutable_mtime()->set_tv_sec(stbuf.st_mtimespec.tv_sec);
+    stat->mutable_mtime()->set_tv_nsec(stbuf.st_mtimespec.tv_nsec);
+#else
+    stat->mutable_mtime()->set_tv_sec(stbuf.st_mtim.tv_sec);
+    stat->mutable_mtime()->set_tv_nsec(stbuf.st_mtim.tv_nsec);
+#endif
+  }
+
+  pthread_mutex_t mutex_;  // protects dirs_
+  DirCursorMap dirs_;
 };
 
 
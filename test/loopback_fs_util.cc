@@ -2,11 +2,26 @@
 //
 // Mounts the loopback fs service.
 
+#include <signal.h>
+#include <stdlib.h>
 #include <syslog.h>
+#include "cache/listing_cache_fs_service.h"
 #include "fs/fs.h"
 #include "fs/fs_proxy.h"
+#include "fs/service_backend.h"
+#include "memory/memory_budget.h"
+#include "metrics/metrics_fs_service.h"
+#include "metrics/metrics_server.h"
+#include "prefetch/prefetch_fs_service.h"
 #include "proto/fs_service.pb.h"
+#include "replay/recording_fs_service.h"
+#include "scheduler/scheduling_fs_service.h"
+#include "test/latency_fs_service.h"
+#include "test/loopback_backend.h"
 #include "test/loopback_fs_service.h"
+#include "test/uring_loopback_fs_service.h"
+#include "trace/trace.h"
+#include "xattr/xattr_fs_service.h"
 
 int main(int argc, char* argv[]) {
   openlog("loopback_fs_util", LOG_PERROR, LOG_USER);
@@ -15,22 +30,114 @@ int main(int argc, char* argv[]) {
 #else
   setlogmask(LOG_UPTO(LOG_INFO));
 #endif
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <volume> <volicon>\n", argv[0]);
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s <volume> <volicon> [trace file]\n", argv[0]);
     return 1;
   }
   const std::string& volume(argv[1]);
   const std::string& volicon(argv[2]);
-  proto::FsService* service = test::NewLoopbackService();
-  fs::Filesystem* fs = fs::NewProxyFilesystem(service, "dummy-fs-id", volume,
-                                              volicon);
+  // The memory budget for caches and buffers may be set from the environment
+  const char* budget_mb = getenv("IPHONEDISK_MEMORY_BUDGET_MB");
+  if (budget_mb != NULL) {
+    memory::SetBudget(atoll(budget_mb) * 1024 * 1024);
+  }
+  const std::string trace_file(argc == 4 ? argv[3] : "");
+  if (!trace_file.empty() && !trace::FlushOnSignal(SIGUSR1, trace_file)) {
+    syslog(LOG_ERR, "Failed to enable tracing");
+    return 1;
+  }
+  // IPHONEDISK_LOOPBACK=uring selects the io_uring backend on Linux, and
+  // IPHONEDISK_LOOPBACK=native an FsBackend that fuse calls without messages
+  // when no other services are used (see fs/fs_backend.h)
+  proto::FsService* loopback = NULL;
+  fs::FsBackend* native = NULL;
+  const char* backend = getenv("IPHONEDISK_LOOPBACK");
+  if (backend != NULL && std::string(backend) == "native") {
+    native = test::NewLoopbackBackend();
+    // Owns native
+    loopback = fs::NewBackendService(native);
+  } else {
+    loopback = test::NewLoopbackServiceFromEnvironment();
+    if (loopback == NULL) {
+      return 1;
+    }
+  }
+  proto::FsService* service = loopback;
+  // Simulates a device connection, see test/latency_fs_service.h.  Like a
+  // device, the simulated connection is scheduled one call at a time and
+  // missing names are looked up in cached listings.
+  const char* simulate = getenv("IPHONEDISK_SIMULATE");
+  if (simulate != NULL) {
+    test::LatencyOptions options;
+    if (!test::ParseLatencyOptions(simulate, &options)) {
+      syslog(LOG_ERR, "Invalid IPHONEDISK_SIMULATE: %s", simulate);
+      return 1;
+    }
+    service = scheduler::NewSchedulingFsService(
+        test::NewLatencyFsService(loopback, options),
+        scheduler::SchedulerOptions());
+    // Predicted ranges are fetched ahead as by mobile_fs_util
+    prefetch::PrefetchOptions prefetch_options;
+    const char* prefetch_tail = getenv("IPHONEDISK_PREFETCH_TAIL_KB");
+    if (prefetch_tail != NULL) {
+      prefetch_options.tail_size = atoll(prefetch_tail) * 1024;
+    }
+    service = prefetch::NewPrefetchFsService(service, prefetch_options);
+    // Listings are checked for changes made to the directory by other means
+    // every IPHONEDISK_POLL_INTERVAL_MS, as on a device
+    cache::ListingCacheOptions cache_options;
+    const char* poll_interval = getenv("IPHONEDISK_POLL_INTERVAL_MS");
+    if (poll_interval != NULL) {
+      cache_options.poll_interval_usec = atoll(poll_interval) * 1000;
+    }
+    const char* poll_budget = getenv("IPHONEDISK_POLL_BUDGET");
+    if (poll_budget != NULL) {
+      cache_options.poll_budget = atoi(poll_budget);
+    }
+    cache_options.invalidate = &fs::InvalidatePath;
+    service = cache::NewListingCacheFsService(service, cache_options);
+  }
+  // Keeps extended attributes in a store, as mobile_fs_util does
+  const char* xattr_store = getenv("IPHONEDISK_XATTR_STORE");
+  if (xattr_store != NULL) {
+    service = xattr::NewXAttrFsService(service, xattr_store);
+    if (service == NULL) {
+      return 1;
+    }
+  }
+  // Records the calls for fs_replay
+  const char* recording = getenv("IPHONEDISK_RECORD");
+  if (recording != NULL) {
+    service = replay::NewRecordingFsService(service, recording);
+    if (service == NULL) {
+      return 1;
+    }
+  }
+  // Serves metrics for each call, as mobile_fs_util does
+  const char* metrics_socket = getenv("IPHONEDISK_METRICS_SOCKET");
+  if (metrics_socket != NULL) {
+    if (!metrics::Serve(metrics_socket)) {
+      return 1;
+    }
+    service = metrics::NewMetricsFsService(service);
+  }
+  fs::Filesystem* fs = NULL;
+  if (native != NULL && service == loopback) {
+    fs = fs::NewBackendFilesystem(native, "dummy-fs-id", volume, volicon);
+  } else {
+    fs = fs::NewProxyFilesystem(service, "dummy-fs-id", volume, volicon);
+  }
   if (!fs->Mount()) {
     syslog(LOG_ERR, "Failed to mount filesystem");
   } else {
     fs->WaitForUnmount();
   }
   delete fs;
+  // Each service owns the one it wraps, down to the loopback service
   delete service;
+  if (!trace_file.empty()) {
+    trace::Flush(trace_file);
+  }
   closelog();
   return 0;
 }
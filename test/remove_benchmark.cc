@@ -0,0 +1,228 @@
+// Measures removing a directory tree over simulated device connections, e.g.
+//
+//   remove_benchmark /tmp/scratch "latency=1500,jitter=300,bandwidth=20m" 4
+//
+// The tree is created directly on the loopback service and then removed
+// through latency services, first the way the kernel removes it through a
+// mount (each directory listed, then each entry removed, one call at a
+// time), and then with RemoveTree over every number of connections up to
+// the one given.  As on the device the primary connection is behind a
+// scheduler and the others are striping helpers.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/time.h>
+#include <vector>
+#include "proto/fs_service.pb.h"
+#include "rpc/rpc.h"
+#include "scheduler/scheduling_fs_service.h"
+#include "stripe/striping_fs_service.h"
+#include "test/latency_fs_service.h"
+#include "test/loopback_fs_service.h"
+
+using google::protobuf::Closure;
+
+static const int kDirectories = 20;
+static const int kFilesPerDirectory = 50;
+
+static long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static bool Failed(const rpc::Rpc& rpc, const char* call) {
+  if (rpc.Failed()) {
+    fprintf(stderr, "%s failed: %s\n", call, rpc.ErrorText().c_str());
+    return true;
+  }
+  return false;
+}
+
+static void Report(const char* name, int entries, long long start) {
+  double seconds = (NowMicros() - start) / 1000000.0;
+  printf("%-16s %8d entries %10.1f entries/s\n", name, entries,
+         entries / seconds);
+}
+
+// Creates root holding kDirectories directories of kFilesPerDirectory empty
+// files, returning the number of entries or -1 on failure
+static int CreateTree(proto::FsService* service, const std::string& root,
+                      Closure* done) {
+  int entries = 0;
+  for (int i = -1; i < kDirectories; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "/dir-%d", i);
+    std::string directory = (i < 0) ? root : root + name;
+    rpc::Rpc rpc;
+    proto::MkDirRequest request;
+    proto::MkDirResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_path(directory);
+    request.set_mode(0755);
+    service->MkDir(&rpc, &request, &response, done);
+    if (Failed(rpc, "MkDir")) {
+      return -1;
+    }
+    entries++;
+    for (int j = 0; i >= 0 && j < kFilesPerDirectory; ++j) {
+      snprintf(name, sizeof(name), "/file-%d", j);
+      rpc::Rpc create_rpc;
+      proto::CreateRequest create;
+      proto::CreateResponse created;
+      create.mutable_header()->set_fs_id("benchmark");
+      create.set_path(directory + name);
+      create.set_flags(O_CREAT | O_TRUNC | O_WRONLY);
+      create.set_mode(0644);
+      service->Create(&create_rpc, &create, &created, done);
+      if (Failed(create_rpc, "Create")) {
+        return -1;
+      }
+      rpc::Rpc release_rpc;
+      proto::ReleaseRequest release;
+      proto::ReleaseResponse released;
+      release.mutable_header()->set_fs_id("benchmark");
+      release.set_filehandle(created.filehandle());
+      service->Release(&release_rpc, &release, &released, done);
+      entries++;
+    }
+  }
+  return entries;
+}
+
+// Removes path the way rm -r through a mount does, returning false on
+// failure
+static bool RemoveEntries(proto::FsService* service, const std::string& path,
+                          Closure* done) {
+  std::vector<std::string> names;
+  long long offset = 0;
+  while (true) {
+    rpc::Rpc rpc;
+    proto::ReadDirRequest request;
+    proto::ReadDirResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_path(path);
+    request.set_offset(offset);
+    service->ReadDir(&rpc, &request, &response, done);
+    if (Failed(rpc, "ReadDir")) {
+      return false;
+    }
+    for (int i = 0; i < response.entry_size(); ++i) {
+      const std::string& filename = response.entry(i).filename();
+      if (filename != "." && filename != "..") {
+        names.push_back(filename);
+      }
+    }
+    if (!response.has_next_offset()) {
+      break;
+    }
+    offset = response.next_offset();
+  }
+  for (size_t i = 0; i < names.size(); ++i) {
+    std::string child = path + "/" + names[i];
+    // The kernel would stat each entry; the layout of the tree is known
+    if (names[i].compare(0, 4, "dir-") == 0) {
+      if (!RemoveEntries(service, child, done)) {
+        return false;
+      }
+      continue;
+    }
+    rpc::Rpc rpc;
+    proto::UnlinkRequest request;
+    proto::UnlinkResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_path(child);
+    service->Unlink(&rpc, &request, &response, done);
+    if (Failed(rpc, "Unlink")) {
+      return false;
+    }
+  }
+  rpc::Rpc rpc;
+  proto::UnlinkRequest request;
+  proto::UnlinkResponse response;
+  request.mutable_header()->set_fs_id("benchmark");
+  request.set_path(path);
+  service->Unlink(&rpc, &request, &response, done);
+  return !Failed(rpc, "Unlink");
+}
+
+// Returns a striping service over a number of simulated connections
+static proto::FsService* NewStriper(const test::LatencyOptions& latency,
+                                    int connections) {
+  proto::FsService* primary = scheduler::NewSchedulingFsService(
+      test::NewLatencyFsService(test::NewLoopbackService(), latency),
+      scheduler::SchedulerOptions());
+  std::vector<proto::FsService*> helpers;
+  for (int i = 1; i < connections; ++i) {
+    helpers.push_back(test::NewLatencyFsService(test::NewLoopbackService(),
+                                                latency));
+  }
+  return stripe::NewStripingFsService(primary, helpers,
+                                      stripe::StripingOptions());
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr,
+            "Usage: %s <scratch directory> <latency spec> [connections]\n",
+            argv[0]);
+    return 1;
+  }
+  test::LatencyOptions latency;
+  if (!test::ParseLatencyOptions(argv[2], &latency)) {
+    fprintf(stderr, "Invalid latency spec: %s\n", argv[2]);
+    return 1;
+  }
+  // The connections share the bandwidth of one USB link
+  test::Link link(latency.bytes_per_second);
+  latency.link = &link;
+  int connections = (argc == 4) ? atoi(argv[3]) : 4;
+  if (connections < 1) {
+    fprintf(stderr, "Invalid number of connections: %s\n", argv[3]);
+    return 1;
+  }
+  Closure* done = google::protobuf::NewPermanentCallback(
+      &google::protobuf::DoNothing);
+  proto::FsService* loopback = test::NewLoopbackService();
+  const std::string root = std::string(argv[1]) + "/remove_benchmark";
+  bool success = true;
+  int entries = CreateTree(loopback, root, done);
+  if (entries < 0) {
+    success = false;
+  } else {
+    proto::FsService* service = NewStriper(latency, 1);
+    long long start = NowMicros();
+    success = RemoveEntries(service, root, done);
+    if (success) {
+      Report("unlink", entries, start);
+    }
+    delete service;
+  }
+  for (int i = 1; success && i <= connections; ++i) {
+    entries = CreateTree(loopback, root, done);
+    if (entries < 0) {
+      success = false;
+      break;
+    }
+    proto::FsService* service = NewStriper(latency, i);
+    rpc::Rpc rpc;
+    proto::RemoveTreeRequest request;
+    proto::RemoveTreeResponse response;
+    request.mutable_header()->set_fs_id("benchmark");
+    request.set_path(root);
+    long long start = NowMicros();
+    service->RemoveTree(&rpc, &request, &response, done);
+    success = !Failed(rpc, "RemoveTree");
+    if (success) {
+      char label[32];
+      snprintf(label, sizeof(label), "rmtree-%d", i);
+      Report(label, response.removed(), start);
+    }
+    delete service;
+  }
+  delete loopback;
+  delete done;
+  return success ? 0 : 1;
+}
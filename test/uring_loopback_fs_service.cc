@@ -0,0 +1,641 @@
+#include "test/uring_loopback_fs_service.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "test/loopback_fs_service.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <vector>
+#include "memory/memory_budget.h"
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace test {
+
+static const unsigned int kRingEntries = 64;
+// Registered buffers, each large enough for the largest read
+static const int kBuffers = 8;
+static const int kMaxBufferSize = 1024 * 1024;
+
+static metrics::Counter g_submits(
+    "uring_submits_total", "io_uring_enter calls that submitted requests");
+static metrics::Counter g_submitted(
+    "uring_submitted_total", "Requests submitted to io_uring");
+
+static memory::Consumer g_buffer_memory("uring_buffers", NULL, NULL);
+
+// Opcodes that must be supported by the kernel
+static const int kOpcodes[] = {
+  IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+  IORING_OP_WRITE, IORING_OP_STATX,
+};
+
+class UringLoopbackService : public proto::FsService {
+ public:
+  UringLoopbackService()
+      : fallback_(NewLoopbackService()),
+        ring_fd_(-1),
+        ring_(MAP_FAILED),
+        ring_size_(0),
+        sqes_(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+        buffers_(NULL),
+        fixed_(false),
+        queued_(0),
+        in_flight_(0),
+        submitting_(false),
+        waiting_(false) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&changed_, NULL);
+    pthread_cond_init(&buffer_available_, NULL);
+  }
+
+  virtual ~UringLoopbackService() {
+    if (buffers_ != NULL) {
+      g_buffer_memory.Release(kBuffers * kMaxBufferSize);
+      free(buffers_);
+    }
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sq_entries_ * sizeof(struct io_uring_sqe));
+    }
+    if (ring_ != MAP_FAILED) {
+      munmap(ring_, ring_size_);
+    }
+    if (ring_fd_ != -1) {
+      close(ring_fd_);
+    }
+    pthread_cond_destroy(&buffer_available_);
+    pthread_cond_destroy(&changed_);
+    pthread_mutex_destroy(&mutex_);
+    delete fallback_;
+  }
+
+  // Sets up the ring.  Returns false if io_uring is not usable.
+  bool Init() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ = syscall(__NR_io_uring_setup, kRingEntries, &params);
+    if (ring_fd_ == -1) {
+      syslog(LOG_INFO, "io_uring_setup failed: %m");
+      return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || !Probe()) {
+      syslog(LOG_INFO, "io_uring is missing required features");
+      return false;
+    }
+    sq_entries_ = params.sq_entries;
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(__u32);
+    size_t cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size_ = (sq_size > cq_size) ? sq_size : cq_size;
+    ring_ = mmap(NULL, ring_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (ring_ == MAP_FAILED) {
+      syslog(LOG_ERR, "Unable to map io_uring: %m");
+      return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(
+        mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+             IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+      syslog(LOG_ERR, "Unable to map io_uring entries: %m");
+      return false;
+    }
+    char* ring = static_cast<char*>(ring_);
+    sq_tail_ = reinterpret_cast<__u32*>(ring + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<__u32*>(ring + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<__u32*>(ring + params.sq_off.array);
+    cq_head_ = reinterpret_cast<__u32*>(ring + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<__u32*>(ring + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<__u32*>(ring + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(ring + params.cq_off.cqes);
+
+    return RegisterBuffers();
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    Stat(rpc, AT_FDCWD, request->path().c_str(), AT_SYMLINK_NOFOLLOW,
+         response->mutable_stat());
+    done->Run();
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    fallback_->ReadLink(rpc, request, response, done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    fallback_->SymLink(rpc, request, response, done);
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    fallback_->ReadDir(rpc, request, response, done);
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    fallback_->Unlink(rpc, request, response, done);
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    fallback_->RemoveTree(rpc, request, response, done);
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    fallback_->MkDir(rpc, request, response, done);
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    fallback_->Rename(rpc, request, response, done);
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    fallback_->Open(rpc, request, response, done);
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    fallback_->Create(rpc, request, response, done);
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    fallback_->Release(rpc, request, response, done);
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    if (request->size() > kMaxBufferSize) {
+      rpc->SetFailed("Read request too large");
+      done->Run();
+      return;
+    }
+    Completion completion;
+    int buffer = AcquireBuffer();
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = fixed_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe.fd = request->filehandle();
+    sqe.addr = reinterpret_cast<unsigned long>(Buffer(buffer));
+    sqe.len = request->size();
+    sqe.off = request->offset();
+    sqe.buf_index = buffer;
+    int res = Execute(&sqe, &completion);
+    if (res < 0) {
+      rpc->SetFailed(strerror(-res));
+    } else {
+      response->mutable_buffer()->assign(Buffer(buffer), res);
+    }
+    ReleaseBuffer(buffer);
+    done->Run();
+  }
+
+  // The ranges share one buffer and are submitted together, so the kernel
+  // works on all of them at once.
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    long long total = 0;
+    for (int i = 0; i < request->range_size(); ++i) {
+      total += request->range(i).size();
+    }
+    if (total > kMaxBufferSize ||
+        request->range_size() > static_cast<int>(sq_entries_)) {
+      rpc->SetFailed("Read request too large");
+      done->Run();
+      return;
+    }
+    int count = request->range_size();
+    std::vector<struct io_uring_sqe> sqes(count);
+    std::vector<Completion> completions(count);
+    int buffer = AcquireBuffer();
+    char* data = Buffer(buffer);
+    for (int i = 0; i < count; ++i) {
+      struct io_uring_sqe& sqe = sqes[i];
+      memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = fixed_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe.fd = request->filehandle();
+      sqe.addr = reinterpret_cast<unsigned long>(data);
+      sqe.len = request->range(i).size();
+      sqe.off = request->range(i).offset();
+      sqe.buf_index = buffer;
+      data += request->range(i).size();
+    }
+    if (count > 0) {
+      ExecuteAll(&sqes[0], &completions[0], count);
+    }
+    data = Buffer(buffer);
+    for (int i = 0; i < count; ++i) {
+      if (completions[i].result < 0) {
+        rpc->SetFailed(strerror(-completions[i].result));
+        response->Clear();
+        break;
+      }
+      response->add_buffer()->assign(data, completions[i].result);
+      data += request->range(i).size();
+    }
+    ReleaseBuffer(buffer);
+    done->Run();
+  }
+
+  // Writes larger than a registered buffer are written from the request
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    const std::string& data = request->buffer();
+    Completion completion;
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = request->filehandle();
+    sqe.len = data.size();
+    sqe.off = request->offset();
+    int buffer = -1;
+    if (data.size() <= static_cast<size_t>(kMaxBufferSize)) {
+      buffer = AcquireBuffer();
+      memcpy(Buffer(buffer), data.data(), data.size());
+      sqe.opcode = fixed_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      sqe.addr = reinterpret_cast<unsigned long>(Buffer(buffer));
+      sqe.buf_index = buffer;
+    } else {
+      sqe.opcode = IORING_OP_WRITE;
+      sqe.addr = reinterpret_cast<unsigned long>(data.data());
+    }
+    int res = Execute(&sqe, &completion);
+    if (res < 0) {
+      rpc->SetFailed(strerror(-res));
+    } else {
+      response->set_size(res);
+    }
+    if (buffer != -1) {
+      ReleaseBuffer(buffer);
+    }
+    done->Run();
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    fallback_->CopyRange(rpc, request, response, done);
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    fallback_->Truncate(rpc, request, response, done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    fallback_->FTruncate(rpc, request, response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    Stat(rpc, request->filehandle(), "", AT_EMPTY_PATH,
+         response->mutable_stat());
+    done->Run();
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    fallback_->StatFs(rpc, request, response, done);
+  }
+
+ private:
+  // A request waiting for its result
+  struct Completion {
+    Completion() : done(false), result(0) { }
+
+    bool done;
+    int result;
+  };
+
+  bool Probe() {
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe =
+        static_cast<struct io_uring_probe*>(calloc(1, size));
+    bool supported = (syscall(__NR_io_uring_register, ring_fd_,
+                              IORING_REGISTER_PROBE, probe, 256) == 0);
+    for (size_t i = 0;
+         supported && i < sizeof(kOpcodes) / sizeof(kOpcodes[0]); ++i) {
+      supported = (kOpcodes[i] <= probe->last_op &&
+                   (probe->ops[kOpcodes[i]].flags & IO_URING_OP_SUPPORTED));
+    }
+    free(probe);
+    return supported;
+  }
+
+  // Buffers are used unregistered if they cannot be registered, for example
+  // because they would exceed the locked memory limit.  Returns false if they
+  // cannot be allocated.
+  bool RegisterBuffers() {
+    if (posix_memalign(&buffers_, 4096, kBuffers * kMaxBufferSize) != 0) {
+      buffers_ = NULL;
+      return false;
+    }
+    g_buffer_memory.Charge(kBuffers * kMaxBufferSize);
+    struct iovec iov[kBuffers];
+    for (int i = 0; i < kBuffers; ++i) {
+      iov[i].iov_base = Buffer(i);
+      iov[i].iov_len = kMaxBufferSize;
+      free_buffers_.push_back(i);
+    }
+    fixed_ = (syscall(__NR_io_uring_register, ring_fd_,
+                      IORING_REGISTER_BUFFERS, iov, kBuffers) == 0);
+    if (!fixed_) {
+      syslog(LOG_INFO, "Unable to register io_uring buffers: %m");
+    }
+    return true;
+  }
+
+  char* Buffer(int i) {
+    return static_cast<char*>(buffers_) +
+           static_cast<size_t>(i) * kMaxBufferSize;
+  }
+
+  int AcquireBuffer() {
+    pthread_mutex_lock(&mutex_);
+    while (free_buffers_.empty()) {
+      pthread_cond_wait(&buffer_available_, &mutex_);
+    }
+    int buffer = free_buffers_.back();
+    free_buffers_.pop_back();
+    pthread_mutex_unlock(&mutex_);
+    return buffer;
+  }
+
+  void ReleaseBuffer(int buffer) {
+    pthread_mutex_lock(&mutex_);
+    free_buffers_.push_back(buffer);
+    pthread_cond_signal(&buffer_available_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  void Stat(RpcController* rpc, int fd, const char* path, int flags,
+            proto::Stat* stat) {
+    struct statx stx;
+    Completion completion;
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<unsigned long>(path);
+    sqe.len = STATX_BASIC_STATS;
+    sqe.off = reinterpret_cast<unsigned long>(&stx);
+    sqe.statx_flags = flags;
+    int res = Execute(&sqe, &completion);
+    if (res < 0) {
+      rpc->SetFailed(strerror(-res));
+      return;
+    }
+    stat->set_size(stx.stx_size);
+    stat->set_blocks(stx.stx_blocks);
+    stat->set_mode(stx.stx_mode);
+    stat->set_nlink(stx.stx_nlink);
+    stat->mutable_mtime()->set_tv_sec(stx.stx_mtime.tv_sec);
+    stat->mutable_mtime()->set_tv_nsec(stx.stx_mtime.tv_nsec);
+  }
+
+  // Queues the request and waits for its result, which is a negated errno on
+  // failure.  There is no thread dedicated to the ring: a caller with a
+  // queued request submits every request queued so far in one call, and one
+  // caller at a time waits in the kernel for completions on behalf of all of
+  // them.  Requests queued while another caller is submitting or waiting are
+  // picked up by the next submit.
+  int Execute(struct io_uring_sqe* sqe, Completion* completion) {
+    ExecuteAll(sqe, completion, 1);
+    return completion->result;
+  }
+
+  // Queues count requests together and waits for all of their results
+  void ExecuteAll(struct io_uring_sqe* sqes, Completion* completions,
+                  unsigned int count) {
+    pthread_mutex_lock(&mutex_);
+    while (in_flight_ + count > sq_entries_) {
+      pthread_cond_wait(&changed_, &mutex_);
+    }
+    for (unsigned int i = 0; i < count; ++i) {
+      sqes[i].user_data = reinterpret_cast<unsigned long>(&completions[i]);
+      Queue(sqes[i]);
+    }
+    while (!Done(completions, count)) {
+      if (queued_ > 0 && !submitting_) {
+        Submit();
+      } else if (!waiting_) {
+        waiting_ = true;
+        pthread_mutex_unlock(&mutex_);
+        Enter(0, IORING_ENTER_GETEVENTS);
+        pthread_mutex_lock(&mutex_);
+        waiting_ = false;
+        Reap();
+      } else {
+        pthread_cond_wait(&changed_, &mutex_);
+      }
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  static bool Done(const Completion* completions, unsigned int count) {
+    for (unsigned int i = 0; i < count; ++i) {
+      if (!completions[i].done) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Adds an entry to the submission queue.  Called with mutex_ held.
+  void Queue(const struct io_uring_sqe& sqe) {
+    __u32 tail = *sq_tail_;
+    __u32 index = tail & sq_mask_;
+    sqes_[index] = sqe;
+    sq_array_[index] = index;
+    // The entry must be visible before the tail that publishes it
+    __sync_synchronize();
+    *sq_tail_ = tail + 1;
+    queued_++;
+    in_flight_++;
+  }
+
+  // Submits the queued entries, releasing mutex_ during the system call.
+  // Reads of cached data often complete during the submit.  While a caller
+  // is waiting only it reaps, so that it cannot sleep in the kernel on a
+  // completion that was already taken from the ring.
+  void Submit() {
+    unsigned int to_submit = queued_;
+    queued_ = 0;
+    submitting_ = true;
+    pthread_mutex_unlock(&mutex_);
+    int submitted = Enter(to_submit, 0);
+    g_submits.Increment();
+    g_submitted.IncrementBy(submitted);
+    pthread_mutex_lock(&mutex_);
+    submitting_ = false;
+    queued_ += to_submit - submitted;
+    if (!waiting_) {
+      Reap();
+    } else {
+      pthread_cond_broadcast(&changed_);
+    }
+  }
+
+  // Returns the number of entries submitted
+  int Enter(unsigned int to_submit, unsigned int flags) {
+    int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+                      (flags & IORING_ENTER_GETEVENTS) ? 1 : 0, flags, NULL,
+                      0);
+    if (ret < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        syslog(LOG_ERR, "io_uring_enter failed: %m");
+      }
+      return 0;
+    }
+    return ret;
+  }
+
+  // Completes the finished requests.  Called with mutex_ held.
+  void Reap() {
+    __u32 head = *cq_head_;
+    __u32 tail = *cq_tail_;
+    __sync_synchronize();
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      Completion* completion = reinterpret_cast<Completion*>(cqe.user_data);
+      completion->result = cqe.res;
+      completion->done = true;
+      in_flight_--;
+    }
+    __sync_synchronize();
+    *cq_head_ = head;
+    // Wakes the callers that completed, and lets another caller submit or
+    // wait in place of this one.
+    pthread_cond_broadcast(&changed_);
+  }
+
+  proto::FsService* fallback_;
+  int ring_fd_;
+  void* ring_;
+  size_t ring_size_;
+  unsigned int sq_entries_;
+  __u32* sq_tail_;
+  __u32 sq_mask_;
+  __u32* sq_array_;
+  struct io_uring_sqe* sqes_;
+  __u32* cq_head_;
+  __u32* cq_tail_;
+  __u32 cq_mask_;
+  struct io_uring_cqe* cqes_;
+  void* buffers_;
+  // Whether the buffers are registered with the kernel
+  bool fixed_;
+
+  pthread_mutex_t mutex_;
+  // Signaled when requests complete or a caller stops submitting or waiting
+  pthread_cond_t changed_;
+  pthread_cond_t buffer_available_;
+  std::vector<int> free_buffers_;
+  // Entries not yet submitted, and entries not yet completed
+  unsigned int queued_;
+  unsigned int in_flight_;
+  // Whether a caller is submitting, or waiting for completions
+  bool submitting_;
+  bool waiting_;
+};
+
+proto::FsService* NewUringLoopbackService() {
+  UringLoopbackService* service = new UringLoopbackService();
+  if (!service->Init()) {
+    delete service;
+    return NULL;
+  }
+  return service;
+}
+
+}  // namespace test
+
+#else  // __linux__
+
+namespace test {
+
+proto::FsService* NewUringLoopbackService() {
+  return NULL;
+}
+
+}  // namespace test
+
+#endif  // __linux__
+
+namespace test {
+
+proto::FsService* NewLoopbackServiceFromEnvironment() {
+  const char* backend = getenv("IPHONEDISK_LOOPBACK");
+  if (backend == NULL || std::string(backend) != "uring") {
+    return NewLoopbackService();
+  }
+  proto::FsService* service = NewUringLoopbackService();
+  if (service == NULL) {
+    fprintf(stderr, "io_uring is not available\n");
+  }
+  return service;
+}
+
+}  // namespace test
@@ -0,0 +1,28 @@
+// A loopback FsService for Linux that reads, writes and stats files through
+// io_uring instead of one blocking system call per request.  Calls from any
+// number of threads are queued on one ring and submitted together, and reads
+// and writes go through buffers registered with the kernel once.  Every other
+// call is handled by the ordinary loopback service.  This is a reference
+// backend for measuring how fast the frontend can go.
+
+#ifndef __TEST_URING_LOOPBACK_FS_SERVICE_H__
+#define __TEST_URING_LOOPBACK_FS_SERVICE_H__
+
+namespace proto {
+class FsService;
+}
+
+namespace test {
+
+// Returns NULL where io_uring is not available, such as on Mac OS X or on
+// Linux kernels older than 5.6.
+proto::FsService* NewUringLoopbackService();
+
+// The io_uring service when IPHONEDISK_LOOPBACK=uring, and otherwise the
+// ordinary loopback service.  Returns NULL, after printing why, when io_uring
+// was asked for but is not available.
+proto::FsService* NewLoopbackServiceFromEnvironment();
+
+}  // namespace test
+
+#endif  // __TEST_URING_LOOPBACK_FS_SERVICE_H__
@@ -0,0 +1,221 @@
+// Every thread that records a span lazily allocates its own ring buffer and
+// pushes it onto a global list with a compare-and-swap; the list is never
+// shrunk.  Each event carries a sequence number that is odd while the owning
+// thread is writing it, so Flush can skip events that are overwritten while
+// they are being copied out instead of making the writer wait.
+
+#include "trace/trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace trace {
+
+volatile bool g_enabled = false;
+
+namespace {
+
+// Number of events kept per thread; the oldest events are overwritten first
+const int kEventsPerThread = 8192;
+// Paths longer than this are truncated in the trace
+const int kMaxPathLength = 128;
+
+struct Event {
+  volatile unsigned int sequence;
+  const char* category;
+  const char* name;
+  long long start;
+  long long duration;
+  long long size;
+  long long offset;
+  char path[kMaxPathLength];
+};
+
+struct Buffer {
+  int tid;
+  // Total number of events ever recorded by the thread
+  volatile unsigned long long head;
+  Buffer* next;
+  Event events[kEventsPerThread];
+};
+
+Buffer* volatile g_buffers = NULL;
+volatile int g_next_tid = 0;
+__thread Buffer* t_buffer = NULL;
+
+long long NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+Buffer* GetThreadBuffer() {
+  if (t_buffer == NULL) {
+    Buffer* buffer = static_cast<Buffer*>(calloc(1, sizeof(Buffer)));
+    buffer->tid = __sync_add_and_fetch(&g_next_tid, 1);
+    do {
+      buffer->next = g_buffers;
+    } while (!__sync_bool_compare_and_swap(&g_buffers, buffer->next, buffer));
+    t_buffer = buffer;
+  }
+  return t_buffer;
+}
+
+void WriteJsonString(FILE* file, const char* str) {
+  fputc('"', file);
+  for (const char* p = str; *p != '\0'; ++p) {
+    unsigned char c = *p;
+    if (c == '"' || c == '\\') {
+      fprintf(file, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(file, "\\u%04x", c);
+    } else {
+      fputc(c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+void WriteEvent(FILE* file, int tid, const Event& event, bool first) {
+  fprintf(file, "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\","
+          "\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{",
+          first ? "" : ",", event.category, event.name, event.start,
+          event.duration, getpid(), tid);
+  const char* separator = "";
+  if (event.path[0] != '\0') {
+    fprintf(file, "\"path\":");
+    WriteJsonString(file, event.path);
+    separator = ",";
+  }
+  if (event.size >= 0) {
+    fprintf(file, "%s\"size\":%lld", separator, event.size);
+    separator = ",";
+  }
+  if (event.offset >= 0) {
+    fprintf(file, "%s\"offset\":%lld", separator, event.offset);
+  }
+  fprintf(file, "}}");
+}
+
+struct SignalArgs {
+  sigset_t signals;
+  std::string filename;
+};
+
+void* SignalThread(void* data) {
+  SignalArgs* args = static_cast<SignalArgs*>(data);
+  while (true) {
+    int signal;
+    if (sigwait(&args->signals, &signal) != 0) {
+      continue;
+    }
+    if (Flush(args->filename)) {
+      syslog(LOG_INFO, "Wrote trace to %s", args->filename.c_str());
+    } else {
+      syslog(LOG_ERR, "Failed to write trace to %s", args->filename.c_str());
+    }
+  }
+  return NULL;
+}
+
+}  // namespace
+
+void Enable() {
+  g_enabled = true;
+}
+
+void Disable() {
+  g_enabled = false;
+}
+
+bool Flush(const std::string& filename) {
+  FILE* file = fopen(filename.c_str(), "w");
+  if (file == NULL) {
+    return false;
+  }
+  fprintf(file, "{\"traceEvents\":[");
+  bool first = true;
+  for (Buffer* buffer = g_buffers; buffer != NULL; buffer = buffer->next) {
+    unsigned long long head = buffer->head;
+    __sync_synchronize();
+    unsigned long long begin =
+        head > kEventsPerThread ? head - kEventsPerThread : 0;
+    for (unsigned long long i = begin; i < head; ++i) {
+      const Event& slot = buffer->events[i % kEventsPerThread];
+      unsigned int sequence = slot.sequence;
+      if (sequence & 1) {
+        continue;
+      }
+      __sync_synchronize();
+      Event event;
+      memcpy(&event, &slot, sizeof(Event));
+      __sync_synchronize();
+      if (slot.sequence != sequence) {
+        continue;
+      }
+      event.path[kMaxPathLength - 1] = '\0';
+      WriteEvent(file, buffer->tid, event, first);
+      first = false;
+    }
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
+
+bool FlushOnSignal(int signal, const std::string& filename) {
+  SignalArgs* args = new SignalArgs;
+  args->filename = filename;
+  sigemptyset(&args->signals);
+  sigaddset(&args->signals, signal);
+  pthread_sigmask(SIG_BLOCK, &args->signals, NULL);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &SignalThread, args) != 0) {
+    syslog(LOG_ERR, "pthread_create() failed: %m");
+    delete args;
+    return false;
+  }
+  pthread_detach(thread);
+  Enable();
+  return true;
+}
+
+void Span::Begin(const char* category, const char* name) {
+  category_ = category;
+  name_ = name;
+  start_ = NowMicros();
+}
+
+void Span::SetPath(const char* path) {
+  path_ = path;
+}
+
+void Span::End() {
+  if (!active_) {
+    return;
+  }
+  active_ = false;
+  long long now = NowMicros();
+  Buffer* buffer = GetThreadBuffer();
+  Event* event = &buffer->events[buffer->head % kEventsPerThread];
+  event->sequence++;
+  __sync_synchronize();
+  event->category = category_;
+  event->name = name_;
+  event->start = start_;
+  event->duration = now - start_;
+  event->size = size_;
+  event->offset = offset_;
+  strncpy(event->path, path_.c_str(), kMaxPathLength - 1);
+  event->path[kMaxPathLength - 1] = '\0';
+  __sync_synchronize();
+  event->sequence++;
+  buffer->head++;
+}
+
+}  // namespace trace
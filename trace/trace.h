@@ -0,0 +1,79 @@
+// An opt-in request tracer.  Spans are recorded into a fixed size ring buffer
+// owned by the thread that records them, so recording never takes a lock, and
+// are written out in the Chrome trace event format (viewable in
+// chrome://tracing or Perfetto) when Flush is called.
+//
+// Tracing is disabled by default, in which case constructing a Span costs a
+// single load of a global flag.
+
+#ifndef __TRACE_TRACE_H__
+#define __TRACE_TRACE_H__
+
+#include <string>
+
+namespace trace {
+
+// Starts recording spans on all threads.
+void Enable();
+
+// Stops recording spans.  Previously recorded spans are kept until Flush.
+void Disable();
+
+// Writes every span currently held in the ring buffers to the specified file
+// as a JSON trace.  Returns false if the file could not be written.
+bool Flush(const std::string& filename);
+
+// Enables tracing and starts a background thread that writes the trace to the
+// specified file every time the process receives signal.  This must be called
+// before any other threads are started, so that they inherit a signal mask
+// with the signal blocked.
+bool FlushOnSignal(int signal, const std::string& filename);
+
+extern volatile bool g_enabled;
+
+// Records a single complete event covering the lifetime of the object, or
+// until End is called.  The category and name must be string literals.
+class Span {
+ public:
+  Span(const char* category, const char* name)
+      : active_(g_enabled), size_(-1), offset_(-1) {
+    if (active_) {
+      Begin(category, name);
+    }
+  }
+
+  ~Span() {
+    if (active_) {
+      End();
+    }
+  }
+
+  // Optional details about the request, shown as arguments of the event
+  void set_path(const char* path) {
+    if (active_) {
+      SetPath(path);
+    }
+  }
+  void set_path(const std::string& path) { set_path(path.c_str()); }
+  void set_size(long long size) { size_ = size; }
+  void set_offset(long long offset) { offset_ = offset; }
+
+  // Records the event now rather than when the object is destroyed.
+  void End();
+
+ private:
+  void Begin(const char* category, const char* name);
+  void SetPath(const char* path);
+
+  bool active_;
+  const char* category_;
+  const char* name_;
+  long long start_;
+  long long size_;
+  long long offset_;
+  std::string path_;
+};
+
+}  // namespace trace
+
+#endif  // __TRACE_TRACE_H__
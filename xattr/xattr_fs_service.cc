@@ -0,0 +1,244 @@
+#include "xattr/xattr_fs_service.h"
+
+#include "metrics/metrics.h"
+#include "proto/fs_service.pb.h"
+#include "xattr/xattr_store.h"
+
+using ::google::protobuf::Closure;
+using ::google::protobuf::RpcController;
+
+namespace xattr {
+
+static metrics::Counter g_xattr_calls(
+    "xattr_calls_total",
+    "Extended attribute calls answered from the host");
+
+class XAttrService : public proto::FsService {
+ public:
+  XAttrService(proto::FsService* service, XAttrStore* store)
+      : service_(service), store_(store) {
+    null_callback_ = google::protobuf::NewPermanentCallback(
+        &google::protobuf::DoNothing);
+  }
+
+  virtual ~XAttrService() {
+    delete null_callback_;
+    delete store_;
+    delete service_;
+  }
+
+  void GetAttr(RpcController* rpc,
+               const proto::GetAttrRequest* request,
+               proto::GetAttrResponse* response,
+               Closure* done) {
+    service_->GetAttr(rpc, request, response, done);
+  }
+
+  void ReadLink(RpcController* rpc,
+                const proto::ReadLinkRequest* request,
+                proto::ReadLinkResponse* response,
+                Closure* done) {
+    service_->ReadLink(rpc, request, response, done);
+  }
+
+  void SymLink(RpcController* rpc,
+               const proto::SymLinkRequest* request,
+               proto::SymLinkResponse* response,
+               Closure* done) {
+    service_->SymLink(rpc, request, response, done);
+  }
+
+  void ReadDir(RpcController* rpc,
+               const proto::ReadDirRequest* request,
+               proto::ReadDirResponse* response,
+               Closure* done) {
+    service_->ReadDir(rpc, request, response, done);
+  }
+
+  void Unlink(RpcController* rpc,
+              const proto::UnlinkRequest* request,
+              proto::UnlinkResponse* response,
+              Closure* done) {
+    service_->Unlink(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      store_->Unlink(request->path());
+    }
+    done->Run();
+  }
+
+  void RemoveTree(RpcController* rpc,
+                  const proto::RemoveTreeRequest* request,
+                  proto::RemoveTreeResponse* response,
+                  Closure* done) {
+    service_->RemoveTree(rpc, request, response, done);
+  }
+
+  void MkDir(RpcController* rpc,
+             const proto::MkDirRequest* request,
+             proto::MkDirResponse* response,
+             Closure* done) {
+    service_->MkDir(rpc, request, response, done);
+  }
+
+  void Rename(RpcController* rpc,
+              const proto::RenameRequest* request,
+              proto::RenameResponse* response,
+              Closure* done) {
+    service_->Rename(rpc, request, response, null_callback_);
+    if (!rpc->Failed()) {
+      store_->Rename(request->source_path(), request->destination_path());
+    }
+    done->Run();
+  }
+
+  void Open(RpcController* rpc,
+            const proto::OpenRequest* request,
+            proto::OpenResponse* response,
+            Closure* done) {
+    service_->Open(rpc, request, response, done);
+  }
+
+  void Create(RpcController* rpc,
+              const proto::CreateRequest* request,
+              proto::CreateResponse* response,
+              Closure* done) {
+    service_->Create(rpc, request, response, done);
+  }
+
+  void Release(RpcController* rpc,
+               const proto::ReleaseRequest* request,
+               proto::ReleaseResponse* response,
+               Closure* done) {
+    service_->Release(rpc, request, response, done);
+  }
+
+  void Read(RpcController* rpc,
+            const proto::ReadRequest* request,
+            proto::ReadResponse* response,
+            Closure* done) {
+    service_->Read(rpc, request, response, done);
+  }
+
+  void ReadV(RpcController* rpc,
+             const proto::ReadVRequest* request,
+             proto::ReadVResponse* response,
+             Closure* done) {
+    service_->ReadV(rpc, request, response, done);
+  }
+
+  void Write(RpcController* rpc,
+             const proto::WriteRequest* request,
+             proto::WriteResponse* response,
+             Closure* done) {
+    service_->Write(rpc, request, response, done);
+  }
+
+  void CopyRange(RpcController* rpc,
+                 const proto::CopyRangeRequest* request,
+                 proto::CopyRangeResponse* response,
+                 Closure* done) {
+    service_->CopyRange(rpc, request, response, done);
+  }
+
+  void Truncate(RpcController* rpc,
+                const proto::TruncateRequest* request,
+                proto::TruncateResponse* response,
+                Closure* done) {
+    service_->Truncate(rpc, request, response, done);
+  }
+
+  void FTruncate(RpcController* rpc,
+                 const proto::FTruncateRequest* request,
+                 proto::FTruncateResponse* response,
+                 Closure* done) {
+    service_->FTruncate(rpc, request, response, done);
+  }
+
+  void FGetAttr(RpcController* rpc,
+                const proto::FGetAttrRequest* request,
+                proto::FGetAttrResponse* response,
+                Closure* done) {
+    service_->FGetAttr(rpc, request, response, done);
+  }
+
+  void StatFs(RpcController* rpc,
+              const proto::StatFsRequest* request,
+              proto::StatFsResponse* response,
+              Closure* done) {
+    service_->StatFs(rpc, request, response, done);
+  }
+
+  void GetXAttr(RpcController* rpc,
+                const proto::GetXAttrRequest* request,
+                proto::GetXAttrResponse* response,
+                Closure* done) {
+    g_xattr_calls.Increment();
+    std::string value;
+    if (store_->Get(request->path(), request->name(), request->position(),
+                    &value)) {
+      response->set_value(value);
+    }
+    done->Run();
+  }
+
+  // Attributes are only stored for paths that exist on the device, so that
+  // nothing is left in the store for a file removed by other means
+  void SetXAttr(RpcController* rpc,
+                const proto::SetXAttrRequest* request,
+                proto::SetXAttrResponse* response,
+                Closure* done) {
+    g_xattr_calls.Increment();
+    proto::GetAttrRequest stat_request;
+    proto::GetAttrResponse stat_response;
+    *stat_request.mutable_header() = request->header();
+    stat_request.set_path(request->path());
+    service_->GetAttr(rpc, &stat_request, &stat_response, null_callback_);
+    if (rpc->Failed()) {
+      done->Run();
+      return;
+    }
+    response->set_existed(store_->Set(request->path(), request->name(),
+                                      request->value(), request->position(),
+                                      request->create(), request->replace()));
+    done->Run();
+  }
+
+  void ListXAttr(RpcController* rpc,
+                 const proto::ListXAttrRequest* request,
+                 proto::ListXAttrResponse* response,
+                 Closure* done) {
+    g_xattr_calls.Increment();
+    std::vector<std::string> names;
+    store_->List(request->path(), &names);
+    for (size_t i = 0; i < names.size(); ++i) {
+      response->add_name(names[i]);
+    }
+    done->Run();
+  }
+
+  void RemoveXAttr(RpcController* rpc,
+                   const proto::RemoveXAttrRequest* request,
+                   proto::RemoveXAttrResponse* response,
+                   Closure* done) {
+    g_xattr_calls.Increment();
+    response->set_existed(store_->Remove(request->path(), request->name()));
+    done->Run();
+  }
+
+ private:
+  proto::FsService* service_;
+  XAttrStore* store_;
+  Closure* null_callback_;
+};
+
+proto::FsService* NewXAttrFsService(proto::FsService* service,
+                                    const std::string& filename) {
+  XAttrStore* store = new XAttrStore;
+  if (!store->Open(filename)) {
+    delete store;
+    return NULL;
+  }
+  return new XAttrService(service, store);
+}
+
+}  // namespace xattr
@@ -0,0 +1,25 @@
+// An FsService that answers the extended attribute calls from a store on the
+// host (see xattr/xattr_store.h) and passes every other call through.  AFC has
+// no extended attributes, and without them the Finder writes an AppleDouble
+// (._*) file next to every file it copies.  The store is kept in step with
+// the files by following the renames and removals that succeed.
+
+#ifndef __XATTR_XATTR_FS_SERVICE_H__
+#define __XATTR_XATTR_FS_SERVICE_H__
+
+#include <string>
+
+namespace proto {
+class FsService;
+}
+
+namespace xattr {
+
+// Takes ownership of service, unless the store in filename cannot be opened,
+// in which case NULL is returned.  There should be one store per device.
+proto::FsService* NewXAttrFsService(proto::FsService* service,
+                                    const std::string& filename);
+
+}  // namespace xattr
+
+#endif  // __XATTR_XATTR_FS_SERVICE_H__
@@ -0,0 +1,338 @@
+#include "xattr/xattr_store.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "proto/xattr.pb.h"
+
+namespace xattr {
+
+// The log is rewritten once it holds this many more entries than twice the
+// number of attributes
+static const int kCompactSlack = 1024;
+
+// Reads the next entry of a log.  Returns false at the end of the log or at a
+// partial or corrupt entry.
+static bool ReadEntry(FILE* file, proto::XAttrLogEntry* entry) {
+  unsigned int length = 0;
+  for (int shift = 0; ; shift += 7) {
+    int c = fgetc(file);
+    if (c == EOF || shift > 28) {
+      return false;
+    }
+    length |= (c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      break;
+    }
+  }
+  std::string buffer(length, '\0');
+  if (length > 0 && fread(&buffer[0], 1, length, file) != length) {
+    return false;
+  }
+  return entry->ParseFromString(buffer);
+}
+
+static bool WriteEntry(FILE* file, const proto::XAttrLogEntry& entry) {
+  std::string buffer;
+  entry.SerializeToString(&buffer);
+  // The length of the entry as a varint
+  unsigned char length[5];
+  int n = 0;
+  size_t size = buffer.size();
+  do {
+    length[n] = size & 0x7f;
+    size >>= 7;
+    if (size != 0) {
+      length[n] |= 0x80;
+    }
+    n++;
+  } while (size != 0);
+  return (fwrite(length, 1, n, file) == static_cast<size_t>(n) &&
+          fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size());
+}
+
+// Returns true if path is beneath directory
+static bool IsBeneath(const std::string& path, const std::string& directory) {
+  return (path.size() > directory.size() &&
+          path.compare(0, directory.size(), directory) == 0 &&
+          path[directory.size()] == '/');
+}
+
+XAttrStore::XAttrStore()
+    : lock_fd_(-1), file_(NULL), log_entries_(0), attributes_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+XAttrStore::~XAttrStore() {
+  if (file_ != NULL) {
+    fclose(file_);
+  }
+  if (lock_fd_ != -1) {
+    close(lock_fd_);
+  }
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool XAttrStore::Open(const std::string& filename) {
+  filename_ = filename;
+  std::string lock = filename + ".lock";
+  lock_fd_ = open(lock.c_str(), O_RDWR | O_CREAT, 0644);
+  if (lock_fd_ == -1) {
+    syslog(LOG_ERR, "Unable to open %s: %m", lock.c_str());
+    return false;
+  }
+  if (flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+    syslog(LOG_ERR, "%s is in use by another process", filename.c_str());
+    return false;
+  }
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (file != NULL) {
+    proto::XAttrLogEntry entry;
+    while (ReadEntry(file, &entry)) {
+      Apply(entry);
+    }
+    if (!feof(file)) {
+      syslog(LOG_WARNING, "Ignoring the end of %s", filename.c_str());
+    }
+    fclose(file);
+  }
+  return Compact();
+}
+
+bool XAttrStore::Get(const std::string& path, const std::string& name,
+                     long long position, std::string* value) {
+  bool found = false;
+  pthread_mutex_lock(&mutex_);
+  Files::const_iterator file = files_.find(path);
+  if (file != files_.end()) {
+    Attributes::const_iterator it = file->second.find(name);
+    if (it != file->second.end()) {
+      found = true;
+      if (static_cast<size_t>(position) < it->second.size()) {
+        value->assign(it->second, position, std::string::npos);
+      } else {
+        value->clear();
+      }
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+  return found;
+}
+
+bool XAttrStore::Set(const std::string& path, const std::string& name,
+                     const std::string& value, long long position,
+                     bool create, bool replace) {
+  pthread_mutex_lock(&mutex_);
+  Files::const_iterator file = files_.find(path);
+  bool existed = (file != files_.end() &&
+                  file->second.find(name) != file->second.end());
+  if (!(create && existed) && !(replace && !existed)) {
+    proto::XAttrLogEntry entry;
+    entry.set_type(proto::XAttrLogEntry::SET);
+    entry.set_path(path);
+    entry.set_name(name);
+    entry.set_value(value);
+    if (position != 0) {
+      entry.set_position(position);
+    }
+    Apply(entry);
+    Append(entry);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return existed;
+}
+
+bool XAttrStore::Remove(const std::string& path, const std::string& name) {
+  proto::XAttrLogEntry entry;
+  entry.set_type(proto::XAttrLogEntry::REMOVE);
+  entry.set_path(path);
+  entry.set_name(name);
+  pthread_mutex_lock(&mutex_);
+  bool existed = Apply(entry);
+  if (existed) {
+    Append(entry);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return existed;
+}
+
+void XAttrStore::List(const std::string& path,
+                      std::vector<std::string>* names) {
+  pthread_mutex_lock(&mutex_);
+  Files::const_iterator file = files_.find(path);
+  if (file != files_.end()) {
+    for (Attributes::const_iterator it = file->second.begin();
+         it != file->second.end(); ++it) {
+      names->push_back(it->first);
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void XAttrStore::Rename(const std::string& source,
+                        const std::string& destination) {
+  proto::XAttrLogEntry entry;
+  entry.set_type(proto::XAttrLogEntry::RENAME);
+  entry.set_path(source);
+  entry.set_destination(destination);
+  pthread_mutex_lock(&mutex_);
+  if (Apply(entry)) {
+    Append(entry);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void XAttrStore::Unlink(const std::string& path) {
+  proto::XAttrLogEntry entry;
+  entry.set_type(proto::XAttrLogEntry::UNLINK);
+  entry.set_path(path);
+  pthread_mutex_lock(&mutex_);
+  if (Apply(entry)) {
+    Append(entry);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool XAttrStore::Apply(const proto::XAttrLogEntry& entry) {
+  switch (entry.type()) {
+    case proto::XAttrLogEntry::SET: {
+      Attributes& attributes = files_[entry.path()];
+      std::pair<Attributes::iterator, bool> inserted =
+          attributes.insert(std::make_pair(entry.name(), std::string()));
+      if (inserted.second) {
+        attributes_++;
+      }
+      std::string& value = inserted.first->second;
+      if (entry.position() == 0) {
+        value = entry.value();
+      } else {
+        size_t end = entry.position() + entry.value().size();
+        if (value.size() < end) {
+          value.resize(end);
+        }
+        value.replace(entry.position(), entry.value().size(), entry.value());
+      }
+      return true;
+    }
+    case proto::XAttrLogEntry::REMOVE: {
+      Files::iterator file = files_.find(entry.path());
+      if (file == files_.end() || file->second.erase(entry.name()) == 0) {
+        return false;
+      }
+      attributes_--;
+      if (file->second.empty()) {
+        files_.erase(file);
+      }
+      return true;
+    }
+    case proto::XAttrLogEntry::RENAME: {
+      const std::string& source = entry.path();
+      const std::string& destination = entry.destination();
+      if (source == destination || IsBeneath(destination, source)) {
+        return false;
+      }
+      // Collect the moved attributes first, since the destination is erased
+      std::vector<Files::iterator> found;
+      FindSubtree(source, &found);
+      std::vector<std::pair<std::string, Attributes> > moved;
+      for (size_t i = 0; i < found.size(); ++i) {
+        moved.push_back(std::make_pair(
+            destination + found[i]->first.substr(source.size()),
+            Attributes()));
+        moved.back().second.swap(found[i]->second);
+        files_.erase(found[i]);
+      }
+      bool changed = Erase(destination);
+      for (size_t i = 0; i < moved.size(); ++i) {
+        files_[moved[i].first].swap(moved[i].second);
+      }
+      return changed || !moved.empty();
+    }
+    case proto::XAttrLogEntry::UNLINK:
+      return Erase(entry.path());
+  }
+  return false;
+}
+
+bool XAttrStore::Erase(const std::string& path) {
+  std::vector<Files::iterator> found;
+  FindSubtree(path, &found);
+  for (size_t i = 0; i < found.size(); ++i) {
+    attributes_ -= found[i]->second.size();
+    files_.erase(found[i]);
+  }
+  return !found.empty();
+}
+
+// Names such as "a b" sort between "a" and "a/b", so the files beneath path
+// are found from path + "/"
+void XAttrStore::FindSubtree(const std::string& path,
+                             std::vector<Files::iterator>* found) {
+  Files::iterator it = files_.find(path);
+  if (it != files_.end()) {
+    found->push_back(it);
+  }
+  for (it = files_.lower_bound(path + "/");
+       it != files_.end() && IsBeneath(it->first, path); ++it) {
+    found->push_back(it);
+  }
+}
+
+void XAttrStore::Append(const proto::XAttrLogEntry& entry) {
+  if (file_ == NULL) {
+    return;
+  }
+  log_entries_++;
+  if (!WriteEntry(file_, entry) || fflush(file_) != 0) {
+    syslog(LOG_ERR, "Failed to write %s: %m", filename_.c_str());
+  }
+  if (log_entries_ > 2 * attributes_ + kCompactSlack) {
+    Compact();
+  }
+}
+
+// Writes the live attributes to a new log, which replaces the old one
+bool XAttrStore::Compact() {
+  std::string temp = filename_ + ".tmp";
+  FILE* file = fopen(temp.c_str(), "wb");
+  if (file == NULL) {
+    syslog(LOG_ERR, "Unable to create %s: %m", temp.c_str());
+    return false;
+  }
+  bool ok = true;
+  int entries = 0;
+  for (Files::const_iterator it = files_.begin();
+       ok && it != files_.end(); ++it) {
+    for (Attributes::const_iterator attribute = it->second.begin();
+         ok && attribute != it->second.end(); ++attribute) {
+      proto::XAttrLogEntry entry;
+      entry.set_type(proto::XAttrLogEntry::SET);
+      entry.set_path(it->first);
+      entry.set_name(attribute->first);
+      entry.set_value(attribute->second);
+      ok = WriteEntry(file, entry);
+      entries++;
+    }
+  }
+  if (fflush(file) != 0 || !ok) {
+    syslog(LOG_ERR, "Failed to write %s: %m", temp.c_str());
+    fclose(file);
+    unlink(temp.c_str());
+    return false;
+  }
+  if (rename(temp.c_str(), filename_.c_str()) != 0) {
+    syslog(LOG_ERR, "Unable to replace %s: %m", filename_.c_str());
+    fclose(file);
+    unlink(temp.c_str());
+    return false;
+  }
+  if (file_ != NULL) {
+    fclose(file_);
+  }
+  file_ = file;
+  log_entries_ = entries;
+  return true;
+}
+
+}  // namespace xattr
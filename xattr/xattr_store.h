@@ -0,0 +1,89 @@
+// A small key-value store for the extended attributes of the files on one
+// device, kept in a file on the host.  Attributes are keyed by path, so the
+// store must be told when files are renamed or removed.
+//
+// Changes are appended to a log (see proto/xattr.proto) as they are made.
+// The log is rewritten with only the live attributes when it is opened, and
+// again whenever it has grown to mostly hold entries that no longer matter.
+
+#ifndef __XATTR_XATTR_STORE_H__
+#define __XATTR_XATTR_STORE_H__
+
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace proto {
+class XAttrLogEntry;
+}
+
+namespace xattr {
+
+class XAttrStore {
+ public:
+  XAttrStore();
+  ~XAttrStore();
+
+  // Loads the attributes from filename, which is created if it does not
+  // exist.  A log that ends in a partial entry, for example after a crash, is
+  // loaded up to that entry.  Fails if another store has the file open, which
+  // it keeps locked through filename.lock.
+  bool Open(const std::string& filename);
+
+  // Returns false if path has no attribute with the name.  The value is read
+  // from position onwards.
+  bool Get(const std::string& path, const std::string& name,
+           long long position, std::string* value);
+
+  // Replaces the value of the attribute, or when position is not 0, writes
+  // value at position, extending the attribute as needed.  If create
+  // is set, the attribute is only written if it does not exist yet, and if
+  // replace is set, only if it does.  Returns whether it already existed.
+  bool Set(const std::string& path, const std::string& name,
+           const std::string& value, long long position,
+           bool create, bool replace);
+
+  // Returns whether the attribute existed
+  bool Remove(const std::string& path, const std::string& name);
+
+  void List(const std::string& path, std::vector<std::string>* names);
+
+  // Moves the attributes of source and everything beneath it to
+  // destination, replacing those of destination.
+  void Rename(const std::string& source, const std::string& destination);
+
+  // Removes the attributes of path and everything beneath it
+  void Unlink(const std::string& path);
+
+ private:
+  typedef std::map<std::string, std::string> Attributes;
+  typedef std::map<std::string, Attributes> Files;
+
+  // Returns false if the entry did not change anything
+  bool Apply(const proto::XAttrLogEntry& entry);
+  // Removes path and everything beneath it, returning false if there was
+  // nothing to remove
+  bool Erase(const std::string& path);
+  // Finds the files of path and of everything beneath it
+  void FindSubtree(const std::string& path,
+                   std::vector<Files::iterator>* found);
+  void Append(const proto::XAttrLogEntry& entry);
+  bool Compact();
+
+  pthread_mutex_t mutex_;
+  std::string filename_;
+  // Holds an exclusive flock for as long as the store is open.  The log
+  // itself is replaced when compacted, so it is not the file locked.
+  int lock_fd_;
+  FILE* file_;
+  Files files_;
+  // Number of entries in the log, and of attributes in files_
+  int log_entries_;
+  int attributes_;
+};
+
+}  // namespace xattr
+
+#endif  // __XATTR_XATTR_STORE_H__